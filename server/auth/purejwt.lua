@@ -4,6 +4,21 @@ local bit = require("bit") -- LuaJIT/5.1-compatible bit library
 local json = require("cjson.safe") -- works in LuaJIT / 5.1
 local sha2 = require("auth.sha256")
 
+-- Inside the server, signing and verification run natively (uws.jwt: HS256,
+-- constant-time compare, cached verified tokens). The Lua code below is only the
+-- fallback for tools running without the uwebsockets module, such as bin/jwtcli.lua.
+local has_uws, uws = pcall(require, "uwebsockets")
+local native = has_uws and type(uws) == "table" and uws.jwt or nil
+
+local messages = {
+    invalid_token = "Expected header.payload.signature",
+    invalid_algorithm = "Unsupported JWT algorithm",
+    invalid_signature = "JWT signature mismatch",
+    invalid_payload = "Could not decode JSON payload",
+    token_expired = "Token expired",
+    token_not_yet_valid = "Token not yet valid",
+}
+
 -- Helpers
 local function hex_to_bin(hex)
     return (hex:gsub('..', function(cc)
@@ -105,8 +120,64 @@ end
 
 
 
+-- Issuer, audience and custom claims; exp/nbf are checked by the decoders.
+local function check_claims(payload, options)
+    if options.verify_iss and options.issuer and payload.iss ~= options.issuer then
+        return nil, { error = "invalid_issuer", message = "Issuer mismatch" }
+    end
+    if options.verify_aud and options.audience then
+        local aud = payload.aud
+        if type(aud) == "string" then
+            if aud ~= options.audience then
+                return nil, { error = "invalid_audience", message = "Audience mismatch" }
+            end
+        elseif type(aud) == "table" then
+            local found = false
+            for _, a in ipairs(aud) do
+                if a == options.audience then found = true break end
+            end
+            if not found then
+                return nil, { error = "invalid_audience", message = "Audience not found" }
+            end
+        else
+            return nil, { error = "invalid_audience", message = "Invalid audience format" }
+        end
+    end
+    if options.custom_claims then
+        for claim, expected in pairs(options.custom_claims) do
+            if payload[claim] ~= expected then
+                return nil, { error = "invalid_claim", message = "Mismatch in " .. claim }
+            end
+        end
+    end
+    return payload, nil
+end
+
+local NO_TIME_CHECKS = { verify_exp = false, verify_nbf = false }
+
+local function native_decode(token, secret, options)
+    if type(token) ~= "string" then
+        return nil, { error = "invalid_token", message = messages.invalid_token }
+    end
+    local verify_opts = NO_TIME_CHECKS
+    if options then
+        verify_opts = { verify_exp = options.verify_exp and true or false, verify_nbf = options.verify_nbf and true or false }
+    end
+    local payload, code = native.verify(token, secret, verify_opts)
+    if not payload then
+        return nil, { error = code, message = messages[code] or code }
+    end
+    if options then
+        return check_claims(payload, options)
+    end
+    return payload, nil
+end
+
 -- JWT Encode
 function M.encode(payload, secret)
+    if native then
+        return native.sign(json.encode(payload), secret)
+    end
     local header = { alg = "HS256", typ = "JWT" }
     local header_json = json.encode(header)
     local payload_json = json.encode(payload)
@@ -121,6 +192,10 @@ end
 
 -- JWT Decode + optional verification
 function M.decode(token, secret, options)
+    if native then
+        return native_decode(token, secret, options)
+    end
+
     local parts = {}
     for part in token:gmatch("[^.]+") do
         parts[#parts + 1] = part
@@ -153,34 +228,7 @@ function M.decode(token, secret, options)
         if options.verify_nbf and payload.nbf and now < payload.nbf then
             return nil, { error = "token_not_yet_valid", message = "Token not yet valid" }
         end
-        if options.verify_iss and options.issuer and payload.iss ~= options.issuer then
-            return nil, { error = "invalid_issuer", message = "Issuer mismatch" }
-        end
-        if options.verify_aud and options.audience then
-            local aud = payload.aud
-            if type(aud) == "string" then
-                if aud ~= options.audience then
-                    return nil, { error = "invalid_audience", message = "Audience mismatch" }
-                end
-            elseif type(aud) == "table" then
-                local found = false
-                for _, a in ipairs(aud) do
-                    if a == options.audience then found = true break end
-                end
-                if not found then
-                    return nil, { error = "invalid_audience", message = "Audience not found" }
-                end
-            else
-                return nil, { error = "invalid_audience", message = "Invalid audience format" }
-            end
-        end
-        if options.custom_claims then
-            for claim, expected in pairs(options.custom_claims) do
-                if payload[claim] ~= expected then
-                    return nil, { error = "invalid_claim", message = "Mismatch in " .. claim }
-                end
-            end
-        end
+        return check_claims(payload, options)
     end
 
     return payload, nil
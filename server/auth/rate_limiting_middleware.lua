@@ -1,27 +1,38 @@
-local rate_limit_store = {}
+local uws = require("uwebsockets")
 
-return  function ()
-    return function (req, res, next)
-    local ip = req._raw:getRemoteAddressAsText()
-    local now = os.time()
-    local window = 10 -- seconds
-    local max_requests = 5
+-- Limits each client (by peer address) to opts.rate requests per opts.period
+-- seconds, allowing bursts of opts.burst. The counters live in the shim's native
+-- limiter, shared by every worker and bounded to opts.capacity clients. Each
+-- middleware gets counters of its own unless several pass the same opts.name
+-- (with the same options) to share them. For checks that should run before any
+-- Lua, see DawnServer:guard{ rate_limit = ... }.
 
-    local record = rate_limit_store[ip] or { count = 0, last = now }
-    if now - record.last > window then
-        record = { count = 1, last = now }
-    else
-        record.count = record.count + 1
-    end
+-- Numbers the middlewares created without a name. Every worker runs the same
+-- setup code, so the n-th one gets the same name, and limiter, in all of them.
+local unnamed = 0
 
-    if record.count > max_requests then
-        print("too many requests")
-        res:writeStatus(429):send("Too Many Requests")
-        return
+return function (opts)
+    opts = opts or {}
+    local name = opts.name
+    if not name then
+        unnamed = unnamed + 1
+        name = "rate_limiting_middleware#" .. unnamed
     end
+    local limiter = uws.rate_limiter(name, {
+        rate = opts.rate or 5,
+        period = opts.period or 10,
+        burst = opts.burst or opts.rate or 5,
+        capacity = opts.capacity
+    })
 
-    rate_limit_store[ip] = record
-    next()
-end
-
+    return function (req, res, next)
+        local allowed, _, retry_after = limiter:check(res:getRemoteAddress())
+        if not allowed then
+            res:writeStatus(429)
+               :writeHeader("Retry-After", tostring(math.max(1, math.ceil(retry_after))))
+               :send("Too Many Requests")
+            return
+        end
+        next()
+    end
 end
@@ -103,6 +103,12 @@ local function sha256(msg)
 end
 
 
+-- The server's native SHA-256 (uws.jwt) when the uwebsockets module is available.
+local has_uws, uws = pcall(require, "uwebsockets")
+if has_uws and type(uws) == "table" and uws.jwt then
+    sha256 = uws.jwt.sha256_hex
+end
+
 return {
     sha256_hex = sha256
 }
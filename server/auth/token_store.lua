@@ -1,9 +1,17 @@
--- utils/token_store_file.lua
+-- auth/token_store.lua
 
 local json = require("cjson.safe")
 local jwt = require("auth.purejwt")
 local path = "refresh_tokens.json"
 
+-- Inside the server the sessions live in the shim's native store
+-- (uws.token_store): an append-only log indexed by user and token hash, whose
+-- expired sessions drop out on a timer wheel. Outside it, the whole store is
+-- kept in `store` and rewritten to `path` on every change.
+local has_uws, uws = pcall(require, "uwebsockets")
+local native_open = has_uws and type(uws) == "table" and uws.token_store or nil
+local native -- the open native store, see backend()
+
 local store = {}
 local M = {}
 
@@ -12,7 +20,8 @@ local config = {
     cleanup_expired = true,
     max_session_age = 7 * 86400,     -- 7 days max session (absolute cap), nil to disable
     cleanup_interval = 3600,         -- run auto-cleanup every 1 hour (in seconds)
-    secrete = "dawn_sever_key"
+    secrete = "dawn_sever_key",
+    log_path = "refresh_tokens.log"  -- the native store's log
 }
 
 local function load_store()
@@ -42,6 +51,11 @@ else
 end
 end
 
+local function token_exp(token)
+    local payload = jwt.decode(token, config.secrete, false)
+    return payload and payload.exp
+end
+
 local function is_expired(token, issued)
     local payload = jwt.decode(token, config.secrete, false)
     local now = os.time()
@@ -68,6 +82,75 @@ local function cleanup_user_tokens(user_id)
 end
 
 
+-- Sessions from an old refresh_tokens.json move into a new, empty native log.
+-- Every worker opens the same store, so the JSON file is claimed by renaming it
+-- before it is read: the rename succeeds for exactly one of them, and the others
+-- find nothing to import.
+local function import_json(native_store)
+    if native_store:size() > 0 then return end
+    local claimed = path .. ".imported"
+    if not os.rename(path, claimed) then return end
+    local file = io.open(claimed, "r")
+    if not file then return end
+    local data = json.decode(file:read("*a"))
+    file:close()
+    if type(data) ~= "table" then return end
+
+    for user_id, entries in pairs(data) do
+        for _, entry in ipairs(type(entries) == "table" and entries or {}) do
+            if type(entry.token) == "string" then
+                native_store:save(tostring(user_id), entry.token, {
+                    device_id = entry.device_id, ip = entry.ip, agent = entry.agent,
+                    issued = entry.issued, expires = token_exp(entry.token)
+                })
+            end
+        end
+    end
+end
+
+-- The native store, opened on first use so M.init's options apply; nil when
+-- running outside the server or when the log cannot be opened.
+local function backend()
+    if native or not native_open then return native end
+    local opened, err = native_open(config.log_path, { max_age = config.max_session_age or 0 })
+    native_open = nil
+    if opened then
+        import_json(opened)
+        native = opened
+    else
+        print("[TokenStore] " .. tostring(err) .. "; falling back to " .. path)
+        load_store()
+    end
+    return native
+end
+
+local function format_time_left(seconds)
+    if not seconds then return "unknown" end
+    if seconds <= 0 then return "expired" end
+    if seconds < 60 then return seconds .. " sec" end
+    if seconds < 3600 then return math.floor(seconds / 60) .. " min" end
+    if seconds < 86400 then return math.floor(seconds / 3600) .. " hr" end
+    return math.floor(seconds / 86400) .. " day"
+end
+
+local function describe_session(entry, exp, now)
+    -- A token without exp only ends with the session's max age.
+    local expired = false
+    if exp then
+        expired = now >= exp
+    end
+    return {
+        device_id = entry.device_id,
+        ip = entry.ip,
+        agent = entry.agent,
+        issued = entry.issued,
+        expires = exp,
+        is_expired = expired,
+        expires_in = format_time_left(exp and (exp - now))
+    }
+end
+
+
 -- Initialize config
 function M.init(options)
     for k, v in pairs(options or {}) do
@@ -80,6 +163,16 @@ end
 -- @param refresh_token string
 -- @param metadata table: { device_id, ip, agent }
 function M.save_refresh_token(user_id, refresh_token, metadata)
+    metadata = metadata or {}
+    local native_store = backend()
+    if native_store then
+        native_store:save(tostring(user_id), refresh_token, {
+            device_id = metadata.device_id, ip = metadata.ip, agent = metadata.agent,
+            expires = token_exp(refresh_token)
+        }, not config.allow_multiple)
+        return
+    end
+
     local entry = {
         token = refresh_token,
         device_id = metadata.device_id or "unknown",
@@ -99,6 +192,10 @@ end
 
 --- Verify a refresh token is valid for a user
 function M.verify(user_id, refresh_token)
+    local native_store = backend()
+    if native_store then
+        return type(refresh_token) == "string" and native_store:verify(tostring(user_id), refresh_token)
+    end
     if config.cleanup_expired then cleanup_user_tokens(user_id) end
     local entries = store[user_id]
     if not entries then return false end
@@ -113,6 +210,11 @@ end
 
 --- Revoke a specific refresh token
 function M.revoke_refresh_token(user_id, refresh_token)
+    local native_store = backend()
+    if native_store then
+        if type(refresh_token) == "string" then native_store:revoke(tostring(user_id), refresh_token) end
+        return
+    end
     local entries = store[user_id]
     if not entries then return end
 
@@ -128,6 +230,11 @@ end
 
 --- Revoke a refresh token by device_id
 function M.revoke_by_device_id(user_id, device_id)
+    local native_store = backend()
+    if native_store then
+        native_store:revoke_device(tostring(user_id), tostring(device_id))
+        return
+    end
     local entries = store[user_id]
     if not entries then return end
 
@@ -145,36 +252,20 @@ end
 
 --- List a user's active devices
 function M.list_sessions(user_id)
-    if config.cleanup_expired then cleanup_user_tokens(user_id) end
-    local entries = store[user_id]
-    if not entries then return {} end
-
     local now = os.time()
     local sessions = {}
 
-    for _, entry in ipairs(entries) do
-        local payload = jwt.decode(entry.token, config.secrete, false)
-        local exp = payload and payload.exp
-        local delta = exp and (exp - now)
-
-        local function format_time_left(seconds)
-            if not seconds then return "unknown" end
-            if seconds <= 0 then return "expired" end
-            if seconds < 60 then return seconds .. " sec" end
-            if seconds < 3600 then return math.floor(seconds / 60) .. " min" end
-            if seconds < 86400 then return math.floor(seconds / 3600) .. " hr" end
-            return math.floor(seconds / 86400) .. " day"
+    local native_store = backend()
+    if native_store then
+        for _, entry in ipairs(native_store:sessions(tostring(user_id))) do
+            table.insert(sessions, describe_session(entry, entry.expires, now))
+        end
+    else
+        if config.cleanup_expired then cleanup_user_tokens(user_id) end
+        for _, entry in ipairs(store[user_id] or {}) do
+            local payload = jwt.decode(entry.token, config.secrete, false)
+            table.insert(sessions, describe_session(entry, payload and payload.exp, now))
         end
-
-        table.insert(sessions, {
-            device_id = entry.device_id,
-            ip = entry.ip,
-            agent = entry.agent,
-            issued = entry.issued,
-            expires = exp,
-            is_expired = exp and (now >= exp) or true,
-            expires_in = format_time_left(delta)
-        })
     end
 
     table.sort(sessions, function(a, b)
@@ -186,6 +277,11 @@ end
 
 
 function M.cleanup_all()
+    local native_store = backend()
+    if native_store then
+        return native_store:sweep()
+    end
+
     local removed_total = 0
 
     for user_id, entries in pairs(store) do
@@ -205,6 +301,6 @@ end
 
 
 
-load_store()
+if not native_open then load_store() end
 
 return M
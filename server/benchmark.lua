@@ -0,0 +1,104 @@
+-- benchmark.lua
+-- Keep-alive HTTP load generator for measuring requests/sec of the uWS shim.
+--
+--   luajit benchmark_server.lua 3001 &
+--   luajit benchmark.lua [host] [port] [connections] [seconds] [label]
+--
+-- To compare two builds of uwebsockets.so (e.g. before and after a shim change),
+-- build each one, restart benchmark_server.lua against it and run this script with
+-- the same arguments. Each connection keeps exactly one request in flight.
+--
+-- With a label the run is appended to benchmark_results.tsv (label, connections,
+-- seconds, requests, errors, requests/sec) and compared with the file's first
+-- row, so label the run against the old build "baseline".
+
+local uv = require("luv")
+
+local host = arg[1] or "127.0.0.1"
+local port = tonumber(arg[2]) or 3001
+local connections = tonumber(arg[3]) or 64
+local duration = tonumber(arg[4]) or 10
+local label = arg[5]
+local RESULTS_FILE = "benchmark_results.tsv"
+
+local request = "GET /bench HTTP/1.1\r\nHost: " .. host .. "\r\n\r\n"
+local completed = 0
+local errors = 0
+local running = true
+local clients = {}
+
+for i = 1, connections do
+    local client = uv.new_tcp()
+    clients[i] = client
+    client:connect(host, port, function(connect_err)
+        if connect_err then
+            errors = errors + 1
+            client:close()
+            return
+        end
+        -- A response can arrive split over several reads (or several in one), so
+        -- bytes are buffered until a whole response (headers plus Content-Length
+        -- bytes of body) is there before it counts.
+        local buffer = ""
+        client:read_start(function(read_err, chunk)
+            if read_err or not chunk then
+                if read_err then errors = errors + 1 end
+                if not client:is_closing() then client:close() end
+                return
+            end
+            buffer = buffer .. chunk
+            local responses = 0
+            while true do
+                local header_end = buffer:find("\r\n\r\n", 1, true)
+                if not header_end then break end
+                local headers = buffer:sub(1, header_end - 1):lower()
+                local length = tonumber(headers:match("\r\ncontent%-length:%s*(%d+)")) or 0
+                local total = header_end + 3 + length
+                if #buffer < total then break end
+                buffer = buffer:sub(total + 1)
+                responses = responses + 1
+            end
+            completed = completed + responses
+            if running then
+                for _ = 1, responses do
+                    client:write(request)
+                end
+            end
+        end)
+        client:write(request)
+    end)
+end
+
+local started = uv.hrtime()
+local timer = uv.new_timer()
+timer:start(duration * 1000, 0, function()
+    running = false
+    local elapsed = (uv.hrtime() - started) / 1e9
+    print(string.format("[Benchmark] %d connections, %.2f s", connections, elapsed))
+    print(string.format("[Benchmark] %d requests, %d errors", completed, errors))
+    local rps = completed / elapsed
+    print(string.format("[Benchmark] %.0f requests/sec", rps))
+    if label then
+        local baseline
+        local existing = io.open(RESULTS_FILE, "r")
+        if existing then
+            local first = existing:read("*l")
+            existing:close()
+            baseline = first and tonumber(first:match("([^\t]+)$"))
+        end
+        local out = io.open(RESULTS_FILE, "a")
+        if out then
+            out:write(string.format("%s\t%d\t%.2f\t%d\t%d\t%.0f\n", label, connections, elapsed, completed, errors, rps))
+            out:close()
+        end
+        if baseline and baseline > 0 then
+            print(string.format("[Benchmark] %+.1f%% vs baseline (%.0f requests/sec)", (rps / baseline - 1) * 100, baseline))
+        end
+    end
+    for _, client in ipairs(clients) do
+        if not client:is_closing() then client:close() end
+    end
+    timer:close()
+end)
+
+uv.run()
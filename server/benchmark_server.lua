@@ -0,0 +1,17 @@
+-- benchmark_server.lua
+-- Minimal server used by benchmark.lua: a single GET route, no middleware, so the
+-- numbers measure the shim's per-request overhead rather than application code.
+--
+--   luajit benchmark_server.lua [port]
+
+package.cpath = package.cpath .. ";./?.so"
+local uws = require("uwebsockets")
+
+local port = tonumber(arg and arg[1]) or 3001
+
+uws.create_app()
+uws.get("/bench", function(req, res)
+    res:send("ok")
+end)
+uws.listen(port)
+uws.run()
@@ -16,105 +16,17 @@ local function timestamp()
     return os.date("[%Y-%m-%d %H:%M:%S]")
 end
 
-local function extractHttpMethod(request_str)
-    -- Extract the first line of the request
-    local first_line = request_str:match("([^\r\n]+)")
-    if first_line then
-        -- Match the method (first word before a space)
-        local method = first_line:match("^(%S+)")
-        if method then
-            return method:lower() -- return it in lowercase
-        end
-    end
-    return "" -- if something fails
-end
-
-local TrieNode = {}
-
-function TrieNode:new(logger)
-    local self = setmetatable({}, { __index = TrieNode })
-    self.children = {}
-    self.handler = nil
-    self.isEndOfPath = false
-    self.params = {}
-    self.log = logger
-    return self
-end
-
-function TrieNode:insert(method, route, handler)
-    local node = self
-    local parts = {}
-    local normalizedRoute = route:lower()
-    for part in normalizedRoute:gmatch("([^/]+)") do
-        table.insert(parts, part)
-    end
-
-    for i, part in ipairs(parts) do
-        local paramName = nil
-        if part:sub(1, 1) == ":" then
-            paramName = part:sub(2)
-            part = ":"
-        elseif part == "*" then
-            part = "*"
-        end
-
-        if not node.children[part] then
-            node.children[part] = TrieNode:new()
-        end
-        node = node.children[part]
-        if paramName then
-            node.params[i] = paramName
-        end
-    end
-
-    if node.isEndOfPath and node.handler then
-        self.log:log(log_level.WARN, string.format("Route conflict: %s %s is being overridden.", method, route), "DawnServer")
-    end
-    node.isEndOfPath = true
-    node.handler = { method = method, func = handler }
-end
-
-function TrieNode:search(method, path)
-    local node = self
-    local params = {}
-    local parts = {}
-    local normalizedPath = path:lower()
-    for part in normalizedPath:gmatch("([^/]+)") do
-        table.insert(parts, part)
-    end
-
-    for i, part in ipairs(parts) do
-        local child = node.children[part]
-        if not child then
-            child = node.children[":"]
-            if not child then
-                child = node.children["*"]
-                if child then
-                    params.splat = table.concat(parts, "/", i)
-                    return child.handler and child.handler.func, params
-                else
-                    return nil, {}
-                end
-            else
-                local paramName = child.params[i]
-                if paramName then
-                    params[paramName] = part
-                end
-            end
-        end
-        node = child
-        if not node then
-            return nil, {}
-        end
-    end
-
-    if node and node.isEndOfPath and node.handler and node.handler.method == method then
-        return node.handler.func, params
-    else
-        print("  Handler not found at end of path.")
-        return nil, {}
-    end
-end
+-- Lowercase method names indexed by the shim's req.method_id (uws.METHOD_*).
+local METHOD_NAMES = {
+    [uws.METHOD_GET] = "get",
+    [uws.METHOD_POST] = "post",
+    [uws.METHOD_PUT] = "put",
+    [uws.METHOD_DELETE] = "delete",
+    [uws.METHOD_PATCH] = "patch",
+    [uws.METHOD_HEAD] = "head",
+    [uws.METHOD_OPTIONS] = "options",
+}
+local METHOD_POST, METHOD_PUT, METHOD_PATCH = uws.METHOD_POST, uws.METHOD_PUT, uws.METHOD_PATCH
 
 local DawnServer = {}
 DawnServer.__index = DawnServer
@@ -123,18 +35,35 @@ function DawnServer:new(config)
     local self = setmetatable({}, DawnServer)
     self.config = config or {}
     self.logger = config.logger
-    self.router = TrieNode:new(self.logger)
     self.middlewares = {}
+    self.guards = {}
     self.error_handlers = { middleware = nil, route = {} }
     self.supervisor = Supervisor:new("WebServerSupervisor", "one_for_one", self.logger)
     self.port = config.port or 3000
     self.running = false
     self.multipart_parser_options = config.multipart_parser_options or nil
+    -- Parse multipart/form-data bodies in the shim as they arrive (opt-in; routes
+    -- can override it with opts.multipart). Uses multipart_parser_options.
+    self.native_multipart = config.native_multipart or false
+    -- Default request body limit in bytes (413 beyond it); routes can override it
+    -- with opts.max_body_size. nil means unlimited.
+    self.max_body_size = config.max_body_size
+    -- Decode application/json bodies in the shim instead of with cjson: true hands
+    -- handlers plain tables, "lazy" a view whose fields are converted on access
+    -- (uws.json_totable() turns it into a table). Routes can override it with opts.json.
+    self.native_json = config.native_json or false
+    -- Defaults for uws.ws routes: max_backpressure (bytes), slow_consumer
+    -- ("drop_newest" | "drop_oldest" | "close"), max_queued (bytes), compression,
+    -- max_payload_length, idle_timeout (s), send_pings, max_lifetime (min).
+    self.ws_options = config.ws_options or {}
     self.token_store = config.token_store or {
         store = nil,  cleanup_interval =  1800
     }
     self.route_scopes = {}
     self.routes = {}
+    -- Every route in registration order, so registration and printRoutes do not
+    -- depend on pairs() order over self.routes.
+    self.route_list = {}
     self.request_parsers = {}
     self.shared_state = {
         sessions = {},
@@ -177,18 +106,28 @@ function DawnServer:use(middleware, route)
     })
 end
 
+-- Native guard (see uws.guard in the shim): IP allow/deny lists, rate limits,
+-- required headers, bearer JWT and CORS preflight checked in C++ before any middleware
+-- runs, for every request under `route` (all requests when nil). A verified
+-- token's claims are in req._raw.jwt.
+function DawnServer:guard(opts, route)
+    assert(type(opts) == "table", "Guard options must be a table")
+    table.insert(self.guards, { opts = opts, route = route })
+end
+
 function DawnServer:addRoute(method, path, handler, opts)
     if not self.routes[method] then
         self.routes[method] = {}
     end
 
-    table.insert(self.routes[method], {
+    local route = {
+        method = method,
         path = path,
         handler = handler,
         opts = opts or {}
-    })
-
-    self.router:insert(method, path, handler)
+    }
+    table.insert(self.routes[method], route)
+    table.insert(self.route_list, route)
 end
 
 function DawnServer:scope(prefix, func)
@@ -198,24 +137,29 @@ function DawnServer:scope(prefix, func)
 end
 
 for _, method in ipairs({"get", "post", "put", "delete", "patch", "head", "options"}) do
-    DawnServer[method] = function(self, route, handler)
+    -- opts: { max_body_size = bytes, stream = true, json = true } for body methods.
+    DawnServer[method] = function(self, route, handler, opts)
         local scoped_route = table.concat(self.route_scopes, "") .. route
-        self:addRoute(method, scoped_route, handler)
+        self:addRoute(method, scoped_route, handler, opts)
     end
 end
 
-function DawnServer:ws(route, handler)
+-- opts override config.ws_options for this route.
+function DawnServer:ws(route, handler, opts)
     local scoped_route = table.concat(self.route_scopes, "") .. route
-    self:addRoute("WS", scoped_route, handler)
+    self:addRoute("WS", scoped_route, handler, opts)
 end
 
 -- New function to add static file serving configuration
-function DawnServer:serveStatic(route_prefix, directory_path) -- <--- Add this function
+-- opts (optional) is passed to uws.serve_static: cache_size, stream_threshold,
+-- precompressed, max_age, index.
+function DawnServer:serveStatic(route_prefix, directory_path, opts) -- <--- Add this function
     assert(type(route_prefix) == "string", "Route prefix for static serving must be a string.")
     assert(type(directory_path) == "string", "Directory path for static serving must be a string.")
     table.insert(self.static_configs, {
         route_prefix = route_prefix,
-        directory_path = directory_path
+        directory_path = directory_path,
+        opts = opts
     })
 end
 
@@ -226,18 +170,9 @@ end
 
 function DawnServer:printRoutes()
     self.logger:log(log_level.INFO, "Registered Routes:", "DawnServer")
-    local function printNodeRoutes(node, prefix)
-        if node.handler then
-            self.logger:log(log_level.INFO, "  " .. node.handler.method .. " " .. prefix, "DawnServer")
-        end
-        for path, child in pairs(node.children) do
-            local slashCount = select(2, prefix:gsub("/", ""))
-            local param = child.params[slashCount + 1] or ""
-            local segment = (path == ":" and "/:" .. param) or (path == "*" and "/*") or ("/" .. path)
-            printNodeRoutes(child, prefix .. segment)
-        end
+    for _, route in ipairs(self.route_list) do
+        self.logger:log(log_level.INFO, "  " .. route.method .. " " .. route.path, "DawnServer")
     end
-    printNodeRoutes(self.router, "")
 end
 
 local function log_invisible_chars(str, label)
@@ -332,176 +267,205 @@ function DawnServer:run()
         return str
     end
 
-    local function handleRequest(_req, res, chunk, is_last)
+    -- The path a request's error handler is looked up under.
+    local function requestPath(_req)
         local path = _req:getUrl():match("^[^?]*")
         if path ~= "/" and path:sub(-1) == "/" then
             path = path:sub(1, -2)
         end
-        local method = extractHttpMethod(_req.method)
-
-        -- Important: Before router.search, check if the request should be handled by static serving
-        -- This logic needs to be outside the route handler loop, handled by uWS itself
-        -- The C++ shim will handle this by registering the wildcard route `/static/*`
+        return path
+    end
 
-        local handler_info, params = self_ref.router:search(method, path)
+    -- Builds the req table and runs CORS and the middleware chain, once per
+    -- request; nil when one of them answered it. POST/PUT/PATCH routes run this
+    -- from the shim's before_body hook, before any of the body is read, so
+    -- middleware can turn an upload away; their handler then gets this req table
+    -- back in place of params, for every chunk.
+    local function prepareRequest(_req, res, params)
+        local path = requestPath(_req)
+        local method = METHOD_NAMES[_req.method_id] or ""
         local req = {
             _raw = _req,
-            params = params,
+            params = params or {},
             method = method
         }
-        self_ref.logger:log(log_level.DEBUG, string.format("Method: %s, Path: %s, Handler Found: %s, Params: %s", method, path, tostring(handler_info ~= nil), json.encode(params)), "DawnServer")
+        if (self_ref.logger.min_level or log_level.DEBUG) <= log_level.DEBUG then
+            self_ref.logger:log(log_level.DEBUG, string.format("Method: %s, Path: %s, Params: %s", method, path, json.encode(params)), "DawnServer")
+        end
+
+        if not handleCORS(req, res) then return nil end
+        if not executeMiddleware(self_ref, req, res, path, self_ref.middlewares, 1) then return nil end
+        return req
+    end
 
-        if not handleCORS(req, res) then return end
+    local function handlerFailed(kind, req, res, err)
+        local path = requestPath(req._raw)
+        self_ref.logger:log(log_level.ERROR, string.format("Error in %s for %s %s: %s", kind, string.upper(req.method), path, tostring(err)), "DawnServer")
+        local route_error_handler = self_ref.error_handlers.route[path:lower()]
+        if type(route_error_handler) == "function" then
+            route_error_handler(req, res, err)
+        else
+            res:writeHeader("Content-Type", "text/plain")
+                :writeStatus(500)
+                :send("Internal Server Error")
+        end
+    end
 
-        if handler_info then
-            local handler = handler_info
+    -- Route matching happens in the shim's native router; `handler` is the
+    -- route's handler. GET and the other bodiless methods get `params`, the table
+    -- the shim built from the matched path; POST/PUT/PATCH get the req table
+    -- prepareRequest returned instead. For those `chunk` is the whole body
+    -- (is_last = true), unless the route was registered with opts.stream, in which
+    -- case it is called per chunk. multipart/form-data bodies arrive as the form
+    -- table the shim already parsed.
+    local function handleRequest(handler, opts, _req, res, params, chunk, is_last, json_error)
+        local method_id = _req.method_id
+        local has_body = method_id == METHOD_POST or method_id == METHOD_PUT or method_id == METHOD_PATCH
+        if not has_body then
+            local req = prepareRequest(_req, res, params)
+            if not req then return end
             local query_params = parseQuery(_req.url)
-            if executeMiddleware(self_ref, req, res, path, self_ref.middlewares, 1) then
-                method = string.upper(method)
-                if method == "WS" then
-                    res:writeStatus(404):send("Not Found")
-                elseif method == "GET" or method == "DELETE" or method == "HEAD" or method == "OPTIONS" then
-                    local ok, err = pcall(function()
-                        handler(req, res, query_params)
-                    end)
-                    if not ok then
-                        self_ref.logger:log(log_level.ERROR, string.format("Error in route handler for %s %s: %s", method, path, tostring(err)), "DawnServer")
-                        local route_error_handler = self_ref.error_handlers.route[path:lower()]
-                        if type(route_error_handler) == "function" then
-                            route_error_handler(req, res, err)
-                        else
-                            res:writeHeader("Content-Type", "text/plain")
-                                :writeStatus(500)
-                                :send("Internal Server Error")
-                        end
-                    end
-                elseif method == "POST" or method == "PUT" or method == "PATCH" then
-                    local content_type = (_req:getHeader("content-type") or ""):lower()
-                    local multipart_marker = "multipart/form-data"
-
-                    if (content_type:sub(1, #multipart_marker) == multipart_marker) then
-                        req.form_data_parser = req.form_data_parser or StreamingMultipartParser.new(content_type, function(part)
-                            req.form_data = req.form_data or {}
-                            req.form_data[part.name] = part.is_file and part or part.body
-                        end, self_ref.multipart_parser_options)
-
-                        req.form_data_parser:feed(chunk or "")
-
-                        if is_last then
-                            local ok, err = pcall(handler, req, res, req.form_data)
-                            if not ok then
-                                self_ref.logger:log(log_level.ERROR, string.format("Error in multipart route handler for %s %s: %s", method, path, tostring(err)), "DawnServer")
-                                local route_error_handler = self_ref.error_handlers.route[path:lower()]
-                                if type(route_error_handler) == "function" then
-                                    route_error_handler(req, res, err)
-                                else
-                                    res:writeHeader("Content-Type", "text/plain")
-                                        :writeStatus(500)
-                                        :send("Internal Server Error")
-                                end
-                            end
-                        end
-                    else
-                        if chunk then
-                            req.body = (req.body or "") .. chunk
-                        end
-                        if is_last then
-                            local parsed_body = nil
-                            local parse_error = nil
-
-                            if content_type:find("application/json") then
-                                parsed_body = json.decode(req.body)
-                                if not parsed_body then
-                                    parse_error = "Failed to parse JSON body"
-                                    self_ref.logger:log(log_level.ERROR, string.format("Error parsing JSON body for %s %s: %s", method, path, parse_error), "DawnServer")
-                                end
-                            elseif content_type:find("application/x-www-form-urlencoded") then
-                                parsed_body = {}
-                                for key, value in (req.body or ""):gmatch("([^&=]+)=([^&=]*)") do
-                                    local decoded_key = decodeURIComponent(key)
-                                    local decoded_value = decodeURIComponent(value)
-                                    parsed_body[decoded_key] = decoded_value
-                                end
-                            else
-                                parsed_body = req.body
-                            end
-
-                            local ok, err = pcall(handler, req, res, parsed_body, parse_error)
-                            if not ok then
-                                self_ref.logger:log(log_level.ERROR, string.format("Error in route handler for %s %s: %s", method, path, tostring(err)), "DawnServer")
-                                local route_error_handler = self_ref.error_handlers.route[path:lower()]
-                                if type(route_error_handler) == "function" then
-                                    route_error_handler(req, res, err)
-                                else
-                                    res:writeHeader("Content-Type", "text/plain")
-                                        :writeStatus(500)
-                                        :send("Internal Server Error")
-                                end
-                            end
-                        end
-                    end
-                end
+            local ok, err = pcall(handler, req, res, query_params)
+            if not ok then handlerFailed("route handler", req, res, err) end
+            return
+        end
+
+        -- The same req table for every chunk; _req is the handle of the body read.
+        local req = params
+        req._raw = _req
+        if opts.stream then
+            local ok, err = pcall(handler, req, res, chunk, is_last)
+            if not ok then handlerFailed("streaming route handler", req, res, err) end
+            return
+        end
+
+        local content_type = (_req:getHeader("content-type") or ""):lower()
+        local multipart_marker = "multipart/form-data"
+
+        if (content_type:sub(1, #multipart_marker) == multipart_marker) then
+            if type(chunk) == "table" then
+                -- Already parsed by the shim (opts.multipart)
+                req.form_data = chunk
+            else
+                req.form_data_parser = req.form_data_parser or StreamingMultipartParser.new(_req:getHeader("content-type"), function(part)
+                    req.form_data = req.form_data or {}
+                    req.form_data[part.name] = part.is_file and part or part.body
+                end, self_ref.multipart_parser_options)
+
+                req.form_data_parser:feed(chunk or "")
+            end
+
+            if is_last then
+                local ok, err = pcall(handler, req, res, req.form_data)
+                if not ok then handlerFailed("multipart route handler", req, res, err) end
+            end
+            return
+        end
+
+        req.body = chunk
+        if not is_last then return end
+        local parsed_body = nil
+        local parse_error = nil
+
+        if json_error ~= nil then
+            -- Decoded by the shim (opts.json); on a parse error chunk is the raw text
+            if json_error then
+                parse_error = "Failed to parse JSON body"
+                self_ref.logger:log(log_level.ERROR, string.format("Error parsing JSON body for %s %s: %s", string.upper(req.method), requestPath(_req), json_error), "DawnServer")
+            else
+                parsed_body = chunk
+            end
+        elseif content_type:find("application/json") then
+            parsed_body = json.decode(req.body)
+            if not parsed_body then
+                parse_error = "Failed to parse JSON body"
+                self_ref.logger:log(log_level.ERROR, string.format("Error parsing JSON body for %s %s: %s", string.upper(req.method), requestPath(_req), parse_error), "DawnServer")
+            end
+        elseif content_type:find("application/x-www-form-urlencoded") then
+            parsed_body = {}
+            for key, value in (req.body or ""):gmatch("([^&=]+)=([^&=]*)") do
+                local decoded_key = decodeURIComponent(key)
+                local decoded_value = decodeURIComponent(value)
+                parsed_body[decoded_key] = decoded_value
             end
         else
-            -- If no specific Lua route handler is found, the C++ `serve_static` might still catch it.
-            -- If it's not caught by `serve_static`, then it's a true 404.
-            res:writeStatus(404):send("Not Found")
+            parsed_body = req.body
         end
+
+        local ok, err = pcall(handler, req, res, parsed_body, parse_error)
+        if not ok then handlerFailed("route handler", req, res, err) end
     end
 
-    local function registerRouteHandlers(node, prefix)
-        if node.handler then
-            local method = node.handler.method:lower()
-            local routePath = prefix
-            if method == "ws" then
-                uws.ws(routePath, function(ws, event, message, code, reason)
-                    if event == "open" then
-                        local fake_req = {
-                            method = "WS",
-                            url = routePath,
-                            headers = {}
-                        }
-                        local fake_res = {}
-                        fake_res.writeHeader = function() return fake_res end
-                        fake_res.writeStatus = function() return fake_res end
-                        fake_res.send = function(...)
-                            print( "[WS Middleware] Blocking upgrade:", ..., " : dawn_server")
-                            ws:close()
-                        end
-                        local ok = executeMiddleware(self_ref, fake_req, fake_res, routePath, self_ref.middlewares, 1)
-                        if ok then
-                            self_ref.dawn_sockets_handler:handle_open( ws, message)
-                        else
-                            print("[WS] Connection rejected by middleware:", routePath)
-                        end
-                    elseif event == "message" then
-                        self_ref.dawn_sockets_handler:handle_message( ws, message, code)
-                    elseif event == "close" then
-                        self_ref.dawn_sockets_handler:handle_close( ws, code, reason)
-                    end
-                end)
-            elseif method == "get" or method == "delete" or method == "head" or method == "options" then
-                uws[method](routePath, handleRequest)
-            elseif method == "post" or method == "put" or method == "patch" then
-                uws[method](routePath, handleRequest)
+    local function registerWebSocketRoute(routePath, opts)
+        local ws_options = {}
+        for k, v in pairs(self_ref.ws_options) do ws_options[k] = v end
+        for k, v in pairs(opts) do ws_options[k] = v end
+        -- Native pings keep live sockets open and uWS closes the rest after idle_timeout.
+        local native_heartbeat = ws_options.send_pings ~= false and ws_options.idle_timeout ~= 0
+        uws.ws(routePath, function(ws, event, message, code, reason)
+            if event == "open" then
+                local fake_req = {
+                    method = "WS",
+                    url = routePath,
+                    headers = {}
+                }
+                local fake_res = {}
+                fake_res.writeHeader = function() return fake_res end
+                fake_res.writeStatus = function() return fake_res end
+                fake_res.send = function(...)
+                    print( "[WS Middleware] Blocking upgrade:", ..., " : dawn_server")
+                    ws:close()
+                end
+                local ok = executeMiddleware(self_ref, fake_req, fake_res, routePath, self_ref.middlewares, 1)
+                if ok then
+                    self_ref.dawn_sockets_handler:handle_open(ws, native_heartbeat)
+                else
+                    print("[WS] Connection rejected by middleware:", routePath)
+                end
+            elseif event == "message" then
+                self_ref.dawn_sockets_handler:handle_message( ws, message, code)
+            elseif event == "drain" then
+                self_ref.dawn_sockets_handler:handle_drain(ws, message)
+            elseif event == "close" then
+                self_ref.dawn_sockets_handler:handle_close( ws, code, reason)
+            end
+        end, ws_options)
+    end
+
+    for _, guard in ipairs(self_ref.guards) do
+        uws.guard(guard.opts, guard.route)
+    end
+
+    local function registerRouteHandlers()
+        for _, route in ipairs(self_ref.route_list) do
+            local method = route.method
+            if method == "WS" then
+                registerWebSocketRoute(route.path, route.opts)
+            else
+                local handler, opts = route.handler, route.opts
+                local _, replaced = uws.route(method, route.path, function(_req, res, params, chunk, is_last, json_error)
+                    handleRequest(handler, opts, _req, res, params, chunk, is_last, json_error)
+                end, {
+                    before_body = prepareRequest,
+                    max_body_size = opts.max_body_size or self_ref.max_body_size,
+                    stream = opts.stream,
+                    json = (opts.json == nil) and self_ref.native_json or opts.json,
+                    multipart = (opts.multipart == nil)
+                        and (self_ref.native_multipart and (self_ref.multipart_parser_options or true))
+                        or opts.multipart
+                })
+                if replaced then
+                    self_ref.logger:log(log_level.WARN, string.format("Route conflict: %s %s is being overridden.", method, route.path), "DawnServer")
+                end
             end
-        end
-        for path, child in pairs(node.children) do
-            local slashCount = select(2, prefix:gsub("/", ""))
-            local param = child.params[slashCount + 1] or ""
-            local nextPrefix = prefix .. (
-                path == ":" and "/:" .. param or
-                (path == "*" and "/*" or "/" .. path)
-            )
-            registerRouteHandlers(child, nextPrefix)
         end
     end
-    registerRouteHandlers(self.router, "")
+    registerRouteHandlers()
 
     -- Register static file serving using the new uws.serve_static function
     for _, config in ipairs(self_ref.static_configs) do
         self_ref.logger:log(log_level.INFO, string.format("Serving static files from '%s' at route '%s'", config.directory_path, config.route_prefix), "DawnServer")
-        uws.serve_static(config.route_prefix, config.directory_path) -- <--- Call the new C++ function here
+        uws.serve_static(config.route_prefix, config.directory_path, config.opts)
     end
 
     self:printRoutes()
@@ -515,6 +479,16 @@ function DawnServer:run()
 
 end
 
+-- Runs the server on `count` worker threads (one per core when count is nil or 0).
+-- Each worker executes `bootstrap_script` in its own Lua state; the script must
+-- build a DawnServer with the same routes and call :run() (not :start()), after
+-- which the worker enters its own uWS event loop. All workers share the port.
+function DawnServer:startWorkers(count, bootstrap_script)
+    assert(type(bootstrap_script) == "string", "Worker bootstrap script path must be a string.")
+    self.logger:log(log_level.INFO, string.format("Starting %s worker(s) from %s on port %d", tostring(count or "auto"), bootstrap_script, self.port), "DawnServer")
+    return uws.run_workers(count or 0, bootstrap_script)
+end
+
 function DawnServer:stop()
     if self.running then
         self.running = false
@@ -1,5 +1,6 @@
 -- dawn_sockets.lua (Enhanced with Phoenix-style Presence + Lifecycle + Timeout + Modular Events + Ack + Binary + Dynamic Rooms + Message Queuing)
 local Supervisor = require("runtime.loop")
+local uws = require("uwebsockets")
 local uv = require("luv")
 local cjson = require("cjson")
 local Set = require('utils.set')
@@ -38,6 +39,10 @@ function DawnSockets:new(parent_supervisor, shared_state, options)
     self.logger = self.supervisor.logger
     self.handlers = handlers or {}
     self.connections = {}
+    -- uWS sends protocol pings and closes sockets past idle_timeout (uws.ws opts),
+    -- so the Lua ping/stale sweep only covers connections whose route switched
+    -- that off. This is the default for connections opened without route options.
+    self.native_heartbeat = true
 
     -- Use the provided state_management or default to InMemoryBackend
     self.state_management =  state_management["__active__"] and state_management["__active__"] or state_management["__default__"]
@@ -130,7 +135,7 @@ end
 
 function DawnSockets:send_heartbeats()
     for ws_id, conn in pairs(self.connections) do
-        if conn and conn.ws then
+        if conn and conn.ws and not conn.native_heartbeat then
             conn.ws:send('{"type":"ping"}')
         end
     end
@@ -141,7 +146,7 @@ function DawnSockets:cleanup_stale_clients(timeout_seconds)
     local stale_ws_ids = {}
     for ws_id, conn in pairs(self.connections) do
         local last = conn.state.last_pong or conn.state.last_message or 0
-        if now - last > timeout_seconds then
+        if not conn.native_heartbeat and now - last > timeout_seconds then
             print("[HEARTBEAT] Stale connection closing:", tostring(conn.ws), "(ID:", ws_id, ")")
             table.insert(stale_ws_ids, ws_id)
             if conn.ws then
@@ -154,19 +159,73 @@ function DawnSockets:cleanup_stale_clients(timeout_seconds)
     end
 end
 
+-- Presence is read once per room rather than once per member and room. Backends
+-- with idle_members (in-memory) answer from native joined-at times; backends with
+-- get_all_presence_many (Redis) fetch every room in one pipelined round trip and
+-- call back later, so the sweep looks connections up again when it runs.
 function DawnSockets:auto_leave_idle_clients(room_timeout_seconds)
-    local now = os.time()
-    for ws_id, conn in pairs(self.connections) do
+    local topics, seen = {}, {}
+    for _, conn in pairs(self.connections) do
         for _, topic in ipairs(conn.state.rooms or {}) do
-            -- Use state_management for presence check
-            if self.state_management:exist_in_presence(ws_id, topic) then
-                local presence_data = self.state_management:get_all_presence(topic)[ws_id]
-                if presence_data and presence_data.joined_at and now - presence_data.joined_at > room_timeout_seconds then
-                    self:leave_room(topic, conn.ws)
-                    print("[AUTO-LEAVE] Removing idle", ws_id, "from", topic)
+            if not seen[topic] then
+                seen[topic] = true
+                topics[#topics + 1] = topic
+            end
+        end
+    end
+    if #topics == 0 then return end
+
+    local cutoff = os.time() - room_timeout_seconds
+
+    -- idle_by_topic[topic][id] is true for members past the timeout.
+    local function sweep(idle_by_topic)
+        local idle = {}
+        for ws_id, conn in pairs(self.connections) do
+            for _, topic in ipairs(conn.state.rooms or {}) do
+                if idle_by_topic[topic] and idle_by_topic[topic][ws_id] then
+                    idle[#idle + 1] = { ws_id = ws_id, ws = conn.ws, topic = topic }
+                end
+            end
+        end
+        -- leave_room edits conn.state.rooms, so leave only after the scan.
+        for _, entry in ipairs(idle) do
+            self:leave_room(entry.topic, entry.ws)
+            print("[AUTO-LEAVE] Removing idle", entry.ws_id, "from", entry.topic)
+        end
+    end
+
+    local function sweep_presence(presence_by_topic)
+        local idle_by_topic = {}
+        for topic, presence in pairs(presence_by_topic) do
+            local idle = {}
+            for id, presence_data in pairs(presence) do
+                if presence_data.joined_at and presence_data.joined_at < cutoff then
+                    idle[id] = true
                 end
             end
+            idle_by_topic[topic] = idle
+        end
+        sweep(idle_by_topic)
+    end
+
+    if self.state_management.idle_members then
+        local idle_by_topic = {}
+        for _, topic in ipairs(topics) do
+            local idle = {}
+            for _, id in ipairs(self.state_management:idle_members(topic, cutoff)) do
+                idle[id] = true
+            end
+            idle_by_topic[topic] = idle
         end
+        sweep(idle_by_topic)
+    elseif self.state_management.get_all_presence_many then
+        self.state_management:get_all_presence_many(topics, sweep_presence)
+    else
+        local presence_by_topic = {}
+        for _, topic in ipairs(topics) do
+            presence_by_topic[topic] = self.state_management:get_all_presence(topic) or {}
+        end
+        sweep_presence(presence_by_topic)
     end
 end
 
@@ -187,22 +246,36 @@ end
 --     end
 -- end
 
+-- Every member's socket is subscribed to the room's topic in join_room, so the
+-- message is encoded once and the shim fans it out to all of them, on every worker.
 function DawnSockets:broadcast_to_room(topic, message_table)
-    local room = self.state_management:get_all_presence(topic) or {}
-    if not room then return end
+    if not message_table then return end
+    message_table.id = message_table.id or uuid.v4()
+    uws.publish(topic, cjson.encode(message_table))
+end
 
-    if message_table then
-        message_table.id = message_table.id or uuid.v4()
+-- Remembers a room's presence before a change, for presence_diff_since. Backends
+-- that log changes natively (presence_version) hand out a version number instead
+-- of a copy of the room.
+function DawnSockets:presence_mark(topic)
+    if self.state_management.presence_version then
+        return self.state_management:presence_version()
     end
+    return shallow_copy(self.state_management:get_all_presence(topic)) or {}
+end
 
-    for ws_id, _ in pairs(room) do
-        local existing_user_id = self:getSyncPrivateChatId(ws_id) or ws_id
-        local receiver_user_id = self:getSyncPrivateUserID(ws_id) or ws_id -- Get the user_id *inside* the loop
-        if receiver_user_id then
-            message_table.receiver = receiver_user_id
-            self:send_to_user(existing_user_id, message_table)
+function DawnSockets:presence_diff_since(topic, mark)
+    if type(mark) == "number" then
+        local changes = self.state_management:presence_changes(topic, mark)
+        if changes then
+            return changes
         end
+        -- The change log overflowed since the mark, so what changed is lost: send
+        -- the whole room as joins, which clients merge like any other diff.
+        return { joins = shallow_copy(self.state_management:get_all_presence(topic) or {}), leaves = {} }
     end
+    local new_presence = shallow_copy(self.state_management:get_all_presence(topic)) or {}
+    return self.state_management:diff_presence(topic, mark, new_presence)
 end
 
 function DawnSockets:broadcast_presence_diff(topic, diff)
@@ -247,7 +320,7 @@ function DawnSockets:join_room(topic, ws, payload)
         return
     end
 
-    local old_presence = shallow_copy(self.state_management:get_all_presence(topic)) or {}
+    local presence_mark = self:presence_mark(topic)
         local user_id = self:getSyncPrivateUserID(ws_id) or nil
 
     local existing = self.state_management:exist_in_presence(ws_id, topic)
@@ -258,6 +331,7 @@ function DawnSockets:join_room(topic, ws, payload)
         joined_at = os.time(),
         meta = payload or {},
     }) -- Set presence
+    ws:subscribe(topic)
 
     if self.connections[ws_id] then
         self.connections[ws_id].state.rooms = self.connections[ws_id].state.rooms or {}
@@ -266,8 +340,7 @@ function DawnSockets:join_room(topic, ws, payload)
         end
     end
 
-    local new_presence = shallow_copy(self.state_management:get_all_presence(topic)) or {}
-    local diff = self.state_management:diff_presence(topic, old_presence, new_presence)
+    local diff = self:presence_diff_since(topic, presence_mark)
 
     if (not existing or existing == false) and (not user_existing or user_existing == false) then
         self:broadcast_presence_diff(topic, diff)
@@ -296,8 +369,9 @@ function DawnSockets:leave_room(topic, ws)
         return
     end
 
-    local old_presence = shallow_copy(self.state_management:get_all_presence(topic)) or {}
+    local presence_mark = self:presence_mark(topic)
     self.state_management:remove_presence(topic, ws_id)
+    ws:unsubscribe(topic)
 
     if self.connections[ws_id] and self.connections[ws_id].state then
         for i = #self.connections[ws_id].state.rooms, 1, -1 do
@@ -308,8 +382,7 @@ function DawnSockets:leave_room(topic, ws)
         end
     end
 
-    local new_presence = shallow_copy(self.state_management:get_all_presence(topic)) or {}
-    local diff = self.state_management:diff_presence(topic, old_presence, new_presence)
+    local diff = self:presence_diff_since(topic, presence_mark)
 
     if not self.state_management:exist_in_presence(ws_id, topic) then
         self:broadcast_presence_diff(topic, diff)
@@ -351,7 +424,9 @@ function DawnSockets:safe_close(ws_id)
 end
 
 -- This function is used to handle the opening of a WebSocket connection.
-function DawnSockets:handle_open(ws)
+-- native_heartbeat: whether the socket's route has uWS pings and idle_timeout on;
+-- nil falls back to self.native_heartbeat.
+function DawnSockets:handle_open(ws, native_heartbeat)
     local ws_id = get_ws_id(ws)
     if not ws_id then
         print("Error: Unable to get WebSocket ID.")
@@ -369,10 +444,13 @@ function DawnSockets:handle_open(ws)
         return
     end
 
-    self:setupWsChildProcess(ws_id, ws)
+    if native_heartbeat == nil then
+        native_heartbeat = self.native_heartbeat
+    end
+    self:setupWsChildProcess(ws_id, ws, native_heartbeat)
 end
 
-function DawnSockets:setupWsChildProcess(ws_id, ws)
+function DawnSockets:setupWsChildProcess(ws_id, ws, native_heartbeat)
     local child = {
         name = ws_id,
         restart_policy = "transient",
@@ -382,6 +460,8 @@ function DawnSockets:setupWsChildProcess(ws_id, ws)
             self.connections[ws_id] = {
                 ws = ws,
                 ws_id = ws_id,
+                handle = ws:handle(), -- for uws.send; a no-op once the socket closes
+                native_heartbeat = native_heartbeat,
                 state = {
                     connected_at = os.time(),
                     last_message = os.time(),
@@ -533,12 +613,16 @@ function DawnSockets:handle_message(ws, message, opcode)
 end
 
 function DawnSockets:send_to_user(ws_unique_identifier, message_table, ack_callback)
+    if type(message_table) ~= "table" then
+        self.logger:log(log_level.ERROR, "[WS] send_to_user called without a message table", "DawnSockets")
+        return false
+    end
     local encoded = cjson.encode(message_table)
     print("Sending message to user:", ws_unique_identifier, "message:", encoded)
-    local ws = self.connections[ws_unique_identifier] and self.connections[ws_unique_identifier].ws
-    print("WebSocket object:", tostring(ws))
-    local receiver = message_table and message_table.receiver or nil
-    local sender = message_table and message_table.sender or nil
+    -- The socket may have closed since the caller looked it up.
+    local conn = self.connections[ws_unique_identifier]
+    local receiver = message_table.receiver
+    local sender = message_table.sender
     local message_id = message_table.id
     print("Message ID:", message_id, "Receiver:", receiver, "Sender:", sender, ws_unique_identifier)
     if receiver and sender then
@@ -562,8 +646,21 @@ function DawnSockets:send_to_user(ws_unique_identifier, message_table, ack_callb
         end
     end
 
-    if ws and ws.send then
-        ws:send(encoded)
+    -- uws.send resolves the handle (or the socket id) natively; a closed socket
+    -- reports "closed" instead of being touched.
+    local sent, status = uws.send(conn and conn.handle or ws_unique_identifier, encoded)
+    if not sent and status ~= "closed" then
+        -- Dropped by the slow-consumer policy: keep private messages for later.
+        if receiver then
+            self.state_management:queue_private_message(receiver, message_table)
+        end
+        return false
+    end
+
+    if sent then
+        if status ~= "sent" and conn and conn.state then
+            conn.state.backpressure = true
+        end
         if ack_callback and message_id then
             self.shared.pending_acknowledgements[ws_unique_identifier] =
                 self.shared.pending_acknowledgements[ws_unique_identifier] or {}
@@ -590,21 +687,19 @@ function DawnSockets:send_to_user(ws_unique_identifier, message_table, ack_callb
             print(string.format("[WS]No Receiver User %s is offline. Message (ID: %s) queued.", receiver, message_id))
             return false
         else
-           print("[WS] Invalid WebSocket object:", tostring(ws), "Message (ID: %s) not sent.", message_id)
+           print("[WS] Socket closed:", ws_unique_identifier, "Message (ID: %s) not sent.", message_id)
         end
         return false
     end
 end
 
 function DawnSockets:send_binary_to_user(ws_unique_identifier, binary_data)
-    local ws = self.connections[ws_unique_identifier] and self.connections[ws_unique_identifier].ws
-    if ws and ws.send then
-        ws:send(binary_data, "binary")
-        return true
-    else
-        print("[WS] Invalid WebSocket object:", tostring(ws), "Binary message not sent.")
-        return false
+    local conn = self.connections[ws_unique_identifier]
+    local sent = uws.send(conn and conn.handle or ws_unique_identifier, binary_data, "binary")
+    if not sent then
+        print("[WS] Socket closed:", ws_unique_identifier, "Binary message not sent.")
     end
+    return sent
 end
 
 function DawnSockets:push_notification(ws, payload)
@@ -621,6 +716,15 @@ function DawnSockets:push_notification(ws, payload)
     })
 end
 
+-- The socket's send buffer fell below max_backpressure again.
+function DawnSockets:handle_drain(ws, buffered)
+    local ws_id = get_ws_id(ws)
+    local conn = ws_id and self.connections[ws_id]
+    if conn then
+        conn.state.backpressure = false
+    end
+end
+
 function DawnSockets:handle_close(ws, code, reason)
     local ws_id = get_ws_id(ws)
     if ws_id then
@@ -0,0 +1,125 @@
+// access_rules.hpp
+// Rules for the native guard stage (uws.guard): IP allow/deny lists matched as
+// CIDR ranges against the peer's raw address, and the CORS preflight policy.
+// IPv4 ranges are stored as IPv4-mapped IPv6 (::ffff:a.b.c.d), so one compare
+// covers peers on IPv4 and on dual-stack sockets alike.
+#pragma once
+
+#include <arpa/inet.h>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace dawn {
+
+class IpRangeList {
+public:
+    // Adds "10.0.0.0/8", "2001:db8::/32" or a single address. False if the text
+    // is neither.
+    bool add(std::string_view text) {
+        std::string_view address = text;
+        int prefix = -1;
+        size_t slash = text.find('/');
+        if (slash != std::string_view::npos) {
+            address = text.substr(0, slash);
+            std::string_view bits = text.substr(slash + 1);
+            auto [end, ec] = std::from_chars(bits.data(), bits.data() + bits.size(), prefix);
+            if (ec != std::errc() || end != bits.data() + bits.size() || prefix < 0) return false;
+        }
+
+        char buffer[INET6_ADDRSTRLEN];
+        if (address.empty() || address.size() >= sizeof(buffer)) return false;
+        std::memcpy(buffer, address.data(), address.size());
+        buffer[address.size()] = '\0';
+
+        Range range{};
+        if (inet_pton(AF_INET, buffer, range.bytes + 12) == 1) {
+            if (prefix > 32) return false;
+            range.bytes[10] = range.bytes[11] = 0xff;
+            range.prefix = 96 + static_cast<unsigned>(prefix < 0 ? 32 : prefix);
+        } else if (inet_pton(AF_INET6, buffer, range.bytes) == 1) {
+            if (prefix > 128) return false;
+            range.prefix = static_cast<unsigned>(prefix < 0 ? 128 : prefix);
+        } else {
+            return false;
+        }
+        mask(range);
+        ranges_.push_back(range);
+        return true;
+    }
+
+    // `address` is a raw 4- or 16-byte address, as from HttpResponse::getRemoteAddress().
+    bool contains(std::string_view address) const {
+        uint8_t bytes[16];
+        if (!to_mapped(address, bytes)) return false;
+        for (const Range &range : ranges_) {
+            if (matches(range, bytes)) return true;
+        }
+        return false;
+    }
+
+    bool empty() const { return ranges_.empty(); }
+
+private:
+    struct Range {
+        uint8_t bytes[16];
+        unsigned prefix;
+    };
+
+    static bool to_mapped(std::string_view raw, uint8_t out[16]) {
+        if (raw.size() == 16) {
+            std::memcpy(out, raw.data(), 16);
+            return true;
+        }
+        if (raw.size() != 4) return false;
+        std::memset(out, 0, 10);
+        out[10] = out[11] = 0xff;
+        std::memcpy(out + 12, raw.data(), 4);
+        return true;
+    }
+
+    static void mask(Range &range) {
+        for (unsigned i = 0; i < 16; ++i) {
+            unsigned keep = range.prefix > i * 8 ? range.prefix - i * 8 : 0;
+            if (keep < 8) range.bytes[i] &= static_cast<uint8_t>(0xff00 >> keep);
+        }
+    }
+
+    static bool matches(const Range &range, const uint8_t bytes[16]) {
+        unsigned full = range.prefix / 8;
+        if (std::memcmp(range.bytes, bytes, full) != 0) return false;
+        unsigned rest = range.prefix % 8;
+        if (rest == 0) return true;
+        uint8_t m = static_cast<uint8_t>(0xff00 >> rest);
+        return (bytes[full] & m) == range.bytes[full];
+    }
+
+    std::vector<Range> ranges_;
+};
+
+// How OPTIONS preflights are answered. Only preflights are handled natively;
+// headers on the actual responses stay with the Lua side.
+struct CorsPolicy {
+    std::vector<std::string> origins; // empty = any origin
+    std::string methods = "GET, POST, PUT, DELETE, PATCH, OPTIONS";
+    std::string headers;              // empty = echo Access-Control-Request-Headers
+    std::string max_age = "86400";
+    bool credentials = false;
+
+    bool allows(std::string_view origin) const {
+        if (origins.empty()) return true;
+        for (const std::string &allowed : origins) {
+            if (allowed == origin) return true;
+        }
+        return false;
+    }
+
+    // "*" only when any origin may read without credentials; otherwise the
+    // request's own origin is echoed (and the response must vary on Origin).
+    bool wildcard() const { return origins.empty() && !credentials; }
+};
+
+} // namespace dawn
@@ -0,0 +1,281 @@
+// async_log.hpp
+// Logging off the event loops. Callers format a line into a thread-local buffer
+// and hand it to a bounded lock-free multi-producer ring (Vyukov's queue: each
+// cell carries a sequence number saying whose turn it is); one writer thread per
+// log drains the ring and writes whole batches with writev. write() checks the
+// level (a relaxed atomic load) before formatting anything, so a filtered call
+// neither formats nor queues.
+//
+// Cells keep their string's capacity: a producer swaps its buffer with the
+// cell's, so in steady state logging allocates nothing. When the ring is full
+// the line is dropped and counted rather than blocking the loop; the writer
+// reports the count. Timestamps are formatted at most once a second per thread.
+#pragma once
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace dawn {
+
+enum LogLevel : int { LOG_DEBUG = 1, LOG_INFO = 2, LOG_WARN = 3, LOG_ERROR = 4, LOG_FATAL = 5 };
+
+inline const char *log_level_name(int level) {
+    switch (level) {
+    case LOG_DEBUG: return "DEBUG";
+    case LOG_INFO: return "INFO";
+    case LOG_WARN: return "WARN";
+    case LOG_ERROR: return "ERROR";
+    case LOG_FATAL: return "FATAL";
+    default: return "UNKNOWN";
+    }
+}
+
+// "2024-01-31T12:00:00Z" for the current second, reformatted only when the
+// second changes.
+inline std::string_view log_timestamp() {
+    thread_local time_t cached_second = -1;
+    thread_local char cached[sizeof("2024-01-31T12:00:00Z")];
+    time_t now = std::time(nullptr);
+    if (now != cached_second) {
+        struct tm utc;
+        gmtime_r(&now, &utc);
+        std::strftime(cached, sizeof(cached), "%Y-%m-%dT%H:%M:%SZ", &utc);
+        cached_second = now;
+    }
+    return std::string_view(cached, sizeof(cached) - 1);
+}
+
+// Appends s as the body of a JSON string (without the quotes).
+inline void append_json_escaped(std::string &out, std::string_view s) {
+    static const char hex[] = "0123456789abcdef";
+    for (char c : s) {
+        unsigned char u = static_cast<unsigned char>(c);
+        switch (c) {
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        default:
+            if (u < 0x20) {
+                out += "\\u00";
+                out.push_back(hex[u >> 4]);
+                out.push_back(hex[u & 0xf]);
+            } else {
+                out.push_back(c);
+            }
+        }
+    }
+}
+
+class AsyncLog {
+public:
+    static constexpr size_t CAPACITY = 16384; // lines in flight; a power of two
+    static constexpr size_t BATCH = 256;      // lines per writev (at most IOV_MAX)
+
+    // Writes to fd, which stays owned by the caller unless owns_fd.
+    AsyncLog(int fd, bool owns_fd, int min_level = LOG_INFO)
+        : fd_(fd), owns_fd_(owns_fd), min_level_(min_level), cells_(CAPACITY) {
+        for (size_t i = 0; i < CAPACITY; ++i) cells_[i].sequence.store(i, std::memory_order_relaxed);
+        writer_ = std::thread([this] { run(); });
+    }
+
+    ~AsyncLog() {
+        {
+            std::lock_guard<std::mutex> lock(wake_mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_one();
+        writer_.join();
+        if (owns_fd_) ::close(fd_);
+    }
+
+    AsyncLog(const AsyncLog &) = delete;
+    AsyncLog &operator=(const AsyncLog &) = delete;
+
+    bool enabled(int level) const { return level >= min_level_.load(std::memory_order_relaxed); }
+    void set_level(int level) { min_level_.store(level, std::memory_order_relaxed); }
+    int level() const { return min_level_.load(std::memory_order_relaxed); }
+    uint64_t dropped() const { return dropped_total_.load(std::memory_order_relaxed); }
+
+    // Queues `line` (which should end in '\n'); its contents are taken and it is
+    // left with some other buffer to reuse. False if the ring was full.
+    bool push(std::string &line) {
+        size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+        Cell *cell;
+        for (;;) {
+            cell = &cells_[pos & (CAPACITY - 1)];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+                dropped_total_.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            } else {
+                pos = enqueue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+        cell->line.swap(line);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        if (sleeping_.load(std::memory_order_acquire)) wake_.notify_one();
+        return true;
+    }
+
+    // "<timestamp> <LEVEL> " followed by parts (strings, C strings, numbers) and
+    // a newline; nothing if level is below the log's.
+    template <typename... Parts>
+    void write(int level, const Parts &...parts) {
+        if (!enabled(level)) return;
+        std::string &line = scratch();
+        line.append(log_timestamp()).append(" ").append(log_level_name(level)).append(" ");
+        (append_part(line, parts), ...);
+        line.push_back('\n');
+        push(line);
+        if (level >= LOG_FATAL) flush();
+    }
+
+    // Blocks until every line queued before the call has been written.
+    void flush() {
+        size_t target = enqueue_pos_.load(std::memory_order_acquire);
+        std::unique_lock<std::mutex> lock(wake_mutex_);
+        ++flush_waiters_;
+        wake_.notify_one();
+        flushed_.wait(lock, [&] { return written_pos_.load() >= target || stopping_; });
+        --flush_waiters_;
+    }
+
+    // A per-thread buffer for building a line to push(); starts empty.
+    static std::string &scratch() {
+        thread_local std::string line;
+        line.clear();
+        return line;
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        std::string line;
+    };
+
+    template <typename T>
+    static void append_part(std::string &out, const T &part) {
+        if constexpr (std::is_same_v<T, bool>) {
+            out += part ? "true" : "false";
+        } else if constexpr (std::is_arithmetic_v<T>) {
+            out += std::to_string(part);
+        } else if constexpr (std::is_convertible_v<const T &, const char *>) {
+            const char *s = part;
+            out += s ? s : "(null)";
+        } else {
+            out += std::string_view(part);
+        }
+    }
+
+    void run() {
+        size_t pos = 0; // next cell to read; only this thread dequeues
+        std::vector<iovec> iov(BATCH);
+        for (;;) {
+            size_t count = 0;
+            while (count < BATCH) {
+                Cell &cell = cells_[(pos + count) & (CAPACITY - 1)];
+                if (cell.sequence.load(std::memory_order_acquire) != pos + count + 1) break;
+                iov[count].iov_base = cell.line.data();
+                iov[count].iov_len = cell.line.size();
+                ++count;
+            }
+
+            if (count > 0) {
+                write_batch(iov.data(), count);
+                for (size_t i = 0; i < count; ++i) {
+                    Cell &cell = cells_[(pos + i) & (CAPACITY - 1)];
+                    cell.line.clear();
+                    cell.sequence.store(pos + i + CAPACITY, std::memory_order_release);
+                }
+                pos += count;
+                report_dropped();
+                // Both sides use seq_cst, so either flush() sees the new position or
+                // this sees its waiter.
+                written_pos_.store(pos);
+                if (flush_waiters_.load() > 0) {
+                    std::lock_guard<std::mutex> lock(wake_mutex_);
+                    flushed_.notify_all();
+                }
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(wake_mutex_);
+            if (stopping_ && enqueue_pos_.load(std::memory_order_acquire) == pos) break;
+            // A push between the check above and the wait is picked up by the timeout.
+            sleeping_.store(true, std::memory_order_release);
+            wake_.wait_for(lock, std::chrono::milliseconds(10));
+            sleeping_.store(false, std::memory_order_relaxed);
+        }
+        report_dropped();
+        std::lock_guard<std::mutex> lock(wake_mutex_);
+        flushed_.notify_all();
+    }
+
+    void write_batch(iovec *iov, size_t count) {
+        while (count > 0) {
+            ssize_t n = ::writev(fd_, iov, static_cast<int>(count));
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return; // nowhere left to report it
+            }
+            size_t left = static_cast<size_t>(n);
+            while (count > 0 && left >= iov->iov_len) {
+                left -= iov->iov_len;
+                ++iov;
+                --count;
+            }
+            if (count > 0) {
+                iov->iov_base = static_cast<char *>(iov->iov_base) + left;
+                iov->iov_len -= left;
+            }
+        }
+    }
+
+    void report_dropped() {
+        uint64_t dropped = dropped_.exchange(0, std::memory_order_relaxed);
+        if (dropped == 0) return;
+        std::string line;
+        line.append(log_timestamp()).append(" WARN log ring full, dropped ").append(std::to_string(dropped)).append(" lines\n");
+        iovec iov{line.data(), line.size()};
+        write_batch(&iov, 1);
+    }
+
+    int fd_;
+    bool owns_fd_;
+    std::atomic<int> min_level_;
+    std::vector<Cell> cells_;
+    alignas(64) std::atomic<size_t> enqueue_pos_{0};
+    alignas(64) std::atomic<uint64_t> dropped_{0};
+    std::atomic<uint64_t> dropped_total_{0};
+    std::atomic<bool> sleeping_{false};
+
+    std::mutex wake_mutex_;
+    std::condition_variable wake_;
+    std::condition_variable flushed_;
+    std::atomic<size_t> written_pos_{0};
+    std::atomic<int> flush_waiters_{0}; // changed under wake_mutex_
+    bool stopping_ = false;             // guarded by wake_mutex_
+    std::thread writer_;
+};
+
+} // namespace dawn
@@ -0,0 +1,62 @@
+// handle_pool.hpp
+// Recycles per-request native objects (the shim's req/res handles) without letting
+// a stale reference reach whichever request gets the object next. Every object
+// carries a generation that moves on when it goes back to the pool; a Ref records
+// the generation it was issued under and resolves to nullptr once that has passed.
+//
+// T needs a `uint32_t generation` member. The pool owns its objects, so a Ref
+// never dangles; at worst it resolves to nothing.
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace dawn {
+
+template <typename T>
+class HandlePool {
+public:
+    struct Ref {
+        T *handle = nullptr;
+        uint32_t generation = 0;
+    };
+
+    // An object no request is using, default-constructed the first time round.
+    T *acquire() {
+        if (!idle_.empty()) {
+            T *h = idle_.back();
+            idle_.pop_back();
+            return h;
+        }
+        owned_.push_back(std::make_unique<T>());
+        return owned_.back().get();
+    }
+
+    // Hands h back; every Ref issued for it so far goes stale.
+    void release(T *h) {
+        ++h->generation;
+        idle_.push_back(h);
+    }
+
+    static Ref ref(T *h) { return Ref{h, h->generation}; }
+
+    // The object r names, or nullptr if it has been released since r was issued.
+    static T *resolve(const Ref &r) {
+        return r.handle && r.handle->generation == r.generation ? r.handle : nullptr;
+    }
+
+    size_t size() const { return owned_.size(); }
+    size_t idle() const { return idle_.size(); }
+
+    void clear() {
+        idle_.clear();
+        owned_.clear();
+    }
+
+private:
+    std::vector<std::unique_ptr<T>> owned_;
+    std::vector<T *> idle_;
+};
+
+} // namespace dawn
@@ -0,0 +1,390 @@
+// json.hpp
+// Single-pass JSON parser used for request bodies. The document keeps the source
+// text and a flat "tape" of nodes describing it; strings and numbers are not
+// decoded until someone asks for them, so a handler that reads a few fields out of
+// a large payload only pays for validating it once.
+//
+// Tape layout: every value is one node followed by its children. An object's
+// children alternate key (a string node) and value; `next` on each node is the
+// index just past its subtree, which makes skipping a member O(1). Indexing deep
+// into a long array builds a table of where its elements start, so a loop over
+// view[i] stays linear; that table is a cache on an otherwise const document, so
+// a document is meant to be read from one thread.
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace dawn {
+
+enum class JsonType : uint8_t {
+    NUL,
+    FALSE,
+    TRUE,
+    NUMBER,
+    STRING,
+    ARRAY,
+    OBJECT
+};
+
+struct JsonNode {
+    JsonType type;
+    bool escaped = false; // string contains backslash escapes
+    uint32_t start = 0;   // byte offset in the source (strings: after the opening quote)
+    uint32_t length = 0;  // byte length (strings: without quotes; containers: whole span)
+    uint32_t count = 0;   // array elements / object members
+    uint32_t next = 0;    // tape index after this node's subtree
+};
+
+class JsonDocument {
+public:
+    static constexpr uint32_t NONE = UINT32_MAX;
+    static constexpr int MAX_DEPTH = 512;
+
+    // Takes ownership of the text. Returns false (see error()) if it is not valid JSON.
+    bool parse(std::string text) {
+        text_ = std::move(text);
+        nodes_.clear();
+        nodes_.reserve(text_.size() / 8 + 1);
+        elements_.clear();
+        error_ = nullptr;
+        pos_ = 0;
+        if (text_.size() >= UINT32_MAX) return fail("document too large");
+
+        skip_ws();
+        if (!parse_value(0)) return false;
+        skip_ws();
+        if (pos_ != text_.size()) return fail("trailing characters after JSON value");
+        return true;
+    }
+
+    const char *error() const { return error_; }
+    size_t error_offset() const { return pos_; }
+
+    const JsonNode &node(uint32_t i) const { return nodes_[i]; }
+    std::string_view source() const { return text_; }
+
+    std::string_view raw(uint32_t i) const {
+        const JsonNode &n = nodes_[i];
+        if (n.type == JsonType::STRING) return std::string_view(text_).substr(n.start - 1, n.length + 2);
+        return std::string_view(text_).substr(n.start, n.length);
+    }
+
+    double number(uint32_t i) const {
+        // strtod stops at the first character that is not part of the number and
+        // text_ is NUL-terminated, so parsing in place is safe.
+        return std::strtod(text_.c_str() + nodes_[i].start, nullptr);
+    }
+
+    // The decoded string. Returns a view into the source when the string has no
+    // escapes, otherwise decodes into `scratch` and returns a view of it.
+    std::string_view string(uint32_t i, std::string &scratch) const {
+        const JsonNode &n = nodes_[i];
+        std::string_view s = std::string_view(text_).substr(n.start, n.length);
+        if (!n.escaped) return s;
+        unescape(s, scratch);
+        return scratch;
+    }
+
+    // Index of the value stored under `key` in object node `obj`, or NONE.
+    uint32_t find(uint32_t obj, std::string_view key) const {
+        const JsonNode &o = nodes_[obj];
+        if (o.type != JsonType::OBJECT) return NONE;
+        std::string scratch;
+        uint32_t k = obj + 1;
+        for (uint32_t m = 0; m < o.count; ++m) {
+            uint32_t v = k + 1;
+            const JsonNode &kn = nodes_[k];
+            if (kn.escaped ? string(k, scratch) == key
+                           : std::string_view(text_).substr(kn.start, kn.length) == key) {
+                return v;
+            }
+            k = nodes_[v].next;
+        }
+        return NONE;
+    }
+
+    // Index of element `index` (0-based) of array node `arr`, or NONE. Elements
+    // past the first few are looked up in the array's element table, built on
+    // first use.
+    uint32_t at(uint32_t arr, uint32_t index) const {
+        const JsonNode &a = nodes_[arr];
+        if (a.type != JsonType::ARRAY || index >= a.count) return NONE;
+        if (index < SCAN_LIMIT) {
+            uint32_t e = arr + 1;
+            while (index--) e = nodes_[e].next;
+            return e;
+        }
+        auto it = elements_.find(arr);
+        if (it == elements_.end()) {
+            std::vector<uint32_t> starts;
+            starts.reserve(a.count);
+            for (uint32_t e = arr + 1, m = 0; m < a.count; ++m, e = nodes_[e].next) starts.push_back(e);
+            it = elements_.emplace(arr, std::move(starts)).first;
+        }
+        return it->second[index];
+    }
+
+    // The member after the one whose key is node `key` in object `obj` (obj + 1
+    // for the first), as the index of its key node, or NONE past the last.
+    uint32_t next_member(uint32_t obj, uint32_t key) const {
+        const JsonNode &o = nodes_[obj];
+        if (o.type != JsonType::OBJECT || o.count == 0) return NONE;
+        uint32_t k = key == NONE ? obj + 1 : nodes_[key + 1].next;
+        return k < o.next ? k : NONE;
+    }
+
+private:
+    static constexpr uint32_t SCAN_LIMIT = 8; // elements reached by walking the tape
+    bool fail(const char *message) {
+        error_ = message;
+        return false;
+    }
+
+    void skip_ws() {
+        while (pos_ < text_.size()) {
+            char c = text_[pos_];
+            if (c != ' ' && c != '\n' && c != '\r' && c != '\t') break;
+            ++pos_;
+        }
+    }
+
+    bool consume(std::string_view word) {
+        if (text_.compare(pos_, word.size(), word) != 0) return false;
+        pos_ += word.size();
+        return true;
+    }
+
+    uint32_t push(JsonType type, size_t start) {
+        JsonNode n;
+        n.type = type;
+        n.start = static_cast<uint32_t>(start);
+        nodes_.push_back(n);
+        return static_cast<uint32_t>(nodes_.size() - 1);
+    }
+
+    void close(uint32_t i, size_t end) {
+        nodes_[i].length = static_cast<uint32_t>(end - nodes_[i].start);
+        nodes_[i].next = static_cast<uint32_t>(nodes_.size());
+    }
+
+    bool parse_value(int depth) {
+        if (pos_ >= text_.size()) return fail("unexpected end of input");
+        size_t start = pos_;
+        switch (text_[pos_]) {
+        case '{': return parse_object(depth);
+        case '[': return parse_array(depth);
+        case '"': return parse_string();
+        case 't':
+            if (!consume("true")) return fail("invalid literal");
+            close(push(JsonType::TRUE, start), pos_);
+            return true;
+        case 'f':
+            if (!consume("false")) return fail("invalid literal");
+            close(push(JsonType::FALSE, start), pos_);
+            return true;
+        case 'n':
+            if (!consume("null")) return fail("invalid literal");
+            close(push(JsonType::NUL, start), pos_);
+            return true;
+        default:
+            return parse_number();
+        }
+    }
+
+    bool parse_object(int depth) {
+        if (depth >= MAX_DEPTH) return fail("nesting too deep");
+        uint32_t obj = push(JsonType::OBJECT, pos_);
+        ++pos_; // '{'
+        skip_ws();
+        if (pos_ < text_.size() && text_[pos_] == '}') {
+            ++pos_;
+            close(obj, pos_);
+            return true;
+        }
+        for (;;) {
+            skip_ws();
+            if (pos_ >= text_.size() || text_[pos_] != '"') return fail("expected object key");
+            if (!parse_string()) return false;
+            skip_ws();
+            if (pos_ >= text_.size() || text_[pos_] != ':') return fail("expected ':' after object key");
+            ++pos_;
+            skip_ws();
+            if (!parse_value(depth + 1)) return false;
+            ++nodes_[obj].count;
+            skip_ws();
+            if (pos_ >= text_.size()) return fail("unterminated object");
+            char c = text_[pos_++];
+            if (c == '}') break;
+            if (c != ',') return fail("expected ',' or '}' in object");
+        }
+        close(obj, pos_);
+        return true;
+    }
+
+    bool parse_array(int depth) {
+        if (depth >= MAX_DEPTH) return fail("nesting too deep");
+        uint32_t arr = push(JsonType::ARRAY, pos_);
+        ++pos_; // '['
+        skip_ws();
+        if (pos_ < text_.size() && text_[pos_] == ']') {
+            ++pos_;
+            close(arr, pos_);
+            return true;
+        }
+        for (;;) {
+            skip_ws();
+            if (!parse_value(depth + 1)) return false;
+            ++nodes_[arr].count;
+            skip_ws();
+            if (pos_ >= text_.size()) return fail("unterminated array");
+            char c = text_[pos_++];
+            if (c == ']') break;
+            if (c != ',') return fail("expected ',' or ']' in array");
+        }
+        close(arr, pos_);
+        return true;
+    }
+
+    static bool is_hex(char c) {
+        return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+    }
+
+    bool parse_string() {
+        ++pos_; // opening quote
+        uint32_t s = push(JsonType::STRING, pos_);
+        const size_t n = text_.size();
+        while (pos_ < n) {
+            unsigned char c = static_cast<unsigned char>(text_[pos_]);
+            if (c == '"') {
+                close(s, pos_);
+                ++pos_;
+                return true;
+            }
+            if (c < 0x20) return fail("control character in string");
+            if (c == '\\') {
+                nodes_[s].escaped = true;
+                if (pos_ + 1 >= n) break;
+                char e = text_[pos_ + 1];
+                if (e == 'u') {
+                    if (pos_ + 5 >= n || !is_hex(text_[pos_ + 2]) || !is_hex(text_[pos_ + 3]) ||
+                        !is_hex(text_[pos_ + 4]) || !is_hex(text_[pos_ + 5])) {
+                        return fail("invalid \\u escape");
+                    }
+                    pos_ += 6;
+                    continue;
+                }
+                if (e != '"' && e != '\\' && e != '/' && e != 'b' && e != 'f' && e != 'n' && e != 'r' && e != 't') {
+                    return fail("invalid escape in string");
+                }
+                pos_ += 2;
+                continue;
+            }
+            ++pos_;
+        }
+        return fail("unterminated string");
+    }
+
+    bool parse_number() {
+        size_t start = pos_;
+        const size_t n = text_.size();
+        auto digit = [&](size_t i) { return i < n && text_[i] >= '0' && text_[i] <= '9'; };
+
+        if (pos_ < n && text_[pos_] == '-') ++pos_;
+        if (!digit(pos_)) return fail("invalid value");
+        if (text_[pos_] == '0') {
+            ++pos_;
+        } else {
+            while (digit(pos_)) ++pos_;
+        }
+        if (pos_ < n && text_[pos_] == '.') {
+            ++pos_;
+            if (!digit(pos_)) return fail("invalid number");
+            while (digit(pos_)) ++pos_;
+        }
+        if (pos_ < n && (text_[pos_] == 'e' || text_[pos_] == 'E')) {
+            ++pos_;
+            if (pos_ < n && (text_[pos_] == '+' || text_[pos_] == '-')) ++pos_;
+            if (!digit(pos_)) return fail("invalid number");
+            while (digit(pos_)) ++pos_;
+        }
+        close(push(JsonType::NUMBER, start), pos_);
+        return true;
+    }
+
+    static unsigned hex_value(std::string_view s) {
+        unsigned v = 0;
+        for (char c : s) {
+            v <<= 4;
+            if (c >= '0' && c <= '9') v |= static_cast<unsigned>(c - '0');
+            else if (c >= 'a' && c <= 'f') v |= static_cast<unsigned>(c - 'a' + 10);
+            else v |= static_cast<unsigned>(c - 'A' + 10);
+        }
+        return v;
+    }
+
+    static void append_utf8(std::string &out, unsigned cp) {
+        if (cp < 0x80) {
+            out.push_back(static_cast<char>(cp));
+        } else if (cp < 0x800) {
+            out.push_back(static_cast<char>(0xC0 | (cp >> 6)));
+            out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+        } else if (cp < 0x10000) {
+            out.push_back(static_cast<char>(0xE0 | (cp >> 12)));
+            out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+            out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+        } else {
+            out.push_back(static_cast<char>(0xF0 | (cp >> 18)));
+            out.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3F)));
+            out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+            out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+        }
+    }
+
+    // Escapes were validated by parse_string.
+    static void unescape(std::string_view s, std::string &out) {
+        out.clear();
+        out.reserve(s.size());
+        for (size_t i = 0; i < s.size(); ++i) {
+            char c = s[i];
+            if (c != '\\') {
+                out.push_back(c);
+                continue;
+            }
+            char e = s[++i];
+            switch (e) {
+            case 'b': out.push_back('\b'); break;
+            case 'f': out.push_back('\f'); break;
+            case 'n': out.push_back('\n'); break;
+            case 'r': out.push_back('\r'); break;
+            case 't': out.push_back('\t'); break;
+            case 'u': {
+                unsigned cp = hex_value(s.substr(i + 1, 4));
+                i += 4;
+                if (cp >= 0xD800 && cp <= 0xDBFF && i + 6 < s.size() && s[i + 1] == '\\' && s[i + 2] == 'u') {
+                    unsigned low = hex_value(s.substr(i + 3, 4));
+                    if (low >= 0xDC00 && low <= 0xDFFF) {
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                        i += 6;
+                    }
+                }
+                append_utf8(out, cp);
+                break;
+            }
+            default: out.push_back(e); break; // " \ /
+            }
+        }
+    }
+
+    std::string text_;
+    std::vector<JsonNode> nodes_;
+    mutable std::unordered_map<uint32_t, std::vector<uint32_t>> elements_; // array node -> element nodes
+    const char *error_ = nullptr;
+    size_t pos_ = 0;
+};
+
+} // namespace dawn
@@ -0,0 +1,385 @@
+// jwt.hpp
+// SHA-256, HMAC-SHA256, base64url and HS256 JSON Web Tokens. An HmacSha256 keeps
+// the hash states after the key's inner and outer pad blocks, so a message signed
+// with a known secret costs its own blocks plus two. JwtCache remembers tokens that
+// verified, keyed by their signature segment, so a client sending the same bearer
+// token on every request is checked with one lookup and one compare; time claims
+// are still checked on every use.
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "json.hpp"
+
+namespace dawn {
+
+class Sha256 {
+public:
+    static constexpr size_t DIGEST_SIZE = 32;
+    static constexpr size_t BLOCK_SIZE = 64;
+
+    void update(const void *data, size_t length) {
+        const auto *p = static_cast<const uint8_t *>(data);
+        total_ += length;
+        if (buffered_ > 0) {
+            size_t take = std::min(length, BLOCK_SIZE - buffered_);
+            std::memcpy(buffer_ + buffered_, p, take);
+            buffered_ += take;
+            p += take;
+            length -= take;
+            if (buffered_ < BLOCK_SIZE) return;
+            compress(buffer_);
+            buffered_ = 0;
+        }
+        for (; length >= BLOCK_SIZE; p += BLOCK_SIZE, length -= BLOCK_SIZE) compress(p);
+        std::memcpy(buffer_, p, length);
+        buffered_ = length;
+    }
+
+    void update(std::string_view s) { update(s.data(), s.size()); }
+
+    void finish(uint8_t out[DIGEST_SIZE]) {
+        uint64_t bits = total_ * 8;
+        static const uint8_t padding[BLOCK_SIZE] = {0x80};
+        update(padding, buffered_ < 56 ? 56 - buffered_ : 120 - buffered_);
+        uint8_t length[8];
+        for (int i = 0; i < 8; ++i) length[i] = static_cast<uint8_t>(bits >> (56 - 8 * i));
+        update(length, 8);
+        for (int i = 0; i < 8; ++i) {
+            out[4 * i] = static_cast<uint8_t>(state_[i] >> 24);
+            out[4 * i + 1] = static_cast<uint8_t>(state_[i] >> 16);
+            out[4 * i + 2] = static_cast<uint8_t>(state_[i] >> 8);
+            out[4 * i + 3] = static_cast<uint8_t>(state_[i]);
+        }
+    }
+
+private:
+    static uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+    void compress(const uint8_t *block) {
+        static const uint32_t K[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i) {
+            w[i] = (uint32_t(block[4 * i]) << 24) | (uint32_t(block[4 * i + 1]) << 16) |
+                   (uint32_t(block[4 * i + 2]) << 8) | uint32_t(block[4 * i + 3]);
+        }
+        for (int i = 16; i < 64; ++i) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state_[0], b = state_[1], c = state_[2], d = state_[3];
+        uint32_t e = state_[4], f = state_[5], g = state_[6], h = state_[7];
+        for (int i = 0; i < 64; ++i) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state_[0] += a;
+        state_[1] += b;
+        state_[2] += c;
+        state_[3] += d;
+        state_[4] += e;
+        state_[5] += f;
+        state_[6] += g;
+        state_[7] += h;
+    }
+
+    uint32_t state_[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                          0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    uint8_t buffer_[BLOCK_SIZE];
+    size_t buffered_ = 0;
+    uint64_t total_ = 0;
+};
+
+inline std::string sha256(std::string_view data) {
+    uint8_t digest[Sha256::DIGEST_SIZE];
+    Sha256 h;
+    h.update(data);
+    h.finish(digest);
+    return std::string(reinterpret_cast<const char *>(digest), sizeof(digest));
+}
+
+inline std::string to_hex(std::string_view bytes) {
+    static const char digits[] = "0123456789abcdef";
+    std::string out(bytes.size() * 2, '\0');
+    for (size_t i = 0; i < bytes.size(); ++i) {
+        out[2 * i] = digits[static_cast<uint8_t>(bytes[i]) >> 4];
+        out[2 * i + 1] = digits[static_cast<uint8_t>(bytes[i]) & 0xf];
+    }
+    return out;
+}
+
+class HmacSha256 {
+public:
+    explicit HmacSha256(std::string_view key) {
+        uint8_t block[Sha256::BLOCK_SIZE] = {};
+        if (key.size() > Sha256::BLOCK_SIZE) {
+            Sha256 h;
+            h.update(key);
+            h.finish(block);
+        } else {
+            std::memcpy(block, key.data(), key.size());
+        }
+        uint8_t pad[Sha256::BLOCK_SIZE];
+        for (size_t i = 0; i < sizeof(pad); ++i) pad[i] = block[i] ^ 0x36;
+        inner_.update(pad, sizeof(pad));
+        for (size_t i = 0; i < sizeof(pad); ++i) pad[i] = block[i] ^ 0x5c;
+        outer_.update(pad, sizeof(pad));
+    }
+
+    void sign(std::string_view message, uint8_t out[Sha256::DIGEST_SIZE]) const {
+        uint8_t inner_digest[Sha256::DIGEST_SIZE];
+        Sha256 inner = inner_;
+        inner.update(message);
+        inner.finish(inner_digest);
+        Sha256 outer = outer_;
+        outer.update(inner_digest, sizeof(inner_digest));
+        outer.finish(out);
+    }
+
+private:
+    Sha256 inner_;
+    Sha256 outer_;
+};
+
+// Compares without an early exit, so the time taken does not tell how many
+// leading bytes matched.
+inline bool constant_time_equal(std::string_view a, std::string_view b) {
+    if (a.size() != b.size()) return false;
+    uint8_t diff = 0;
+    for (size_t i = 0; i < a.size(); ++i) diff |= static_cast<uint8_t>(a[i] ^ b[i]);
+    return diff == 0;
+}
+
+// Unpadded base64url (RFC 4648 section 5), appended to out.
+inline void base64url_encode(std::string_view in, std::string &out) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    out.reserve(out.size() + (in.size() * 4 + 2) / 3);
+    size_t i = 0;
+    for (; i + 3 <= in.size(); i += 3) {
+        uint32_t n = (uint32_t(uint8_t(in[i])) << 16) | (uint32_t(uint8_t(in[i + 1])) << 8) | uint8_t(in[i + 2]);
+        out.push_back(alphabet[n >> 18]);
+        out.push_back(alphabet[(n >> 12) & 63]);
+        out.push_back(alphabet[(n >> 6) & 63]);
+        out.push_back(alphabet[n & 63]);
+    }
+    if (i < in.size()) {
+        uint32_t n = uint32_t(uint8_t(in[i])) << 16;
+        if (i + 1 < in.size()) n |= uint32_t(uint8_t(in[i + 1])) << 8;
+        out.push_back(alphabet[n >> 18]);
+        out.push_back(alphabet[(n >> 12) & 63]);
+        if (i + 1 < in.size()) out.push_back(alphabet[(n >> 6) & 63]);
+    }
+}
+
+// Accepts base64url with or without its '=' padding. False on any character
+// outside the base64url alphabet (so no '+' or '/'), on padding that does not
+// complete the last quantum, on an impossible length, and on non-zero bits after
+// the last byte: every byte string has exactly one accepted encoding per padding
+// style, and a token cannot be changed without changing its bytes.
+inline bool base64url_decode(std::string_view in, std::string &out) {
+    size_t padding = 0;
+    while (!in.empty() && in.back() == '=') {
+        in.remove_suffix(1);
+        ++padding;
+    }
+    if (in.size() % 4 == 1) return false;
+    if (padding != 0 && (in.size() + padding) % 4 != 0) return false;
+    out.clear();
+    out.reserve(in.size() * 3 / 4);
+    uint32_t accum = 0;
+    int bits = 0;
+    for (char c : in) {
+        int v;
+        if (c >= 'A' && c <= 'Z') v = c - 'A';
+        else if (c >= 'a' && c <= 'z') v = c - 'a' + 26;
+        else if (c >= '0' && c <= '9') v = c - '0' + 52;
+        else if (c == '-') v = 62;
+        else if (c == '_') v = 63;
+        else return false;
+        accum = (accum << 6) | static_cast<uint32_t>(v);
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out.push_back(static_cast<char>((accum >> bits) & 0xff));
+        }
+    }
+    return (accum & ((1u << bits) - 1)) == 0;
+}
+
+enum class JwtError { NONE, MALFORMED, ALGORITHM, SIGNATURE, PAYLOAD, EXPIRED, NOT_YET_VALID };
+
+// The error codes purejwt.lua reports.
+inline const char *jwt_error_code(JwtError e) {
+    switch (e) {
+    case JwtError::NONE: return "ok";
+    case JwtError::MALFORMED: return "invalid_token";
+    case JwtError::ALGORITHM: return "invalid_algorithm";
+    case JwtError::SIGNATURE: return "invalid_signature";
+    case JwtError::PAYLOAD: return "invalid_payload";
+    case JwtError::EXPIRED: return "token_expired";
+    case JwtError::NOT_YET_VALID: return "token_not_yet_valid";
+    }
+    return "invalid_token";
+}
+
+inline const char *jwt_error_message(JwtError e) {
+    switch (e) {
+    case JwtError::NONE: return "ok";
+    case JwtError::MALFORMED: return "Expected header.payload.signature";
+    case JwtError::ALGORITHM: return "Unsupported JWT algorithm";
+    case JwtError::SIGNATURE: return "JWT signature mismatch";
+    case JwtError::PAYLOAD: return "Could not decode JSON payload";
+    case JwtError::EXPIRED: return "Token expired";
+    case JwtError::NOT_YET_VALID: return "Token not yet valid";
+    }
+    return "Invalid token";
+}
+
+struct JwtToken {
+    std::shared_ptr<const JsonDocument> payload; // root is an object
+    std::optional<double> exp;
+    std::optional<double> nbf;
+};
+
+// Signs payload_json (already encoded) under a fixed {"alg":"HS256","typ":"JWT"} header.
+inline std::string jwt_sign(const HmacSha256 &key, std::string_view payload_json) {
+    static const std::string header = [] {
+        std::string h;
+        base64url_encode(R"({"alg":"HS256","typ":"JWT"})", h);
+        return h;
+    }();
+    std::string token = header;
+    token.push_back('.');
+    base64url_encode(payload_json, token);
+    uint8_t signature[Sha256::DIGEST_SIZE];
+    key.sign(token, signature);
+    token.push_back('.');
+    base64url_encode(std::string_view(reinterpret_cast<const char *>(signature), sizeof(signature)), token);
+    return token;
+}
+
+// Checks the header's algorithm and the signature, then decodes the payload and
+// its exp/nbf claims. Time is not checked here (see jwt_check_time).
+inline JwtError jwt_decode(const HmacSha256 &key, std::string_view token, JwtToken &out) {
+    size_t first = token.find('.');
+    size_t second = first == std::string_view::npos ? first : token.find('.', first + 1);
+    if (second == std::string_view::npos || token.find('.', second + 1) != std::string_view::npos) {
+        return JwtError::MALFORMED;
+    }
+
+    std::string buffer;
+    if (!base64url_decode(token.substr(0, first), buffer)) return JwtError::MALFORMED;
+    JsonDocument header;
+    if (!header.parse(std::move(buffer)) || header.node(0).type != JsonType::OBJECT) return JwtError::MALFORMED;
+    uint32_t alg = header.find(0, "alg");
+    std::string scratch;
+    if (alg == JsonDocument::NONE || header.node(alg).type != JsonType::STRING || header.string(alg, scratch) != "HS256") {
+        return JwtError::ALGORITHM;
+    }
+
+    uint8_t expected[Sha256::DIGEST_SIZE];
+    key.sign(token.substr(0, second), expected);
+    if (!base64url_decode(token.substr(second + 1), buffer) ||
+        !constant_time_equal(buffer, std::string_view(reinterpret_cast<const char *>(expected), sizeof(expected)))) {
+        return JwtError::SIGNATURE;
+    }
+
+    auto payload = std::make_shared<JsonDocument>();
+    if (!base64url_decode(token.substr(first + 1, second - first - 1), buffer) ||
+        !payload->parse(std::move(buffer)) || payload->node(0).type != JsonType::OBJECT) {
+        return JwtError::PAYLOAD;
+    }
+    uint32_t exp = payload->find(0, "exp");
+    if (exp != JsonDocument::NONE && payload->node(exp).type == JsonType::NUMBER) out.exp = payload->number(exp);
+    uint32_t nbf = payload->find(0, "nbf");
+    if (nbf != JsonDocument::NONE && payload->node(nbf).type == JsonType::NUMBER) out.nbf = payload->number(nbf);
+    out.payload = std::move(payload);
+    return JwtError::NONE;
+}
+
+// Expired once now reaches exp; not valid while now is before nbf. leeway widens
+// both windows, for clock skew between issuer and verifier.
+inline JwtError jwt_check_time(const JwtToken &t, double now, double leeway, bool verify_exp, bool verify_nbf) {
+    if (verify_exp && t.exp && now >= *t.exp + leeway) return JwtError::EXPIRED;
+    if (verify_nbf && t.nbf && now < *t.nbf - leeway) return JwtError::NOT_YET_VALID;
+    return JwtError::NONE;
+}
+
+// Tokens that passed jwt_decode under one secret, least recently used first out.
+class JwtCache {
+public:
+    explicit JwtCache(size_t capacity = 1024) : capacity_(capacity) {}
+
+    const JwtToken *find(std::string_view token) {
+        auto it = index_.find(signature_of(token));
+        if (it == index_.end() || !constant_time_equal(it->second->token, token)) return nullptr;
+        entries_.splice(entries_.begin(), entries_, it->second);
+        return &it->second->data;
+    }
+
+    void insert(std::string_view token, JwtToken data) {
+        if (capacity_ == 0) return;
+        erase(token);
+        if (entries_.size() == capacity_) {
+            index_.erase(signature_of(entries_.back().token));
+            entries_.pop_back();
+        }
+        entries_.push_front(Entry{std::string(token), std::move(data)});
+        index_.emplace(signature_of(entries_.front().token), entries_.begin());
+    }
+
+    void erase(std::string_view token) {
+        auto it = index_.find(signature_of(token));
+        if (it == index_.end()) return;
+        auto entry = it->second;
+        index_.erase(it);
+        entries_.erase(entry);
+    }
+
+    size_t size() const { return entries_.size(); }
+
+private:
+    struct Entry {
+        std::string token;
+        JwtToken data;
+    };
+
+    static std::string_view signature_of(std::string_view token) {
+        size_t dot = token.rfind('.');
+        return dot == std::string_view::npos ? token : token.substr(dot + 1);
+    }
+
+    size_t capacity_;
+    std::list<Entry> entries_;
+    // Keys view the signature inside each entry's token; list nodes never move.
+    std::unordered_map<std::string_view, std::list<Entry>::iterator> index_;
+};
+
+} // namespace dawn
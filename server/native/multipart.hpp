@@ -0,0 +1,421 @@
+// multipart.hpp
+// Incremental multipart/form-data parser. Input is copied through a fixed-size
+// window; the part delimiter is found with Boyer-Moore-Horspool and everything in
+// front of it is handed on as soon as it cannot be the start of a delimiter, so
+// memory use does not grow with the upload. File parts go straight to disk with
+// write(2); only field values are kept in memory. The body as a whole is capped
+// (max_total_size), so an upload cannot fill the disk, and a parser destroyed
+// before the closing boundary (aborted request, malformed body, over the cap)
+// deletes every file it wrote; after a complete body the files are the caller's.
+//
+// The stream is treated as if it began with CRLF, which lets the first boundary
+// ("--b" at the very start) and every later one ("\r\n--b") be found with the same
+// delimiter.
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace dawn {
+
+struct MultipartOptions {
+    size_t max_memory_size = 2 * 1024 * 1024; // per in-memory part
+    size_t max_header_size = 16 * 1024;       // per part header block
+    size_t max_total_size = 100 * 1024 * 1024; // whole body, files included; 0 = unlimited
+    bool stream_to_disk = true;               // write file parts to auto_save_dir
+    bool decode_base64 = true;                // honour Content-Transfer-Encoding: base64
+    std::string auto_save_dir = "/tmp";
+};
+
+struct MultipartPart {
+    std::vector<std::pair<std::string, std::string>> headers; // names lowercased
+    std::string name;
+    std::string filename;
+    std::string content_type;
+    bool is_file = false;
+    bool base64 = false;
+    size_t size = 0;  // decoded bytes
+    std::string body; // in-memory parts
+    std::string path; // parts written to disk
+
+    const std::string *header(std::string_view key) const {
+        for (const auto &[k, v] : headers) {
+            if (k == key) return &v;
+        }
+        return nullptr;
+    }
+};
+
+class MultipartParser {
+public:
+    // Return false from a callback to stop parsing; set `error` to say why.
+    std::function<bool(MultipartPart &)> on_part_begin;
+    std::function<bool(MultipartPart &)> on_part_end;
+    std::string error;
+
+    // Extracts the boundary parameter of a multipart Content-Type, or "".
+    static std::string boundary_from_content_type(std::string_view content_type) {
+        size_t pos = content_type.find("boundary=");
+        if (pos == std::string_view::npos) return {};
+        std::string_view b = content_type.substr(pos + 9);
+        if (!b.empty() && b.front() == '"') {
+            b.remove_prefix(1);
+            size_t end = b.find('"');
+            return std::string(b.substr(0, end));
+        }
+        size_t end = b.find_first_of("; \t");
+        return std::string(b.substr(0, end));
+    }
+
+    MultipartParser(std::string_view boundary, MultipartOptions options)
+        : options_(std::move(options)) {
+        delimiter_ = "\r\n--";
+        delimiter_.append(boundary.data(), boundary.size());
+        skip_.fill(delimiter_.size());
+        for (size_t i = 0; i + 1 < delimiter_.size(); ++i) {
+            skip_[static_cast<unsigned char>(delimiter_[i])] = delimiter_.size() - 1 - i;
+        }
+        size_t capacity = std::max<size_t>(64 * 1024, options_.max_header_size + 2 * delimiter_.size() + 4);
+        window_.resize(capacity);
+        window_[0] = '\r';
+        window_[1] = '\n';
+        len_ = 2;
+    }
+
+    ~MultipartParser() {
+        // A file part still open here was cut short: drop the partial file.
+        if (fd_ >= 0) {
+            ::close(fd_);
+            ::unlink(part_.path.c_str());
+        }
+        // So was the body if the closing boundary never came.
+        if (!done()) {
+            for (const std::string &path : files_) ::unlink(path.c_str());
+        }
+    }
+
+    MultipartParser(const MultipartParser &) = delete;
+    MultipartParser &operator=(const MultipartParser &) = delete;
+
+    bool feed(std::string_view data) {
+        if (failed_) return false;
+        total_read_ += data.size();
+        if (options_.max_total_size && total_read_ > options_.max_total_size) {
+            too_large_ = true;
+            return fail("multipart body too large");
+        }
+        while (!data.empty()) {
+            size_t n = std::min(window_.size() - len_, data.size());
+            std::memcpy(window_.data() + len_, data.data(), n);
+            len_ += n;
+            data.remove_prefix(n);
+
+            if (!process()) return false;
+
+            if (pos_ > 0) {
+                std::memmove(window_.data(), window_.data() + pos_, len_ - pos_);
+                len_ -= pos_;
+                pos_ = 0;
+            } else if (len_ == window_.size()) {
+                return fail("multipart header block too large");
+            }
+        }
+        return true;
+    }
+
+    bool done() const { return state_ == State::DONE; }
+    bool failed() const { return failed_; }
+    bool too_large() const { return too_large_; } // failed on max_total_size
+    size_t total_read() const { return total_read_; }
+
+private:
+    enum class State { PREAMBLE, AFTER_BOUNDARY, HEADERS, BODY, DONE };
+
+    bool fail(std::string message) {
+        if (error.empty()) error = std::move(message);
+        failed_ = true;
+        return false;
+    }
+
+    // Offset of the next delimiter in [from, len_), or npos.
+    size_t find_delimiter(size_t from) const {
+        const size_t m = delimiter_.size();
+        const char *hay = window_.data();
+        size_t i = from;
+        while (i + m <= len_) {
+            char last = hay[i + m - 1];
+            if (last == delimiter_[m - 1] && std::memcmp(hay + i, delimiter_.data(), m - 1) == 0) {
+                return i;
+            }
+            i += skip_[static_cast<unsigned char>(last)];
+        }
+        return std::string_view::npos;
+    }
+
+    size_t find_header_end(size_t from) const {
+        std::string_view view(window_.data() + from, len_ - from);
+        size_t at = view.find("\r\n\r\n");
+        return at == std::string_view::npos ? at : from + at;
+    }
+
+    bool process() {
+        for (;;) {
+            switch (state_) {
+            case State::PREAMBLE: {
+                size_t at = find_delimiter(pos_);
+                if (at == std::string_view::npos) {
+                    size_t keep = delimiter_.size() - 1;
+                    if (len_ - pos_ > keep) pos_ = len_ - keep;
+                    return true;
+                }
+                pos_ = at + delimiter_.size();
+                state_ = State::AFTER_BOUNDARY;
+                break;
+            }
+            case State::AFTER_BOUNDARY: {
+                while (pos_ < len_ && (window_[pos_] == ' ' || window_[pos_] == '\t')) ++pos_;
+                if (len_ - pos_ < 2) return true;
+                if (window_[pos_] == '-' && window_[pos_ + 1] == '-') {
+                    state_ = State::DONE;
+                    break;
+                }
+                if (window_[pos_] != '\r' || window_[pos_ + 1] != '\n') {
+                    return fail("malformed multipart boundary line");
+                }
+                pos_ += 2;
+                state_ = State::HEADERS;
+                break;
+            }
+            case State::HEADERS: {
+                std::string_view block;
+                if (len_ - pos_ >= 2 && window_[pos_] == '\r' && window_[pos_ + 1] == '\n') {
+                    pos_ += 2; // part without headers
+                } else {
+                    size_t end = find_header_end(pos_);
+                    if (end == std::string_view::npos) {
+                        if (len_ - pos_ > options_.max_header_size) return fail("multipart header block too large");
+                        return true;
+                    }
+                    block = std::string_view(window_.data() + pos_, end - pos_);
+                    pos_ = end + 4;
+                }
+                if (!begin_part(block)) return false;
+                state_ = State::BODY;
+                break;
+            }
+            case State::BODY: {
+                size_t at = find_delimiter(pos_);
+                if (at == std::string_view::npos) {
+                    size_t keep = delimiter_.size() - 1;
+                    if (len_ - pos_ > keep) {
+                        if (!part_data(std::string_view(window_.data() + pos_, len_ - keep - pos_))) return false;
+                        pos_ = len_ - keep;
+                    }
+                    return true;
+                }
+                if (!part_data(std::string_view(window_.data() + pos_, at - pos_))) return false;
+                pos_ = at + delimiter_.size();
+                if (!end_part()) return false;
+                state_ = State::AFTER_BOUNDARY;
+                break;
+            }
+            case State::DONE:
+                pos_ = len_; // epilogue is ignored
+                return true;
+            }
+        }
+    }
+
+    static std::string lower(std::string_view s) {
+        std::string out(s);
+        for (char &c : out) {
+            if (c >= 'A' && c <= 'Z') c = static_cast<char>(c - 'A' + 'a');
+        }
+        return out;
+    }
+
+    static std::string_view trim(std::string_view s) {
+        while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) s.remove_prefix(1);
+        while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) s.remove_suffix(1);
+        return s;
+    }
+
+    // Value of `key="..."` (or key=token) in a Content-Disposition header.
+    static bool disposition_param(std::string_view header, std::string_view key, std::string &out) {
+        size_t pos = 0;
+        while ((pos = header.find(key, pos)) != std::string_view::npos) {
+            bool at_start = pos == 0 || header[pos - 1] == ';' || header[pos - 1] == ' ' || header[pos - 1] == '\t';
+            size_t eq = pos + key.size();
+            if (!at_start || eq >= header.size() || header[eq] != '=') {
+                pos = eq;
+                continue;
+            }
+            std::string_view v = header.substr(eq + 1);
+            if (!v.empty() && v.front() == '"') {
+                v.remove_prefix(1);
+                out.clear();
+                for (size_t i = 0; i < v.size() && v[i] != '"'; ++i) {
+                    if (v[i] == '\\' && i + 1 < v.size()) ++i;
+                    out.push_back(v[i]);
+                }
+            } else {
+                out = std::string(trim(v.substr(0, v.find(';'))));
+            }
+            return true;
+        }
+        return false;
+    }
+
+    static std::string sanitize_filename(std::string_view name) {
+        std::string out;
+        out.reserve(name.size());
+        for (char c : name) {
+            bool ok = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+                      c == '.' || c == '-' || c == '_';
+            out.push_back(ok ? c : '_');
+        }
+        if (out.size() > 100) out.erase(0, out.size() - 100);
+        return out;
+    }
+
+    bool begin_part(std::string_view block) {
+        part_ = MultipartPart();
+        decoder_ = Base64Decoder();
+        while (!block.empty()) {
+            size_t eol = block.find("\r\n");
+            std::string_view line = block.substr(0, eol);
+            block = eol == std::string_view::npos ? std::string_view() : block.substr(eol + 2);
+            size_t colon = line.find(':');
+            if (colon == std::string_view::npos) continue;
+            part_.headers.emplace_back(lower(trim(line.substr(0, colon))), std::string(trim(line.substr(colon + 1))));
+        }
+
+        if (const std::string *cd = part_.header("content-disposition")) {
+            disposition_param(*cd, "name", part_.name);
+            part_.is_file = disposition_param(*cd, "filename", part_.filename);
+        }
+        if (const std::string *ct = part_.header("content-type")) part_.content_type = *ct;
+        if (const std::string *te = part_.header("content-transfer-encoding")) {
+            part_.base64 = options_.decode_base64 && lower(*te) == "base64";
+        }
+
+        if (part_.is_file && options_.stream_to_disk) {
+            std::string path = options_.auto_save_dir + "/dawn-XXXXXX-";
+            std::string suffix = sanitize_filename(part_.filename.empty() ? "upload" : part_.filename);
+            path += suffix;
+            fd_ = ::mkstemps(path.data(), static_cast<int>(suffix.size() + 1));
+            if (fd_ < 0) return fail("cannot create upload file in " + options_.auto_save_dir + ": " + std::strerror(errno));
+            part_.path = std::move(path);
+        }
+
+        if (on_part_begin && !on_part_begin(part_)) return fail(error.empty() ? "multipart part rejected" : error);
+        return true;
+    }
+
+    bool part_data(std::string_view data) {
+        if (data.empty()) return true;
+        if (part_.base64) {
+            decoded_.clear();
+            decoder_.decode(data, decoded_);
+            data = decoded_;
+        }
+        part_.size += data.size();
+        if (fd_ >= 0) return write_all(data);
+        if (part_.size > options_.max_memory_size) return fail("Part size exceeds memory limit");
+        part_.body.append(data.data(), data.size());
+        return true;
+    }
+
+    bool write_all(std::string_view data) {
+        while (!data.empty()) {
+            ssize_t n = ::write(fd_, data.data(), data.size());
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return fail(std::string("writing upload failed: ") + std::strerror(errno));
+            }
+            data.remove_prefix(static_cast<size_t>(n));
+        }
+        return true;
+    }
+
+    bool end_part() {
+        if (fd_ >= 0) {
+            int fd = fd_;
+            fd_ = -1;
+            files_.push_back(part_.path);
+            if (::close(fd) != 0) return fail(std::string("closing upload failed: ") + std::strerror(errno));
+        }
+        if (on_part_end && !on_part_end(part_)) return fail(error.empty() ? "multipart part rejected" : error);
+        return true;
+    }
+
+    // Streaming base64 decoder; carries incomplete quads between chunks and skips
+    // line breaks and other non-alphabet bytes.
+    struct Base64Decoder {
+        uint32_t bits = 0;
+        int count = 0;
+        bool ended = false;
+
+        void decode(std::string_view in, std::string &out) {
+            for (char ch : in) {
+                int v = value(ch);
+                if (ch == '=') ended = true;
+                if (v < 0 || ended) continue;
+                bits = (bits << 6) | static_cast<uint32_t>(v);
+                if (++count == 4) {
+                    out.push_back(static_cast<char>((bits >> 16) & 0xFF));
+                    out.push_back(static_cast<char>((bits >> 8) & 0xFF));
+                    out.push_back(static_cast<char>(bits & 0xFF));
+                    bits = 0;
+                    count = 0;
+                }
+            }
+            if (ended && count > 1) {
+                bits <<= 6 * (4 - count);
+                out.push_back(static_cast<char>((bits >> 16) & 0xFF));
+                if (count == 3) out.push_back(static_cast<char>((bits >> 8) & 0xFF));
+                bits = 0;
+                count = 0;
+            }
+        }
+
+        static int value(char c) {
+            if (c >= 'A' && c <= 'Z') return c - 'A';
+            if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+            if (c >= '0' && c <= '9') return c - '0' + 52;
+            if (c == '+' || c == '-') return 62;
+            if (c == '/' || c == '_') return 63;
+            return -1;
+        }
+    };
+
+    MultipartOptions options_;
+    std::string delimiter_;
+    std::array<size_t, 256> skip_;
+    std::vector<char> window_;
+    size_t len_ = 0;
+    size_t pos_ = 0;
+    size_t total_read_ = 0;
+    State state_ = State::PREAMBLE;
+    bool failed_ = false;
+    bool too_large_ = false;
+    std::vector<std::string> files_; // file parts written so far
+    MultipartPart part_;
+    Base64Decoder decoder_;
+    std::string decoded_;
+    int fd_ = -1;
+};
+
+} // namespace dawn
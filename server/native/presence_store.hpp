@@ -0,0 +1,309 @@
+// presence_store.hpp
+// Room membership for one event loop. Member and topic names are interned once;
+// each topic keeps its members in a dense vector (swap-remove on leave) and each
+// member keeps the (topic, slot) pairs it occupies, so join, leave and lookups
+// touch neither a per-topic hash table nor a copy of the room. Name lookups key
+// the index by views of the interned names and allocate nothing.
+//
+// Every join and leave bumps a store-wide version and is appended to a bounded
+// change log. A caller remembers version() before a change and asks for
+// changes_since() afterwards instead of diffing two copies of the room; once the
+// log has dropped entries past that version, changes_since() reports failure and
+// the caller falls back to the full state.
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace dawn {
+
+class PresenceStore {
+public:
+    // One member's presence in a topic. meta is opaque to the store (the Lua side
+    // keeps JSON in it).
+    struct Entry {
+        uint32_t member;
+        int64_t joined_at;
+        std::string meta;
+    };
+
+    struct Change {
+        uint64_t version;
+        bool joined;
+        std::string topic;
+        std::string member;
+        int64_t joined_at;
+        std::string meta;
+    };
+
+    explicit PresenceStore(size_t log_capacity = 1024) : log_capacity_(log_capacity) {}
+
+    uint64_t version() const { return version_; }
+    size_t topic_count() const { return topic_ids_.size(); }
+    size_t member_count() const { return member_ids_.size(); }
+
+    bool exists(std::string_view topic) const { return find_topic(topic) != NONE; }
+
+    // Creates an empty topic; false if it already existed.
+    bool create(std::string_view topic) {
+        if (find_topic(topic) != NONE) return false;
+        intern_topic(topic);
+        return true;
+    }
+
+    // Adds member to topic (creating the topic). An existing membership is left as
+    // it is and false returned.
+    bool join(std::string_view topic, std::string_view member, int64_t joined_at, std::string meta) {
+        uint32_t t = find_topic(topic);
+        if (t == NONE) t = intern_topic(topic);
+        uint32_t m = intern_member(member);
+        if (slot_of(m, t) != NONE) return false;
+
+        Topic &room = topics_[t];
+        uint32_t slot = static_cast<uint32_t>(room.entries.size());
+        room.entries.push_back(Entry{m, joined_at, std::move(meta)});
+        members_[m].rooms.push_back({t, slot});
+        record(true, room.name, members_[m].id, room.entries.back());
+        return true;
+    }
+
+    // Like join, but an existing membership gets the new joined_at and meta instead
+    // of being left alone; logged as a join either way, so a diff carries the new
+    // meta. True if member was not in topic before.
+    bool replace(std::string_view topic, std::string_view member, int64_t joined_at, std::string meta) {
+        uint32_t t = find_topic(topic);
+        uint32_t m = t == NONE ? NONE : find_member(member);
+        uint32_t slot = m == NONE ? NONE : slot_of(m, t);
+        if (slot == NONE) return join(topic, member, joined_at, std::move(meta));
+
+        Entry &entry = topics_[t].entries[slot];
+        entry.joined_at = joined_at;
+        entry.meta = std::move(meta);
+        record(true, topics_[t].name, members_[m].id, entry);
+        return false;
+    }
+
+    // Removes member from topic; the topic goes away with its last member.
+    bool leave(std::string_view topic, std::string_view member) {
+        uint32_t t = find_topic(topic);
+        uint32_t m = find_member(member);
+        if (t == NONE || m == NONE || slot_of(m, t) == NONE) return false;
+        remove(t, m);
+        return true;
+    }
+
+    // Removes member from every topic; returns the topics it left.
+    std::vector<std::string> leave_all(std::string_view member) {
+        std::vector<std::string> left;
+        uint32_t m = find_member(member);
+        if (m == NONE) return left;
+        // Once the last room is gone the member is released, leaving its slot empty.
+        while (!members_[m].rooms.empty()) {
+            uint32_t t = members_[m].rooms.back().topic;
+            left.push_back(topics_[t].name);
+            remove(t, m);
+        }
+        return left;
+    }
+
+    // Drops a topic and all of its memberships.
+    bool remove_topic(std::string_view topic) {
+        uint32_t t = find_topic(topic);
+        if (t == NONE) return false;
+        if (topics_[t].entries.empty()) {
+            release_topic(t);
+            return true;
+        }
+        // remove() releases the topic with its last member.
+        while (!topics_[t].entries.empty()) remove(t, topics_[t].entries.back().member);
+        return true;
+    }
+
+    const Entry *find(std::string_view topic, std::string_view member) const {
+        uint32_t t = find_topic(topic);
+        uint32_t m = find_member(member);
+        if (t == NONE || m == NONE) return nullptr;
+        uint32_t slot = slot_of(m, t);
+        return slot == NONE ? nullptr : &topics_[t].entries[slot];
+    }
+
+    size_t count(std::string_view topic) const {
+        uint32_t t = find_topic(topic);
+        return t == NONE ? 0 : topics_[t].entries.size();
+    }
+
+    // f(member_id, entry) for every member of topic. f must not modify the store.
+    template <typename F>
+    void each(std::string_view topic, F &&f) const {
+        uint32_t t = find_topic(topic);
+        if (t == NONE) return;
+        for (const Entry &entry : topics_[t].entries) f(std::string_view(members_[entry.member].id), entry);
+    }
+
+    // f(topic) for every topic member is in.
+    template <typename F>
+    void each_topic(std::string_view member, F &&f) const {
+        uint32_t m = find_member(member);
+        if (m == NONE) return;
+        for (const Room &room : members_[m].rooms) f(std::string_view(topics_[room.topic].name));
+    }
+
+    // f(change) for each change to topic after version `since`, oldest first.
+    // False when the log no longer reaches back that far.
+    template <typename F>
+    bool changes_since(std::string_view topic, uint64_t since, F &&f) const {
+        if (since < dropped_through_) return false;
+        size_t first = log_.size();
+        while (first > 0 && log_[first - 1].version > since) --first;
+        for (size_t i = first; i < log_.size(); ++i) {
+            if (log_[i].topic == topic) f(log_[i]);
+        }
+        return true;
+    }
+
+private:
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    struct Room {
+        uint32_t topic;
+        uint32_t slot; // index into the topic's entries
+    };
+
+    struct Member {
+        std::string id;
+        std::vector<Room> rooms;
+    };
+
+    struct Topic {
+        std::string name;
+        std::vector<Entry> entries;
+    };
+
+    uint32_t find_topic(std::string_view name) const {
+        auto it = topic_ids_.find(name);
+        return it == topic_ids_.end() ? NONE : it->second;
+    }
+
+    uint32_t find_member(std::string_view id) const {
+        auto it = member_ids_.find(id);
+        return it == member_ids_.end() ? NONE : it->second;
+    }
+
+    template <typename Items>
+    static uint32_t allocate(Items &items, std::vector<uint32_t> &free) {
+        if (!free.empty()) {
+            uint32_t index = free.back();
+            free.pop_back();
+            return index;
+        }
+        items.emplace_back();
+        return static_cast<uint32_t>(items.size() - 1);
+    }
+
+    uint32_t intern_topic(std::string_view name) {
+        uint32_t t = allocate(topics_, free_topics_);
+        topics_[t].name.assign(name.data(), name.size());
+        topic_ids_.emplace(topics_[t].name, t);
+        return t;
+    }
+
+    uint32_t intern_member(std::string_view id) {
+        uint32_t m = find_member(id);
+        if (m != NONE) return m;
+        m = allocate(members_, free_members_);
+        members_[m].id.assign(id.data(), id.size());
+        member_ids_.emplace(members_[m].id, m);
+        return m;
+    }
+
+    void release_topic(uint32_t t) {
+        topic_ids_.erase(topics_[t].name);
+        topics_[t] = Topic();
+        free_topics_.push_back(t);
+    }
+
+    void release_member(uint32_t m) {
+        member_ids_.erase(members_[m].id);
+        members_[m] = Member();
+        free_members_.push_back(m);
+    }
+
+    uint32_t slot_of(uint32_t m, uint32_t t) const {
+        for (const Room &room : members_[m].rooms) {
+            if (room.topic == t) return room.slot;
+        }
+        return NONE;
+    }
+
+    static void erase_room(Member &member, uint32_t t) {
+        for (Room &room : member.rooms) {
+            if (room.topic == t) {
+                room = member.rooms.back();
+                member.rooms.pop_back();
+                return;
+            }
+        }
+    }
+
+    static void move_room(Member &member, uint32_t t, uint32_t slot) {
+        for (Room &room : member.rooms) {
+            if (room.topic == t) {
+                room.slot = slot;
+                return;
+            }
+        }
+    }
+
+    // Swap-removes m from t, logs the leave and releases whichever of the two
+    // ends up empty.
+    void remove(uint32_t t, uint32_t m) {
+        Topic &room = topics_[t];
+        uint32_t slot = slot_of(m, t);
+        record(false, room.name, members_[m].id, room.entries[slot]);
+
+        uint32_t last = static_cast<uint32_t>(room.entries.size() - 1);
+        if (slot != last) {
+            room.entries[slot] = std::move(room.entries[last]);
+            move_room(members_[room.entries[slot].member], t, slot);
+        }
+        room.entries.pop_back();
+        erase_room(members_[m], t);
+
+        if (room.entries.empty()) release_topic(t);
+        if (members_[m].rooms.empty()) release_member(m);
+    }
+
+    void record(bool joined, const std::string &topic, const std::string &member, const Entry &entry) {
+        ++version_;
+        if (log_capacity_ == 0) {
+            dropped_through_ = version_;
+            return;
+        }
+        if (log_.size() == log_capacity_) {
+            dropped_through_ = log_.front().version;
+            log_.pop_front();
+        }
+        log_.push_back(Change{version_, joined, topic, member, entry.joined_at, entry.meta});
+    }
+
+    // Deques, so growing them never moves a name the id maps point into. A slot's
+    // name is only reassigned after its key has been erased.
+    std::deque<Topic> topics_;
+    std::vector<uint32_t> free_topics_;
+    std::unordered_map<std::string_view, uint32_t> topic_ids_;
+    std::deque<Member> members_;
+    std::vector<uint32_t> free_members_;
+    std::unordered_map<std::string_view, uint32_t> member_ids_;
+
+    uint64_t version_ = 0;
+    uint64_t dropped_through_ = 0;
+    size_t log_capacity_;
+    std::deque<Change> log_;
+};
+
+} // namespace dawn
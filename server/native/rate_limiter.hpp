@@ -0,0 +1,223 @@
+// rate_limiter.hpp
+// GCRA (the generic cell rate algorithm, a token bucket kept as one timestamp per
+// key) over a fixed number of keys. A key's state is its theoretical arrival time:
+// each request pushes it one emission interval (period / rate) into the future,
+// and a request is refused while that would put it more than `burst` intervals
+// ahead of now. Keys are opaque bytes (a binary IP, a user id, either plus a path).
+//
+// One limiter is shared by every worker thread, so keys live in SHARDS shards,
+// each behind its own mutex. A shard is a fixed-size table: at most capacity /
+// SHARDS slots, found through an open-addressing index (linear probing,
+// backward-shift deletion) sized once up front, and threaded on an LRU list by
+// slot number. A full shard hands its least recently used slot to the new key,
+// which starts with a full bucket, and the slot's key buffer is reused, so a busy
+// limiter allocates nothing per request. Time comes from the monotonic clock.
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace dawn {
+
+struct RateLimitResult {
+    bool allowed;
+    uint32_t remaining;     // requests still allowed right now
+    int64_t retry_after_ns; // when refused: wait this long before the next try
+};
+
+class RateLimiter {
+public:
+    static constexpr size_t SHARDS = 16;
+
+    // rate requests per period_seconds on average, up to burst at once.
+    RateLimiter(double rate, double period_seconds, double burst, size_t capacity)
+        : rate_(rate), period_(period_seconds), burst_(burst), capacity_(capacity),
+          interval_ns_(static_cast<int64_t>(period_seconds * 1e9 / std::max(rate, 1e-9))),
+          tolerance_ns_(static_cast<int64_t>(static_cast<double>(interval_ns_) * std::max(burst, 1.0))) {
+        if (interval_ns_ < 1) interval_ns_ = 1;
+        size_t per_shard = std::max<size_t>(1, (capacity + SHARDS - 1) / SHARDS);
+        for (Shard &shard : shards_) shard.init(per_shard);
+    }
+
+    // Whether the limiter was created with these options.
+    bool same_options(double rate, double period_seconds, double burst, size_t capacity) const {
+        return rate == rate_ && period_seconds == period_ && burst == burst_ && capacity == capacity_;
+    }
+
+    static int64_t now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Takes `cost` requests' worth from key's bucket if it has them.
+    RateLimitResult check(std::string_view key, int64_t now, double cost = 1) {
+        size_t hash = std::hash<std::string_view>()(key);
+        Shard &shard = shards_[hash % SHARDS];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        int64_t &tat = shard.touch(key, hash);
+
+        int64_t increment = static_cast<int64_t>(static_cast<double>(interval_ns_) * std::max(cost, 0.0));
+        int64_t new_tat = std::max(tat, now) + increment;
+        int64_t allow_at = new_tat - tolerance_ns_;
+        if (now < allow_at) {
+            int64_t ahead = std::max<int64_t>(0, tat - now);
+            return {false, remaining(ahead), allow_at - now};
+        }
+        tat = new_tat;
+        return {true, remaining(new_tat - now), 0};
+    }
+
+    void reset(std::string_view key) {
+        size_t hash = std::hash<std::string_view>()(key);
+        Shard &shard = shards_[hash % SHARDS];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.erase(key, hash);
+    }
+
+    size_t size() {
+        size_t total = 0;
+        for (Shard &shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            total += shard.used;
+        }
+        return total;
+    }
+
+private:
+    static constexpr uint32_t NIL = UINT32_MAX;
+
+    struct Slot {
+        std::string key;
+        size_t hash = 0;
+        int64_t tat = 0;
+        uint32_t prev = NIL; // towards the most recently used
+        uint32_t next = NIL; // towards the least recently used
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::vector<Slot> slots;   // grows to capacity, then slots are reused
+        std::vector<uint32_t> free; // slots given up by erase()
+        std::vector<uint32_t> index; // slot + 1 per bucket, 0 = empty; a power of two
+        size_t capacity = 0;
+        size_t used = 0;
+        uint32_t head = NIL; // most recently used
+        uint32_t tail = NIL; // least recently used
+
+        void init(size_t slot_capacity) {
+            capacity = slot_capacity;
+            size_t buckets = 4;
+            while (buckets < capacity * 2) buckets *= 2; // load factor at most 1/2
+            index.assign(buckets, 0);
+        }
+
+        size_t mask() const { return index.size() - 1; }
+
+        // The bucket holding key, or the empty bucket where it would go.
+        size_t probe(std::string_view key, size_t hash) const {
+            size_t b = hash & mask();
+            while (index[b] != 0) {
+                const Slot &slot = slots[index[b] - 1];
+                if (slot.hash == hash && slot.key == key) return b;
+                b = (b + 1) & mask();
+            }
+            return b;
+        }
+
+        // The key's arrival time, inserting the key (with an empty history) if needed.
+        int64_t &touch(std::string_view key, size_t hash) {
+            size_t b = probe(key, hash);
+            if (index[b] != 0) {
+                uint32_t s = index[b] - 1;
+                unlink(s);
+                push_front(s);
+                return slots[s].tat;
+            }
+
+            uint32_t s;
+            if (used == capacity) {
+                s = tail;
+                unlink(s);
+                remove_bucket(probe(slots[s].key, slots[s].hash));
+                --used;
+                b = probe(key, hash); // the removal may have shifted buckets
+            } else if (!free.empty()) {
+                s = free.back();
+                free.pop_back();
+            } else {
+                s = static_cast<uint32_t>(slots.size());
+                slots.emplace_back();
+            }
+            Slot &slot = slots[s];
+            slot.key.assign(key.data(), key.size());
+            slot.hash = hash;
+            slot.tat = 0;
+            index[b] = s + 1;
+            push_front(s);
+            ++used;
+            return slot.tat;
+        }
+
+        void erase(std::string_view key, size_t hash) {
+            size_t b = probe(key, hash);
+            if (index[b] == 0) return;
+            uint32_t s = index[b] - 1;
+            unlink(s);
+            remove_bucket(b);
+            free.push_back(s);
+            --used;
+        }
+
+        // Empties bucket b and moves later buckets of the same run back into the
+        // gap when that brings them closer to their home, so probes never stop
+        // short of a key.
+        void remove_bucket(size_t b) {
+            size_t gap = b;
+            for (size_t next = (b + 1) & mask(); index[next] != 0; next = (next + 1) & mask()) {
+                size_t home = slots[index[next] - 1].hash & mask();
+                // Movable unless home lies cyclically in (gap, next].
+                bool stays = gap <= next ? (home > gap && home <= next) : (home > gap || home <= next);
+                if (!stays) {
+                    index[gap] = index[next];
+                    gap = next;
+                }
+            }
+            index[gap] = 0;
+        }
+
+        void unlink(uint32_t s) {
+            Slot &slot = slots[s];
+            if (slot.prev != NIL) slots[slot.prev].next = slot.next; else head = slot.next;
+            if (slot.next != NIL) slots[slot.next].prev = slot.prev; else tail = slot.prev;
+            slot.prev = slot.next = NIL;
+        }
+
+        void push_front(uint32_t s) {
+            slots[s].next = head;
+            if (head != NIL) slots[head].prev = s;
+            head = s;
+            if (tail == NIL) tail = s;
+        }
+    };
+
+    // Whole requests that fit between `ahead` (how far the arrival time is past
+    // now) and the burst tolerance.
+    uint32_t remaining(int64_t ahead) const {
+        int64_t room = tolerance_ns_ - ahead;
+        return room <= 0 ? 0 : static_cast<uint32_t>(room / interval_ns_);
+    }
+
+    double rate_, period_, burst_;
+    size_t capacity_;
+    int64_t interval_ns_;
+    int64_t tolerance_ns_;
+    Shard shards_[SHARDS];
+};
+
+} // namespace dawn
@@ -0,0 +1,202 @@
+// resp.hpp
+// RESP2 (the Redis protocol) encoder and incremental reply parser. Replies are
+// parsed out of an append-only buffer and the parser resumes where the last chunk
+// ran out: finished elements of an unfinished array stay parsed, a bulk string
+// whose header has been read waits for its body, and a line without its CRLF yet
+// is searched on from where the last search stopped. Every byte is looked at once.
+#pragma once
+
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace dawn {
+
+enum class RespType : uint8_t { SIMPLE, ERROR, INTEGER, BULK, NIL, ARRAY };
+
+struct RespValue {
+    RespType type = RespType::NIL;
+    int64_t integer = 0;
+    std::string str; // SIMPLE, ERROR and BULK
+    std::vector<RespValue> elements;
+
+    bool is_string(std::string_view s) const {
+        return (type == RespType::BULK || type == RespType::SIMPLE) && str == s;
+    }
+};
+
+inline void resp_append_array_header(std::string &out, size_t count) {
+    out.push_back('*');
+    out += std::to_string(count);
+    out += "\r\n";
+}
+
+inline void resp_append_bulk(std::string &out, std::string_view arg) {
+    out.push_back('$');
+    out += std::to_string(arg.size());
+    out += "\r\n";
+    out.append(arg.data(), arg.size());
+    out += "\r\n";
+}
+
+// Appends one command as an array of bulk strings.
+template <typename Args>
+inline void resp_append_command(std::string &out, const Args &args) {
+    resp_append_array_header(out, args.size());
+    for (std::string_view arg : args) resp_append_bulk(out, arg);
+}
+
+enum class RespStatus { OK, INCOMPLETE, INVALID };
+
+class RespParser {
+public:
+    static constexpr int MAX_DEPTH = 32;
+    static constexpr int64_t MAX_BULK = 512LL * 1024 * 1024; // Redis' proto-max-bulk-len
+
+    void feed(const char *data, size_t length) {
+        if (pos_ > 0 && pos_ >= buffer_.size() / 2) {
+            buffer_.erase(0, pos_);
+            scan_ -= pos_;
+            pos_ = 0;
+        }
+        buffer_.append(data, length);
+    }
+
+    // Takes the next complete reply off the buffer. INCOMPLETE keeps whatever was
+    // parsed so far for the next call; after INVALID the stream is lost and the
+    // parser needs a reset().
+    RespStatus next(RespValue &out) {
+        for (;;) {
+            RespValue value;
+            RespStatus status = token(value);
+            if (status != RespStatus::OK) return status;
+            // Attach the finished value to the innermost open array, closing every
+            // array it completes, until one is still short or the reply is done.
+            for (;;) {
+                if (open_.empty()) {
+                    out = std::move(value);
+                    return RespStatus::OK;
+                }
+                Frame &frame = open_.back();
+                frame.array.elements.push_back(std::move(value));
+                if (frame.array.elements.size() < frame.count) break;
+                value = std::move(frame.array);
+                open_.pop_back();
+            }
+        }
+    }
+
+    void reset() {
+        buffer_.clear();
+        pos_ = 0;
+        scan_ = 0;
+        bulk_ = -1;
+        open_.clear();
+    }
+
+private:
+    struct Frame {
+        RespValue array;
+        size_t count = 0;
+    };
+
+    static bool to_integer(std::string_view text, int64_t &out) {
+        auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), out);
+        return ec == std::errc() && end == text.data() + text.size();
+    }
+
+    // Reads the line at pos_ (without its CRLF) and moves pos_ past it.
+    bool line(std::string_view &out) {
+        size_t from = scan_ > pos_ ? scan_ : pos_;
+        size_t end = buffer_.find("\r\n", from);
+        if (end == std::string::npos) {
+            // The CR may be the last byte in; look at it again with what follows.
+            scan_ = buffer_.size() > pos_ ? buffer_.size() - 1 : pos_;
+            return false;
+        }
+        out = std::string_view(buffer_).substr(pos_, end - pos_);
+        pos_ = end + 2;
+        scan_ = pos_;
+        return true;
+    }
+
+    // Parses one scalar, or the header of an array that opens a new frame (and
+    // then the array's first element, and so on). OK means out holds a complete value.
+    RespStatus token(RespValue &out) {
+        for (;;) {
+            if (bulk_ >= 0) return bulk_body(out);
+            if (pos_ >= buffer_.size()) return RespStatus::INCOMPLETE;
+            char marker = buffer_[pos_];
+            size_t start = pos_++;
+            std::string_view text;
+            if (!line(text)) {
+                pos_ = start;
+                return RespStatus::INCOMPLETE;
+            }
+            switch (marker) {
+            case '+':
+            case '-':
+                out.type = marker == '+' ? RespType::SIMPLE : RespType::ERROR;
+                out.str.assign(text.data(), text.size());
+                return RespStatus::OK;
+            case ':':
+                out.type = RespType::INTEGER;
+                return to_integer(text, out.integer) ? RespStatus::OK : RespStatus::INVALID;
+            case '$': {
+                int64_t length = 0;
+                if (!to_integer(text, length) || length < -1 || length > MAX_BULK) return RespStatus::INVALID;
+                if (length == -1) {
+                    out.type = RespType::NIL;
+                    return RespStatus::OK;
+                }
+                bulk_ = length;
+                continue;
+            }
+            case '*': {
+                int64_t count = 0;
+                if (!to_integer(text, count) || count < -1) return RespStatus::INVALID;
+                if (count <= 0) {
+                    out.type = count == 0 ? RespType::ARRAY : RespType::NIL;
+                    return RespStatus::OK;
+                }
+                if (open_.size() >= static_cast<size_t>(MAX_DEPTH)) return RespStatus::INVALID;
+                Frame frame;
+                frame.array.type = RespType::ARRAY;
+                frame.count = static_cast<size_t>(count);
+                // The count is the server's word, not bytes in hand: reserve a little.
+                frame.array.elements.reserve(frame.count < 64 ? frame.count : 64);
+                open_.push_back(std::move(frame));
+                continue;
+            }
+            default:
+                return RespStatus::INVALID;
+            }
+        }
+    }
+
+    // The body of a bulk string whose header has been read; it is only copied out
+    // once all of it and its CRLF are in.
+    RespStatus bulk_body(RespValue &out) {
+        size_t length = static_cast<size_t>(bulk_);
+        if (buffer_.size() - pos_ < length + 2) return RespStatus::INCOMPLETE;
+        if (buffer_.compare(pos_ + length, 2, "\r\n") != 0) return RespStatus::INVALID;
+        out.type = RespType::BULK;
+        out.str.assign(buffer_, pos_, length);
+        pos_ += length + 2;
+        scan_ = pos_;
+        bulk_ = -1;
+        return RespStatus::OK;
+    }
+
+    std::string buffer_;
+    size_t pos_ = 0;   // start of the first byte not yet parsed
+    size_t scan_ = 0;  // where the search for the current line's CRLF resumes
+    int64_t bulk_ = -1; // length of the bulk string being waited for, or -1
+    std::vector<Frame> open_; // arrays still missing elements, outermost first
+};
+
+} // namespace dawn
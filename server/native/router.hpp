@@ -0,0 +1,296 @@
+// router.hpp
+// Segment radix router used by the uWS shim. Routes are compiled once at startup
+// into a tree of path segments; matching walks the request path in place and
+// records parameter values as string_views into it, so a lookup never allocates.
+//
+// Pattern syntax (same as DawnServer routes):
+//   /users/list        static segments, compared case-insensitively
+//   /users/:id         named parameter, matches exactly one segment
+//   /files/*           splat, matches one or more trailing segments
+//
+// Precedence at every segment is static > :param > *, with backtracking, and each
+// node keeps one handler slot per HTTP method.
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace dawn {
+
+enum class HttpMethod : uint8_t {
+    GET = 0,
+    POST,
+    PUT,
+    DEL,
+    PATCH,
+    HEAD,
+    OPTIONS,
+    COUNT,
+    UNKNOWN = 0xff
+};
+
+constexpr size_t METHOD_COUNT = static_cast<size_t>(HttpMethod::COUNT);
+
+inline char ascii_lower(char c) {
+    return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+}
+
+inline bool iequals(std::string_view a, std::string_view b) {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (ascii_lower(a[i]) != ascii_lower(b[i])) return false;
+    }
+    return true;
+}
+
+// Case-insensitive three-way compare; `b` must already be lowercase.
+inline int icompare_lower(std::string_view a, std::string_view b) {
+    size_t n = std::min(a.size(), b.size());
+    for (size_t i = 0; i < n; ++i) {
+        char ca = ascii_lower(a[i]);
+        if (ca != b[i]) return ca < b[i] ? -1 : 1;
+    }
+    if (a.size() == b.size()) return 0;
+    return a.size() < b.size() ? -1 : 1;
+}
+
+// Accepts both the lowercase form uWS reports and the uppercase wire form.
+inline HttpMethod parse_method(std::string_view m) {
+    switch (m.size()) {
+    case 3:
+        if (iequals(m, "get")) return HttpMethod::GET;
+        if (iequals(m, "put")) return HttpMethod::PUT;
+        break;
+    case 4:
+        if (iequals(m, "post")) return HttpMethod::POST;
+        if (iequals(m, "head")) return HttpMethod::HEAD;
+        break;
+    case 5:
+        if (iequals(m, "patch")) return HttpMethod::PATCH;
+        break;
+    case 6:
+        if (iequals(m, "delete")) return HttpMethod::DEL;
+        break;
+    case 7:
+        if (iequals(m, "options")) return HttpMethod::OPTIONS;
+        break;
+    }
+    return HttpMethod::UNKNOWN;
+}
+
+inline const char *method_name(HttpMethod m) {
+    static const char *names[] = {"get", "post", "put", "delete", "patch", "head", "options"};
+    return m < HttpMethod::COUNT ? names[static_cast<size_t>(m)] : "unknown";
+}
+
+// The path segment at or after pos (empty once there is none) and moves pos past
+// it. Runs of '/' separate segments, so "//a///b/" has just "a" and "b".
+inline std::string_view next_path_segment(std::string_view path, size_t &pos) {
+    while (pos < path.size() && path[pos] == '/') ++pos;
+    size_t start = pos;
+    while (pos < path.size() && path[pos] != '/') ++pos;
+    return path.substr(start, pos - start);
+}
+
+// Whether path lies under prefix the way the router reads both: segment by segment
+// with repeated and trailing slashes ignored, static segments compared
+// case-insensitively, ":name" standing for any one segment and "*" for the rest.
+// "/api" covers "/API/x" and "//api" but not "/apiary". An empty prefix covers all.
+inline bool path_under_prefix(std::string_view path, std::string_view prefix) {
+    size_t at = 0, prefix_at = 0;
+    for (;;) {
+        std::string_view want = next_path_segment(prefix, prefix_at);
+        if (want.empty() || want == "*") return true;
+        std::string_view have = next_path_segment(path, at);
+        if (have.empty()) return false;
+        if (want[0] != ':' && !iequals(have, want)) return false;
+    }
+}
+
+struct Route {
+    std::string pattern;
+    HttpMethod method = HttpMethod::UNKNOWN;
+    std::vector<std::string> param_names; // in pattern order
+    bool has_splat = false;
+    int handler = -1; // opaque to the router (the shim stores a Lua registry ref)
+};
+
+struct RouteMatch {
+    static constexpr size_t MAX_PARAMS = 16;
+
+    int route_id = -1;
+    size_t param_count = 0;
+    std::array<std::string_view, MAX_PARAMS> params;
+    std::string_view splat;
+};
+
+class Router {
+public:
+    static constexpr int NO_ROUTE = -1;
+
+    // Adds a route and returns its id. If the method+pattern pair was already
+    // registered the slot is taken over and the previous id is stored in *replaced.
+    int insert(HttpMethod method, std::string_view pattern, int handler, int *replaced = nullptr) {
+        if (replaced) *replaced = NO_ROUTE;
+        if (method >= HttpMethod::COUNT) return NO_ROUTE;
+
+        // Count parameters first so a rejected pattern leaves no nodes behind.
+        size_t params = 0;
+        bool splat = false;
+        for_each_segment(pattern, [&](std::string_view segment) {
+            if (splat) return;
+            if (segment[0] == ':') ++params;
+            splat = segment == "*";
+        });
+        if (params > RouteMatch::MAX_PARAMS) return NO_ROUTE;
+
+        Route route;
+        route.pattern = std::string(pattern);
+        route.method = method;
+        route.handler = handler;
+
+        Node *node = &root_;
+        for_each_segment(pattern, [&](std::string_view segment) {
+            if (route.has_splat) return; // anything after '*' is ignored
+            if (segment[0] == ':') {
+                if (!node->param) node->param = std::make_unique<Node>();
+                route.param_names.emplace_back(segment.substr(1));
+                node = node->param.get();
+            } else if (segment == "*") {
+                if (!node->splat) node->splat = std::make_unique<Node>();
+                route.has_splat = true;
+                node = node->splat.get();
+            } else {
+                node = node->static_child(segment, true);
+            }
+        });
+
+        int &slot = node->handlers[static_cast<size_t>(method)];
+        if (replaced) *replaced = slot;
+        slot = static_cast<int>(routes_.size());
+        routes_.push_back(std::move(route));
+        return slot;
+    }
+
+    bool match(HttpMethod method, std::string_view path, RouteMatch &out) const {
+        out.route_id = NO_ROUTE;
+        out.param_count = 0;
+        out.splat = {};
+        if (method >= HttpMethod::COUNT) return false;
+
+        size_t query = path.find('?');
+        if (query != std::string_view::npos) path = path.substr(0, query);
+        return match_node(&root_, path, 0, static_cast<size_t>(method), out);
+    }
+
+    const Route &route(int id) const { return routes_[static_cast<size_t>(id)]; }
+    Route &route(int id) { return routes_[static_cast<size_t>(id)]; }
+    size_t size() const { return routes_.size(); }
+    const std::vector<Route> &routes() const { return routes_; }
+
+    // Nodes in the tree, the root included.
+    size_t node_count() const { return count_nodes(&root_); }
+
+private:
+    struct Node {
+        std::string segment; // lowercase, for static children
+        std::vector<std::unique_ptr<Node>> statics; // sorted by segment
+        std::unique_ptr<Node> param;
+        std::unique_ptr<Node> splat;
+        std::array<int, METHOD_COUNT> handlers;
+
+        Node() { handlers.fill(NO_ROUTE); }
+
+        Node *static_child(std::string_view segment, bool create) {
+            auto it = std::lower_bound(statics.begin(), statics.end(), segment,
+                [](const std::unique_ptr<Node> &n, std::string_view s) {
+                    return icompare_lower(s, n->segment) > 0;
+                });
+            if (it != statics.end() && icompare_lower(segment, (*it)->segment) == 0) {
+                return it->get();
+            }
+            if (!create) return nullptr;
+            auto child = std::make_unique<Node>();
+            child->segment.reserve(segment.size());
+            for (char c : segment) child->segment.push_back(ascii_lower(c));
+            return statics.insert(it, std::move(child))->get();
+        }
+
+        const Node *find_static(std::string_view segment) const {
+            size_t lo = 0, hi = statics.size();
+            while (lo < hi) {
+                size_t mid = (lo + hi) / 2;
+                int cmp = icompare_lower(segment, statics[mid]->segment);
+                if (cmp == 0) return statics[mid].get();
+                if (cmp < 0) hi = mid; else lo = mid + 1;
+            }
+            return nullptr;
+        }
+    };
+
+    template <typename Fn>
+    static void for_each_segment(std::string_view path, Fn &&fn) {
+        size_t i = 0;
+        while (i < path.size()) {
+            while (i < path.size() && path[i] == '/') ++i;
+            size_t start = i;
+            while (i < path.size() && path[i] != '/') ++i;
+            if (i > start) fn(path.substr(start, i - start));
+        }
+    }
+
+    static std::string_view next_segment(std::string_view path, size_t &pos) { return next_path_segment(path, pos); }
+
+    static std::string_view trim_trailing_slashes(std::string_view s) {
+        while (!s.empty() && s.back() == '/') s.remove_suffix(1);
+        return s;
+    }
+
+    bool match_node(const Node *node, std::string_view path, size_t pos, size_t method, RouteMatch &out) const {
+        size_t after = pos;
+        std::string_view segment = next_segment(path, after);
+        if (segment.empty()) {
+            int id = node->handlers[method];
+            if (id == NO_ROUTE) return false;
+            out.route_id = id;
+            return true;
+        }
+
+        if (const Node *child = node->find_static(segment)) {
+            if (match_node(child, path, after, method, out)) return true;
+        }
+        if (node->param && out.param_count < RouteMatch::MAX_PARAMS) {
+            size_t saved = out.param_count;
+            out.params[out.param_count++] = segment;
+            if (match_node(node->param.get(), path, after, method, out)) return true;
+            out.param_count = saved;
+        }
+        if (node->splat) {
+            int id = node->splat->handlers[method];
+            if (id != NO_ROUTE) {
+                out.splat = trim_trailing_slashes(path.substr(after - segment.size()));
+                out.route_id = id;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static size_t count_nodes(const Node *node) {
+        size_t n = 1;
+        for (const auto &child : node->statics) n += count_nodes(child.get());
+        if (node->param) n += count_nodes(node->param.get());
+        if (node->splat) n += count_nodes(node->splat.get());
+        return n;
+    }
+
+    Node root_;
+    std::vector<Route> routes_;
+};
+
+} // namespace dawn
@@ -0,0 +1,486 @@
+// static_cache.hpp
+// File cache behind uws.serve_static. Hot files are kept in an LRU bounded by
+// bytes: small ones are read into memory, large ones are kept open and streamed
+// from the page cache with pread. Large files are not mmap'd: a file truncated
+// while mapped turns the next read of the lost pages into SIGBUS, whereas pread
+// just comes up short. Each entry carries its validators (ETag, Last-Modified)
+// and remembers whether precompressed .br / .gz siblings exist.
+//
+// Entries are invalidated through inotify on the directories they live in; the
+// owner calls poll() periodically to drain events. Where inotify is unavailable
+// entries are revalidated with stat() at most once per second instead. Streamed
+// files are also checked with fstat() on every get(), since their bytes are read
+// at send time rather than when they were cached.
+//
+// A cache belongs to one event loop and is not thread-safe. Files handed out are
+// shared_ptrs, so a response still streaming an evicted file keeps it open.
+#pragma once
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+namespace dawn {
+
+struct StaticOptions {
+    size_t cache_size = 64 * 1024 * 1024;  // bytes of file data kept across all entries
+    size_t stream_threshold = 256 * 1024;  // files at least this large are streamed with pread
+    bool precompressed = true;             // serve .br / .gz siblings when accepted
+    long max_age = -1;                     // Cache-Control max-age; < 0 omits the header
+    std::string index = "index.html";
+};
+
+inline std::string_view mime_type(std::string_view path) {
+    size_t dot = path.rfind('.');
+    if (dot == std::string_view::npos || path.find('/', dot) != std::string_view::npos) {
+        return "application/octet-stream";
+    }
+    std::string ext;
+    for (char c : path.substr(dot + 1)) ext.push_back((c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c);
+
+    static const std::unordered_map<std::string, std::string_view> types = {
+        {"html", "text/html; charset=utf-8"}, {"htm", "text/html; charset=utf-8"},
+        {"css", "text/css; charset=utf-8"}, {"js", "application/javascript; charset=utf-8"},
+        {"mjs", "application/javascript; charset=utf-8"}, {"json", "application/json"},
+        {"map", "application/json"}, {"txt", "text/plain; charset=utf-8"},
+        {"xml", "application/xml"}, {"csv", "text/csv"}, {"wasm", "application/wasm"},
+        {"jpg", "image/jpeg"}, {"jpeg", "image/jpeg"}, {"png", "image/png"},
+        {"gif", "image/gif"}, {"svg", "image/svg+xml"}, {"ico", "image/x-icon"},
+        {"webp", "image/webp"}, {"avif", "image/avif"}, {"woff", "font/woff"},
+        {"woff2", "font/woff2"}, {"ttf", "font/ttf"}, {"otf", "font/otf"},
+        {"mp4", "video/mp4"}, {"webm", "video/webm"}, {"mp3", "audio/mpeg"},
+        {"pdf", "application/pdf"}, {"zip", "application/zip"},
+    };
+    auto it = types.find(ext);
+    return it == types.end() ? std::string_view("application/octet-stream") : it->second;
+}
+
+// RFC 7231 IMF-fixdate.
+inline std::string http_date(time_t t) {
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    char buffer[32];
+    size_t n = strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return std::string(buffer, n);
+}
+
+inline bool parse_http_date(std::string_view value, time_t &out) {
+    std::string s(value);
+    struct tm tm = {};
+    const char *end = strptime(s.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (!end) return false;
+    out = timegm(&tm);
+    return true;
+}
+
+// True if `etag` appears in an If-None-Match / If-Range list (weak comparison),
+// or the header is a bare "*". A '*' inside a list or an ETag matches nothing.
+inline bool etag_matches(std::string_view header, std::string_view etag) {
+    while (!header.empty() && header.front() == ' ') header.remove_prefix(1);
+    while (!header.empty() && header.back() == ' ') header.remove_suffix(1);
+    if (header == "*") return true;
+    size_t pos = 0;
+    while (pos < header.size()) {
+        while (pos < header.size() && (header[pos] == ' ' || header[pos] == ',')) ++pos;
+        size_t end = header.find(',', pos);
+        if (end == std::string_view::npos) end = header.size();
+        std::string_view candidate = header.substr(pos, end - pos);
+        while (!candidate.empty() && candidate.back() == ' ') candidate.remove_suffix(1);
+        if (candidate.substr(0, 2) == "W/") candidate.remove_prefix(2);
+        if (candidate == etag) return true;
+        pos = end + 1;
+    }
+    return false;
+}
+
+// True if Accept-Encoding lists `coding` without q=0.
+inline bool accepts_encoding(std::string_view header, std::string_view coding) {
+    size_t pos = 0;
+    while (pos < header.size()) {
+        size_t end = header.find(',', pos);
+        if (end == std::string_view::npos) end = header.size();
+        std::string_view item = header.substr(pos, end - pos);
+        while (!item.empty() && item.front() == ' ') item.remove_prefix(1);
+        size_t semi = item.find(';');
+        std::string_view name = item.substr(0, semi);
+        while (!name.empty() && name.back() == ' ') name.remove_suffix(1);
+        if (name == coding) {
+            if (semi == std::string_view::npos) return true;
+            std::string_view params = item.substr(semi + 1);
+            size_t q = params.find("q=");
+            if (q == std::string_view::npos) return true;
+            return std::strtod(std::string(params.substr(q + 2)).c_str(), nullptr) > 0.0;
+        }
+        pos = end + 1;
+    }
+    return false;
+}
+
+enum class RangeResult { NONE, SATISFIABLE, UNSATISFIABLE };
+
+// Parses a single "bytes=a-b" / "bytes=a-" / "bytes=-n" range against `size`.
+// Multi-range requests report NONE, so the whole file is sent.
+inline RangeResult parse_range(std::string_view header, size_t size, size_t &first, size_t &last) {
+    if (header.substr(0, 6) != "bytes=") return RangeResult::NONE;
+    std::string_view spec = header.substr(6);
+    if (spec.find(',') != std::string_view::npos) return RangeResult::NONE;
+    size_t dash = spec.find('-');
+    if (dash == std::string_view::npos) return RangeResult::NONE;
+
+    auto parse = [](std::string_view digits, size_t &out) {
+        if (digits.empty() || digits.size() > 19) return false;
+        out = 0;
+        for (char c : digits) {
+            if (c < '0' || c > '9') return false;
+            out = out * 10 + static_cast<size_t>(c - '0');
+        }
+        return true;
+    };
+
+    std::string_view from = spec.substr(0, dash), to = spec.substr(dash + 1);
+    if (from.empty()) {
+        size_t suffix = 0;
+        if (!parse(to, suffix)) return RangeResult::NONE;
+        if (suffix == 0 || size == 0) return RangeResult::UNSATISFIABLE;
+        first = suffix >= size ? 0 : size - suffix;
+        last = size - 1;
+        return RangeResult::SATISFIABLE;
+    }
+    if (!parse(from, first)) return RangeResult::NONE;
+    if (to.empty()) {
+        last = size ? size - 1 : 0;
+    } else if (!parse(to, last) || last < first) {
+        return RangeResult::NONE;
+    }
+    if (first >= size) return RangeResult::UNSATISFIABLE;
+    if (last >= size) last = size - 1;
+    return RangeResult::SATISFIABLE;
+}
+
+// Percent-decodes a URL path below the static prefix and rejects anything that
+// could escape the served directory ("..", NUL, backslashes).
+inline bool decode_static_path(std::string_view url, std::string &out) {
+    out.clear();
+    out.reserve(url.size());
+    for (size_t i = 0; i < url.size(); ++i) {
+        char c = url[i];
+        if (c == '%' && i + 2 < url.size()) {
+            auto hex = [](char h) {
+                if (h >= '0' && h <= '9') return h - '0';
+                if (h >= 'a' && h <= 'f') return h - 'a' + 10;
+                if (h >= 'A' && h <= 'F') return h - 'A' + 10;
+                return -1;
+            };
+            int hi = hex(url[i + 1]), lo = hex(url[i + 2]);
+            if (hi < 0 || lo < 0) return false;
+            c = static_cast<char>(hi * 16 + lo);
+            i += 2;
+        }
+        if (c == '\0' || c == '\\') return false;
+        out.push_back(c);
+    }
+    size_t pos = 0;
+    while (pos <= out.size()) {
+        size_t end = out.find('/', pos);
+        if (end == std::string::npos) end = out.size();
+        if (out.compare(pos, end - pos, "..") == 0) return false;
+        pos = end + 1;
+    }
+    return true;
+}
+
+inline bool is_directory(const std::string &path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+struct StaticFile {
+    std::string path;
+    std::string etag;          // quoted, strong
+    std::string last_modified; // IMF-fixdate
+    time_t mtime = 0;
+    size_t size = 0;
+    bool has_brotli = false;   // a path.br sibling existed when loaded
+    bool has_gzip = false;     // a path.gz sibling existed when loaded
+
+    StaticFile() = default;
+    StaticFile(const StaticFile &) = delete;
+    StaticFile &operator=(const StaticFile &) = delete;
+    ~StaticFile() {
+        if (fd_ >= 0) close(fd_);
+    }
+
+    // Large files are not held in memory: read them with read().
+    bool streamed() const { return fd_ >= 0; }
+
+    // The contents of an in-memory file.
+    std::string_view body() const { return contents_; }
+
+    // Copies up to `length` bytes at `offset` of a streamed file into `out`.
+    // Returns how many were read, fewer only if the file has shrunk (or failed).
+    size_t read(size_t offset, char *out, size_t length) const {
+        size_t done = 0;
+        while (done < length) {
+            ssize_t n = pread(fd_, out + done, length - done, static_cast<off_t>(offset + done));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            done += static_cast<size_t>(n);
+        }
+        return done;
+    }
+
+private:
+    friend class StaticCache;
+    std::string contents_;
+    int fd_ = -1; // streamed files only
+    dev_t dev_ = 0;
+    ino_t ino_ = 0;
+    long mtime_nsec_ = 0;
+    mutable std::chrono::steady_clock::time_point checked_;
+};
+
+class StaticCache {
+public:
+    explicit StaticCache(StaticOptions options) : options_(std::move(options)) {
+#ifdef __linux__
+        inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+    }
+
+    ~StaticCache() {
+        if (inotify_fd_ >= 0) close(inotify_fd_);
+    }
+
+    StaticCache(const StaticCache &) = delete;
+    StaticCache &operator=(const StaticCache &) = delete;
+
+    const StaticOptions &options() const { return options_; }
+    size_t bytes() const { return bytes_; }
+    size_t entries() const { return index_.size(); }
+
+    // Returns the regular file at `path`, from the cache when it is still valid.
+    // nullptr if it does not exist or is not a regular file.
+    std::shared_ptr<const StaticFile> get(const std::string &path) {
+        auto it = index_.find(path);
+        if (it != index_.end()) {
+            auto &file = it->second->file;
+            if ((inotify_fd_ >= 0 || still_valid(*file)) && (!file->streamed() || unchanged(*file))) {
+                lru_.splice(lru_.begin(), lru_, it->second);
+                return file;
+            }
+            erase(it);
+        }
+
+        std::shared_ptr<StaticFile> file = load(path);
+        if (!file) return nullptr;
+        size_t cost = file->size;
+        if (cost > options_.cache_size) return file; // served once, never cached
+
+        watch(path);
+        lru_.push_front(Entry{path, file});
+        index_[path] = lru_.begin();
+        bytes_ += cost;
+        while (bytes_ > options_.cache_size && lru_.size() > 1) {
+            erase(index_.find(lru_.back().path));
+        }
+        return file;
+    }
+
+    // Drains pending inotify events and drops the entries they touch.
+    void poll() {
+#ifdef __linux__
+        if (inotify_fd_ < 0) return;
+        alignas(struct inotify_event) char buffer[16 * 1024];
+        for (;;) {
+            ssize_t n = read(inotify_fd_, buffer, sizeof(buffer));
+            if (n <= 0) return; // EAGAIN: drained
+            for (char *p = buffer; p < buffer + n;) {
+                auto *event = reinterpret_cast<struct inotify_event *>(p);
+                p += sizeof(struct inotify_event) + event->len;
+                if (event->mask & IN_Q_OVERFLOW) {
+                    clear();
+                    continue;
+                }
+                auto dir = watches_.find(event->wd);
+                if (dir == watches_.end()) continue;
+                if (event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+                    invalidate_dir(dir->second);
+                    if (event->mask & IN_IGNORED) {
+                        watched_dirs_.erase(dir->second);
+                        watches_.erase(dir);
+                    }
+                    continue;
+                }
+                if (event->len > 0) invalidate(dir->second + "/" + event->name);
+            }
+        }
+#endif
+    }
+
+    void clear() {
+        lru_.clear();
+        index_.clear();
+        bytes_ = 0;
+    }
+
+private:
+    struct Entry {
+        std::string path;
+        std::shared_ptr<const StaticFile> file;
+    };
+    using EntryList = std::list<Entry>;
+
+    static std::string make_etag(const struct stat &st) {
+        char buffer[64];
+        int n = snprintf(buffer, sizeof(buffer), "\"%llx-%llx\"",
+            static_cast<unsigned long long>(st.st_size),
+            static_cast<unsigned long long>(st.st_mtim.tv_sec) * 1000000000ull +
+                static_cast<unsigned long long>(st.st_mtim.tv_nsec));
+        return std::string(buffer, static_cast<size_t>(n));
+    }
+
+    static bool exists(const std::string &path) {
+        struct stat st;
+        return stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+    }
+
+    std::shared_ptr<StaticFile> load(const std::string &path) const {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return nullptr;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+            close(fd);
+            return nullptr;
+        }
+
+        auto file = std::make_shared<StaticFile>();
+        file->path = path;
+        file->size = static_cast<size_t>(st.st_size);
+        file->mtime = st.st_mtim.tv_sec;
+        file->mtime_nsec_ = st.st_mtim.tv_nsec;
+        file->etag = make_etag(st);
+        file->last_modified = http_date(st.st_mtim.tv_sec);
+        file->dev_ = st.st_dev;
+        file->ino_ = st.st_ino;
+        file->checked_ = std::chrono::steady_clock::now();
+
+        if (file->size >= options_.stream_threshold && file->size > 0) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            file->fd_ = fd;
+        } else {
+            file->contents_.resize(file->size);
+            size_t done = 0;
+            while (done < file->size) {
+                ssize_t n = read(fd, &file->contents_[done], file->size - done);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) break;
+                done += static_cast<size_t>(n);
+            }
+            file->contents_.resize(done);
+            file->size = done;
+            close(fd);
+        }
+
+        if (options_.precompressed) {
+            file->has_brotli = exists(path + ".br");
+            file->has_gzip = exists(path + ".gz");
+        }
+        return file;
+    }
+
+    // Whether a streamed file still has the size and mtime it was loaded with.
+    static bool unchanged(const StaticFile &file) {
+        struct stat st;
+        return fstat(file.fd_, &st) == 0 && static_cast<size_t>(st.st_size) == file.size &&
+               st.st_mtim.tv_sec == file.mtime && st.st_mtim.tv_nsec == file.mtime_nsec_;
+    }
+
+    // stat() fallback used only when inotify is unavailable.
+    static bool still_valid(const StaticFile &file) {
+        auto now = std::chrono::steady_clock::now();
+        if (now - file.checked_ < std::chrono::seconds(1)) return true;
+        struct stat st;
+        if (stat(file.path.c_str(), &st) != 0) return false;
+        if (st.st_ino != file.ino_ || st.st_dev != file.dev_ ||
+            static_cast<size_t>(st.st_size) != file.size || st.st_mtim.tv_sec != file.mtime) {
+            return false;
+        }
+        file.checked_ = now;
+        return true;
+    }
+
+    void watch(const std::string &path) {
+#ifdef __linux__
+        if (inotify_fd_ < 0) return;
+        size_t slash = path.rfind('/');
+        std::string dir = slash == std::string::npos ? "." : path.substr(0, slash);
+        if (watched_dirs_.count(dir)) return;
+        int wd = inotify_add_watch(inotify_fd_, dir.c_str(),
+            IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE |
+            IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+        if (wd < 0) {
+            // Out of watches: fall back to stat() revalidation for everything.
+            close(inotify_fd_);
+            inotify_fd_ = -1;
+            return;
+        }
+        watches_[wd] = dir;
+        watched_dirs_[dir] = wd;
+#endif
+    }
+
+    void erase(std::unordered_map<std::string, EntryList::iterator>::iterator it) {
+        bytes_ -= it->second->file->size;
+        lru_.erase(it->second);
+        index_.erase(it);
+    }
+
+    // A change to "x.br" or "x.gz" also drops "x", whose sibling flags are stale.
+    void invalidate(const std::string &path) {
+        auto it = index_.find(path);
+        if (it != index_.end()) erase(it);
+        for (std::string_view suffix : {".br", ".gz"}) {
+            if (path.size() > suffix.size() && path.compare(path.size() - suffix.size(), suffix.size(), suffix) == 0) {
+                auto base = index_.find(path.substr(0, path.size() - suffix.size()));
+                if (base != index_.end()) erase(base);
+            }
+        }
+    }
+
+    void invalidate_dir(const std::string &dir) {
+        std::string prefix = dir + "/";
+        for (auto it = index_.begin(); it != index_.end();) {
+            auto next = std::next(it);
+            if (it->first.compare(0, prefix.size(), prefix) == 0) erase(it);
+            it = next;
+        }
+    }
+
+    StaticOptions options_;
+    EntryList lru_;
+    std::unordered_map<std::string, EntryList::iterator> index_;
+    size_t bytes_ = 0;
+    int inotify_fd_ = -1;
+    std::unordered_map<int, std::string> watches_;
+    std::unordered_map<std::string, int> watched_dirs_;
+};
+
+} // namespace dawn
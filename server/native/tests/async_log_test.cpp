@@ -0,0 +1,96 @@
+// async_log_test.cpp
+#include "async_log.hpp"
+#include "test.hpp"
+
+#include <fcntl.h>
+
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace dawn;
+
+static std::string temp_file() {
+    char path[] = "/tmp/dawn-async-log-test-XXXXXX";
+    int fd = ::mkstemp(path);
+    if (fd >= 0) ::close(fd);
+    return path;
+}
+
+static std::string slurp(const std::string &path) {
+    std::ifstream in(path, std::ios::binary);
+    std::stringstream ss;
+    ss << in.rdbuf();
+    return ss.str();
+}
+
+static size_t count_lines(const std::string &text) {
+    size_t lines = 0;
+    for (char c : text) lines += c == '\n';
+    return lines;
+}
+
+// write() drops lines below the log's level itself, so callers need not check
+// enabled() first.
+static void test_write_filters_on_level() {
+    std::string path = temp_file();
+    {
+        AsyncLog log(::open(path.c_str(), O_WRONLY | O_APPEND), true, LOG_WARN);
+        CHECK(!log.enabled(LOG_INFO) && log.enabled(LOG_ERROR));
+        log.write(LOG_DEBUG, "debug ", 1);
+        log.write(LOG_INFO, "info ", 2);
+        log.write(LOG_ERROR, "error ", 3, " ", true);
+        log.flush();
+        std::string text = slurp(path);
+        CHECK(count_lines(text) == 1);
+        CHECK(text.find(" ERROR error 3 true\n") != std::string::npos);
+        CHECK(text.find("info") == std::string::npos);
+
+        log.set_level(LOG_DEBUG);
+        log.write(LOG_DEBUG, "now shown");
+        log.flush();
+        CHECK(slurp(path).find(" DEBUG now shown\n") != std::string::npos);
+    }
+    ::unlink(path.c_str());
+}
+
+// Lines from many threads all arrive whole; the destructor drains the ring.
+static void test_concurrent_writers() {
+    std::string path = temp_file();
+    const int threads = 4, per_thread = 2000;
+    uint64_t dropped = 0;
+    {
+        AsyncLog log(::open(path.c_str(), O_WRONLY | O_APPEND), true);
+        std::vector<std::thread> writers;
+        for (int t = 0; t < threads; ++t) {
+            writers.emplace_back([&log, t] {
+                for (int i = 0; i < per_thread; ++i) log.write(LOG_INFO, "thread ", t, " line ", i);
+            });
+        }
+        for (auto &writer : writers) writer.join();
+        dropped = log.dropped();
+    }
+    std::string text = slurp(path);
+    // A full ring drops lines and then reports how many in a line of its own.
+    size_t expected = static_cast<size_t>(threads * per_thread) - dropped;
+    size_t reports = text.find("log ring full") != std::string::npos ? 1 : 0;
+    CHECK(count_lines(text) >= expected + reports);
+    CHECK(text.find(" INFO thread 3 line 1999\n") != std::string::npos || dropped > 0);
+    ::unlink(path.c_str());
+}
+
+static void test_json_escaping() {
+    std::string out;
+    append_json_escaped(out, std::string_view("a\"b\\c\nd\x01", 8));
+    CHECK(out == "a\\\"b\\\\c\\nd\\u0001");
+}
+
+int main() {
+    test_write_filters_on_level();
+    test_concurrent_writers();
+    test_json_escaping();
+    return dawn_test::finish("async_log");
+}
@@ -0,0 +1,80 @@
+// handle_pool_test.cpp
+#include "handle_pool.hpp"
+#include "test.hpp"
+
+using namespace dawn;
+
+struct FakeResponse {
+    uint32_t generation = 1;
+    int client = 0;
+    int sent = 0;
+};
+
+// What res:send does with the ref a Lua closure kept: sends only if the ref is live.
+static bool deferred_send(const HandlePool<FakeResponse>::Ref &ref) {
+    FakeResponse *h = HandlePool<FakeResponse>::resolve(ref);
+    if (!h) return false;
+    ++h->sent;
+    return true;
+}
+
+// A handler stashes res in a timer and finishes; the next request reuses the
+// pooled handle; the timer's late res:send must not reach the second client.
+static void test_deferred_send_after_finish() {
+    HandlePool<FakeResponse> pool;
+    FakeResponse *first = pool.acquire();
+    first->client = 1;
+    auto stashed = HandlePool<FakeResponse>::ref(first);
+    CHECK(HandlePool<FakeResponse>::resolve(stashed) == first);
+    pool.release(first);
+
+    FakeResponse *second = pool.acquire();
+    CHECK(second == first); // recycled, not reallocated
+    CHECK(pool.size() == 1);
+    second->client = 2;
+    auto current = HandlePool<FakeResponse>::ref(second);
+
+    CHECK(!deferred_send(stashed));
+    CHECK(second->sent == 0);
+    CHECK(deferred_send(current));
+    CHECK(second->sent == 1);
+
+    pool.release(second);
+    CHECK(!deferred_send(current));
+    CHECK(pool.idle() == 1);
+}
+
+// Middleware on a body route sees one req/res; the body handler runs later with
+// handles of its own. Whatever middleware kept must be stale by then, even
+// though the pool hands the handler the very object middleware had.
+static void test_middleware_handle_stale_for_body_handler() {
+    HandlePool<FakeResponse> pool;
+    FakeResponse *middleware = pool.acquire();
+    auto kept = HandlePool<FakeResponse>::ref(middleware);
+    pool.release(middleware); // the middleware call returns, final = false
+
+    FakeResponse *handler = pool.acquire();
+    CHECK(handler == middleware);
+    CHECK(!deferred_send(kept));
+    CHECK(deferred_send(HandlePool<FakeResponse>::ref(handler)));
+    CHECK(handler->sent == 1);
+}
+
+static void test_distinct_handles_while_checked_out() {
+    HandlePool<FakeResponse> pool;
+    FakeResponse *a = pool.acquire();
+    FakeResponse *b = pool.acquire();
+    CHECK(a != b);
+    CHECK(pool.size() == 2 && pool.idle() == 0);
+    auto ra = HandlePool<FakeResponse>::ref(a);
+    pool.release(b);
+    CHECK(HandlePool<FakeResponse>::resolve(ra) == a);
+    CHECK(HandlePool<FakeResponse>::resolve(HandlePool<FakeResponse>::Ref{}) == nullptr);
+}
+
+int main() {
+    test_deferred_send_after_finish();
+    test_middleware_handle_stale_for_body_handler();
+    test_distinct_handles_while_checked_out();
+    return dawn_test::finish("handle_pool");
+}
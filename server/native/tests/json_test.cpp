@@ -0,0 +1,100 @@
+// json_test.cpp
+#include "json.hpp"
+#include "test.hpp"
+
+#include <string>
+
+using namespace dawn;
+
+static std::string str(const JsonDocument &doc, uint32_t i) {
+    std::string scratch;
+    return std::string(doc.string(i, scratch));
+}
+
+static void test_scalar_roots() {
+    JsonDocument doc;
+    CHECK(doc.parse("42") && doc.node(0).type == JsonType::NUMBER && doc.number(0) == 42);
+    CHECK(doc.parse(" \"x\\ny\" ") && doc.node(0).type == JsonType::STRING && str(doc, 0) == "x\ny");
+    CHECK(doc.parse("null") && doc.node(0).type == JsonType::NUL);
+    CHECK(doc.parse("true") && doc.node(0).type == JsonType::TRUE);
+    CHECK(doc.parse("-1.5e2") && doc.number(0) == -150);
+}
+
+static void test_objects() {
+    JsonDocument doc;
+    CHECK(doc.parse(R"({"a": 1, "b": {"c": [true, null]}, "d\u0041": "x"})"));
+    uint32_t a = doc.find(0, "a");
+    CHECK(a != JsonDocument::NONE && doc.number(a) == 1);
+    uint32_t b = doc.find(0, "b");
+    uint32_t c = doc.find(b, "c");
+    CHECK(doc.node(c).type == JsonType::ARRAY && doc.node(c).count == 2);
+    CHECK(doc.node(doc.at(c, 1)).type == JsonType::NUL);
+    CHECK(doc.find(0, "dA") != JsonDocument::NONE);
+    CHECK(doc.find(0, "missing") == JsonDocument::NONE);
+    CHECK(doc.find(c, "a") == JsonDocument::NONE);
+
+    // next_member visits every key in order, as __pairs does.
+    std::string keys;
+    for (uint32_t k = doc.next_member(0, JsonDocument::NONE); k != JsonDocument::NONE; k = doc.next_member(0, k)) {
+        keys += str(doc, k) + ",";
+    }
+    CHECK(keys == "a,b,dA,");
+    CHECK(doc.next_member(b, doc.next_member(b, JsonDocument::NONE)) == JsonDocument::NONE);
+    CHECK(doc.parse("{}") && doc.next_member(0, JsonDocument::NONE) == JsonDocument::NONE);
+}
+
+// Every index of a long array, in order and backwards, past the point where
+// lookups switch from walking the tape to the element table.
+static void test_array_indexing() {
+    std::string text = "[";
+    const uint32_t count = 1000;
+    for (uint32_t i = 0; i < count; ++i) {
+        if (i) text += ",";
+        text += (i % 3 == 0) ? "[" + std::to_string(i) + "]" : std::to_string(i);
+    }
+    text += "]";
+    JsonDocument doc;
+    CHECK(doc.parse(text));
+    CHECK(doc.node(0).count == count);
+
+    bool in_order = true;
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t e = doc.at(0, i);
+        double value = doc.node(e).type == JsonType::ARRAY ? doc.number(e + 1) : doc.number(e);
+        in_order = in_order && value == i;
+    }
+    CHECK(in_order);
+    bool backwards = true;
+    for (uint32_t i = count; i-- > 0;) {
+        uint32_t e = doc.at(0, i);
+        double value = doc.node(e).type == JsonType::ARRAY ? doc.number(e + 1) : doc.number(e);
+        backwards = backwards && value == i;
+    }
+    CHECK(backwards);
+    CHECK(doc.at(0, count) == JsonDocument::NONE);
+
+    // Reparsing drops the element table of the previous document.
+    CHECK(doc.parse("[[1],[2],[3],[4],[5],[6],[7],[8],[9],[10]]"));
+    CHECK(doc.number(doc.at(0, 9) + 1) == 10);
+}
+
+static void test_errors() {
+    JsonDocument doc;
+    CHECK(!doc.parse("") && doc.error() != nullptr);
+    CHECK(!doc.parse("{\"a\" 1}"));
+    CHECK(!doc.parse("[1,]"));
+    CHECK(!doc.parse("\"\\x\""));
+    CHECK(!doc.parse("01"));
+    CHECK(!doc.parse("1 2"));
+    std::string deep(JsonDocument::MAX_DEPTH + 1, '[');
+    deep += std::string(JsonDocument::MAX_DEPTH + 1, ']');
+    CHECK(!doc.parse(deep));
+}
+
+int main() {
+    test_scalar_roots();
+    test_objects();
+    test_array_indexing();
+    test_errors();
+    return dawn_test::finish("json");
+}
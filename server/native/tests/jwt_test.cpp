@@ -0,0 +1,68 @@
+// jwt_test.cpp
+#include "jwt.hpp"
+#include "test.hpp"
+
+#include <string>
+
+using namespace dawn;
+
+static bool decodes(std::string_view in, std::string_view expected) {
+    std::string out;
+    return base64url_decode(in, out) && out == expected;
+}
+
+static bool rejects(std::string_view in) {
+    std::string out;
+    return !base64url_decode(in, out);
+}
+
+static void test_base64url_decode() {
+    CHECK(decodes("", ""));
+    CHECK(decodes("Zm9v", "foo"));
+    CHECK(decodes("Zm8", "fo") && decodes("Zm8=", "fo"));
+    CHECK(decodes("Zg", "f") && decodes("Zg==", "f"));
+    CHECK(decodes("-_8", "\xfb\xff"));
+
+    CHECK(rejects("+_8") && rejects("-/8")); // base64, not base64url
+    CHECK(rejects("Zm9v!") && rejects("Zm 9v") && rejects(std::string_view("Zm\0v", 4)));
+    CHECK(rejects("Z") && rejects("Zm9vY"));
+    CHECK(rejects("Zg=") && rejects("Zg===") && rejects("Zm8==") && rejects("Zm9v="));
+    CHECK(rejects("Zh") && rejects("Zm9=")); // stray bits after the last byte
+}
+
+static void test_round_trip() {
+    std::string bytes;
+    for (int i = 0; i < 256; ++i) bytes.push_back(static_cast<char>(i));
+    bool all_ok = true;
+    for (size_t n = 0; n <= bytes.size(); ++n) {
+        std::string encoded;
+        base64url_encode(std::string_view(bytes).substr(0, n), encoded);
+        all_ok = all_ok && decodes(encoded, std::string_view(bytes).substr(0, n));
+    }
+    CHECK(all_ok);
+}
+
+static void test_sign_and_decode() {
+    HmacSha256 key("secret");
+    std::string token = jwt_sign(key, R"({"sub":"u1","exp":100})");
+    JwtToken decoded;
+    CHECK(jwt_decode(key, token, decoded) == JwtError::NONE && decoded.exp && *decoded.exp == 100);
+    CHECK(jwt_check_time(decoded, 200, 0, true, true) == JwtError::EXPIRED);
+
+    // The same signature bytes spelled with base64 characters are not the token.
+    std::string altered = token;
+    size_t at = altered.find_last_of("-_");
+    if (at != std::string::npos && at > altered.rfind('.')) {
+        altered[at] = altered[at] == '-' ? '+' : '/';
+        CHECK(jwt_decode(key, altered, decoded) == JwtError::SIGNATURE);
+    }
+    CHECK(jwt_decode(HmacSha256("other"), token, decoded) == JwtError::SIGNATURE);
+    CHECK(jwt_decode(key, "a.b", decoded) == JwtError::MALFORMED);
+}
+
+int main() {
+    test_base64url_decode();
+    test_round_trip();
+    test_sign_and_decode();
+    return dawn_test::finish("jwt");
+}
@@ -0,0 +1,199 @@
+// multipart_test.cpp
+#include "multipart.hpp"
+#include "test.hpp"
+
+#include <sys/stat.h>
+
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace dawn;
+
+static const std::string BOUNDARY = "XyZ123";
+
+static std::string form_body() {
+    return "preamble\r\n"
+           "--XyZ123\r\n"
+           "Content-Disposition: form-data; name=\"title\"\r\n"
+           "\r\n"
+           "hello world\r\n"
+           "--XyZ123\r\n"
+           "Content-Disposition: form-data; name=\"upload\"; filename=\"a b.txt\"\r\n"
+           "Content-Type: text/plain\r\n"
+           "\r\n"
+           "file contents\r\n--not the boundary\r\n"
+           "--XyZ123\r\n"
+           "Content-Disposition: form-data; name=\"b64\"\r\n"
+           "Content-Transfer-Encoding: base64\r\n"
+           "\r\n"
+           "aGVs\r\nbG8=\r\n"
+           "--XyZ123--\r\n";
+}
+
+static bool exists(const std::string &path) {
+    struct stat st;
+    return ::stat(path.c_str(), &st) == 0;
+}
+
+static std::string slurp(const std::string &path) {
+    std::ifstream in(path, std::ios::binary);
+    std::stringstream ss;
+    ss << in.rdbuf();
+    return ss.str();
+}
+
+static std::string temp_dir() {
+    char dir[] = "/tmp/dawn-multipart-test-XXXXXX";
+    return ::mkdtemp(dir) ? std::string(dir) : std::string("/tmp");
+}
+
+struct Collected {
+    std::vector<MultipartPart> parts;
+};
+
+static std::unique_ptr<MultipartParser> make_parser(Collected &out, MultipartOptions options) {
+    auto parser = std::make_unique<MultipartParser>(BOUNDARY, std::move(options));
+    parser->on_part_end = [&out](MultipartPart &part) {
+        out.parts.push_back(part);
+        return true;
+    };
+    return parser;
+}
+
+// The same form split at every possible offset parses the same way.
+static void test_parts_at_every_split() {
+    std::string dir = temp_dir();
+    MultipartOptions options;
+    options.auto_save_dir = dir;
+    std::string body = form_body();
+    bool all_ok = true;
+    for (size_t split = 0; split <= body.size(); ++split) {
+        Collected out;
+        auto parser = make_parser(out, options);
+        bool ok = parser->feed(std::string_view(body).substr(0, split)) &&
+                  parser->feed(std::string_view(body).substr(split));
+        ok = ok && parser->done() && out.parts.size() == 3;
+        ok = ok && out.parts[0].name == "title" && out.parts[0].body == "hello world";
+        ok = ok && out.parts[1].is_file && out.parts[1].filename == "a b.txt" &&
+             out.parts[1].content_type == "text/plain" &&
+             slurp(out.parts[1].path) == "file contents\r\n--not the boundary";
+        ok = ok && out.parts[2].body == "hello";
+        if (out.parts.size() > 1) ::unlink(out.parts[1].path.c_str());
+        if (!ok) {
+            std::fprintf(stderr, "split at %zu: %s\n", split, parser->error.c_str());
+            all_ok = false;
+            break;
+        }
+    }
+    CHECK(all_ok);
+    ::rmdir(dir.c_str());
+}
+
+static void test_boundary_from_content_type() {
+    CHECK(MultipartParser::boundary_from_content_type("multipart/form-data; boundary=abc") == "abc");
+    CHECK(MultipartParser::boundary_from_content_type("multipart/form-data; boundary=\"a b\"; x=1") == "a b");
+    CHECK(MultipartParser::boundary_from_content_type("multipart/form-data").empty());
+}
+
+// A completed body leaves its files to the caller.
+static void test_complete_body_keeps_files() {
+    std::string dir = temp_dir();
+    MultipartOptions options;
+    options.auto_save_dir = dir;
+    std::string path;
+    {
+        Collected out;
+        auto parser = make_parser(out, options);
+        CHECK(parser->feed(form_body()) && parser->done());
+        CHECK(out.parts.size() == 3);
+        path = out.parts.size() == 3 ? out.parts[1].path : "";
+    }
+    CHECK(!path.empty() && exists(path));
+    ::unlink(path.c_str());
+    ::rmdir(dir.c_str());
+}
+
+// An aborted request drops its parser mid-body: every file it wrote goes, the
+// finished ones as well as the one still open.
+static void test_abort_deletes_files() {
+    std::string dir = temp_dir();
+    MultipartOptions options;
+    options.auto_save_dir = dir;
+    std::string body = "--XyZ123\r\n"
+                       "Content-Disposition: form-data; name=\"a\"; filename=\"a.bin\"\r\n\r\n"
+                       "first file\r\n"
+                       "--XyZ123\r\n"
+                       "Content-Disposition: form-data; name=\"b\"; filename=\"b.bin\"\r\n\r\n"
+                       "second file, cut off";
+    std::vector<std::string> paths;
+    {
+        auto parser = std::make_unique<MultipartParser>(BOUNDARY, options);
+        parser->on_part_begin = [&paths](MultipartPart &part) {
+            paths.push_back(part.path);
+            return true;
+        };
+        CHECK(parser->feed(body));
+        CHECK(!parser->done());
+        CHECK(paths.size() == 2 && exists(paths[0]) && exists(paths[1]));
+    }
+    CHECK(paths.size() == 2 && !exists(paths[0]) && !exists(paths[1]));
+    CHECK(::rmdir(dir.c_str()) == 0); // nothing left behind
+}
+
+static void test_total_size_cap() {
+    std::string dir = temp_dir();
+    MultipartOptions options;
+    options.auto_save_dir = dir;
+    options.max_total_size = 64;
+    std::string body = "--XyZ123\r\n"
+                       "Content-Disposition: form-data; name=\"f\"; filename=\"big.bin\"\r\n\r\n" +
+                       std::string(200, 'x');
+    {
+        auto parser = std::make_unique<MultipartParser>(BOUNDARY, options);
+        CHECK(!parser->feed(body));
+        CHECK(parser->too_large() && parser->failed());
+        CHECK(!parser->feed("more"));
+    }
+    CHECK(::rmdir(dir.c_str()) == 0);
+
+    MultipartOptions unlimited;
+    unlimited.max_total_size = 0;
+    unlimited.stream_to_disk = false;
+    Collected out;
+    auto parser = make_parser(out, unlimited);
+    CHECK(parser->feed(form_body()) && !parser->too_large());
+}
+
+static void test_malformed() {
+    MultipartOptions options;
+    options.stream_to_disk = false;
+    {
+        MultipartParser parser(BOUNDARY, options);
+        CHECK(!parser.feed("--XyZ123garbage\r\n"));
+        CHECK(!parser.error.empty() && !parser.too_large());
+    }
+    {
+        options.max_header_size = 32;
+        MultipartParser parser(BOUNDARY, options);
+        CHECK(!parser.feed("--XyZ123\r\nX-Long: " + std::string(100, 'h')));
+    }
+    {
+        options.max_memory_size = 4;
+        MultipartParser parser(BOUNDARY, options);
+        CHECK(!parser.feed("--XyZ123\r\nContent-Disposition: form-data; name=\"x\"\r\n\r\n0123456789\r\n--XyZ123--"));
+    }
+}
+
+int main() {
+    test_boundary_from_content_type();
+    test_parts_at_every_split();
+    test_complete_body_keeps_files();
+    test_abort_deletes_files();
+    test_total_size_cap();
+    test_malformed();
+    return dawn_test::finish("multipart");
+}
@@ -0,0 +1,92 @@
+// presence_store_test.cpp
+#include "presence_store.hpp"
+#include "test.hpp"
+
+#include <string>
+#include <vector>
+
+using namespace dawn;
+
+static void test_join_leave() {
+    PresenceStore store;
+    CHECK(store.join("lobby", "ws1", 10, "{\"a\":1}"));
+    CHECK(!store.join("lobby", "ws1", 20, "{\"a\":2}"));
+    const PresenceStore::Entry *entry = store.find("lobby", "ws1");
+    CHECK(entry && entry->joined_at == 10 && entry->meta == "{\"a\":1}");
+    CHECK(store.join("lobby", "ws2", 11, "{}") && store.count("lobby") == 2);
+    CHECK(store.leave("lobby", "ws1") && !store.find("lobby", "ws1"));
+    CHECK(store.find("lobby", "ws2") != nullptr); // swapped into the freed slot
+    CHECK(!store.leave("lobby", "ws1"));
+    CHECK(store.leave("lobby", "ws2") && !store.exists("lobby"));
+    CHECK(store.topic_count() == 0 && store.member_count() == 0);
+}
+
+// replace() overwrites where join() would keep the old entry, and logs it as a
+// join with the new meta.
+static void test_replace() {
+    PresenceStore store;
+    CHECK(store.replace("lobby", "ws1", 10, "old"));
+    uint64_t mark = store.version();
+    CHECK(!store.replace("lobby", "ws1", 20, "new"));
+    const PresenceStore::Entry *entry = store.find("lobby", "ws1");
+    CHECK(entry && entry->joined_at == 20 && entry->meta == "new");
+    CHECK(store.count("lobby") == 1);
+
+    std::vector<std::string> seen;
+    CHECK(store.changes_since("lobby", mark, [&](const PresenceStore::Change &change) {
+        seen.push_back((change.joined ? "+" : "-") + change.member + ":" + change.meta);
+    }));
+    CHECK(seen.size() == 1 && seen[0] == "+ws1:new");
+}
+
+static void test_change_log_overflow() {
+    PresenceStore store(4);
+    uint64_t mark = store.version();
+    for (int i = 0; i < 3; ++i) store.join("lobby", "ws" + std::to_string(i), 0, "");
+    int count = 0;
+    CHECK(store.changes_since("lobby", mark, [&](const PresenceStore::Change &) { ++count; }));
+    CHECK(count == 3);
+    for (int i = 3; i < 6; ++i) store.join("lobby", "ws" + std::to_string(i), 0, "");
+    CHECK(!store.changes_since("lobby", mark, [](const PresenceStore::Change &) {}));
+}
+
+// Enough topics and members to grow the storage many times over: lookups by view
+// must keep finding names interned before the growth, and freed slots reused.
+static void test_lookups_survive_growth() {
+    PresenceStore store;
+    const int n = 2000;
+    for (int i = 0; i < n; ++i) store.join("t" + std::to_string(i % 50), "m" + std::to_string(i), i, "");
+    bool found = true;
+    for (int i = 0; i < n; ++i) {
+        const PresenceStore::Entry *entry = store.find("t" + std::to_string(i % 50), "m" + std::to_string(i));
+        found = found && entry && entry->joined_at == i;
+    }
+    CHECK(found);
+    for (int i = 0; i < n; i += 2) store.leave_all("m" + std::to_string(i));
+    CHECK(store.member_count() == n / 2);
+    for (int i = 0; i < n; i += 2) store.join("u" + std::to_string(i % 50), "x" + std::to_string(i), i, "");
+    bool after_reuse = true;
+    for (int i = 1; i < n; i += 2) after_reuse = after_reuse && store.find("t" + std::to_string(i % 50), "m" + std::to_string(i));
+    for (int i = 0; i < n; i += 2) after_reuse = after_reuse && store.find("u" + std::to_string(i % 50), "x" + std::to_string(i));
+    CHECK(after_reuse);
+    CHECK(!store.find("t0", "m0"));
+}
+
+static void test_remove_topic() {
+    PresenceStore store;
+    store.join("a", "ws1", 0, "");
+    store.join("b", "ws1", 0, "");
+    CHECK(store.remove_topic("a") && !store.exists("a"));
+    std::vector<std::string> topics;
+    store.each_topic("ws1", [&](std::string_view topic) { topics.emplace_back(topic); });
+    CHECK(topics.size() == 1 && topics[0] == "b");
+}
+
+int main() {
+    test_join_leave();
+    test_replace();
+    test_change_log_overflow();
+    test_lookups_survive_growth();
+    test_remove_topic();
+    return dawn_test::finish("presence_store");
+}
@@ -0,0 +1,94 @@
+// rate_limiter_test.cpp
+#include "rate_limiter.hpp"
+#include "test.hpp"
+
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace dawn;
+
+static const int64_t SECOND = 1000000000;
+
+static void test_burst_and_refill() {
+    RateLimiter limiter(2, 1, 3, 100); // 2 per second, bursts of 3
+    int64_t now = 1000 * SECOND;
+    CHECK(limiter.check("a", now).allowed);
+    CHECK(limiter.check("a", now).allowed);
+    RateLimitResult third = limiter.check("a", now);
+    CHECK(third.allowed && third.remaining == 0);
+    RateLimitResult refused = limiter.check("a", now);
+    CHECK(!refused.allowed && refused.retry_after_ns == SECOND / 2);
+    CHECK(limiter.check("b", now).allowed); // keys are independent
+    CHECK(limiter.check("a", now + SECOND / 2).allowed);
+    CHECK(!limiter.check("a", now + SECOND / 2).allowed);
+    CHECK(limiter.check("a", now + 10 * SECOND, 3).allowed);
+}
+
+// Keys past capacity push out the least recently used, which starts over.
+static void test_lru_eviction() {
+    RateLimiter limiter(1, 60, 1, RateLimiter::SHARDS); // one slot per shard
+    int64_t now = 1000 * SECOND;
+    CHECK(limiter.check("hot", now).allowed);
+    CHECK(!limiter.check("hot", now).allowed);
+    for (int i = 0; i < 1000; ++i) limiter.check("k" + std::to_string(i), now);
+    CHECK(limiter.size() <= RateLimiter::SHARDS);
+    CHECK(limiter.check("hot", now).allowed); // evicted, so a fresh bucket
+}
+
+// Enough keys, resets and evictions to exercise probing and backward shifts: every
+// key still in the table is found with its history, and size() stays exact.
+static void test_table_consistency() {
+    const size_t capacity = 1024;
+    RateLimiter limiter(1, 60, 1, capacity);
+    int64_t now = 1000 * SECOND;
+    for (int i = 0; i < 600; ++i) limiter.check("k" + std::to_string(i), now);
+    CHECK(limiter.size() == 600);
+    for (int i = 0; i < 600; i += 3) limiter.reset("k" + std::to_string(i));
+    CHECK(limiter.size() == 400);
+    bool remembered = true;
+    for (int i = 0; i < 600; ++i) {
+        bool allowed = limiter.check("k" + std::to_string(i), now).allowed;
+        remembered = remembered && allowed == (i % 3 == 0);
+    }
+    CHECK(remembered);
+    CHECK(limiter.size() == 600);
+    limiter.reset("missing");
+    CHECK(limiter.size() == 600);
+
+    for (int i = 0; i < 5000; ++i) limiter.check("x" + std::to_string(i), now);
+    CHECK(limiter.size() <= capacity + RateLimiter::SHARDS);
+    bool recent = true;
+    for (int i = 4990; i < 5000; ++i) recent = recent && !limiter.check("x" + std::to_string(i), now).allowed;
+    CHECK(recent);
+}
+
+static void test_same_options() {
+    RateLimiter limiter(5, 10, 5, 100);
+    CHECK(limiter.same_options(5, 10, 5, 100));
+    CHECK(!limiter.same_options(5, 10, 6, 100));
+    CHECK(!limiter.same_options(5, 10, 5, 200));
+}
+
+static void test_threads() {
+    RateLimiter limiter(1000, 1, 1000, 4096);
+    int64_t now = 1000 * SECOND;
+    std::vector<std::thread> threads;
+    std::vector<int> allowed(4, 0);
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&, t] {
+            for (int i = 0; i < 500; ++i) allowed[t] += limiter.check("shared", now).allowed ? 1 : 0;
+        });
+    }
+    for (auto &thread : threads) thread.join();
+    CHECK(allowed[0] + allowed[1] + allowed[2] + allowed[3] == 1000);
+}
+
+int main() {
+    test_burst_and_refill();
+    test_lru_eviction();
+    test_table_consistency();
+    test_same_options();
+    test_threads();
+    return dawn_test::finish("rate_limiter");
+}
@@ -0,0 +1,122 @@
+// resp_test.cpp
+#include "resp.hpp"
+#include "test.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace dawn;
+
+static const std::string REPLIES = "+OK\r\n"
+                                   "-ERR wrong type\r\n"
+                                   ":-42\r\n"
+                                   "$5\r\nhe\r\no\r\n"
+                                   "$-1\r\n"
+                                   "*3\r\n$1\r\na\r\n*2\r\n:1\r\n*0\r\n+x\r\n"
+                                   "*-1\r\n";
+
+static bool check_replies(const std::vector<RespValue> &r) {
+    return r.size() == 7 && r[0].is_string("OK") && r[1].type == RespType::ERROR &&
+           r[1].str == "ERR wrong type" && r[2].type == RespType::INTEGER && r[2].integer == -42 &&
+           r[3].type == RespType::BULK && r[3].str == "he\r\no" && r[4].type == RespType::NIL &&
+           r[5].type == RespType::ARRAY && r[5].elements.size() == 3 && r[5].elements[0].is_string("a") &&
+           r[5].elements[1].elements.size() == 2 && r[5].elements[1].elements[0].integer == 1 &&
+           r[5].elements[1].elements[1].type == RespType::ARRAY &&
+           r[5].elements[1].elements[1].elements.empty() && r[5].elements[2].is_string("x") &&
+           r[6].type == RespType::NIL;
+}
+
+static void drain(RespParser &parser, std::vector<RespValue> &out, bool &ok) {
+    RespValue value;
+    RespStatus status;
+    while ((status = parser.next(value)) == RespStatus::OK) out.push_back(value);
+    ok = ok && status == RespStatus::INCOMPLETE;
+}
+
+// A pipeline of replies split in two at every offset parses the same way.
+static void test_every_split() {
+    bool all_ok = true;
+    for (size_t split = 0; split <= REPLIES.size() && all_ok; ++split) {
+        RespParser parser;
+        std::vector<RespValue> replies;
+        bool ok = true;
+        parser.feed(REPLIES.data(), split);
+        drain(parser, replies, ok);
+        parser.feed(REPLIES.data() + split, REPLIES.size() - split);
+        drain(parser, replies, ok);
+        all_ok = ok && check_replies(replies);
+        if (!all_ok) std::fprintf(stderr, "split at %zu\n", split);
+    }
+    CHECK(all_ok);
+}
+
+// One byte at a time: every element of the nested array is resumed, not redone.
+static void test_byte_at_a_time() {
+    RespParser parser;
+    std::vector<RespValue> replies;
+    bool ok = true;
+    for (char c : REPLIES) {
+        parser.feed(&c, 1);
+        drain(parser, replies, ok);
+    }
+    CHECK(ok && check_replies(replies));
+}
+
+// A large array arriving in chunks, with the buffer compacted on the way.
+static void test_large_array_in_chunks() {
+    std::string data = "*1000\r\n";
+    for (int i = 0; i < 1000; ++i) data += "$4\r\n" + std::to_string(1000 + i) + "\r\n";
+    data += ":7\r\n";
+    RespParser parser;
+    std::vector<RespValue> replies;
+    bool ok = true;
+    for (size_t at = 0; at < data.size(); at += 13) {
+        parser.feed(data.data() + at, std::min<size_t>(13, data.size() - at));
+        drain(parser, replies, ok);
+    }
+    CHECK(ok && replies.size() == 2);
+    CHECK(replies.size() == 2 && replies[0].elements.size() == 1000 &&
+          replies[0].elements[999].is_string("1999") && replies[1].integer == 7);
+}
+
+static void test_invalid() {
+    const char *bad[] = {"?x\r\n", ":12a\r\n", "$3\r\nabcd\r\n", "$-2\r\n", "*-2\r\n"};
+    for (const char *text : bad) {
+        RespParser parser;
+        RespValue value;
+        parser.feed(text, std::strlen(text));
+        CHECK(parser.next(value) == RespStatus::INVALID);
+    }
+    std::string deep;
+    for (int i = 0; i <= RespParser::MAX_DEPTH; ++i) deep += "*1\r\n";
+    deep += ":1\r\n";
+    RespParser parser;
+    RespValue value;
+    parser.feed(deep.data(), deep.size());
+    CHECK(parser.next(value) == RespStatus::INVALID);
+
+    // reset() drops a half-parsed reply along with the buffer.
+    parser.reset();
+    parser.feed("*2\r\n:1\r\n", 8);
+    CHECK(parser.next(value) == RespStatus::INCOMPLETE);
+    parser.reset();
+    parser.feed(":5\r\n", 4);
+    CHECK(parser.next(value) == RespStatus::OK && value.type == RespType::INTEGER && value.integer == 5);
+}
+
+static void test_encode() {
+    std::string out;
+    resp_append_command(out, std::vector<std::string_view>{"SET", "k", ""});
+    CHECK(out == "*3\r\n$3\r\nSET\r\n$1\r\nk\r\n$0\r\n\r\n");
+}
+
+int main() {
+    test_every_split();
+    test_byte_at_a_time();
+    test_large_array_in_chunks();
+    test_invalid();
+    test_encode();
+    return dawn_test::finish("resp");
+}
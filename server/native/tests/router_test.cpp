@@ -0,0 +1,118 @@
+// router_test.cpp
+#include "router.hpp"
+#include "test.hpp"
+
+#include <string>
+
+using namespace dawn;
+
+static void test_static_and_params() {
+    Router r;
+    int user = r.insert(HttpMethod::GET, "/api/user/:id", 1);
+    int fresh = r.insert(HttpMethod::GET, "/api/user/new", 2);
+    int edit = r.insert(HttpMethod::POST, "/api/user/:id/edit", 3);
+    int fresh_edit = r.insert(HttpMethod::POST, "/api/user/new/edit", 4);
+    int root = r.insert(HttpMethod::GET, "/", 5);
+
+    RouteMatch m;
+    CHECK(r.match(HttpMethod::GET, "/api/user/42", m) && m.route_id == user);
+    CHECK(m.param_count == 1 && m.params[0] == "42");
+    CHECK(r.match(HttpMethod::GET, "/API/user/new/", m) && m.route_id == fresh && m.param_count == 0);
+    CHECK(r.match(HttpMethod::POST, "/api/user/New/edit", m) && m.route_id == fresh_edit);
+    CHECK(r.match(HttpMethod::POST, "/api/user/xY/edit?x=1", m) && m.route_id == edit && m.params[0] == "xY");
+    CHECK(!r.match(HttpMethod::PUT, "/api/user/42", m));
+    CHECK(!r.match(HttpMethod::GET, "/api/user/new/x", m));
+    CHECK(r.match(HttpMethod::GET, "/", m) && m.route_id == root);
+    CHECK(r.match(HttpMethod::GET, "", m) && m.route_id == root);
+}
+
+// Static segments compare case-insensitively and empty segments are skipped,
+// which is what the guard prefix matcher has to agree with.
+static void test_normalisation() {
+    Router r;
+    int admin = r.insert(HttpMethod::GET, "/admin/:page", 1);
+    RouteMatch m;
+    CHECK(r.match(HttpMethod::GET, "/ADMIN/x", m) && m.route_id == admin);
+    CHECK(r.match(HttpMethod::GET, "//admin//x", m) && m.route_id == admin && m.params[0] == "x");
+    CHECK(!r.match(HttpMethod::GET, "/adminx/x", m));
+}
+
+static void test_splat() {
+    Router r;
+    int files = r.insert(HttpMethod::GET, "/static/*", 1);
+    RouteMatch m;
+    CHECK(r.match(HttpMethod::GET, "/static/css/a.css", m) && m.route_id == files && m.splat == "css/a.css");
+    CHECK(!r.match(HttpMethod::GET, "/static", m));
+}
+
+static void test_replace_and_backtracking() {
+    Router r;
+    int replaced = 0;
+    int first = r.insert(HttpMethod::GET, "/Api/Hello", 1, &replaced);
+    CHECK(replaced == Router::NO_ROUTE);
+    int second = r.insert(HttpMethod::GET, "/api/hello", 2, &replaced);
+    CHECK(replaced == first);
+    RouteMatch m;
+    CHECK(r.match(HttpMethod::GET, "/api/hello", m) && m.route_id == second);
+
+    // GET /a/new has no static GET route, so it falls back to the parameter.
+    Router b;
+    int param = b.insert(HttpMethod::GET, "/a/:id", 1);
+    b.insert(HttpMethod::POST, "/a/new", 2);
+    CHECK(b.match(HttpMethod::GET, "/a/new", m) && m.route_id == param && m.params[0] == "new");
+}
+
+static void test_too_many_params_leaves_no_nodes() {
+    Router r;
+    std::string pattern = "/p";
+    for (size_t i = 0; i <= RouteMatch::MAX_PARAMS; ++i) pattern += "/:p" + std::to_string(i);
+    size_t before = r.node_count();
+    CHECK(r.insert(HttpMethod::GET, pattern, 1) == Router::NO_ROUTE);
+    CHECK(r.node_count() == before);
+    CHECK(r.size() == 0);
+
+    // Parameters after a splat are ignored, so they do not count either.
+    std::string after_splat = "/q/*";
+    for (size_t i = 0; i <= RouteMatch::MAX_PARAMS; ++i) after_splat += "/:p" + std::to_string(i);
+    CHECK(r.insert(HttpMethod::GET, after_splat, 1) != Router::NO_ROUTE);
+}
+
+// Guards select requests with path_under_prefix; every spelling the router would
+// route to a guarded path must be covered.
+static void test_path_under_prefix() {
+    CHECK(path_under_prefix("/admin/x", "/admin"));
+    CHECK(path_under_prefix("/ADMIN/x", "/admin"));
+    CHECK(path_under_prefix("//admin/x", "/admin"));
+    CHECK(path_under_prefix("/admin//x/", "/admin/"));
+    CHECK(path_under_prefix("/admin", "/admin"));
+    CHECK(path_under_prefix("/admin/", "//admin"));
+    CHECK(!path_under_prefix("/apiary", "/api"));
+    CHECK(!path_under_prefix("/api", "/api/v1"));
+    CHECK(!path_under_prefix("/public/admin", "/admin"));
+    CHECK(path_under_prefix("/users/42/settings", "/users/:id/settings"));
+    CHECK(path_under_prefix("/files/a/b", "/files/*"));
+    CHECK(path_under_prefix("/anything", "") && path_under_prefix("/anything", "/"));
+
+    // The guard and the router agree on what "/ADMIN//x" is.
+    Router r;
+    int id = r.insert(HttpMethod::GET, "/admin/x", 7);
+    RouteMatch m;
+    CHECK(r.match(HttpMethod::GET, "/ADMIN//x", m) && m.route_id == id && path_under_prefix("/ADMIN//x", "/admin"));
+}
+
+static void test_parse_method() {
+    CHECK(parse_method("GET") == HttpMethod::GET);
+    CHECK(parse_method("delete") == HttpMethod::DEL);
+    CHECK(parse_method("FOO") == HttpMethod::UNKNOWN);
+}
+
+int main() {
+    test_static_and_params();
+    test_normalisation();
+    test_splat();
+    test_replace_and_backtracking();
+    test_too_many_params_leaves_no_nodes();
+    test_path_under_prefix();
+    test_parse_method();
+    return dawn_test::finish("router");
+}
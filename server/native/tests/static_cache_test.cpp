@@ -0,0 +1,113 @@
+// static_cache_test.cpp
+#include "static_cache.hpp"
+#include "test.hpp"
+
+#include <fstream>
+#include <string>
+
+using namespace dawn;
+
+static std::string temp_dir() {
+    char dir[] = "/tmp/dawn-static-test-XXXXXX";
+    return ::mkdtemp(dir) ? std::string(dir) : std::string("/tmp");
+}
+
+static void write_file(const std::string &path, const std::string &contents) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out << contents;
+}
+
+static void test_etag_matches() {
+    CHECK(etag_matches("\"abc\"", "\"abc\""));
+    CHECK(etag_matches("W/\"abc\"", "\"abc\""));
+    CHECK(etag_matches("\"x\", \"abc\"", "\"abc\""));
+    CHECK(etag_matches("*", "\"abc\""));
+    CHECK(etag_matches("  * ", "\"abc\""));
+    CHECK(!etag_matches("\"x\", *", "\"abc\""));
+    CHECK(!etag_matches("\"a*c\"", "\"abc\""));
+    CHECK(!etag_matches("\"abd\"", "\"abc\""));
+    CHECK(!etag_matches("", "\"abc\""));
+}
+
+static void test_parse_range() {
+    size_t first = 0, last = 0;
+    CHECK(parse_range("bytes=0-9", 100, first, last) == RangeResult::SATISFIABLE && first == 0 && last == 9);
+    CHECK(parse_range("bytes=90-", 100, first, last) == RangeResult::SATISFIABLE && first == 90 && last == 99);
+    CHECK(parse_range("bytes=-10", 100, first, last) == RangeResult::SATISFIABLE && first == 90 && last == 99);
+    CHECK(parse_range("bytes=50-500", 100, first, last) == RangeResult::SATISFIABLE && last == 99);
+    CHECK(parse_range("bytes=100-", 100, first, last) == RangeResult::UNSATISFIABLE);
+    CHECK(parse_range("bytes=0-1,5-6", 100, first, last) == RangeResult::NONE);
+    CHECK(parse_range("bytes=9-1", 100, first, last) == RangeResult::NONE);
+    CHECK(parse_range("items=0-1", 100, first, last) == RangeResult::NONE);
+}
+
+static void test_decode_static_path() {
+    std::string out;
+    CHECK(decode_static_path("/a%20b/c.txt", out) && out == "/a b/c.txt");
+    CHECK(!decode_static_path("/../etc/passwd", out));
+    CHECK(!decode_static_path("/a/%2e%2e/b", out));
+    CHECK(!decode_static_path("/a%00b", out));
+    CHECK(!decode_static_path("/a\\b", out));
+    CHECK(decode_static_path("/a..b/", out));
+}
+
+static void test_in_memory_and_streamed() {
+    std::string dir = temp_dir();
+    StaticOptions options;
+    options.stream_threshold = 1024;
+    StaticCache cache(options);
+
+    write_file(dir + "/small.txt", "small");
+    auto small = cache.get(dir + "/small.txt");
+    CHECK(small && !small->streamed() && small->body() == "small");
+    CHECK(cache.get(dir + "/small.txt") == small);
+
+    std::string big(4096, 'b');
+    big[4095] = 'z';
+    write_file(dir + "/big.bin", big);
+    auto file = cache.get(dir + "/big.bin");
+    CHECK(file && file->streamed() && file->size == big.size());
+    char buffer[8];
+    CHECK(file && file->read(4090, buffer, 6) == 6 && std::string(buffer, 6) == "bbbbbz");
+
+    // Truncated behind the cache's back: reads come up short instead of faulting,
+    // and the next get() notices and reloads.
+    CHECK(::truncate((dir + "/big.bin").c_str(), 2000) == 0);
+    CHECK(file && file->read(4090, buffer, 6) == 0);
+    auto reloaded = cache.get(dir + "/big.bin");
+    CHECK(reloaded && reloaded != file && reloaded->size == 2000);
+
+    CHECK(!cache.get(dir + "/missing"));
+    CHECK(!cache.get(dir)); // a directory is not a file
+
+    ::unlink((dir + "/small.txt").c_str());
+    ::unlink((dir + "/big.bin").c_str());
+    ::rmdir(dir.c_str());
+}
+
+static void test_is_directory() {
+    std::string dir = temp_dir();
+    write_file(dir + "/index.html", "<p>");
+    CHECK(is_directory(dir));
+    CHECK(!is_directory(dir + "/index.html"));
+    CHECK(!is_directory(dir + "/index.html/index.html"));
+    CHECK(!is_directory(dir + "/missing"));
+    ::unlink((dir + "/index.html").c_str());
+    ::rmdir(dir.c_str());
+}
+
+static void test_mime_type() {
+    CHECK(mime_type("/a/b.HTML") == "text/html; charset=utf-8");
+    CHECK(mime_type("/a.b/c") == "application/octet-stream");
+    CHECK(mime_type("x.unknown") == "application/octet-stream");
+}
+
+int main() {
+    test_etag_matches();
+    test_parse_range();
+    test_decode_static_path();
+    test_in_memory_and_streamed();
+    test_is_directory();
+    test_mime_type();
+    return dawn_test::finish("static_cache");
+}
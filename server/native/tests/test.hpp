@@ -0,0 +1,39 @@
+// test.hpp
+// The few helpers the native unit tests share: CHECK records a failure and
+// carries on, so one run reports every broken expectation; finish() prints the
+// tally and is main's return value.
+#pragma once
+
+#include <cstdio>
+
+namespace dawn_test {
+
+inline int &failures() {
+    static int count = 0;
+    return count;
+}
+
+inline int &checks() {
+    static int count = 0;
+    return count;
+}
+
+inline int finish(const char *name) {
+    if (failures() == 0) {
+        std::printf("%s: %d checks passed\n", name, checks());
+        return 0;
+    }
+    std::printf("%s: %d of %d checks FAILED\n", name, failures(), checks());
+    return 1;
+}
+
+} // namespace dawn_test
+
+#define CHECK(cond)                                                                   \
+    do {                                                                              \
+        ++dawn_test::checks();                                                        \
+        if (!(cond)) {                                                                \
+            ++dawn_test::failures();                                                  \
+            std::fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+        }                                                                             \
+    } while (0)
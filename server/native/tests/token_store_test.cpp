@@ -0,0 +1,95 @@
+// token_store_test.cpp
+#include "token_store.hpp"
+#include "test.hpp"
+
+#include <string>
+
+using namespace dawn;
+
+static std::string temp_log() {
+    char dir[] = "/tmp/dawn-token-test-XXXXXX";
+    return std::string(::mkdtemp(dir) ? dir : "/tmp") + "/tokens.log";
+}
+
+static TokenSession session(const std::string &user, const std::string &hash, int64_t issued = 1000) {
+    TokenSession s;
+    s.user_id = user;
+    s.token_hash = hash;
+    s.device_id = "dev";
+    s.issued = issued;
+    return s;
+}
+
+static void cleanup(const std::string &path) {
+    ::unlink(path.c_str());
+    ::unlink((path + ".tmp").c_str());
+    ::rmdir(path.substr(0, path.rfind('/')).c_str());
+}
+
+static void test_save_verify_revoke_replay() {
+    std::string path = temp_log();
+    {
+        TokenStore store(path, 0);
+        CHECK(store.open(1000));
+        CHECK(store.save(session("u1", "h1"), false, 1000));
+        CHECK(store.save(session("u1", "h2"), false, 1000));
+        CHECK(store.save(session("u2", "h3"), false, 1000));
+        CHECK(store.verify("u1", "h1", 1000) && !store.verify("u2", "h1", 1000));
+        CHECK(store.revoke("u1", "h1", 1000) && !store.verify("u1", "h1", 1000));
+    }
+    TokenStore reopened(path, 0);
+    CHECK(reopened.open(1000));
+    CHECK(reopened.size() == 2 && reopened.verify("u1", "h2", 1000) && !reopened.verify("u1", "h1", 1000));
+    cleanup(path);
+}
+
+static void test_max_age() {
+    std::string path = temp_log();
+    TokenStore store(path, 60);
+    CHECK(store.open(1000));
+    store.save(session("u1", "h1", 1000), false, 1000);
+    CHECK(store.verify("u1", "h1", 1059));
+    CHECK(store.sweep(1060) == 1 && store.size() == 0);
+    cleanup(path);
+}
+
+// Churn well past the compaction threshold: compactions run in the background
+// while saves and revokes keep coming, and whatever the log ends up as replays
+// to exactly the live sessions.
+static void test_background_compaction_keeps_every_record() {
+    std::string path = temp_log();
+    const int n = 5000;
+    {
+        TokenStore store(path, 0);
+        CHECK(store.open(1000));
+        for (int i = 0; i < n; ++i) {
+            std::string hash = "h" + std::to_string(i);
+            store.save(session("u" + std::to_string(i % 10), hash), false, 1000);
+            if (i % 4 != 0) store.revoke("u" + std::to_string(i % 10), hash, 1000);
+        }
+        CHECK(store.size() == n / 4);
+        CHECK(store.take_error().empty());
+    } // the destructor waits for a compaction still running
+    {
+        TokenStore reopened(path, 0);
+        CHECK(reopened.open(1000));
+        CHECK(reopened.size() == n / 4);
+        bool all = true;
+        for (int i = 0; i < n; i += 4) all = all && reopened.verify("u" + std::to_string(i % 10), "h" + std::to_string(i), 1000);
+        CHECK(all);
+        CHECK(reopened.compact());
+        reopened.save(session("late", "hl"), false, 1000);
+    }
+    struct stat st;
+    CHECK(::stat((path + ".tmp").c_str(), &st) != 0); // no leftover temp file
+    TokenStore final_store(path, 0);
+    CHECK(final_store.open(1000) && final_store.size() == n / 4 + 1 && final_store.verify("late", "hl", 1000));
+    cleanup(path);
+}
+
+int main() {
+    test_save_verify_revoke_replay();
+    test_max_age();
+    test_background_compaction_keeps_every_record();
+    return dawn_test::finish("token_store");
+}
@@ -0,0 +1,538 @@
+// token_store.hpp
+// Refresh-token sessions kept in memory and persisted as an append-only log.
+// Every change (a save, a revoke) appends one checksummed record; opening the
+// store replays the log, dropping a torn record at its tail. Once the log holds
+// many more records than there are live sessions it is compacted: the live
+// sessions are serialised under the lock, a background thread writes and syncs
+// them to a fresh file, and the lock is only taken again to add the records
+// appended meanwhile and rename the new file over the old one.
+//
+// Sessions are indexed by token hash (SHA-256 of the token, never the token
+// itself) and by user id. Each has a deadline, the earlier of the token's exp
+// and issued + max_age; deadlines sit in a hashed timer wheel of one-second
+// slots, so expiring sessions costs the slots that have come due rather than a
+// scan of every session. Wheel entries are dropped lazily: a revoked session's
+// entry is recognised by its stale generation.
+//
+// One store is shared by every worker thread; all public methods lock.
+#pragma once
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace dawn {
+
+struct TokenSession {
+    std::string user_id;
+    std::string token_hash; // raw SHA-256 of the refresh token
+    std::string device_id;
+    std::string ip;
+    std::string agent;
+    int64_t issued = 0;   // unix seconds
+    int64_t expires = 0;  // the token's exp; 0 = none
+    int64_t deadline = 0; // when the session is dropped; 0 = never
+};
+
+class TokenStore {
+public:
+    static constexpr uint32_t WHEEL_SLOTS = 4096;
+    static constexpr size_t COMPACT_MIN_RECORDS = 1024;
+
+    // max_age caps a session's life after it was issued (0 = no cap).
+    TokenStore(std::string path, int64_t max_age) : path_(std::move(path)), max_age_(max_age), wheel_(WHEEL_SLOTS) {}
+
+    ~TokenStore() {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            compacted_.wait(lock, [this] { return !compacting_; });
+        }
+        if (compactor_.joinable()) compactor_.join();
+        if (fd_ >= 0) ::close(fd_);
+    }
+
+    TokenStore(const TokenStore &) = delete;
+    TokenStore &operator=(const TokenStore &) = delete;
+
+    // Replays the log (creating it if missing). Sessions past their deadline at
+    // `now` are skipped.
+    bool open(int64_t now) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+        if (fd_ < 0) return fail("open");
+
+        std::string data;
+        char chunk[65536];
+        ssize_t n;
+        while ((n = ::read(fd_, chunk, sizeof(chunk))) > 0) data.append(chunk, static_cast<size_t>(n));
+        if (n < 0) return fail("read");
+
+        last_tick_ = now;
+        if (data.empty()) return write_all(fd_, std::string_view(MAGIC, MAGIC_SIZE)) || fail("write");
+        if (data.compare(0, MAGIC_SIZE, MAGIC, MAGIC_SIZE) != 0) {
+            error_ = path_ + " is not a token log";
+            return false;
+        }
+
+        size_t pos = MAGIC_SIZE;
+        std::string_view body;
+        while (next_record(data, pos, body)) {
+            replay(body);
+            ++log_records_;
+        }
+        // A crash mid-append leaves a partial record; cut it so new ones follow a good one.
+        if (pos < data.size() && ::ftruncate(fd_, static_cast<off_t>(pos)) != 0) return fail("truncate");
+        for (size_t id = 0; id < slots_.size(); ++id) {
+            if (slots_[id].live && expired(slots_[id].session, now)) remove(static_cast<uint32_t>(id));
+        }
+        maybe_compact();
+        return true;
+    }
+
+    // Adds a session, replacing one with the same token and, with replace_user,
+    // every other session of the user.
+    bool save(TokenSession session, bool replace_user, int64_t now) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        advance(now);
+        std::string body;
+        body.push_back(SAVE);
+        body.push_back(replace_user ? 1 : 0);
+        put_session(body, session);
+        insert(std::move(session), replace_user);
+        return append(body);
+    }
+
+    bool verify(std::string_view user_id, std::string_view token_hash, int64_t now) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        advance(now);
+        auto it = by_hash_.find(std::string(token_hash));
+        if (it == by_hash_.end()) return false;
+        const TokenSession &session = slots_[it->second].session;
+        return session.user_id == user_id && !expired(session, now);
+    }
+
+    // True if the token was a session of user_id.
+    bool revoke(std::string_view user_id, std::string_view token_hash, int64_t now) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        advance(now);
+        auto it = by_hash_.find(std::string(token_hash));
+        if (it == by_hash_.end() || slots_[it->second].session.user_id != user_id) return false;
+        remove(it->second);
+        std::string body;
+        body.push_back(REVOKE);
+        put_string(body, user_id);
+        put_string(body, token_hash);
+        append(body);
+        return true;
+    }
+
+    // Removes the user's sessions on device_id; returns how many there were.
+    size_t revoke_device(std::string_view user_id, std::string_view device_id, int64_t now) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        advance(now);
+        size_t removed = remove_device(user_id, device_id);
+        if (removed == 0) return 0;
+        std::string body;
+        body.push_back(REVOKE_DEVICE);
+        put_string(body, user_id);
+        put_string(body, device_id);
+        append(body);
+        return removed;
+    }
+
+    std::vector<TokenSession> sessions(std::string_view user_id, int64_t now) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        advance(now);
+        std::vector<TokenSession> out;
+        auto it = by_user_.find(std::string(user_id));
+        if (it == by_user_.end()) return out;
+        for (uint32_t id : it->second) out.push_back(slots_[id].session);
+        return out;
+    }
+
+    // Drops every session whose deadline has passed; returns how many.
+    size_t sweep(int64_t now) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return advance(now);
+    }
+
+    // Compacts now and waits for it to finish (a compaction already running is
+    // waited for first); false if it failed.
+    bool compact() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        compacted_.wait(lock, [this] { return !compacting_; });
+        if (!start_compaction()) return false;
+        compacted_.wait(lock, [this] { return !compacting_; });
+        return compaction_ok_;
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return by_hash_.size();
+    }
+
+    // The last I/O failure, cleared when read; in-memory state stays correct when
+    // the log cannot be written, it just will not survive a restart.
+    std::string take_error() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return std::exchange(error_, std::string());
+    }
+
+private:
+    static constexpr const char *MAGIC = "DAWNTOK1";
+    static constexpr size_t MAGIC_SIZE = 8;
+    static constexpr uint32_t MAX_RECORD = 1 << 20;
+
+    enum Op : char { SAVE = 1, REVOKE = 2, REVOKE_DEVICE = 3 };
+
+    struct Slot {
+        TokenSession session;
+        uint32_t generation = 0;
+        bool live = false;
+    };
+
+    struct Timer {
+        uint32_t id;
+        uint32_t generation;
+    };
+
+    bool expired(const TokenSession &session, int64_t now) const {
+        return session.deadline != 0 && session.deadline <= now;
+    }
+
+    int64_t deadline_of(const TokenSession &session) const {
+        int64_t deadline = session.expires;
+        if (max_age_ > 0) {
+            int64_t cap = session.issued + max_age_;
+            deadline = deadline == 0 ? cap : std::min(deadline, cap);
+        }
+        return deadline;
+    }
+
+    // Index maintenance; none of these touch the log.
+
+    void insert(TokenSession session, bool replace_user) {
+        if (replace_user) {
+            auto user = by_user_.find(session.user_id);
+            if (user != by_user_.end()) {
+                std::vector<uint32_t> ids = user->second;
+                for (uint32_t id : ids) remove(id);
+            }
+        }
+        auto existing = by_hash_.find(session.token_hash);
+        if (existing != by_hash_.end()) remove(existing->second);
+
+        session.deadline = deadline_of(session);
+        uint32_t id;
+        if (!free_.empty()) {
+            id = free_.back();
+            free_.pop_back();
+        } else {
+            id = static_cast<uint32_t>(slots_.size());
+            slots_.emplace_back();
+        }
+        Slot &slot = slots_[id];
+        slot.session = std::move(session);
+        slot.live = true;
+        by_hash_.emplace(slot.session.token_hash, id);
+        by_user_[slot.session.user_id].push_back(id);
+        if (slot.session.deadline != 0) {
+            wheel_[static_cast<uint64_t>(slot.session.deadline) % WHEEL_SLOTS].push_back({id, slot.generation});
+        }
+    }
+
+    void remove(uint32_t id) {
+        Slot &slot = slots_[id];
+        by_hash_.erase(slot.session.token_hash);
+        auto user = by_user_.find(slot.session.user_id);
+        if (user != by_user_.end()) {
+            std::vector<uint32_t> &ids = user->second;
+            auto it = std::find(ids.begin(), ids.end(), id);
+            if (it != ids.end()) {
+                *it = ids.back();
+                ids.pop_back();
+            }
+            if (ids.empty()) by_user_.erase(user);
+        }
+        slot.session = TokenSession();
+        slot.live = false;
+        ++slot.generation;
+        free_.push_back(id);
+    }
+
+    size_t remove_device(std::string_view user_id, std::string_view device_id) {
+        auto user = by_user_.find(std::string(user_id));
+        if (user == by_user_.end()) return 0;
+        std::vector<uint32_t> matching;
+        for (uint32_t id : user->second) {
+            if (slots_[id].session.device_id == device_id) matching.push_back(id);
+        }
+        for (uint32_t id : matching) remove(id);
+        return matching.size();
+    }
+
+    // Runs the wheel's slots from the last tick up to now. A jump of a full turn
+    // or more visits each slot once.
+    size_t advance(int64_t now) {
+        if (now <= last_tick_) return 0;
+        int64_t from = now - last_tick_ >= WHEEL_SLOTS ? now - WHEEL_SLOTS + 1 : last_tick_ + 1;
+        last_tick_ = now;
+        size_t removed = 0;
+        for (int64_t tick = from; tick <= now; ++tick) {
+            std::vector<Timer> &bucket = wheel_[static_cast<uint64_t>(tick) % WHEEL_SLOTS];
+            size_t kept = 0;
+            for (const Timer &timer : bucket) {
+                Slot &slot = slots_[timer.id];
+                if (!slot.live || slot.generation != timer.generation) continue;
+                if (expired(slot.session, now)) {
+                    remove(timer.id);
+                    ++removed;
+                } else {
+                    bucket[kept++] = timer; // due on a later turn
+                }
+            }
+            bucket.resize(kept);
+        }
+        // Expiry is not logged; replay skips sessions past their deadline instead.
+        if (removed > 0) maybe_compact();
+        return removed;
+    }
+
+    void replay(std::string_view body) {
+        size_t pos = 1;
+        std::string user_id, value;
+        switch (body[0]) {
+        case SAVE: {
+            if (body.size() < 2) return;
+            bool replace_user = body[1] != 0;
+            pos = 2;
+            TokenSession session;
+            if (!get_session(body, pos, session)) return;
+            insert(std::move(session), replace_user);
+            break;
+        }
+        case REVOKE: {
+            if (!get_string(body, pos, user_id) || !get_string(body, pos, value)) return;
+            auto it = by_hash_.find(value);
+            if (it != by_hash_.end() && slots_[it->second].session.user_id == user_id) remove(it->second);
+            break;
+        }
+        case REVOKE_DEVICE:
+            if (!get_string(body, pos, user_id) || !get_string(body, pos, value)) return;
+            remove_device(user_id, value);
+            break;
+        default:
+            break;
+        }
+    }
+
+    // Log I/O. A record is [u32 length][u32 checksum][body], little-endian.
+
+    static uint32_t checksum(std::string_view body) {
+        uint32_t h = 2166136261u; // FNV-1a
+        for (unsigned char c : body) {
+            h ^= c;
+            h *= 16777619u;
+        }
+        return h;
+    }
+
+    static void put_u32(std::string &out, uint32_t v) {
+        for (int i = 0; i < 4; ++i) out.push_back(static_cast<char>((v >> (8 * i)) & 0xff));
+    }
+
+    static void put_i64(std::string &out, int64_t v) {
+        uint64_t u = static_cast<uint64_t>(v);
+        for (int i = 0; i < 8; ++i) out.push_back(static_cast<char>((u >> (8 * i)) & 0xff));
+    }
+
+    static void put_string(std::string &out, std::string_view s) {
+        put_u32(out, static_cast<uint32_t>(s.size()));
+        out.append(s);
+    }
+
+    static void put_session(std::string &out, const TokenSession &s) {
+        put_string(out, s.user_id);
+        put_string(out, s.token_hash);
+        put_string(out, s.device_id);
+        put_string(out, s.ip);
+        put_string(out, s.agent);
+        put_i64(out, s.issued);
+        put_i64(out, s.expires);
+    }
+
+    static uint32_t get_u32(std::string_view in, size_t pos) {
+        uint32_t v = 0;
+        for (int i = 0; i < 4; ++i) v |= static_cast<uint32_t>(static_cast<uint8_t>(in[pos + i])) << (8 * i);
+        return v;
+    }
+
+    static bool get_i64(std::string_view in, size_t &pos, int64_t &out) {
+        if (in.size() - pos < 8) return false;
+        uint64_t v = 0;
+        for (int i = 0; i < 8; ++i) v |= static_cast<uint64_t>(static_cast<uint8_t>(in[pos + i])) << (8 * i);
+        out = static_cast<int64_t>(v);
+        pos += 8;
+        return true;
+    }
+
+    static bool get_string(std::string_view in, size_t &pos, std::string &out) {
+        if (in.size() - pos < 4) return false;
+        uint32_t length = get_u32(in, pos);
+        pos += 4;
+        if (in.size() - pos < length) return false;
+        out.assign(in.data() + pos, length);
+        pos += length;
+        return true;
+    }
+
+    static bool get_session(std::string_view in, size_t &pos, TokenSession &s) {
+        return get_string(in, pos, s.user_id) && get_string(in, pos, s.token_hash) &&
+               get_string(in, pos, s.device_id) && get_string(in, pos, s.ip) &&
+               get_string(in, pos, s.agent) && get_i64(in, pos, s.issued) && get_i64(in, pos, s.expires);
+    }
+
+    // Reads the record at pos into body and moves pos past it; false at the end
+    // of the log or at a torn or corrupt record.
+    static bool next_record(std::string_view data, size_t &pos, std::string_view &body) {
+        if (data.size() - pos < 8) return false;
+        uint32_t length = get_u32(data, pos);
+        uint32_t sum = get_u32(data, pos + 4);
+        if (length == 0 || length > MAX_RECORD || data.size() - pos - 8 < length) return false;
+        body = data.substr(pos + 8, length);
+        if (checksum(body) != sum) return false;
+        pos += 8 + length;
+        return true;
+    }
+
+    static void frame(std::string &out, std::string_view body) {
+        put_u32(out, static_cast<uint32_t>(body.size()));
+        put_u32(out, checksum(body));
+        out.append(body);
+    }
+
+    bool fail(const char *what) {
+        error_ = std::string("token log ") + what + " failed for " + path_ + ": " + std::strerror(errno);
+        return false;
+    }
+
+    static bool write_all(int fd, std::string_view data) {
+        while (!data.empty()) {
+            ssize_t n = ::write(fd, data.data(), data.size());
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            data.remove_prefix(static_cast<size_t>(n));
+        }
+        return true;
+    }
+
+    // One write per record, so a crash can at worst leave a torn tail.
+    bool append(std::string_view body) {
+        if (fd_ < 0) return false;
+        std::string record;
+        frame(record, body);
+        if (!write_all(fd_, record)) return fail("write");
+        ++log_records_;
+        if (compacting_) {
+            // The snapshot being written predates this record; it follows it over.
+            compact_tail_ += record;
+            ++compact_tail_records_;
+        }
+        maybe_compact();
+        return true;
+    }
+
+    void maybe_compact() {
+        if (!compacting_ && log_records_ > COMPACT_MIN_RECORDS && log_records_ > 2 * by_hash_.size()) {
+            start_compaction();
+        }
+    }
+
+    // Serialises the live sessions and hands them to a background thread that
+    // writes them to path.tmp. Called with the lock held and no compaction running.
+    bool start_compaction() {
+        if (fd_ < 0) return false;
+        // The previous compactor has left its locked section; it is only exiting.
+        if (compactor_.joinable()) compactor_.join();
+        std::string data(MAGIC, MAGIC_SIZE);
+        std::string body;
+        for (const Slot &slot : slots_) {
+            if (!slot.live) continue;
+            body.assign(1, SAVE);
+            body.push_back(0);
+            put_session(body, slot.session);
+            frame(data, body);
+        }
+        compacting_ = true;
+        compact_tail_.clear();
+        compact_tail_records_ = 0;
+        size_t records = by_hash_.size();
+        compactor_ = std::thread([this, data = std::move(data), records] { finish_compaction(data, records); });
+        return true;
+    }
+
+    // On the compactor thread: writes and syncs the snapshot without the lock, then
+    // under it adds the records appended meanwhile and renames the file over the log.
+    void finish_compaction(const std::string &data, size_t records) {
+        std::string tmp_path = path_ + ".tmp";
+        int tmp = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+        bool ok = tmp >= 0 && write_all(tmp, data) && ::fsync(tmp) == 0;
+        int error = errno;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        ok = ok && write_all(tmp, compact_tail_) && ::rename(tmp_path.c_str(), path_.c_str()) == 0;
+        if (!ok) error = errno;
+        if (ok) {
+            // tmp now is the log, positioned at its end.
+            ::close(fd_);
+            fd_ = tmp;
+            log_records_ = records + compact_tail_records_;
+        } else {
+            errno = error;
+            fail("compaction");
+            if (tmp >= 0) ::close(tmp);
+            ::unlink(tmp_path.c_str());
+        }
+        compact_tail_.clear();
+        compacting_ = false;
+        compaction_ok_ = ok;
+        compacted_.notify_all();
+    }
+
+    std::mutex mutex_;
+    std::condition_variable compacted_; // signalled when a compaction ends
+    std::thread compactor_;
+    bool compacting_ = false;
+    bool compaction_ok_ = false;
+    std::string compact_tail_; // records appended while compacting, framed
+    size_t compact_tail_records_ = 0;
+    std::string path_;
+    int64_t max_age_;
+    int fd_ = -1;
+    std::string error_;
+    size_t log_records_ = 0;
+    int64_t last_tick_ = 0;
+
+    std::vector<Slot> slots_;
+    std::vector<uint32_t> free_;
+    std::unordered_map<std::string, uint32_t> by_hash_;
+    std::unordered_map<std::string, std::vector<uint32_t>> by_user_;
+    std::vector<std::vector<Timer>> wheel_;
+};
+
+} // namespace dawn
@@ -0,0 +1,114 @@
+// uuid.hpp
+// RFC 9562 UUIDs from a per-thread xoshiro256** generator, formatted straight
+// into a fixed 36-byte buffer. v4 is fully random; v7 puts the Unix time in ms
+// first and a per-thread counter after it, so ids from one thread sort in
+// creation order.
+//
+// xoshiro is fast, not cryptographic: use these for ids, never for secrets.
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <random>
+#include <string>
+
+namespace dawn {
+
+constexpr size_t UUID_LENGTH = 36;
+
+class Xoshiro256 {
+public:
+    Xoshiro256() {
+        std::random_device device;
+        uint64_t seed = (uint64_t(device()) << 32) ^ device();
+        for (auto &word : state_) word = splitmix64(seed);
+    }
+
+    uint64_t next() {
+        uint64_t result = rotl(state_[1] * 5, 7) * 9;
+        uint64_t t = state_[1] << 17;
+        state_[2] ^= state_[0];
+        state_[3] ^= state_[1];
+        state_[1] ^= state_[2];
+        state_[0] ^= state_[3];
+        state_[2] ^= t;
+        state_[3] = rotl(state_[3], 45);
+        return result;
+    }
+
+private:
+    static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+    static uint64_t splitmix64(uint64_t &x) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+
+    uint64_t state_[4];
+};
+
+inline Xoshiro256 &thread_rng() {
+    static thread_local Xoshiro256 rng;
+    return rng;
+}
+
+// Writes 16 bytes as 8-4-4-4-12 lowercase hex; `out` needs UUID_LENGTH bytes.
+inline void format_uuid(uint64_t high, uint64_t low, char *out) {
+    static const char digits[] = "0123456789abcdef";
+    int bit = 60;
+    for (size_t i = 0; i < UUID_LENGTH; ++i) {
+        if (i == 8 || i == 13 || i == 18 || i == 23) {
+            out[i] = '-';
+            continue;
+        }
+        uint64_t word = bit >= 0 ? high : low;
+        int shift = bit >= 0 ? bit : bit + 64;
+        out[i] = digits[(word >> shift) & 0xf];
+        bit -= 4;
+    }
+}
+
+inline void uuid_v4(char *out) {
+    Xoshiro256 &rng = thread_rng();
+    uint64_t high = (rng.next() & ~0xf000ull) | 0x4000ull;                           // version 4
+    uint64_t low = (rng.next() & 0x3fffffffffffffffull) | 0x8000000000000000ull;    // variant 10
+    format_uuid(high, low, out);
+}
+
+// 48-bit ms timestamp, 12-bit counter (restarted at a random value each ms and
+// carried into the timestamp if it overflows), 62 random bits.
+inline void uuid_v7(char *out) {
+    static thread_local uint64_t last_ms = 0;
+    static thread_local uint64_t counter = 0;
+    Xoshiro256 &rng = thread_rng();
+
+    uint64_t now = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count());
+    if (now > last_ms) {
+        last_ms = now;
+        counter = rng.next() & 0x7ff; // leave headroom before the 12-bit field overflows
+    } else if (++counter > 0xfff) {
+        ++last_ms;
+        counter = 0;
+    }
+
+    uint64_t high = ((last_ms & 0xffffffffffffull) << 16) | 0x7000ull | counter;
+    uint64_t low = (rng.next() & 0x3fffffffffffffffull) | 0x8000000000000000ull;
+    format_uuid(high, low, out);
+}
+
+inline std::string uuid_v4() {
+    std::string id(UUID_LENGTH, '\0');
+    uuid_v4(&id[0]);
+    return id;
+}
+
+inline std::string uuid_v7() {
+    std::string id(UUID_LENGTH, '\0');
+    uuid_v7(&id[0]);
+    return id;
+}
+
+} // namespace dawn
@@ -1,33 +1,106 @@
 #include <uWebSockets/App.h>
 #include <lua.hpp>
+#include <algorithm>
 #include <iostream>
 #include <unordered_map>
 #include <memory>
-#include <mutex>
+#include <cassert>
 #include <string_view>
 #include <vector>
+#include <deque>
 #include <functional>
 #include <string> // For std::to_string
+#include <charconv> // For std::from_chars
 #include <sys/socket.h> // For sockaddr, sockaddr_storage
 #include <netdb.h>
-#include <random>     // Include for random number generation
-#include <sstream>    // Include for stringstream
-#include <iomanip>
-#include <fstream>    // For file operations
 #include <filesystem> // For path manipulation (C++17)
+#include <thread>     // For worker threads (run_workers)
+#include <mutex>
+#include <map>
+#include <chrono>
+#include <ctime>
+#include <cctype>
+#include <climits>
+#include <cmath>
+#include <cstdlib>    // For std::atexit (flush_logs)
+#include <dlfcn.h>    // For resolving luv_set_loop in worker states
+
+#ifdef LIBUS_USE_LIBUV
+#include <uv.h>
+#endif
+
+#include "native/access_rules.hpp"
+#include "native/async_log.hpp"
+#include "native/handle_pool.hpp"
+#include "native/json.hpp"
+#include "native/jwt.hpp"
+#include "native/multipart.hpp"
+#include "native/presence_store.hpp"
+#include "native/rate_limiter.hpp"
+#include "native/resp.hpp"
+#include "native/router.hpp"
+#include "native/static_cache.hpp"
+#include "native/token_store.hpp"
+#include "native/uuid.hpp"
 
 
 namespace fs = std::filesystem; // Alias for convenience
 
+// Every async log in the process. shim carries the shim's own diagnostics to
+// stderr, so reporting an error never blocks a loop on the terminal; logs holds
+// the ones Lua opens through uws.logger (utils/logger.lua), one per destination
+// ("stdout" or a file path opened for append) and shared by every worker.
+struct LogRegistry {
+    dawn::AsyncLog shim{STDERR_FILENO, false};
+    std::mutex mutex;
+    std::unordered_map<std::string, std::unique_ptr<dawn::AsyncLog>> logs;
+};
+
+static void flush_logs();
+
+// Leaked on purpose: a worker can still be logging while exit() runs static
+// destructors, so no log is ever destroyed. flush_logs, registered with atexit,
+// writes out whatever is still queued instead.
+static LogRegistry &log_registry() {
+    static LogRegistry *registry = [] {
+        auto *created = new LogRegistry();
+        std::atexit(flush_logs);
+        return created;
+    }();
+    return *registry;
+}
+
+static void flush_logs() {
+    LogRegistry &registry = log_registry();
+    registry.shim.flush();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    for (auto &entry : registry.logs) entry.second->flush();
+}
+
+static dawn::AsyncLog &shim_log() {
+    return log_registry().shim;
+}
+
 // For getnameinfo, NI_MAXHOST, NI_NUMERICHOST
 
-static std::shared_ptr<uWS::App> app;
-static lua_State *main_L = nullptr;
-static std::mutex lua_mutex;
-static std::unordered_map<int, int> lua_callbacks;
-static int callback_id_counter = 0;
+// Everything below is per event loop: each worker thread started by
+// run_workers gets its own uWS::App, Lua state, callbacks and middlewares.
+static thread_local std::shared_ptr<uWS::App> app;
+static thread_local lua_State *main_L = nullptr;
+static thread_local std::thread::id loop_thread;
+static thread_local std::unordered_map<int, int> lua_callbacks;
+static thread_local int callback_id_counter = 0;
+static thread_local int worker_id = 0; // 0 = not running under run_workers
 
-struct DummyUserData {};
+// uWS invokes every handler on the thread running its loop, and that thread is the
+// only one allowed to touch main_L, so no lock is taken on the request path.
+// Debug builds verify the affinity instead.
+static inline void assert_loop_thread() {
+#ifndef NDEBUG
+    assert(main_L != nullptr && "Lua callback fired before create_app");
+    assert(loop_thread == std::this_thread::get_id() && "Lua state used off its loop thread");
+#endif
+}
 
 // Middleware structures
 struct Middleware {
@@ -36,56 +109,406 @@ struct Middleware {
     std::string route; // Route for route-specific middleware
 };
 
-static std::vector<Middleware> middlewares;
+static thread_local std::vector<Middleware> middlewares;
+
+// Limits for reading a POST/PUT/PATCH body.
+struct BodyOptions {
+    size_t max_body_size = 0; // 0 = unlimited; larger bodies get a 413
+    bool stream = false;      // call Lua per chunk instead of once with the whole body
+    bool json = false;        // decode application/json bodies natively into Lua tables
+    bool json_lazy = false;   // ... into a lazy JsonView instead (opts.json = "lazy")
+    bool multipart = false;   // parse multipart/form-data natively into a form table
+    std::shared_ptr<const dawn::MultipartOptions> multipart_options;
+    int multipart_callbacks = LUA_NOREF; // options table with the Lua part callbacks
+    int before_body = LUA_NOREF;         // Lua function run once before the body is read
+};
+
+// Native router: a single catch-all uWS handler dispatches every uws.route() route.
+static thread_local dawn::Router router;
+static thread_local bool router_mounted = false;
+static thread_local std::vector<BodyOptions> route_body_options; // indexed by route id
+
+// Every live event loop, so uws.publish can reach topic subscribers on other
+// workers. Publishing to another loop is deferred onto that loop's thread, which
+// then publishes through its own thread_local app. The mutex is held while
+// deferring so a worker cannot unregister and free its loop mid-publish.
+static std::mutex publish_loops_mutex;
+static std::vector<uWS::Loop *> publish_loops;
+
+static void register_publish_loop(uWS::Loop *loop) {
+    std::lock_guard<std::mutex> lock(publish_loops_mutex);
+    publish_loops.push_back(loop);
+}
+
+static void unregister_publish_loop(uWS::Loop *loop) {
+    std::lock_guard<std::mutex> lock(publish_loops_mutex);
+    publish_loops.erase(std::remove(publish_loops.begin(), publish_loops.end(), loop), publish_loops.end());
+}
 
 int uw_create_app(lua_State *L) {
     if (!app) {
         app = std::make_shared<uWS::App>();
         main_L = L;
+        loop_thread = std::this_thread::get_id();
+        register_publish_loop(uWS::Loop::get());
     }
     lua_pushboolean(L, 1);
     return 1;
 }
 
-int create_req_userdata(lua_State *L, uWS::HttpRequest* req) {
-    void *ud = lua_newuserdata(L, sizeof(uWS::HttpRequest*));
-    uWS::HttpRequest** req_ptr = (uWS::HttpRequest**)ud;
-    *req_ptr = req;
+// Registry refs to the req/res/websocket metatables, taken once in luaopen so the
+// request path never looks a metatable up by name.
+static thread_local int req_mt_ref = LUA_NOREF;
+static thread_local int res_mt_ref = LUA_NOREF;
+static thread_local int ws_mt_ref = LUA_NOREF;
+static thread_local int json_mt_ref = LUA_NOREF;
+static thread_local int multipart_mt_ref = LUA_NOREF;
+static thread_local int rate_limiter_mt_ref = LUA_NOREF;
+static thread_local int token_store_mt_ref = LUA_NOREF;
+static thread_local int logger_mt_ref = LUA_NOREF;
 
-    luaL_getmetatable(L, "req");
-    lua_setmetatable(L, -2);
+// luaL_checkudata against a cached metatable ref.
+static void *check_userdata(lua_State *L, int idx, int mt_ref, const char *tname) {
+    void *p = lua_touserdata(L, idx);
+    if (p && lua_getmetatable(L, idx)) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, mt_ref);
+        bool same = lua_rawequal(L, -1, -2);
+        lua_pop(L, 2);
+        if (same) return p;
+    }
+    luaL_typerror(L, idx, tname);
+    return nullptr;
+}
 
-    return 1;
+// String properties of req, read from uWS on first access and cached for the rest
+// of the request in slots of the handle's cache table.
+enum RequestProperty {
+    REQ_METHOD = 1,
+    REQ_URL,
+    REQ_QUERY,
+    REQ_JWT,   // claims of the token a uws.guard verified, or nil
+    REQ_PROPERTY_COUNT = REQ_JWT,
+    REQ_METHOD_ID // dawn::HttpMethod as an integer (uws.METHOD_*); not cached
+};
+
+// Copy of the request line and headers for calls made after the uWS handler has
+// returned: body chunks arrive later, when the HttpRequest is gone. All strings
+// share one buffer, so taking a snapshot costs two allocations.
+struct RequestSnapshot {
+    struct Field {
+        uint32_t offset = 0;
+        uint32_t length = 0;
+    };
+
+    std::string data;
+    Field method, url, query;
+    std::vector<std::pair<Field, Field>> headers;
+
+    explicit RequestSnapshot(uWS::HttpRequest *req) {
+        method = append(req->getMethod());
+        url = append(req->getUrl());
+        query = append(req->getQuery());
+        for (auto [key, value] : *req) {
+            headers.emplace_back(append(key), append(value));
+        }
+    }
+
+    std::string_view view(Field f) const {
+        return std::string_view(data).substr(f.offset, f.length);
+    }
+
+    // `name` must be lowercase, as with HttpRequest::getHeader.
+    std::string_view header(std::string_view name) const {
+        for (const auto &[key, value] : headers) {
+            if (view(key) == name) return view(value);
+        }
+        return {};
+    }
+
+private:
+    Field append(std::string_view s) {
+        Field f{static_cast<uint32_t>(data.size()), static_cast<uint32_t>(s.size())};
+        data.append(s.data(), s.size());
+        return f;
+    }
+};
+
+// The req/res objects handed to Lua. The uWS pointer comes first and is cleared
+// once the object is no longer usable (handler returned, response ended or aborted).
+// Handles are native and recycled through per-loop HandlePools; Lua gets a small
+// userdata per request naming the handle and its generation, pinned by `ref` while
+// the handle is checked out. A req/res that Lua keeps past its request (in a
+// closure, a timer, a coroutine) goes stale when the handle is released, so it
+// raises instead of reaching whichever request uses the handle next.
+struct NativeGuard;
+
+struct RequestHandle {
+    uWS::HttpRequest *req = nullptr;
+    uint32_t generation = 1;
+    int ref = LUA_NOREF;       // the userdata of the current request
+    int cache_ref = LUA_NOREF; // table of cached RequestProperty values, kept across requests
+    unsigned cached = 0; // bit per RequestProperty already stored in the cache table
+    const RequestSnapshot *snapshot = nullptr; // stands in for req during body reads
+    const NativeGuard *jwt_guard = nullptr;    // the guard whose token check passed
+};
+
+static std::string_view request_property(const RequestHandle *h, int prop) {
+    if (h->req) {
+        switch (prop) {
+        case REQ_METHOD: return h->req->getMethod();
+        case REQ_URL: return h->req->getUrl();
+        case REQ_QUERY: return h->req->getQuery();
+        }
+    } else if (h->snapshot) {
+        switch (prop) {
+        case REQ_METHOD: return h->snapshot->view(h->snapshot->method);
+        case REQ_URL: return h->snapshot->view(h->snapshot->url);
+        case REQ_QUERY: return h->snapshot->view(h->snapshot->query);
+        }
+    }
+    return {};
 }
 
-int create_res_userdata(lua_State *L, uWS::HttpResponse<false>* res) {
-    void *ud = lua_newuserdata(L, sizeof(uWS::HttpResponse<false>*));
-    uWS::HttpResponse<false>** res_ptr = (uWS::HttpResponse<false>**)ud;
-    *res_ptr = res;
+static std::string_view request_header(const RequestHandle *h, std::string_view name) {
+    if (h->req) return h->req->getHeader(name);
+    if (h->snapshot) return h->snapshot->header(name);
+    return {};
+}
 
-    luaL_getmetatable(L, "res");
-    lua_setmetatable(L, -2);
+struct ResponseHandle {
+    uWS::HttpResponse<false> *res = nullptr;
+    uint32_t generation = 1;
+    int ref = LUA_NOREF;
+    int aborted_ref = LUA_NOREF; // res:onAborted callback
+    bool pending = false; // left open by its handler: released on end or abort
+};
+
+using RequestRef = dawn::HandlePool<RequestHandle>::Ref;
+
+// The res userdata also remembers whether its client went away, which stays
+// readable after the handle itself has moved on.
+struct ResponseRef {
+    dawn::HandlePool<ResponseHandle>::Ref handle;
+    bool aborted;
+};
+
+static thread_local dawn::HandlePool<RequestHandle> request_pool;
+static thread_local dawn::HandlePool<ResponseHandle> response_pool;
+
+static RequestHandle *acquire_request() {
+    RequestHandle *h = request_pool.acquire();
+    new (lua_newuserdata(main_L, sizeof(RequestRef))) RequestRef(request_pool.ref(h));
+    lua_rawgeti(main_L, LUA_REGISTRYINDEX, req_mt_ref);
+    lua_setmetatable(main_L, -2);
+    h->ref = luaL_ref(main_L, LUA_REGISTRYINDEX);
+    if (h->cache_ref == LUA_NOREF) {
+        lua_createtable(main_L, REQ_PROPERTY_COUNT, 0);
+        h->cache_ref = luaL_ref(main_L, LUA_REGISTRYINDEX);
+    }
+    h->cached = 0;
+    h->jwt_guard = nullptr;
+    return h;
+}
+
+static void release_request(RequestHandle *h) {
+    h->req = nullptr;
+    h->snapshot = nullptr;
+    luaL_unref(main_L, LUA_REGISTRYINDEX, h->ref);
+    h->ref = LUA_NOREF;
+    request_pool.release(h);
+}
+
+static ResponseHandle *acquire_response(uWS::HttpResponse<false> *r) {
+    ResponseHandle *h = response_pool.acquire();
+    new (lua_newuserdata(main_L, sizeof(ResponseRef))) ResponseRef{response_pool.ref(h), false};
+    lua_rawgeti(main_L, LUA_REGISTRYINDEX, res_mt_ref);
+    lua_setmetatable(main_L, -2);
+    h->ref = luaL_ref(main_L, LUA_REGISTRYINDEX);
+    h->res = r;
+    return h;
+}
+
+static void release_response(ResponseHandle *h) {
+    h->pending = false;
+    luaL_unref(main_L, LUA_REGISTRYINDEX, h->ref);
+    h->ref = LUA_NOREF;
+    response_pool.release(h);
+}
 
+// Called when a response is ended from Lua or aborted by the client.
+static void finish_response(ResponseHandle *h) {
+    h->res = nullptr;
+    luaL_unref(main_L, LUA_REGISTRYINDEX, h->aborted_ref);
+    h->aborted_ref = LUA_NOREF;
+    if (h->pending) release_response(h);
+}
+
+// Runs the res:onAborted callback, if any, once the client has gone away.
+static void abort_response(ResponseHandle *h) {
+    lua_rawgeti(main_L, LUA_REGISTRYINDEX, h->ref);
+    static_cast<ResponseRef *>(lua_touserdata(main_L, -1))->aborted = true;
+    lua_pop(main_L, 1);
+    int ref = h->aborted_ref;
+    h->aborted_ref = LUA_NOREF;
+    finish_response(h);
+    if (ref == LUA_NOREF) return;
+    lua_rawgeti(main_L, LUA_REGISTRYINDEX, ref);
+    luaL_unref(main_L, LUA_REGISTRYINDEX, ref);
+    if (lua_pcall(main_L, 0, 0, 0) != LUA_OK) {
+        shim_log().write(dawn::LOG_ERROR, "Lua error (res:onAborted): ", lua_tostring(main_L, -1));
+        lua_pop(main_L, 1);
+    }
+}
+
+// Answers with a 500 unless the response was already ended or aborted.
+static void fail_response(ResponseHandle *h) {
+    if (!h->res) return;
+    h->res->writeStatus("500 Internal Server Error")->writeHeader("Content-Type", "text/plain")->end("Internal Server Error");
+    finish_response(h);
+}
+
+// Checks out a req/res pair for one call into Lua. Both go back to the pool when
+// the call returns, except a response the handler left open on the final call:
+// that one stays checked out until Lua ends it or the client aborts. Pass
+// final = false when something else (a body read, the next chunk) still owns the
+// response; Lua's res from this call then goes stale with the call.
+struct HttpCall {
+    RequestHandle *req;
+    ResponseHandle *res;
+    uWS::HttpResponse<false> *raw_res;
+    bool final;
+    bool owns_req = true;
+
+    HttpCall(uWS::HttpResponse<false> *r, uWS::HttpRequest *q, bool final = true)
+        : req(acquire_request()), res(acquire_response(r)), raw_res(r), final(final) {
+        req->req = q;
+    }
+
+    // Uses a request handle owned by the caller, e.g. a body read in progress that
+    // hands Lua the same req for every chunk.
+    HttpCall(uWS::HttpResponse<false> *r, RequestHandle *borrowed, bool final)
+        : req(borrowed), res(acquire_response(r)), raw_res(r), final(final), owns_req(false) {}
+
+    ~HttpCall() {
+        if (owns_req) release_request(req);
+        if (res->res && final) {
+            ResponseHandle *h = res;
+            uint32_t generation = h->generation;
+            h->pending = true;
+            raw_res->onAborted([h, generation]() {
+                if (h->generation == generation) abort_response(h);
+            });
+            return;
+        }
+        finish_response(res);
+        release_response(res);
+    }
+
+    // Hands req over to a handler that is still running after this call: the uWS
+    // request dies with its callback, so an owned req is switched to a snapshot.
+    RequestHandle *detach_request(std::unique_ptr<RequestSnapshot> &snapshot) {
+        if (owns_req && req->req) {
+            snapshot = std::make_unique<RequestSnapshot>(req->req);
+            req->snapshot = snapshot.get();
+            req->req = nullptr;
+        }
+        owns_req = false;
+        return req;
+    }
+
+    void push(lua_State *L) const {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, req->ref);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, res->ref);
+    }
+
+    // Answers with a 500 unless the handler already ended the response.
+    void fail() { fail_response(res); }
+};
+
+// The request behind the req at idx, or nullptr once its request is over.
+static RequestHandle *to_request(lua_State *L, int idx) {
+    RequestHandle *h = request_pool.resolve(*static_cast<RequestRef *>(lua_touserdata(L, idx)));
+    return h && (h->req || h->snapshot) ? h : nullptr;
+}
+
+static RequestHandle *check_req(lua_State *L) {
+    check_userdata(L, 1, req_mt_ref, "req");
+    RequestHandle *h = to_request(L, 1);
+    if (!h) luaL_error(L, "request is no longer valid outside its handler");
+    return h;
+}
+
+static ResponseRef *check_res_ref(lua_State *L) {
+    return static_cast<ResponseRef *>(check_userdata(L, 1, res_mt_ref, "res"));
+}
+
+// The response behind res, or nullptr once it has been ended or aborted.
+static ResponseHandle *check_res_handle(lua_State *L) {
+    ResponseHandle *h = response_pool.resolve(check_res_ref(L)->handle);
+    return h && h->res ? h : nullptr;
+}
+
+static uWS::HttpResponse<false> *check_res(lua_State *L) {
+    ResponseHandle *h = check_res_handle(L);
+    if (!h) luaL_error(L, "response has already been sent or aborted");
+    return h->res;
+}
+
+// res:cork(fn): like ws:cork for a response written from outside its handler
+// (timers, other sockets' callbacks). Returns self.
+static int res_cork(lua_State *L) {
+    uWS::HttpResponse<false> *res = check_res(L);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    lua_settop(L, 2);
+    int status = LUA_OK;
+    res->cork([L, &status]() { status = lua_pcall(L, 0, 0, 0); });
+    if (status != LUA_OK) return lua_error(L);
     return 1;
 }
 
 static int res_writeStatus(lua_State *L) {
-    uWS::HttpResponse<false>** res = (uWS::HttpResponse<false>**)luaL_checkudata(L, 1, "res");
+    uWS::HttpResponse<false> *res = check_res(L);
     int status = luaL_checkinteger(L, 2);
-    (*res)->writeStatus(std::to_string(status).c_str());
+    res->writeStatus(std::to_string(status).c_str());
     lua_pushvalue(L, 1); // Return self for chaining
     return 1;
 }
 
+static int res_writeHeader(lua_State *L) {
+    uWS::HttpResponse<false> *res = check_res(L);
+    size_t header_len = 0, value_len = 0;
+    const char *header = luaL_checklstring(L, 2, &header_len);
+    const char *value = luaL_checklstring(L, 3, &value_len);
+    res->writeHeader(std::string_view(header, header_len), std::string_view(value, value_len));
+    lua_pushvalue(L, 1);
+    return 1;
+}
+
+static int res_send(lua_State *L) {
+    ResponseHandle *h = check_res_handle(L);
+    if (!h) return luaL_error(L, "response has already been sent or aborted");
+    size_t len = 0;
+    const char *response = luaL_optlstring(L, 2, "", &len);
+    h->res->end(std::string_view(response, len));
+    finish_response(h);
+    return 0;
+}
+
 static int res_getRemoteAddress(lua_State *L) {
-    uWS::HttpResponse<false>** res = (uWS::HttpResponse<false>**)luaL_checkudata(L, 1, "res");
-    std::string_view remoteAddress = (*res)->getRemoteAddress();
+    uWS::HttpResponse<false> *res = check_res(L);
+    std::string_view remoteAddress = res->getRemoteAddress();
     lua_pushlstring(L, remoteAddress.data(), remoteAddress.length());
     return 1;
 }
 
+static int res_getRemoteAddressAsText(lua_State *L) {
+    uWS::HttpResponse<false> *res = check_res(L);
+    std::string_view address = res->getRemoteAddressAsText();
+    lua_pushlstring(L, address.data(), address.length());
+    return 1;
+}
+
 static int res_getProxiedRemoteAddress(lua_State *L) {
-    uWS::HttpResponse<false>** res = (uWS::HttpResponse<false>**)luaL_checkudata(L, 1, "res");
     // In newer uWebSockets versions, you might need to check headers like X-Forwarded-For
     // For simplicity, let's just return the regular remote address for now.
     return res_getRemoteAddress(L);
@@ -93,734 +516,4163 @@ static int res_getProxiedRemoteAddress(lua_State *L) {
 
 
 static int res_closeConnection(lua_State *L) {
-    uWS::HttpResponse<false>** res = (uWS::HttpResponse<false>**)luaL_checkudata(L, 1, "res");
-    (*res)->close();
+    ResponseHandle *h = check_res_handle(L);
+    if (!h) return 0;
+    h->res->close();
+    finish_response(h);
     return 0;
 }
 
+// res:onAborted(fn): fn() runs if the client goes away before the response is
+// ended. Only one callback is kept; registering again replaces it. Returns self.
+static int res_onAborted(lua_State *L) {
+    ResponseHandle *h = check_res_handle(L);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    if (!h) return luaL_error(L, "response has already been sent or aborted");
+    lua_pushvalue(L, 2);
+    luaL_unref(L, LUA_REGISTRYINDEX, h->aborted_ref);
+    h->aborted_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_settop(L, 1);
+    return 1;
+}
+
+// res:aborted(): whether the client went away, e.g. while the handler was suspended.
+static int res_aborted(lua_State *L) {
+    lua_pushboolean(L, check_res_ref(L)->aborted);
+    return 1;
+}
 
-// User data structure for WebSocket
-struct WebSocketUserData {
-    std::string id;
+// Route handlers run as coroutines taken from a per-loop pool, so they can yield
+// while waiting on I/O (uws.sleep, client:call, promises via uws.resume). A handler
+// runs inside its uWS callback until it first yields; from then on a HandlerTask
+// keeps its req (backed by a snapshot) checked out and tracks its res, and whatever
+// it waits for resumes it through resume_coroutine. Middleware still runs synchronously.
+struct HandlerTask {
+    int thread_ref = LUA_NOREF;
+    dawn::HandlePool<ResponseHandle>::Ref res; // for corking and the 500 if the handler fails later
+    RequestHandle *req = nullptr;
+    std::unique_ptr<RequestSnapshot> snapshot;
+    std::shared_ptr<void> keepalive; // owner of req's snapshot when it is not ours
+    std::string label;               // prefix of error messages
+
+    HandlerTask(int thread_ref, dawn::HandlePool<ResponseHandle>::Ref res) : thread_ref(thread_ref), res(res) {}
 };
 
-static int websocket_send(lua_State *L) {
-    void *ud = luaL_checkudata(L, 1, "websocket");
-    if (!ud) {
-        luaL_error(L, "Invalid WebSocket object");
-        return 0;
-    }
-    uWS::WebSocket<false, true, WebSocketUserData>* ws = *(uWS::WebSocket<false, true, WebSocketUserData>**)ud;
-    const char *message = luaL_checkstring(L, 2);
-    size_t len = lua_objlen(L, 2);
-    uWS::OpCode opCodeToSend = uWS::OpCode::TEXT; // Default to text
+enum class HandlerStatus { DONE, FAILED, SUSPENDED };
 
-    if (lua_gettop(L) > 2 && lua_isstring(L, 3)) {
-        const char *type = luaL_checkstring(L, 3);
-        if (strcmp(type, "binary") == 0) {
-            opCodeToSend = uWS::OpCode::BINARY;
-        }
+static constexpr size_t COROUTINE_POOL_MAX = 256;
+static thread_local std::vector<std::pair<lua_State *, int>> coroutine_pool; // idle threads and their refs
+static thread_local std::unordered_map<lua_State *, HandlerTask *> handler_tasks;
+
+static std::pair<lua_State *, int> acquire_coroutine() {
+    if (!coroutine_pool.empty()) {
+        auto entry = coroutine_pool.back();
+        coroutine_pool.pop_back();
+        return entry;
     }
+    lua_State *co = lua_newthread(main_L);
+    return {co, luaL_ref(main_L, LUA_REGISTRYINDEX)};
+}
 
-    if (ws) {
-        ws->send(std::string_view(message, len), opCodeToSend);
-        lua_pushboolean(L, 1);
-        return 1;
-    } else {
-        luaL_error(L, "Invalid WebSocket object");
-        return 0;
+// A thread that returned normally can run another function; one that raised is dead.
+// Only threads that never suspended come back here as reusable (see end_task).
+static void release_coroutine(lua_State *co, int ref, bool reusable) {
+    if (reusable && coroutine_pool.size() < COROUTINE_POOL_MAX) {
+        lua_settop(co, 0);
+        coroutine_pool.emplace_back(co, ref);
+        return;
     }
+    luaL_unref(main_L, LUA_REGISTRYINDEX, ref);
 }
 
-static int websocket_close(lua_State *L) {
-    void *ud = luaL_checkudata(L, 1, "websocket");
-    if (!ud) {
-        luaL_error(L, "Invalid WebSocket object");
-        return 0;
+// A task's thread is dropped rather than pooled even when the handler returned:
+// whatever it waited on (a promise's callbacks, a timer, user code) may still
+// hold the thread and uws.resume it later, which must find it finished instead of
+// running some other request's handler. The GC takes it once nothing refers to it.
+static void end_task(lua_State *co, HandlerTask *task, bool ok) {
+    handler_tasks.erase(co);
+    ResponseHandle *res = response_pool.resolve(task->res);
+    if (!ok && res) fail_response(res);
+    if (task->req) release_request(task->req);
+    release_coroutine(co, task->thread_ref, false);
+    delete task;
+}
+
+// Runs the function and nargs arguments on top of main_L as the handler of
+// `call`, in a pooled coroutine. Errors are logged as "<prefix><pattern>: <msg>";
+// the caller answers them with call.fail(). When the handler suspends, the task
+// takes req over (together with keepalive, for a req the call only borrows).
+static HandlerStatus run_handler(HttpCall &call, int nargs, std::string_view prefix, std::string_view pattern,
+                                 std::shared_ptr<void> keepalive = nullptr) {
+    auto [co, ref] = acquire_coroutine();
+    lua_xmove(main_L, co, nargs + 1);
+    int status = lua_resume(co, nargs);
+    if (status == LUA_YIELD) {
+        lua_settop(co, 0);
+        auto *task = new HandlerTask(ref, response_pool.ref(call.res));
+        task->req = call.detach_request(task->snapshot);
+        task->keepalive = std::move(keepalive);
+        task->label.assign(prefix.data(), prefix.size());
+        task->label.append(pattern.data(), pattern.size());
+        handler_tasks.emplace(co, task);
+        return HandlerStatus::SUSPENDED;
     }
-    uWS::WebSocket<false, true, DummyUserData>* ws = *(uWS::WebSocket<false, true, DummyUserData>**)ud;
-    if (ws) {
-        ws->close(); // Call close with no arguments
-        lua_pushboolean(L, 1);
-        return 1;
-    } else {
-        luaL_error(L, "Invalid WebSocket object");
-        return 0;
+    if (status != LUA_OK) {
+        shim_log().write(dawn::LOG_ERROR, prefix, pattern, ": ", lua_tostring(co, -1));
     }
+    release_coroutine(co, ref, status == LUA_OK);
+    return status == LUA_OK ? HandlerStatus::DONE : HandlerStatus::FAILED;
 }
 
-static void create_websocket_metatable(lua_State *L) {
-    luaL_newmetatable(L, "websocket");
-    lua_pushstring(L, "__index");
-    lua_newtable(L); // Metatable for methods
-    lua_pushcfunction(L, websocket_send);
-    lua_setfield(L, -2, "send");
-    lua_pushcfunction(L, websocket_close);
-    lua_setfield(L, -2, "close");
-    lua_settable(L, -3); // Set __index to the methods table
-    lua_pop(L, 1); // Pop the metatable
-}
+// Resumes co with the nargs values on its stack. A handler task is resumed corked
+// on its response and cleaned up once it ends (a failure answers 500); any other
+// coroutine is left to the caller, results or error message on its stack.
+static int resume_coroutine(lua_State *co, int nargs) {
+    auto it = handler_tasks.find(co);
+    if (it == handler_tasks.end()) return lua_resume(co, nargs);
 
-static void create_metatables(lua_State *L) {
-    create_websocket_metatable(L);
-    luaL_newmetatable(L, "req");
-    lua_pushstring(L, "__index");
-    lua_pushcfunction(L, [](lua_State *L) -> int {
-        uWS::HttpRequest** req = (uWS::HttpRequest**)luaL_checkudata(L, 1, "req");
-        const char *key = luaL_checkstring(L, 2);
-        if (strcmp(key, "method") == 0) {
-            lua_pushstring(L, (*req)->getMethod().data());
-            return 1;
-        } else if (strcmp(key, "url") == 0) {
-            lua_pushstring(L, (*req)->getUrl().data());
-            return 1;
-        } else if (strcmp(key, "query") == 0) {
-            lua_pushstring(L, (*req)->getQuery().data());
-            return 1;
-        } else if (strcmp(key, "getHeader") == 0) {
-            lua_pushcclosure(L, [](lua_State *L) -> int {
-                uWS::HttpRequest** req = (uWS::HttpRequest**)luaL_checkudata(L, 1, "req");
-                const char *header_name = luaL_checkstring(L, 2);
-                std::string_view header_value = (*req)->getHeader(header_name);
-                lua_pushlstring(L, header_value.data(), header_value.length());
-                return 1;
-            }, 0);
-            return 1;
-        } // Inside the lambda for the '__index' metamethod of 'req'
-        else if (strcmp(key, "getUrl") == 0) {
-            lua_pushcfunction(L, [](lua_State *L) -> int {
-                uWS::HttpRequest** req = (uWS::HttpRequest**)luaL_checkudata(L, 1, "req");
-                std::string_view url = (*req)->getUrl();
-                lua_pushlstring(L, url.data(), url.length());
-                return 1;
-            });
-            return 1;
-        }
+    HandlerTask *task = it->second;
+    int status = LUA_OK;
+    ResponseHandle *res = response_pool.resolve(task->res);
+    if (res && res->res) {
+        res->res->cork([&]() { status = lua_resume(co, nargs); });
+    } else {
+        status = lua_resume(co, nargs);
+    }
+    if (status == LUA_YIELD) {
+        lua_settop(co, 0);
+        return status;
+    }
+    if (status != LUA_OK) {
+        shim_log().write(dawn::LOG_ERROR, task->label, ": ", lua_tostring(co, -1));
+    }
+    end_task(co, task, status == LUA_OK);
+    return status;
+}
 
-        lua_pushnil(L);
-        return 1;
-    });
-    lua_settable(L, -3);
-    lua_pop(L, 1);
+// resume_coroutine for callers that do not want results back; errors of plain
+// coroutines are logged under `what`.
+static void resume_and_report(lua_State *co, int nargs, const char *what) {
+    bool task = handler_tasks.count(co) > 0;
+    int status = resume_coroutine(co, nargs);
+    if (task) return;
+    if (status != LUA_OK && status != LUA_YIELD) {
+        shim_log().write(dawn::LOG_ERROR, "Lua error (", what, "): ", lua_tostring(co, -1));
+    }
+    lua_settop(co, 0);
+}
 
-    luaL_newmetatable(L, "res");
-    lua_pushstring(L, "__index");
-    lua_pushcfunction(L, [](lua_State *L) -> int {
-        uWS::HttpResponse<false>** res = (uWS::HttpResponse<false>**)luaL_checkudata(L, 1, "res");
-        const char *key = luaL_checkstring(L, 2);
-        if (strcmp(key, "send") == 0) {
-            lua_pushcclosure(L, [](lua_State *L) -> int {
-                uWS::HttpResponse<false>** res = (uWS::HttpResponse<false>**)luaL_checkudata(L, 1, "res");
-                const char *response = luaL_checkstring(L, 2);
-                (*res)->end(response);
-                return 0;
-            }, 0);
-            return 1;
-        } else if (strcmp(key, "writeHeader") == 0) {
-            lua_pushcclosure(L, [](lua_State *L) -> int {
-                uWS::HttpResponse<false>** res = (uWS::HttpResponse<false>**)luaL_checkudata(L, 1, "res");
-                const char *header = luaL_checkstring(L, 2);
-                const char *value = luaL_checkstring(L, 3);
-                (*res)->writeHeader(header, value);
-                lua_pushvalue(L, 1);
-                return 1;
-            }, 0);
-            return 1;
-        } else if (strcmp(key, "writeStatus") == 0) {
-            lua_pushcfunction(L, res_writeStatus);
-            return 1;
-        } else if (strcmp(key, "getRemoteAddress") == 0) {
-            lua_pushcfunction(L, res_getRemoteAddress);
-            return 1;
-        } else if (strcmp(key, "getProxiedRemoteAddress") == 0) {
-            lua_pushcfunction(L, res_getProxiedRemoteAddress);
-            return 1;
-        } else if (strcmp(key, "closeConnection") == 0) {
-            lua_pushcfunction(L, res_closeConnection);
-            return 1;
-        }
-        lua_pushnil(L);
+// uws.resume(co, ...): coroutine.resume that also knows about handler tasks, for
+// Lua code (promise callbacks, luv callbacks) waking a suspended handler. For a
+// handler it returns true, or false if the handler failed; for any other
+// coroutine it returns what coroutine.resume would.
+static int uw_resume(lua_State *L) {
+    lua_State *co = lua_tothread(L, 1);
+    luaL_argcheck(L, co != nullptr, 1, "coroutine expected");
+    if (lua_status(co) != LUA_YIELD) {
+        lua_pushboolean(L, 0);
+        lua_pushliteral(L, "cannot resume non-suspended coroutine");
+        return 2;
+    }
+    int nargs = lua_gettop(L) - 1;
+    bool task = handler_tasks.count(co) > 0;
+    lua_xmove(L, co, nargs);
+    int status = resume_coroutine(co, nargs);
+    if (task) {
+        lua_pushboolean(L, status == LUA_OK || status == LUA_YIELD);
         return 1;
-    });
-    lua_settable(L, -3);
-    lua_pop(L, 1);
+    }
+    if (status != LUA_OK && status != LUA_YIELD) {
+        lua_pushboolean(L, 0);
+        lua_xmove(co, L, 1);
+        return 2;
+    }
+    int nresults = lua_gettop(co);
+    lua_pushboolean(L, 1);
+    lua_xmove(co, L, nresults);
+    return nresults + 1;
 }
 
-// Function to execute middleware
-bool execute_middleware(lua_State *L, uWS::HttpResponse<false> *res, uWS::HttpRequest *req, const std::string& route) {
-    for (const auto& mw : middlewares) {
-        if (mw.global || mw.route == route) {
-            lua_rawgeti(L, LUA_REGISTRYINDEX, mw.ref);
-            create_req_userdata(L, req);
-            create_res_userdata(L, res);
-            if (lua_pcall(L, 2, 1, 0) != LUA_OK) {
-                std::cerr << "Lua middleware error: " << lua_tostring(L, -1) << std::endl;
-                lua_pop(L, 1);
-                return false; // Middleware error, stop processing
-            }
+// Coroutines parked in uws.sleep, by deadline. One one-shot timer is armed for
+// the earliest of them.
+static thread_local std::multimap<int64_t, int> sleepers; // steady ms -> thread ref
+static thread_local struct us_timer_t *sleep_timer = nullptr;
+static thread_local int64_t sleep_timer_deadline = 0; // 0 = not armed
 
-            if (lua_isboolean(L, -1) && !lua_toboolean(L, -1)) {
-                lua_pop(L, 1); // Remove boolean return
-                return false; // Middleware returned false, stop processing
-            }
-            lua_pop(L, 1); // Remove boolean return
-        }
-    }
-    return true; // Continue processing if no middleware returned false
+static int64_t steady_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
 }
 
-// Function to add middleware
-int uw_use(lua_State *L) {
-    luaL_checktype(L, 1, LUA_TFUNCTION);
-    lua_pushvalue(L, 1);
-    int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+static void wake_sleepers(struct us_timer_t *);
 
-    Middleware mw;
-    mw.ref = ref;
-    mw.global = true;
+static void arm_sleep_timer() {
+    if (sleepers.empty()) return;
+    int64_t deadline = sleepers.begin()->first;
+    if (sleep_timer_deadline != 0 && sleep_timer_deadline <= deadline) return;
+    if (!sleep_timer) sleep_timer = us_create_timer(reinterpret_cast<struct us_loop_t *>(uWS::Loop::get()), 1, 0);
+    // A zero timeout would disarm the timer rather than fire it at once.
+    int64_t delay = std::max<int64_t>(1, deadline - steady_ms());
+    us_timer_set(sleep_timer, wake_sleepers, static_cast<int>(std::min<int64_t>(delay, INT_MAX)), 0);
+    sleep_timer_deadline = deadline;
+}
 
-    if (lua_gettop(L) > 1 && lua_isstring(L, 2)) {
-        mw.global = false;
-        mw.route = luaL_checkstring(L, 2);
+static void wake_sleepers(struct us_timer_t *) {
+    sleep_timer_deadline = 0;
+    // Taken off the map first: a woken coroutine may well sleep again.
+    std::vector<int> due;
+    int64_t now = steady_ms();
+    while (!sleepers.empty() && sleepers.begin()->first <= now) {
+        due.push_back(sleepers.begin()->second);
+        sleepers.erase(sleepers.begin());
     }
-    middlewares.push_back(mw);
-    lua_pushboolean(L, 1);
-    return 1;
+    for (int ref : due) {
+        lua_rawgeti(main_L, LUA_REGISTRYINDEX, ref);
+        lua_State *co = lua_tothread(main_L, -1);
+        lua_pop(main_L, 1);
+        resume_and_report(co, 0, "uws.sleep");
+        luaL_unref(main_L, LUA_REGISTRYINDEX, ref);
+    }
+    arm_sleep_timer();
 }
 
-int uw_get(lua_State *L) {
-    const char *route = luaL_checkstring(L, 1);
-    luaL_checktype(L, 2, LUA_TFUNCTION);
-    lua_pushvalue(L, 2);
+// uws.sleep(ms): suspends the calling coroutine (a route handler, or any other
+// coroutine) for ms milliseconds without blocking the loop.
+static int uw_sleep(lua_State *L) {
+    lua_Number ms = luaL_checknumber(L, 1);
+    if (!main_L) return luaL_error(L, "uWS::App not initialized. Call create_app first.");
+    if (lua_pushthread(L)) return luaL_error(L, "uws.sleep must be called from a coroutine");
     int ref = luaL_ref(L, LUA_REGISTRYINDEX);
-    int callback_id = callback_id_counter++;
-    lua_callbacks[callback_id] = ref;
+    sleepers.emplace(steady_ms() + static_cast<int64_t>(std::max<lua_Number>(0, ms)), ref);
+    arm_sleep_timer();
+    return lua_yield(L, 0);
+}
 
-    app->get(route, [callback_id, route](auto *res, auto *req) {
-        std::lock_guard<std::mutex> lock(lua_mutex);
-        if (!execute_middleware(main_L, res, req, route)) return;
+static void close_handler_tasks() {
+    if (sleep_timer) {
+        us_timer_close(sleep_timer);
+        sleep_timer = nullptr;
+    }
+    sleep_timer_deadline = 0;
+    sleepers.clear();
+    for (auto &entry : handler_tasks) delete entry.second;
+    handler_tasks.clear();
+    coroutine_pool.clear();
+}
 
-        lua_rawgeti(main_L, LUA_REGISTRYINDEX, lua_callbacks[callback_id]);
-        create_req_userdata(main_L, req);
-        create_res_userdata(main_L, res);
 
-        if (lua_pcall(main_L, 2, 0, 0) != LUA_OK) {
-            std::cerr << "Lua error: " << lua_tostring(main_L, -1) << std::endl;
-            lua_pop(main_L, 1);
-            res->writeHeader("Content-Type", "text/plain")->end("Internal Server Error");
-        }
-    });
+// What a socket does once its send buffer reaches max_backpressure.
+enum class SlowConsumerPolicy : uint8_t {
+    DROP_NEWEST, // refuse new messages until the buffer drains (uWS's own behaviour)
+    DROP_OLDEST, // park new messages in a bounded queue, discarding the oldest
+    CLOSE        // close the connection
+};
 
-    lua_pushboolean(L, 1);
-    return 1;
-}
+// Per uws.ws route; WebSocketUserData points at it for the socket's lifetime.
+struct WebSocketRouteOptions {
+    unsigned int max_backpressure = 64 * 1024;
+    size_t max_queued = 64 * 1024; // DROP_OLDEST queue, in bytes
+    SlowConsumerPolicy policy = SlowConsumerPolicy::DROP_NEWEST;
+    uWS::CompressOptions compression = uWS::DISABLED;
+    unsigned int max_payload_length = 16 * 1024;
+    unsigned short idle_timeout = 120;  // seconds, 0 disables
+    bool send_pings = true;             // protocol-level pings before idle_timeout
+    bool reset_idle_on_send = false;
+    unsigned short max_lifetime = 0;    // minutes, 0 disables
+};
 
-int uw_post(lua_State *L) {
-    const char *route = luaL_checkstring(L, 1);
-    luaL_checktype(L, 2, LUA_TFUNCTION);
-    lua_pushvalue(L, 2);
-    int ref = luaL_ref(L, LUA_REGISTRYINDEX);
-    int callback_id = callback_id_counter++;
-    lua_callbacks[callback_id] = ref;
+// User data structure for WebSocket
+struct WebSocketUserData {
+    std::string id;
+    uint64_t handle = 0;     // slot + generation in socket_slots, 0 = not registered
+    int lua_ref = LUA_NOREF; // the socket's Lua userdata, created once in open
+    const WebSocketRouteOptions *options = nullptr;
+    std::deque<std::pair<std::string, uWS::OpCode>> queued; // DROP_OLDEST only
+    size_t queued_bytes = 0;
+    uint64_t dropped = 0;
+};
 
-    app->post(route, [callback_id, route](uWS::HttpResponse<false> *res_uws, uWS::HttpRequest *req_uws) {
-        // std::cerr << "uw_post handler called. res_uws: " << res_uws << ", req_uws: " << req_uws << std::endl;
-if(res_uws){
-        res_uws->onData([callback_id, res_uws, req_uws, route](std::string_view data, bool last) mutable {
-            std::lock_guard<std::mutex> lock(lua_mutex);
-            if (!execute_middleware(main_L, res_uws, req_uws, route)) return;
+using DawnWebSocket = uWS::WebSocket<false, true, WebSocketUserData>;
 
-            lua_rawgeti(main_L, LUA_REGISTRYINDEX, lua_callbacks[callback_id]);
-            create_req_userdata(main_L, req_uws);
-            create_res_userdata(main_L, res_uws);
-            lua_pushlstring(main_L, data.data(), data.size());
-            lua_pushboolean(main_L, last);
+// Open sockets of this loop. Lua never sees a socket pointer: the websocket userdata
+// and uws.send take a handle = generation << SOCKET_SLOT_BITS | slot, and a slot's
+// generation is bumped when its socket closes, so stale handles resolve to nullptr.
+// Handles stay below 2^53 to survive the trip through a Lua number.
+struct SocketSlot {
+    DawnWebSocket *ws = nullptr;
+    uint32_t generation = 1;
+};
 
-            if (lua_pcall(main_L, 4, 0, 0) != LUA_OK) {
-                std::cerr << "Lua error in POST handler: " << lua_tostring(main_L, -1) << std::endl;
-                lua_pop(main_L, 1);
-                res_uws->writeHeader("Content-Type", "text/plain")->end("Internal Server Error");
-            }
-        });
+static constexpr unsigned SOCKET_SLOT_BITS = 24;
+static constexpr uint64_t SOCKET_SLOT_MASK = (uint64_t(1) << SOCKET_SLOT_BITS) - 1;
+static constexpr uint32_t SOCKET_GENERATION_MASK = (uint32_t(1) << 28) - 1;
 
-        res_uws->onAborted([]() {
-            std::cerr << "POST request aborted" << std::endl;
-        });
+static thread_local std::vector<SocketSlot> socket_slots;
+static thread_local std::vector<uint32_t> free_socket_slots;
+static thread_local std::unordered_map<std::string, uint64_t> socket_ids; // WebSocketUserData::id -> handle
 
-}else{
-        std::cerr << "Error: res_uws is NULL in POST handler!" << std::endl;
+static void register_socket(DawnWebSocket *ws) {
+    uint32_t slot;
+    if (!free_socket_slots.empty()) {
+        slot = free_socket_slots.back();
+        free_socket_slots.pop_back();
+    } else {
+        slot = static_cast<uint32_t>(socket_slots.size());
+        socket_slots.emplace_back();
+    }
+    SocketSlot &entry = socket_slots[slot];
+    entry.ws = ws;
+    WebSocketUserData *data = ws->getUserData();
+    data->handle = (uint64_t(entry.generation) << SOCKET_SLOT_BITS) | slot;
+    socket_ids[data->id] = data->handle;
+}
+
+static void unregister_socket(DawnWebSocket *ws) {
+    WebSocketUserData *data = ws->getUserData();
+    if (!data->handle) return;
+    uint32_t slot = static_cast<uint32_t>(data->handle & SOCKET_SLOT_MASK);
+    SocketSlot &entry = socket_slots[slot];
+    entry.ws = nullptr;
+    entry.generation = (entry.generation + 1) & SOCKET_GENERATION_MASK;
+    if (entry.generation == 0) entry.generation = 1;
+    free_socket_slots.push_back(slot);
+    socket_ids.erase(data->id);
+    data->handle = 0;
+}
+
+static DawnWebSocket *lookup_socket(uint64_t handle) {
+    uint64_t slot = handle & SOCKET_SLOT_MASK;
+    if (slot >= socket_slots.size()) return nullptr;
+    const SocketSlot &entry = socket_slots[slot];
+    return (handle >> SOCKET_SLOT_BITS) == entry.generation ? entry.ws : nullptr;
+}
+
+// Pushes the socket's Lua object, a userdata holding its handle. open, message and
+// close all see the same userdata, so no frame allocates one and Lua can key tables by it.
+static void push_websocket(lua_State *L, DawnWebSocket *ws) {
+    WebSocketUserData *data = ws->getUserData();
+    if (data->lua_ref == LUA_NOREF) {
+        *static_cast<uint64_t *>(lua_newuserdata(L, sizeof(uint64_t))) = data->handle;
+        lua_rawgeti(L, LUA_REGISTRYINDEX, ws_mt_ref);
+        lua_setmetatable(L, -2);
+        lua_pushvalue(L, -1);
+        data->lua_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        return;
+    }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, data->lua_ref);
+}
+
+// Drops the registry ref to a closing socket's Lua object and retires its handle;
+// copies Lua still holds then resolve to a closed socket.
+static void release_websocket(lua_State *L, DawnWebSocket *ws) {
+    WebSocketUserData *data = ws->getUserData();
+    luaL_unref(L, LUA_REGISTRYINDEX, data->lua_ref);
+    data->lua_ref = LUA_NOREF;
+    unregister_socket(ws);
+}
+
+static DawnWebSocket *check_websocket(lua_State *L) {
+    return lookup_socket(*static_cast<uint64_t *>(check_userdata(L, 1, ws_mt_ref, "websocket")));
+}
+
+// Optional opcode argument: "text" (default) or "binary", by name or as the numeric
+// opcode (1, 2). Sends to one socket also take "ping" and "pong" (9, 10), whose
+// payload must fit a control frame. Anything else raises: uWS would otherwise put
+// the value on the wire as is.
+static uWS::OpCode opt_opcode(lua_State *L, int idx, size_t payload_len, bool allow_control) {
+    uWS::OpCode opcode = uWS::OpCode::TEXT;
+    int type = lua_type(L, idx);
+    if (type == LUA_TNUMBER) {
+        lua_Number n = lua_tonumber(L, idx);
+        if (n == uWS::OpCode::TEXT || n == uWS::OpCode::BINARY || n == uWS::OpCode::PING || n == uWS::OpCode::PONG) {
+            opcode = static_cast<uWS::OpCode>(static_cast<int>(n));
+        } else {
+            luaL_argerror(L, idx, "invalid opcode");
+        }
+    } else if (type == LUA_TSTRING) {
+        const char *name = lua_tostring(L, idx);
+        if (strcmp(name, "text") == 0) opcode = uWS::OpCode::TEXT;
+        else if (strcmp(name, "binary") == 0) opcode = uWS::OpCode::BINARY;
+        else if (strcmp(name, "ping") == 0) opcode = uWS::OpCode::PING;
+        else if (strcmp(name, "pong") == 0) opcode = uWS::OpCode::PONG;
+        else luaL_argerror(L, idx, "invalid opcode");
+    } else if (type != LUA_TNONE && type != LUA_TNIL) {
+        luaL_typerror(L, idx, "opcode");
+    }
+    if (opcode == uWS::OpCode::PING || opcode == uWS::OpCode::PONG) {
+        if (!allow_control) luaL_argerror(L, idx, "control opcodes cannot be published");
+        if (payload_len > 125) luaL_argerror(L, idx, "control frame payload exceeds 125 bytes");
+    }
+    return opcode;
+}
+
+enum class SendResult { SENT, BUFFERED, QUEUED, DROPPED };
+
+// Sends through the route's slow-consumer policy. DROP_NEWEST and CLOSE are
+// enforced by uWS itself (maxBackpressure / closeOnBackpressureLimit); DROP_OLDEST
+// holds messages back once the buffer is full and flushes them on drain.
+static SendResult send_websocket(DawnWebSocket *ws, std::string_view message, uWS::OpCode opcode) {
+    WebSocketUserData *data = ws->getUserData();
+    const WebSocketRouteOptions *options = data->options;
+    if (options && options->policy == SlowConsumerPolicy::DROP_OLDEST &&
+        (!data->queued.empty() || ws->getBufferedAmount() >= options->max_backpressure)) {
+        data->queued.emplace_back(std::string(message), opcode);
+        data->queued_bytes += message.size();
+        while (data->queued_bytes > options->max_queued && data->queued.size() > 1) {
+            data->queued_bytes -= data->queued.front().first.size();
+            data->queued.pop_front();
+            ++data->dropped;
+        }
+        return SendResult::QUEUED;
+    }
+    switch (ws->send(message, opcode)) {
+    case DawnWebSocket::SUCCESS: return SendResult::SENT;
+    case DawnWebSocket::BACKPRESSURE: return SendResult::BUFFERED;
+    default:
+        ++data->dropped;
+        return SendResult::DROPPED;
+    }
+}
+
+// Writes queued DROP_OLDEST messages until the buffer is full again.
+static void flush_websocket_queue(DawnWebSocket *ws) {
+    WebSocketUserData *data = ws->getUserData();
+    while (!data->queued.empty() && ws->getBufferedAmount() < data->options->max_backpressure) {
+        auto &[message, opcode] = data->queued.front();
+        ws->send(message, opcode);
+        data->queued_bytes -= message.size();
+        data->queued.pop_front();
+    }
+}
+
+static int push_send_result(lua_State *L, SendResult result) {
+    static const char *const statuses[] = {"sent", "buffered", "queued", "dropped"};
+    lua_pushboolean(L, result != SendResult::DROPPED);
+    lua_pushstring(L, statuses[static_cast<int>(result)]);
+    return 2;
+}
+
+// ws:send(message [, opcode]) -> ok, status. ok is false once the socket has closed
+// or when the message was dropped; status is "sent", "buffered" (written to the
+// backpressure buffer), "queued" (held back by drop_oldest), "dropped" or "closed".
+static int websocket_send(lua_State *L) {
+    DawnWebSocket *ws = check_websocket(L);
+    size_t len = 0;
+    const char *message = luaL_checklstring(L, 2, &len);
+    uWS::OpCode opCodeToSend = opt_opcode(L, 3, len, true);
+
+    if (!ws) {
+        lua_pushboolean(L, 0);
+        lua_pushliteral(L, "closed");
+        return 2;
+    }
+    return push_send_result(L, send_websocket(ws, std::string_view(message, len), opCodeToSend));
+}
+
+// ws:cork(fn): runs fn with the socket corked, so every send inside it goes out
+// in one write. fn's error is re-raised after uncorking.
+static int websocket_cork(lua_State *L) {
+    DawnWebSocket *ws = check_websocket(L);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    lua_settop(L, 2);
+    int status = LUA_OK;
+    if (ws) {
+        ws->cork([L, &status]() { status = lua_pcall(L, 0, 0, 0); });
+    } else {
+        status = lua_pcall(L, 0, 0, 0);
+    }
+    if (status != LUA_OK) return lua_error(L);
+    return 0;
+}
+
+// ws:handle() -> the integer handle uws.send accepts; still valid (and harmless)
+// after the socket closes.
+static int websocket_handle(lua_State *L) {
+    uint64_t handle = *static_cast<uint64_t *>(check_userdata(L, 1, ws_mt_ref, "websocket"));
+    lua_pushnumber(L, static_cast<lua_Number>(handle));
+    return 1;
+}
+
+// True if n is a whole number that fits uint64_t, so the cast is defined.
+static bool is_uint64(lua_Number n) {
+    return std::isfinite(n) && n >= 0 && n < 18446744073709551616.0 && n == std::floor(n);
+}
+
+// Resolves a handle (number) or socket id (string) at idx. A number that cannot
+// be a handle (negative, fractional, NaN, huge) names no socket.
+static DawnWebSocket *socket_from_lua(lua_State *L, int idx) {
+    if (lua_type(L, idx) == LUA_TNUMBER) {
+        lua_Number n = lua_tonumber(L, idx);
+        return is_uint64(n) ? lookup_socket(static_cast<uint64_t>(n)) : nullptr;
+    }
+    size_t len = 0;
+    const char *id = luaL_checklstring(L, idx, &len);
+    auto it = socket_ids.find(std::string(id, len));
+    return it == socket_ids.end() ? nullptr : lookup_socket(it->second);
+}
+
+// uws.send(handle_or_id, message [, opcode]) -> ok, status. Like ws:send, with
+// status "closed" when no socket of this loop has that handle/id.
+static int uw_send(lua_State *L) {
+    DawnWebSocket *ws = socket_from_lua(L, 1);
+    size_t len = 0;
+    const char *message = luaL_checklstring(L, 2, &len);
+    if (!ws) {
+        lua_pushboolean(L, 0);
+        lua_pushliteral(L, "closed");
+        return 2;
+    }
+    return push_send_result(L, send_websocket(ws, std::string_view(message, len), opt_opcode(L, 3, len, true)));
+}
+
+static int uw_is_open(lua_State *L) {
+    lua_pushboolean(L, socket_from_lua(L, 1) != nullptr);
+    return 1;
+}
+
+// ws:buffered() -> bytes in uWS's send buffer, bytes held in the drop_oldest
+// queue, and the number of messages dropped so far.
+static int websocket_buffered(lua_State *L) {
+    DawnWebSocket *ws = check_websocket(L);
+    if (!ws) {
+        lua_pushinteger(L, 0);
+        lua_pushinteger(L, 0);
+        lua_pushinteger(L, 0);
+        return 3;
+    }
+    WebSocketUserData *data = ws->getUserData();
+    lua_pushinteger(L, ws->getBufferedAmount());
+    lua_pushinteger(L, static_cast<lua_Integer>(data->queued_bytes));
+    lua_pushnumber(L, static_cast<lua_Number>(data->dropped));
+    return 3;
+}
+
+static int websocket_close(lua_State *L) {
+    DawnWebSocket *ws = check_websocket(L);
+    if (!ws) {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+    ws->close(); // Call close with no arguments
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// Lua function to get the WebSocket ID
+static int websocket_get_id(lua_State *L) {
+    DawnWebSocket *ws = check_websocket(L);
+    if (!ws) {
+        luaL_error(L, "websocket is closed");
+        return 0;
+    }
+
+    const std::string &id = ws->getUserData()->id;
+    lua_pushlstring(L, id.data(), id.size());
+    return 1;
+}
+
+// ws:subscribe(topic) / ws:unsubscribe(topic) on uWS's topic tree. Sockets are
+// unsubscribed from everything automatically when they close.
+static int websocket_subscribe(lua_State *L) {
+    DawnWebSocket *ws = check_websocket(L);
+    size_t len = 0;
+    const char *topic = luaL_checklstring(L, 2, &len);
+    lua_pushboolean(L, ws && ws->subscribe(std::string_view(topic, len)));
+    return 1;
+}
+
+static int websocket_unsubscribe(lua_State *L) {
+    DawnWebSocket *ws = check_websocket(L);
+    size_t len = 0;
+    const char *topic = luaL_checklstring(L, 2, &len);
+    lua_pushboolean(L, ws && ws->unsubscribe(std::string_view(topic, len)));
+    return 1;
+}
+
+static int websocket_is_subscribed(lua_State *L) {
+    DawnWebSocket *ws = check_websocket(L);
+    size_t len = 0;
+    const char *topic = luaL_checklstring(L, 2, &len);
+    lua_pushboolean(L, ws && ws->isSubscribed(std::string_view(topic, len)));
+    return 1;
+}
+
+// ws:publish(topic, payload [, opcode]) reaches every subscriber but the sender.
+static int websocket_publish(lua_State *L) {
+    DawnWebSocket *ws = check_websocket(L);
+    size_t topic_len = 0, len = 0;
+    const char *topic = luaL_checklstring(L, 2, &topic_len);
+    const char *message = luaL_checklstring(L, 3, &len);
+    lua_pushboolean(L, ws && ws->publish(std::string_view(topic, topic_len), std::string_view(message, len), opt_opcode(L, 4, len, false)));
+    return 1;
+}
+
+static void create_websocket_metatable(lua_State *L) {
+    luaL_newmetatable(L, "websocket");
+    lua_pushstring(L, "__index");
+    lua_newtable(L); // Metatable for methods
+    lua_pushcfunction(L, websocket_send);
+    lua_setfield(L, -2, "send");
+    lua_pushcfunction(L, websocket_close);
+    lua_setfield(L, -2, "close");
+    lua_pushcfunction(L, websocket_subscribe);
+    lua_setfield(L, -2, "subscribe");
+    lua_pushcfunction(L, websocket_unsubscribe);
+    lua_setfield(L, -2, "unsubscribe");
+    lua_pushcfunction(L, websocket_is_subscribed);
+    lua_setfield(L, -2, "is_subscribed");
+    lua_pushcfunction(L, websocket_publish);
+    lua_setfield(L, -2, "publish");
+    lua_pushcfunction(L, websocket_buffered);
+    lua_setfield(L, -2, "buffered");
+    lua_pushcfunction(L, websocket_handle);
+    lua_setfield(L, -2, "handle");
+    lua_pushcfunction(L, websocket_cork);
+    lua_setfield(L, -2, "cork");
+    lua_settable(L, -3); // Set __index to the methods table
+    lua_pushcfunction(L, websocket_get_id);
+    lua_setfield(L, -2, "get_id"); // DawnSockets reads it via getmetatable(ws).get_id
+    ws_mt_ref = luaL_ref(L, LUA_REGISTRYINDEX); // pops the metatable
+}
+
+static int req_getHeader(lua_State *L) {
+    RequestHandle *req = check_req(L);
+    size_t len = 0;
+    const char *header_name = luaL_checklstring(L, 2, &len);
+    std::string_view header_value = request_header(req, std::string_view(header_name, len));
+    lua_pushlstring(L, header_value.data(), header_value.length());
+    return 1;
+}
+
+static int req_getUrl(lua_State *L) {
+    RequestHandle *req = check_req(L);
+    std::string_view url = request_property(req, REQ_URL);
+    lua_pushlstring(L, url.data(), url.length());
+    return 1;
+}
+
+static void push_request_jwt(lua_State *L, const RequestHandle *h);
+
+// __index for req. Upvalue 1 is the methods table, so a method call costs one
+// rawget; upvalue 2 maps property names to their RequestProperty slot.
+static int req_index(lua_State *L) {
+    lua_pushvalue(L, 2);
+    lua_rawget(L, lua_upvalueindex(1));
+    if (!lua_isnil(L, -1)) return 1;
+    lua_pop(L, 1);
+
+    lua_pushvalue(L, 2);
+    lua_rawget(L, lua_upvalueindex(2));
+    int prop = static_cast<int>(lua_tointeger(L, -1));
+    lua_pop(L, 1);
+    if (prop == 0) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    RequestHandle *h = to_request(L, 1);
+    if (!h) return luaL_error(L, "request is no longer valid outside its handler");
+    if (prop == REQ_METHOD_ID) {
+        lua_pushinteger(L, static_cast<lua_Integer>(dawn::parse_method(request_property(h, REQ_METHOD))));
+        return 1;
+    }
+    unsigned bit = 1u << prop;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, h->cache_ref);
+    if (h->cached & bit) {
+        lua_rawgeti(L, -1, prop);
+        return 1;
+    }
+    if (prop == REQ_JWT) {
+        push_request_jwt(L, h);
+    } else {
+        std::string_view value = request_property(h, prop);
+        lua_pushlstring(L, value.data(), value.size());
+    }
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, -3, prop);
+    h->cached |= bit;
+    return 1;
+}
+
+static void create_metatables(lua_State *L) {
+    create_websocket_metatable(L);
+
+    static const luaL_Reg req_methods[] = {
+        {"getHeader", req_getHeader},
+        {"getUrl", req_getUrl},
+        {nullptr, nullptr}
+    };
+    luaL_newmetatable(L, "req");
+    luaL_newlib(L, req_methods);
+    lua_createtable(L, 0, REQ_PROPERTY_COUNT + 1);
+    lua_pushinteger(L, REQ_METHOD);
+    lua_setfield(L, -2, "method");
+    lua_pushinteger(L, REQ_URL);
+    lua_setfield(L, -2, "url");
+    lua_pushinteger(L, REQ_QUERY);
+    lua_setfield(L, -2, "query");
+    lua_pushinteger(L, REQ_JWT);
+    lua_setfield(L, -2, "jwt");
+    lua_pushinteger(L, REQ_METHOD_ID);
+    lua_setfield(L, -2, "method_id");
+    lua_pushcclosure(L, req_index, 2);
+    lua_setfield(L, -2, "__index");
+    req_mt_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    // res has no properties, so its __index is the methods table itself.
+    static const luaL_Reg res_methods[] = {
+        {"send", res_send},
+        {"writeHeader", res_writeHeader},
+        {"writeStatus", res_writeStatus},
+        {"getRemoteAddress", res_getRemoteAddress},
+        {"getRemoteAddressAsText", res_getRemoteAddressAsText},
+        {"getProxiedRemoteAddress", res_getProxiedRemoteAddress},
+        {"closeConnection", res_closeConnection},
+        {"cork", res_cork},
+        {"onAborted", res_onAborted},
+        {"aborted", res_aborted},
+        {nullptr, nullptr}
+    };
+    luaL_newmetatable(L, "res");
+    luaL_newlib(L, res_methods);
+    lua_setfield(L, -2, "__index");
+    res_mt_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+// Function to execute middleware. Every middleware and the final handler share
+// the same req/res objects from `call`.
+bool execute_middleware(lua_State *L, HttpCall &call, const std::string& route) {
+    for (const auto& mw : middlewares) {
+        if (mw.global || mw.route == route) {
+            lua_rawgeti(L, LUA_REGISTRYINDEX, mw.ref);
+            call.push(L);
+            if (lua_pcall(L, 2, 1, 0) != LUA_OK) {
+                shim_log().write(dawn::LOG_ERROR, "Lua middleware error: ", lua_tostring(L, -1));
+                lua_pop(L, 1);
+                return false; // Middleware error, stop processing
+            }
+
+            if (lua_isboolean(L, -1) && !lua_toboolean(L, -1)) {
+                lua_pop(L, 1); // Remove boolean return
+                return false; // Middleware returned false, stop processing
+            }
+            lua_pop(L, 1); // Remove boolean return
+        }
+    }
+    return true; // Continue processing if no middleware returned false
+}
+
+// Function to add middleware
+int uw_use(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    lua_pushvalue(L, 1);
+    int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    Middleware mw;
+    mw.ref = ref;
+    mw.global = true;
+
+    if (lua_gettop(L) > 1 && lua_isstring(L, 2)) {
+        mw.global = false;
+        mw.route = luaL_checkstring(L, 2);
+    }
+    middlewares.push_back(mw);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// Cap on what a Content-Length header alone can make us reserve up front.
+static constexpr size_t BODY_RESERVE_LIMIT = 1 << 20;
+
+// A JSON value decoded natively and handed to Lua as a lazy view: indexing walks
+// the document's tape and only converts what is read. Scalars come back as Lua
+// values, objects and arrays as further views; the document lives as long as any
+// view of it does. null is pushed as lightuserdata NULL, the same value as cjson.null.
+// Views are opt-in: they support indexing, # and pairs (where the Lua build honours
+// __pairs), but type() says "userdata" and cjson cannot encode them, so code that
+// needs a real table calls uws.json_totable.
+struct JsonView {
+    std::shared_ptr<const dawn::JsonDocument> doc;
+    uint32_t node;
+};
+
+static void push_json_value(lua_State *L, const std::shared_ptr<const dawn::JsonDocument> &doc, uint32_t i) {
+    const dawn::JsonNode &n = doc->node(i);
+    switch (n.type) {
+    case dawn::JsonType::NUL:
+        lua_pushlightuserdata(L, nullptr);
+        break;
+    case dawn::JsonType::FALSE:
+    case dawn::JsonType::TRUE:
+        lua_pushboolean(L, n.type == dawn::JsonType::TRUE);
+        break;
+    case dawn::JsonType::NUMBER:
+        lua_pushnumber(L, doc->number(i));
+        break;
+    case dawn::JsonType::STRING: {
+        std::string scratch;
+        std::string_view str = doc->string(i, scratch);
+        lua_pushlstring(L, str.data(), str.size());
+        break;
+    }
+    default:
+        new (lua_newuserdata(L, sizeof(JsonView))) JsonView{doc, i};
+        lua_rawgeti(L, LUA_REGISTRYINDEX, json_mt_ref);
+        lua_setmetatable(L, -2);
+        break;
+    }
+}
+
+// Converts a whole subtree into plain Lua tables.
+static void push_json_table(lua_State *L, const dawn::JsonDocument &doc, uint32_t i) {
+    luaL_checkstack(L, 3, "JSON document nested too deeply");
+    const dawn::JsonNode &n = doc.node(i);
+    std::string scratch;
+    switch (n.type) {
+    case dawn::JsonType::OBJECT: {
+        lua_createtable(L, 0, static_cast<int>(n.count));
+        uint32_t k = i + 1;
+        for (uint32_t m = 0; m < n.count; ++m) {
+            std::string_view key = doc.string(k, scratch);
+            lua_pushlstring(L, key.data(), key.size());
+            push_json_table(L, doc, k + 1);
+            lua_rawset(L, -3);
+            k = doc.node(k + 1).next;
+        }
+        break;
+    }
+    case dawn::JsonType::ARRAY: {
+        lua_createtable(L, static_cast<int>(n.count), 0);
+        uint32_t e = i + 1;
+        for (uint32_t m = 1; m <= n.count; ++m) {
+            push_json_table(L, doc, e);
+            lua_rawseti(L, -2, static_cast<int>(m));
+            e = doc.node(e).next;
+        }
+        break;
+    }
+    case dawn::JsonType::NUL:
+        lua_pushlightuserdata(L, nullptr);
+        break;
+    case dawn::JsonType::FALSE:
+    case dawn::JsonType::TRUE:
+        lua_pushboolean(L, n.type == dawn::JsonType::TRUE);
+        break;
+    case dawn::JsonType::NUMBER:
+        lua_pushnumber(L, doc.number(i));
+        break;
+    case dawn::JsonType::STRING: {
+        std::string_view str = doc.string(i, scratch);
+        lua_pushlstring(L, str.data(), str.size());
+        break;
+    }
+    }
+}
+
+// Parses `text` and pushes the root value, as tables or as a lazy view. Any JSON
+// value may be the root, scalars included. On malformed input pushes the text
+// unchanged and returns the error, so the caller can report it.
+static const char *push_json_body(lua_State *L, std::string text, bool lazy) {
+    auto doc = std::make_shared<dawn::JsonDocument>();
+    if (!doc->parse(std::move(text))) {
+        std::string_view source = doc->source();
+        lua_pushlstring(L, source.data(), source.size());
+        return doc->error();
+    }
+    if (lazy) {
+        push_json_value(L, doc, 0);
+    } else {
+        push_json_table(L, *doc, 0);
+    }
+    return nullptr;
+}
+
+static JsonView *check_json(lua_State *L, int idx) {
+    return static_cast<JsonView *>(check_userdata(L, idx, json_mt_ref, "json"));
+}
+
+// view.key for objects, view[n] (1-based) for arrays.
+static int json_index(lua_State *L) {
+    JsonView *view = check_json(L, 1);
+    const dawn::JsonDocument &doc = *view->doc;
+    uint32_t found = dawn::JsonDocument::NONE;
+    if (doc.node(view->node).type == dawn::JsonType::OBJECT) {
+        size_t len = 0;
+        const char *key = lua_type(L, 2) == LUA_TSTRING ? lua_tolstring(L, 2, &len) : nullptr;
+        if (key) found = doc.find(view->node, std::string_view(key, len));
+    } else if (lua_type(L, 2) == LUA_TNUMBER) {
+        lua_Integer index = lua_tointeger(L, 2);
+        if (index >= 1) found = doc.at(view->node, static_cast<uint32_t>(index - 1));
+    }
+    if (found == dawn::JsonDocument::NONE) {
+        lua_pushnil(L);
+        return 1;
+    }
+    push_json_value(L, view->doc, found);
+    return 1;
+}
+
+// #view: the element count of an array and, as for a Lua table, 0 for an object.
+static int json_len(lua_State *L) {
+    JsonView *view = check_json(L, 1);
+    const dawn::JsonNode &n = view->doc->node(view->node);
+    lua_pushinteger(L, n.type == dawn::JsonType::ARRAY ? n.count : 0);
+    return 1;
+}
+
+// The iterator __pairs returns. Upvalue 1 is the tape index of the key (objects)
+// or element (arrays) returned last, NONE before the first; upvalue 2 is the
+// element's 1-based position. Each step is O(1).
+static int json_pairs_next(lua_State *L) {
+    JsonView *view = check_json(L, 1);
+    const dawn::JsonDocument &doc = *view->doc;
+    const dawn::JsonNode &n = doc.node(view->node);
+    auto last = static_cast<uint32_t>(lua_tointeger(L, lua_upvalueindex(1)));
+    lua_Integer position = lua_tointeger(L, lua_upvalueindex(2)) + 1;
+    uint32_t found = dawn::JsonDocument::NONE;
+    if (n.type == dawn::JsonType::OBJECT) {
+        found = doc.next_member(view->node, last);
+    } else if (position <= static_cast<lua_Integer>(n.count)) {
+        found = last == dawn::JsonDocument::NONE ? view->node + 1 : doc.node(last).next;
+    }
+    if (found == dawn::JsonDocument::NONE) {
+        lua_pushnil(L);
+        return 1;
+    }
+    lua_pushinteger(L, found);
+    lua_replace(L, lua_upvalueindex(1));
+    lua_pushinteger(L, position);
+    lua_replace(L, lua_upvalueindex(2));
+    if (n.type == dawn::JsonType::OBJECT) {
+        std::string scratch;
+        std::string_view key = doc.string(found, scratch);
+        lua_pushlstring(L, key.data(), key.size());
+        push_json_value(L, view->doc, found + 1);
+    } else {
+        lua_pushinteger(L, position);
+        push_json_value(L, view->doc, found);
+    }
+    return 2;
+}
+
+static int json_pairs(lua_State *L) {
+    check_json(L, 1);
+    lua_pushinteger(L, dawn::JsonDocument::NONE);
+    lua_pushinteger(L, 0);
+    lua_pushcclosure(L, json_pairs_next, 2);
+    lua_pushvalue(L, 1);
+    lua_pushnil(L);
+    return 3;
+}
+
+static int json_tostring(lua_State *L) {
+    JsonView *view = check_json(L, 1);
+    std::string_view raw = view->doc->raw(view->node);
+    lua_pushlstring(L, raw.data(), raw.size());
+    return 1;
+}
+
+static int json_gc(lua_State *L) {
+    check_json(L, 1)->~JsonView();
+    return 0;
+}
+
+static void create_json_metatable(lua_State *L) {
+    luaL_newmetatable(L, "json");
+    lua_pushcfunction(L, json_index);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, json_len);
+    lua_setfield(L, -2, "__len");
+    lua_pushcfunction(L, json_pairs);
+    lua_setfield(L, -2, "__pairs");
+    lua_pushcfunction(L, json_tostring);
+    lua_setfield(L, -2, "__tostring");
+    lua_pushcfunction(L, json_gc);
+    lua_setfield(L, -2, "__gc");
+    json_mt_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+// uws.json_decode(text [, lazy]): the decoded value for valid JSON, as plain
+// tables or, with lazy = true, as a lazy view; otherwise nil and an error message.
+static int uw_json_decode(lua_State *L) {
+    size_t len = 0;
+    const char *text = luaL_checklstring(L, 1, &len);
+    auto doc = std::make_shared<dawn::JsonDocument>();
+    if (!doc->parse(std::string(text, len))) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "%s at offset %d", doc->error(), static_cast<int>(doc->error_offset()));
+        return 2;
+    }
+    if (lua_toboolean(L, 2)) {
+        push_json_value(L, doc, 0);
+    } else {
+        push_json_table(L, *doc, 0);
+    }
+    return 1;
+}
+
+// uws.json_totable(value): fully converts a view into Lua tables; any other
+// value is returned unchanged.
+static int uw_json_totable(lua_State *L) {
+    luaL_checkany(L, 1);
+    void *p = lua_touserdata(L, 1);
+    if (p && lua_getmetatable(L, 1)) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, json_mt_ref);
+        bool is_view = lua_rawequal(L, -1, -2);
+        lua_pop(L, 2);
+        if (is_view) {
+            auto *view = static_cast<JsonView *>(p);
+            push_json_table(L, *view->doc, view->node);
+            return 1;
+        }
+    }
+    lua_pushvalue(L, 1);
+    return 1;
+}
+
+static bool is_json_content(std::string_view content_type) {
+    return content_type.find("application/json") != std::string_view::npos;
+}
+
+static std::string_view check_string_view(lua_State *L, int idx) {
+    size_t len = 0;
+    const char *s = luaL_checklstring(L, idx, &len);
+    return std::string_view(s, len);
+}
+
+// HS256 signing key and verified-token cache for one secret. Apps use one secret,
+// or a few during a rotation, so the map is simply emptied if it ever grows past
+// JWT_MAX_SECRETS.
+struct JwtSecret {
+    dawn::HmacSha256 key;
+    dawn::JwtCache cache;
+
+    explicit JwtSecret(std::string_view secret) : key(secret) {}
+};
+
+static constexpr size_t JWT_MAX_SECRETS = 16;
+static thread_local std::unordered_map<std::string, std::shared_ptr<JwtSecret>> jwt_secrets;
+
+static const std::shared_ptr<JwtSecret> &jwt_secret_for(std::string_view secret) {
+    std::string key(secret);
+    auto it = jwt_secrets.find(key);
+    if (it != jwt_secrets.end()) return it->second;
+    if (jwt_secrets.size() >= JWT_MAX_SECRETS) jwt_secrets.clear();
+    auto entry = std::make_shared<JwtSecret>(key);
+    return jwt_secrets.emplace(std::move(key), std::move(entry)).first->second;
+}
+
+static JwtSecret &jwt_secret(lua_State *L, int idx) {
+    return *jwt_secret_for(check_string_view(L, idx));
+}
+
+// uws.jwt.sign(payload_json, secret): HS256 token for an already encoded payload.
+static int jwt_sign(lua_State *L) {
+    std::string_view payload = check_string_view(L, 1);
+    std::string token = dawn::jwt_sign(jwt_secret(L, 2).key, payload);
+    lua_pushlstring(L, token.data(), token.size());
+    return 1;
+}
+
+// Checks token under secret, from the cache when it verified before; the time
+// claims are checked either way. nullptr (and error) if it does not pass.
+static const dawn::JwtToken *verify_cached(JwtSecret &secret, std::string_view token, double now, double leeway,
+                                           bool verify_exp, bool verify_nbf, dawn::JwtError &error) {
+    const dawn::JwtToken *verified = secret.cache.find(token);
+    if (!verified) {
+        dawn::JwtToken decoded;
+        error = dawn::jwt_decode(secret.key, token, decoded);
+        if (error != dawn::JwtError::NONE) return nullptr;
+        secret.cache.insert(token, std::move(decoded));
+        verified = secret.cache.find(token);
+    }
+    error = dawn::jwt_check_time(*verified, now, leeway, verify_exp, verify_nbf);
+    if (error == dawn::JwtError::NONE) return verified;
+    if (error == dawn::JwtError::EXPIRED) secret.cache.erase(token);
+    return nullptr;
+}
+
+// uws.jwt.verify(token, secret [, opts]): the payload as a table, or nil and an
+// error code (invalid_token, invalid_algorithm, invalid_signature, invalid_payload,
+// token_expired, token_not_yet_valid). opts: verify_exp and verify_nbf (default
+// true), leeway in seconds, now (default os.time()). Tokens that verified are
+// cached per secret, so repeat requests skip the HMAC; time claims are still
+// checked on every call.
+static int jwt_verify(lua_State *L) {
+    std::string_view token = check_string_view(L, 1);
+    JwtSecret &secret = jwt_secret(L, 2);
+    bool verify_exp = true, verify_nbf = true;
+    double leeway = 0, now = static_cast<double>(std::time(nullptr));
+    if (lua_istable(L, 3)) {
+        lua_getfield(L, 3, "verify_exp");
+        if (!lua_isnil(L, -1)) verify_exp = lua_toboolean(L, -1);
+        lua_getfield(L, 3, "verify_nbf");
+        if (!lua_isnil(L, -1)) verify_nbf = lua_toboolean(L, -1);
+        lua_getfield(L, 3, "leeway");
+        if (lua_isnumber(L, -1)) leeway = lua_tonumber(L, -1);
+        lua_getfield(L, 3, "now");
+        if (lua_isnumber(L, -1)) now = lua_tonumber(L, -1);
+        lua_pop(L, 4);
+    }
+
+    dawn::JwtError error = dawn::JwtError::NONE;
+    const dawn::JwtToken *verified = verify_cached(secret, token, now, leeway, verify_exp, verify_nbf, error);
+    if (!verified) {
+        lua_pushnil(L);
+        lua_pushstring(L, dawn::jwt_error_code(error));
+        return 2;
+    }
+    push_json_table(L, *verified->payload, 0);
+    return 1;
+}
+
+// uws.jwt.sha256(data) / sha256_hex(data) / hmac_sha256(key, data): raw digests,
+// or lowercase hex for sha256_hex.
+static int jwt_sha256(lua_State *L) {
+    std::string digest = dawn::sha256(check_string_view(L, 1));
+    lua_pushlstring(L, digest.data(), digest.size());
+    return 1;
+}
+
+static int jwt_sha256_hex(lua_State *L) {
+    std::string hex = dawn::to_hex(dawn::sha256(check_string_view(L, 1)));
+    lua_pushlstring(L, hex.data(), hex.size());
+    return 1;
+}
+
+static int jwt_hmac_sha256(lua_State *L) {
+    std::string_view key = check_string_view(L, 1);
+    std::string_view data = check_string_view(L, 2);
+    uint8_t digest[dawn::Sha256::DIGEST_SIZE];
+    dawn::HmacSha256(key).sign(data, digest);
+    lua_pushlstring(L, reinterpret_cast<const char *>(digest), sizeof(digest));
+    return 1;
+}
+
+// uws.jwt.base64url_encode(data) (unpadded) / base64url_decode(text) (nil if malformed).
+static int jwt_base64url_encode(lua_State *L) {
+    std::string out;
+    dawn::base64url_encode(check_string_view(L, 1), out);
+    lua_pushlstring(L, out.data(), out.size());
+    return 1;
+}
+
+static int jwt_base64url_decode(lua_State *L) {
+    std::string out;
+    if (!dawn::base64url_decode(check_string_view(L, 1), out)) {
+        lua_pushnil(L);
+        return 1;
+    }
+    lua_pushlstring(L, out.data(), out.size());
+    return 1;
+}
+
+// uws.jwt.equal(a, b): constant-time string comparison.
+static int jwt_equal(lua_State *L) {
+    lua_pushboolean(L, dawn::constant_time_equal(check_string_view(L, 1), check_string_view(L, 2)));
+    return 1;
+}
+
+// Rate limiters are process-wide: uws.rate_limiter(name, ...) returns the same
+// limiter in every worker, so a client is limited as a whole however its
+// connections are spread over the loops. Every worker asks for a name with the
+// same options; asking for an existing name with different ones is an error
+// rather than a limiter silently configured by whichever call came first.
+static std::mutex rate_limiters_mutex;
+static std::unordered_map<std::string, std::shared_ptr<dawn::RateLimiter>> rate_limiters;
+
+// opts at idx (may be absent): rate (per period, default 60), period (seconds,
+// default 60), burst (default rate), capacity (keys kept, default 65536).
+static std::shared_ptr<dawn::RateLimiter> rate_limiter_for(lua_State *L, const std::string &name, int idx) {
+    double rate = 60, period = 60, burst = 0;
+    size_t capacity = 65536;
+    if (lua_istable(L, idx)) {
+        lua_getfield(L, idx, "rate");
+        if (lua_isnumber(L, -1)) rate = lua_tonumber(L, -1);
+        lua_getfield(L, idx, "period");
+        if (lua_isnumber(L, -1)) period = lua_tonumber(L, -1);
+        lua_getfield(L, idx, "burst");
+        if (lua_isnumber(L, -1)) burst = lua_tonumber(L, -1);
+        lua_getfield(L, idx, "capacity");
+        if (lua_isnumber(L, -1)) capacity = static_cast<size_t>(std::max<lua_Number>(1, lua_tonumber(L, -1)));
+        lua_pop(L, 4);
+    }
+    if (rate <= 0 || period <= 0) luaL_error(L, "rate limiter '%s': rate and period must be positive", name.c_str());
+    if (burst <= 0) burst = rate;
+
+    std::shared_ptr<dawn::RateLimiter> limiter;
+    bool mismatch = false;
+    {
+        std::lock_guard<std::mutex> lock(rate_limiters_mutex);
+        auto &entry = rate_limiters[name];
+        if (!entry) entry = std::make_shared<dawn::RateLimiter>(rate, period, burst, capacity);
+        mismatch = !entry->same_options(rate, period, burst, capacity);
+        limiter = entry;
+    }
+    // Raised outside the lock: luaL_error does not return.
+    if (mismatch) luaL_error(L, "rate limiter '%s' already exists with different options", name.c_str());
+    return limiter;
+}
+
+static std::shared_ptr<dawn::RateLimiter> &check_rate_limiter(lua_State *L) {
+    auto **slot = static_cast<std::shared_ptr<dawn::RateLimiter> **>(check_userdata(L, 1, rate_limiter_mt_ref, "rate_limiter"));
+    if (!*slot) luaL_error(L, "rate limiter has been collected");
+    return **slot;
+}
+
+// limiter:check(key [, cost]): true and the requests left, or false, 0 and the
+// seconds to wait before trying again.
+static int rate_limiter_check(lua_State *L) {
+    auto &limiter = check_rate_limiter(L);
+    std::string_view key = check_string_view(L, 2);
+    double cost = luaL_optnumber(L, 3, 1);
+    dawn::RateLimitResult result = limiter->check(key, dawn::RateLimiter::now_ns(), cost);
+    lua_pushboolean(L, result.allowed);
+    lua_pushinteger(L, static_cast<lua_Integer>(result.remaining));
+    lua_pushnumber(L, static_cast<lua_Number>(result.retry_after_ns) / 1e9);
+    return 3;
+}
+
+static int rate_limiter_reset(lua_State *L) {
+    check_rate_limiter(L)->reset(check_string_view(L, 2));
+    return 0;
+}
+
+static int rate_limiter_size(lua_State *L) {
+    lua_pushinteger(L, static_cast<lua_Integer>(check_rate_limiter(L)->size()));
+    return 1;
+}
+
+static int rate_limiter_gc(lua_State *L) {
+    auto **slot = static_cast<std::shared_ptr<dawn::RateLimiter> **>(check_userdata(L, 1, rate_limiter_mt_ref, "rate_limiter"));
+    delete *slot;
+    *slot = nullptr;
+    return 0;
+}
+
+static void create_rate_limiter_metatable(lua_State *L) {
+    static const luaL_Reg methods[] = {
+        {"check", rate_limiter_check},
+        {"reset", rate_limiter_reset},
+        {"size", rate_limiter_size},
+        {nullptr, nullptr}
+    };
+    luaL_newmetatable(L, "rate_limiter");
+    luaL_newlib(L, methods);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, rate_limiter_gc);
+    lua_setfield(L, -2, "__gc");
+    rate_limiter_mt_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+// uws.rate_limiter(name [, opts]): the process-wide GCRA limiter called name,
+// created with opts (see rate_limiter_for) on first use. Keys are any strings;
+// res:getRemoteAddress() gives a compact one per client.
+static int uw_rate_limiter(lua_State *L) {
+    std::string name = luaL_checkstring(L, 1);
+    auto limiter = rate_limiter_for(L, name, 2);
+    auto **slot = static_cast<std::shared_ptr<dawn::RateLimiter> **>(lua_newuserdata(L, sizeof(void *)));
+    *slot = nullptr;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, rate_limiter_mt_ref);
+    lua_setmetatable(L, -2);
+    *slot = new std::shared_ptr<dawn::RateLimiter>(std::move(limiter));
+    return 1;
+}
+
+// Native guard stage. uws.guard registers declarative checks that run in C++ for
+// every request under a path prefix, before any Lua middleware or handler, so
+// requests they reject (or preflights they answer) never enter the Lua VM. Per
+// guard the order is: IP lists (403), rate limit (429), CORS preflight (204),
+// required headers (400), bearer JWT (401); a rate limit keyed by the token's
+// subject comes after the JWT check instead. Preflights skip headers and JWT,
+// since browsers send them without credentials.
+struct JwtRule {
+    std::shared_ptr<JwtSecret> secret;
+    std::string header = "authorization";
+    double leeway = 0;
+    bool verify_nbf = true;
+    std::string type;     // a "type" claim, if present, must equal this (e.g. "access")
+    std::string issuer;   // required "iss"
+    std::string audience; // required in "aud", a string or an array
+};
+
+struct RateRule {
+    enum class Key { IP, HEADER, SUBJECT };
+
+    std::shared_ptr<dawn::RateLimiter> limiter;
+    Key key = Key::IP;
+    std::string header;    // for Key::HEADER; lowercase
+    bool per_path = false; // count each path separately
+    double cost = 1;
+};
+
+struct NativeGuard {
+    std::string prefix; // empty = every request
+    dawn::IpRangeList allow_ips;
+    dawn::IpRangeList deny_ips;
+    std::vector<std::string> required_headers; // lowercase
+    std::unique_ptr<dawn::CorsPolicy> cors;
+    std::unique_ptr<JwtRule> jwt;
+    std::unique_ptr<RateRule> rate;
+};
+
+static thread_local std::vector<std::unique_ptr<NativeGuard>> guards;
+
+// The token of an "Authorization: Bearer <token>" value, or empty.
+static std::string_view bearer_token(std::string_view value) {
+    static constexpr std::string_view scheme = "bearer";
+    if (value.size() <= scheme.size()) return {};
+    for (size_t i = 0; i < scheme.size(); ++i) {
+        if ((value[i] | 0x20) != scheme[i]) return {};
+    }
+    size_t start = scheme.size();
+    if (value[start] != ' ' && value[start] != '\t') return {};
+    while (start < value.size() && (value[start] == ' ' || value[start] == '\t')) ++start;
+    size_t end = value.size();
+    while (end > start && (value[end - 1] == ' ' || value[end - 1] == '\t')) --end;
+    return value.substr(start, end - start);
+}
+
+static bool string_claim_is(const dawn::JsonDocument &doc, uint32_t node, std::string_view expected) {
+    std::string scratch;
+    return doc.node(node).type == dawn::JsonType::STRING && doc.string(node, scratch) == expected;
+}
+
+// nullptr if the request's token passes rule (verified then points at it),
+// otherwise the 401 message.
+static const char *check_guard_jwt(const JwtRule &rule, std::string_view header_value, const dawn::JwtToken *&verified) {
+    std::string_view token = bearer_token(header_value);
+    if (token.empty()) return "Missing token";
+    dawn::JwtError error = dawn::JwtError::NONE;
+    verified = verify_cached(*rule.secret, token, static_cast<double>(std::time(nullptr)),
+                             rule.leeway, true, rule.verify_nbf, error);
+    if (!verified) return dawn::jwt_error_message(error);
+
+    const dawn::JsonDocument &claims = *verified->payload;
+    if (!rule.type.empty()) {
+        uint32_t type = claims.find(0, "type");
+        if (type != dawn::JsonDocument::NONE && !string_claim_is(claims, type, rule.type)) return "Wrong token type";
+    }
+    if (!rule.issuer.empty()) {
+        uint32_t iss = claims.find(0, "iss");
+        if (iss == dawn::JsonDocument::NONE || !string_claim_is(claims, iss, rule.issuer)) return "Issuer mismatch";
+    }
+    if (!rule.audience.empty()) {
+        uint32_t aud = claims.find(0, "aud");
+        bool found = aud != dawn::JsonDocument::NONE && string_claim_is(claims, aud, rule.audience);
+        if (!found && aud != dawn::JsonDocument::NONE && claims.node(aud).type == dawn::JsonType::ARRAY) {
+            for (uint32_t i = 0; !found && i < claims.node(aud).count; ++i) {
+                found = string_claim_is(claims, claims.at(aud, i), rule.audience);
+            }
+        }
+        if (!found) return "Audience mismatch";
+    }
+    return nullptr;
+}
+
+static void answer_preflight(uWS::HttpResponse<false> *res, uWS::HttpRequest *req, const dawn::CorsPolicy &cors,
+                             std::string_view origin) {
+    if (!cors.allows(origin)) {
+        res->writeStatus("403 Forbidden")->writeHeader("Content-Type", "text/plain")->end("Origin not allowed");
+        return;
+    }
+    res->writeStatus("204 No Content");
+    if (cors.wildcard()) {
+        res->writeHeader("Access-Control-Allow-Origin", "*");
+    } else {
+        res->writeHeader("Access-Control-Allow-Origin", origin);
+        res->writeHeader("Vary", "Origin");
+    }
+    if (cors.credentials) res->writeHeader("Access-Control-Allow-Credentials", "true");
+    res->writeHeader("Access-Control-Allow-Methods", cors.methods);
+    std::string_view headers = cors.headers;
+    if (headers.empty()) headers = req->getHeader("access-control-request-headers");
+    if (!headers.empty()) res->writeHeader("Access-Control-Allow-Headers", headers);
+    res->writeHeader("Access-Control-Max-Age", cors.max_age);
+    res->end();
+}
+
+// Counts the request against rule; false (after answering 429) once the key is
+// over its rate. Keys fall back to the peer address when their header or claim
+// is missing, and are tagged by kind so one limiter can serve several guards.
+static bool check_guard_rate(uWS::HttpResponse<false> *res, uWS::HttpRequest *req, const RateRule &rule,
+                             const dawn::JwtToken *verified) {
+    std::string key;
+    if (rule.key == RateRule::Key::HEADER) {
+        std::string_view value = req->getHeader(rule.header);
+        if (!value.empty()) key.append("h").append(value);
+    } else if (rule.key == RateRule::Key::SUBJECT && verified) {
+        const dawn::JsonDocument &claims = *verified->payload;
+        uint32_t sub = claims.find(0, "sub");
+        std::string scratch;
+        if (sub != dawn::JsonDocument::NONE && claims.node(sub).type == dawn::JsonType::STRING) {
+            key.append("s").append(claims.string(sub, scratch));
+        }
+    }
+    if (key.empty()) key.append("i").append(res->getRemoteAddress());
+    if (rule.per_path) key.append(1, '\0').append(req->getUrl());
+
+    dawn::RateLimitResult result = rule.limiter->check(key, dawn::RateLimiter::now_ns(), rule.cost);
+    if (result.allowed) return true;
+    int64_t retry_after = std::max<int64_t>(1, (result.retry_after_ns + 999999999) / 1000000000);
+    res->writeStatus("429 Too Many Requests")
+        ->writeHeader("Retry-After", std::to_string(retry_after))
+        ->writeHeader("Content-Type", "text/plain")
+        ->end("Too Many Requests");
+    return false;
+}
+
+// Runs the guards matching the request's path. Returns false once one of them
+// has answered the request; otherwise jwt_guard is set to the guard whose token
+// check passed, if any, for req.jwt.
+static bool run_guards(uWS::HttpResponse<false> *res, uWS::HttpRequest *req, const NativeGuard *&jwt_guard) {
+    if (guards.empty()) return true;
+    std::string_view url = req->getUrl();
+    bool preflight = dawn::parse_method(req->getMethod()) == dawn::HttpMethod::OPTIONS &&
+                     !req->getHeader("access-control-request-method").empty();
+    std::string_view origin = preflight ? req->getHeader("origin") : std::string_view();
+    preflight = preflight && !origin.empty();
+
+    for (const auto &guard : guards) {
+        // Matched as the router matches routes, so no spelling of a guarded path
+        // ("/ADMIN/x", "//admin/x") reaches its route unguarded.
+        if (!dawn::path_under_prefix(url, guard->prefix)) continue;
+
+        if (!guard->allow_ips.empty() || !guard->deny_ips.empty()) {
+            std::string_view address = res->getRemoteAddress();
+            if (guard->deny_ips.contains(address) || (!guard->allow_ips.empty() && !guard->allow_ips.contains(address))) {
+                res->writeStatus("403 Forbidden")->writeHeader("Content-Type", "text/plain")->end("Forbidden");
+                return false;
+            }
+        }
+        bool rate_after_jwt = guard->rate && guard->rate->key == RateRule::Key::SUBJECT && guard->jwt;
+        if (guard->rate && !rate_after_jwt && !check_guard_rate(res, req, *guard->rate, nullptr)) return false;
+        if (preflight) {
+            if (!guard->cors) continue;
+            answer_preflight(res, req, *guard->cors, origin);
+            return false;
+        }
+        for (const std::string &name : guard->required_headers) {
+            if (req->getHeader(name).empty()) {
+                res->writeStatus("400 Bad Request")->writeHeader("Content-Type", "text/plain")->end("Missing required header: " + name);
+                return false;
+            }
+        }
+        if (guard->jwt) {
+            const dawn::JwtToken *verified = nullptr;
+            if (const char *message = check_guard_jwt(*guard->jwt, req->getHeader(guard->jwt->header), verified)) {
+                res->writeStatus("401 Unauthorized")->writeHeader("Content-Type", "application/json")
+                    ->end(std::string("{\"error\":\"") + message + "\"}");
+                return false;
+            }
+            jwt_guard = guard.get();
+            if (rate_after_jwt && !check_guard_rate(res, req, *guard->rate, verified)) return false;
+        }
+    }
+    return true;
+}
+
+// req.jwt: the claims of the token a guard verified, from the cache it went into.
+static void push_request_jwt(lua_State *L, const RequestHandle *h) {
+    if (!h->jwt_guard) {
+        lua_pushnil(L);
+        return;
+    }
+    const JwtRule &rule = *h->jwt_guard->jwt;
+    dawn::JwtError error = dawn::JwtError::NONE;
+    const dawn::JwtToken *verified = verify_cached(*rule.secret, bearer_token(request_header(h, rule.header)),
+                                                   0, 0, false, false, error);
+    if (!verified) {
+        lua_pushnil(L);
+        return;
+    }
+    push_json_table(L, *verified->payload, 0);
+}
+
+static std::string string_field(lua_State *L, int idx, const char *name, std::string fallback = {}) {
+    lua_getfield(L, idx, name);
+    if (lua_type(L, -1) == LUA_TSTRING) {
+        size_t len = 0;
+        const char *s = lua_tolstring(L, -1, &len);
+        fallback.assign(s, len);
+    }
+    lua_pop(L, 1);
+    return fallback;
+}
+
+// Calls f(string) for each string in the array at idx[name].
+template <typename F>
+static void each_string_field(lua_State *L, int idx, const char *name, F &&f) {
+    lua_getfield(L, idx, name);
+    if (lua_istable(L, -1)) {
+        int n = static_cast<int>(lua_objlen(L, -1));
+        for (int i = 1; i <= n; ++i) {
+            lua_rawgeti(L, -1, i);
+            size_t len = 0;
+            const char *s = lua_type(L, -1) == LUA_TSTRING ? lua_tolstring(L, -1, &len) : nullptr;
+            if (s) f(std::string_view(s, len));
+            lua_pop(L, 1);
+        }
+    }
+    lua_pop(L, 1);
+}
+
+// uws.guard(opts [, prefix]): adds a native guard for requests whose path is under
+// prefix, compared by whole segments as routes are (all requests without one). opts:
+//   allow_ips / deny_ips = { "10.0.0.0/8", "::1", ... }
+//   require_headers = { "x-api-key", ... }
+//   cors = true | { origins = "*" | { ... }, methods, headers, max_age, credentials }
+//   jwt = { secret, header = "authorization", leeway, verify_nbf, type, issuer, audience }
+//   rate_limit = { name, rate, period, burst, capacity, key = "ip" | "sub" |
+//                  "header:<name>", per_path, cost }
+// (name defaults to one per prefix and position, the same in every worker, so
+// workers share the limiter.) Guards run in registration order; a request that passes a jwt guard has the
+// token's claims in req.jwt. Returns true.
+static int uw_guard(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    auto guard = std::make_unique<NativeGuard>();
+    if (lua_type(L, 2) == LUA_TSTRING) guard->prefix = lua_tostring(L, 2);
+
+    const char *bad_range = nullptr;
+    each_string_field(L, 1, "allow_ips", [&](std::string_view s) {
+        if (!guard->allow_ips.add(s) && !bad_range) bad_range = "allow_ips";
+    });
+    each_string_field(L, 1, "deny_ips", [&](std::string_view s) {
+        if (!guard->deny_ips.add(s) && !bad_range) bad_range = "deny_ips";
+    });
+    if (bad_range) return luaL_error(L, "uws.guard: invalid address or range in %s", bad_range);
+    each_string_field(L, 1, "require_headers", [&](std::string_view s) {
+        std::string name(s);
+        for (char &c : name) c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+        guard->required_headers.push_back(std::move(name));
+    });
+
+    lua_getfield(L, 1, "cors");
+    int cors = lua_gettop(L);
+    if (lua_toboolean(L, cors)) {
+        auto policy = std::make_unique<dawn::CorsPolicy>();
+        if (lua_istable(L, cors)) {
+            each_string_field(L, cors, "origins", [&](std::string_view s) { policy->origins.emplace_back(s); });
+            policy->methods = string_field(L, cors, "methods", policy->methods);
+            policy->headers = string_field(L, cors, "headers");
+            lua_getfield(L, cors, "max_age");
+            if (lua_isnumber(L, -1)) policy->max_age = std::to_string(static_cast<long>(lua_tonumber(L, -1)));
+            lua_getfield(L, cors, "credentials");
+            policy->credentials = lua_toboolean(L, -1);
+            lua_pop(L, 2);
+        }
+        guard->cors = std::move(policy);
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "jwt");
+    int jwt = lua_gettop(L);
+    if (lua_istable(L, jwt)) {
+        lua_getfield(L, jwt, "secret");
+        if (lua_type(L, -1) != LUA_TSTRING) return luaL_error(L, "uws.guard: jwt.secret must be a string");
+        auto rule = std::make_unique<JwtRule>();
+        rule->secret = jwt_secret_for(check_string_view(L, -1));
+        lua_pop(L, 1);
+        rule->header = string_field(L, jwt, "header", rule->header);
+        for (char &c : rule->header) c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+        lua_getfield(L, jwt, "leeway");
+        if (lua_isnumber(L, -1)) rule->leeway = lua_tonumber(L, -1);
+        lua_getfield(L, jwt, "verify_nbf");
+        if (!lua_isnil(L, -1)) rule->verify_nbf = lua_toboolean(L, -1);
+        lua_pop(L, 2);
+        rule->type = string_field(L, jwt, "type");
+        rule->issuer = string_field(L, jwt, "issuer");
+        rule->audience = string_field(L, jwt, "audience");
+        guard->jwt = std::move(rule);
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "rate_limit");
+    int rate = lua_gettop(L);
+    if (lua_istable(L, rate)) {
+        auto rule = std::make_unique<RateRule>();
+        std::string name = string_field(L, rate, "name");
+        if (name.empty()) name = "guard:" + guard->prefix + "#" + std::to_string(guards.size());
+        rule->limiter = rate_limiter_for(L, name, rate);
+        std::string key = string_field(L, rate, "key", "ip");
+        if (key == "sub") {
+            rule->key = RateRule::Key::SUBJECT;
+        } else if (key.compare(0, 7, "header:") == 0 && key.size() > 7) {
+            rule->key = RateRule::Key::HEADER;
+            rule->header = key.substr(7);
+            for (char &c : rule->header) c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+        } else if (key != "ip") {
+            return luaL_error(L, "uws.guard: unknown rate_limit key '%s'", key.c_str());
+        }
+        lua_getfield(L, rate, "per_path");
+        rule->per_path = lua_toboolean(L, -1);
+        lua_getfield(L, rate, "cost");
+        if (lua_isnumber(L, -1)) rule->cost = lua_tonumber(L, -1);
+        lua_pop(L, 2);
+        guard->rate = std::move(rule);
+    }
+    lua_pop(L, 1);
+
+    guards.push_back(std::move(guard));
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// Refresh-token stores, one per log path and shared by every worker like the
+// rate limiters. Tokens are hashed before they reach the store, so neither the
+// log nor memory holds a usable token.
+static std::mutex token_stores_mutex;
+static std::unordered_map<std::string, std::shared_ptr<dawn::TokenStore>> token_stores;
+
+static dawn::TokenStore &check_token_store(lua_State *L) {
+    auto **slot = static_cast<std::shared_ptr<dawn::TokenStore> **>(check_userdata(L, 1, token_store_mt_ref, "token_store"));
+    if (!*slot) luaL_error(L, "token store has been collected");
+    return ***slot;
+}
+
+static int64_t unix_now() {
+    return static_cast<int64_t>(std::time(nullptr));
+}
+
+static void report_token_store_error(dawn::TokenStore &store) {
+    std::string error = store.take_error();
+    if (!error.empty()) shim_log().write(dawn::LOG_ERROR, "TokenStore: ", error);
+}
+
+// store:save(user_id, token, { device_id, ip, agent, issued, expires } [, replace_user])
+static int token_store_save(lua_State *L) {
+    dawn::TokenStore &store = check_token_store(L);
+    dawn::TokenSession session;
+    session.user_id = luaL_checkstring(L, 2);
+    session.token_hash = dawn::sha256(check_string_view(L, 3));
+    int64_t now = unix_now();
+    session.issued = now;
+    if (lua_istable(L, 4)) {
+        session.device_id = string_field(L, 4, "device_id", "unknown");
+        session.ip = string_field(L, 4, "ip", "unknown");
+        session.agent = string_field(L, 4, "agent", "unknown");
+        lua_getfield(L, 4, "issued");
+        if (lua_isnumber(L, -1)) session.issued = static_cast<int64_t>(lua_tonumber(L, -1));
+        lua_getfield(L, 4, "expires");
+        if (lua_isnumber(L, -1)) session.expires = static_cast<int64_t>(lua_tonumber(L, -1));
+        lua_pop(L, 2);
+    }
+    bool saved = store.save(std::move(session), lua_toboolean(L, 5), now);
+    if (!saved) report_token_store_error(store);
+    lua_pushboolean(L, saved);
+    return 1;
+}
+
+static int token_store_verify(lua_State *L) {
+    dawn::TokenStore &store = check_token_store(L);
+    std::string_view user_id = check_string_view(L, 2);
+    lua_pushboolean(L, store.verify(user_id, dawn::sha256(check_string_view(L, 3)), unix_now()));
+    return 1;
+}
+
+static int token_store_revoke(lua_State *L) {
+    dawn::TokenStore &store = check_token_store(L);
+    std::string_view user_id = check_string_view(L, 2);
+    lua_pushboolean(L, store.revoke(user_id, dawn::sha256(check_string_view(L, 3)), unix_now()));
+    report_token_store_error(store);
+    return 1;
+}
+
+static int token_store_revoke_device(lua_State *L) {
+    dawn::TokenStore &store = check_token_store(L);
+    size_t removed = store.revoke_device(check_string_view(L, 2), check_string_view(L, 3), unix_now());
+    report_token_store_error(store);
+    lua_pushinteger(L, static_cast<lua_Integer>(removed));
+    return 1;
+}
+
+// store:sessions(user_id): array of { device_id, ip, agent, issued, expires }.
+static int token_store_sessions(lua_State *L) {
+    dawn::TokenStore &store = check_token_store(L);
+    std::vector<dawn::TokenSession> sessions = store.sessions(check_string_view(L, 2), unix_now());
+    lua_createtable(L, static_cast<int>(sessions.size()), 0);
+    for (size_t i = 0; i < sessions.size(); ++i) {
+        const dawn::TokenSession &session = sessions[i];
+        lua_createtable(L, 0, 5);
+        lua_pushlstring(L, session.device_id.data(), session.device_id.size());
+        lua_setfield(L, -2, "device_id");
+        lua_pushlstring(L, session.ip.data(), session.ip.size());
+        lua_setfield(L, -2, "ip");
+        lua_pushlstring(L, session.agent.data(), session.agent.size());
+        lua_setfield(L, -2, "agent");
+        lua_pushnumber(L, static_cast<lua_Number>(session.issued));
+        lua_setfield(L, -2, "issued");
+        if (session.expires != 0) {
+            lua_pushnumber(L, static_cast<lua_Number>(session.expires));
+            lua_setfield(L, -2, "expires");
+        }
+        lua_rawseti(L, -2, static_cast<int>(i + 1));
+    }
+    return 1;
+}
+
+static int token_store_sweep(lua_State *L) {
+    dawn::TokenStore &store = check_token_store(L);
+    size_t removed = store.sweep(unix_now());
+    report_token_store_error(store);
+    lua_pushinteger(L, static_cast<lua_Integer>(removed));
+    return 1;
+}
+
+static int token_store_compact(lua_State *L) {
+    dawn::TokenStore &store = check_token_store(L);
+    bool compacted = store.compact();
+    report_token_store_error(store);
+    lua_pushboolean(L, compacted);
+    return 1;
+}
+
+static int token_store_size(lua_State *L) {
+    lua_pushinteger(L, static_cast<lua_Integer>(check_token_store(L).size()));
+    return 1;
+}
+
+static int token_store_gc(lua_State *L) {
+    auto **slot = static_cast<std::shared_ptr<dawn::TokenStore> **>(check_userdata(L, 1, token_store_mt_ref, "token_store"));
+    delete *slot;
+    *slot = nullptr;
+    return 0;
+}
+
+static void create_token_store_metatable(lua_State *L) {
+    static const luaL_Reg methods[] = {
+        {"save", token_store_save},
+        {"verify", token_store_verify},
+        {"revoke", token_store_revoke},
+        {"revoke_device", token_store_revoke_device},
+        {"sessions", token_store_sessions},
+        {"sweep", token_store_sweep},
+        {"compact", token_store_compact},
+        {"size", token_store_size},
+        {nullptr, nullptr}
+    };
+    luaL_newmetatable(L, "token_store");
+    luaL_newlib(L, methods);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, token_store_gc);
+    lua_setfield(L, -2, "__gc");
+    token_store_mt_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+// uws.token_store(path [, { max_age }]): the store logged at path, replaying the
+// log the first time the path is opened; nil and a message if it cannot be.
+// max_age (seconds, 0 = none) is taken from that first open.
+static int uw_token_store(lua_State *L) {
+    std::string path = luaL_checkstring(L, 1);
+    int64_t max_age = 0;
+    if (lua_istable(L, 2)) {
+        lua_getfield(L, 2, "max_age");
+        if (lua_isnumber(L, -1)) max_age = static_cast<int64_t>(lua_tonumber(L, -1));
+        lua_pop(L, 1);
+    }
+
+    std::shared_ptr<dawn::TokenStore> store;
+    {
+        std::lock_guard<std::mutex> lock(token_stores_mutex);
+        auto &existing = token_stores[path];
+        if (!existing) {
+            auto opened = std::make_shared<dawn::TokenStore>(path, max_age);
+            if (!opened->open(unix_now())) {
+                token_stores.erase(path);
+                lua_pushnil(L);
+                lua_pushstring(L, opened->take_error().c_str());
+                return 2;
+            }
+            existing = std::move(opened);
+        }
+        store = existing;
+    }
+
+    auto **slot = static_cast<std::shared_ptr<dawn::TokenStore> **>(lua_newuserdata(L, sizeof(void *)));
+    *slot = nullptr;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, token_store_mt_ref);
+    lua_setmetatable(L, -2);
+    *slot = new std::shared_ptr<dawn::TokenStore>(std::move(store));
+    return 1;
+}
+
+static dawn::AsyncLog &check_logger(lua_State *L) {
+    return **static_cast<dawn::AsyncLog **>(check_userdata(L, 1, logger_mt_ref, "logger"));
+}
+
+// The value at idx as log text: strings and numbers as they are, anything else
+// by type name.
+static std::string_view log_text(lua_State *L, int idx) {
+    if (lua_isstring(L, idx)) {
+        size_t len = 0;
+        const char *s = lua_tolstring(L, idx, &len);
+        return std::string_view(s, len);
+    }
+    if (lua_isboolean(L, idx)) return lua_toboolean(L, idx) ? "true" : "false";
+    return luaL_typename(L, idx);
+}
+
+// log:write(level, message [, source [, request_id]]): one JSON line with
+// timestamp, level, message, source, pid and request_id.
+static int logger_write(lua_State *L) {
+    dawn::AsyncLog &log = check_logger(L);
+    int level = static_cast<int>(luaL_checkinteger(L, 2));
+    if (!log.enabled(level)) return 0;
+    static const std::string pid = std::to_string(getpid());
+
+    std::string &line = dawn::AsyncLog::scratch();
+    line.append("{\"timestamp\":\"").append(dawn::log_timestamp());
+    line.append("\",\"level\":\"").append(dawn::log_level_name(level));
+    line.append("\",\"message\":\"");
+    dawn::append_json_escaped(line, log_text(L, 3));
+    line.append("\",\"source\":\"");
+    dawn::append_json_escaped(line, lua_isnoneornil(L, 4) ? std::string_view("unknown") : log_text(L, 4));
+    line.append("\",\"pid\":").append(pid);
+    line.append(",\"request_id\":\"");
+    dawn::append_json_escaped(line, lua_isnoneornil(L, 5) ? std::string_view("N/A") : log_text(L, 5));
+    line.append("\"}\n");
+    log.push(line);
+    if (level >= dawn::LOG_FATAL) log.flush();
+    return 0;
+}
+
+// log:print(level, message): a coloured line for terminals, as the Lua logger
+// prints in dev mode.
+static int logger_print(lua_State *L) {
+    static const char *const colors[] = {"", "\x1b[38;5;244m", "\x1b[38;5;34m", "\x1b[38;5;214m",
+                                         "\x1b[38;5;196m", "\x1b[48;5;88;38;5;231m"};
+    static const char *const icons[] = {"", "\xf0\x9f\x90\x9e", "\xe2\x84\xb9\xef\xb8\x8f ",
+                                        "\xe2\x9a\xa0\xef\xb8\x8f ", "\xe2\x9d\x8c", "\xf0\x9f\x92\x80"};
+    dawn::AsyncLog &log = check_logger(L);
+    int level = static_cast<int>(luaL_checkinteger(L, 2));
+    if (!log.enabled(level)) return 0;
+    int shade = level >= dawn::LOG_DEBUG && level <= dawn::LOG_FATAL ? level : 0;
+
+    std::string &line = dawn::AsyncLog::scratch();
+    line.append(colors[shade]).append("[").append(dawn::log_timestamp()).append("] [");
+    line.append(dawn::log_level_name(level)).append("] ").append(icons[shade]).append(" ");
+    line.append(log_text(L, 3)).append("\x1b[0m\n");
+    log.push(line);
+    return 0;
+}
+
+static int logger_enabled(lua_State *L) {
+    lua_pushboolean(L, check_logger(L).enabled(static_cast<int>(luaL_checkinteger(L, 2))));
+    return 1;
+}
+
+static int logger_set_level(lua_State *L) {
+    check_logger(L).set_level(static_cast<int>(luaL_checkinteger(L, 2)));
+    return 0;
+}
+
+static int logger_flush(lua_State *L) {
+    check_logger(L).flush();
+    return 0;
+}
+
+static int logger_dropped(lua_State *L) {
+    lua_pushnumber(L, static_cast<lua_Number>(check_logger(L).dropped()));
+    return 1;
+}
+
+static void create_logger_metatable(lua_State *L) {
+    static const luaL_Reg methods[] = {
+        {"write", logger_write},
+        {"print", logger_print},
+        {"enabled", logger_enabled},
+        {"set_level", logger_set_level},
+        {"flush", logger_flush},
+        {"dropped", logger_dropped},
+        {nullptr, nullptr}
+    };
+    luaL_newmetatable(L, "logger");
+    luaL_newlib(L, methods);
+    lua_setfield(L, -2, "__index");
+    logger_mt_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+// uws.logger(destination [, level]): the async log for destination, created at
+// level (default INFO) on first use; nil and a message if the file cannot be
+// opened.
+static int uw_logger(lua_State *L) {
+    std::string destination = luaL_checkstring(L, 1);
+    int level = static_cast<int>(luaL_optinteger(L, 2, dawn::LOG_INFO));
+
+    dawn::AsyncLog *log = nullptr;
+    if (destination == "stderr") {
+        log = &shim_log();
+    } else {
+        LogRegistry &registry = log_registry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        auto &existing = registry.logs[destination];
+        if (!existing) {
+            int fd = destination == "stdout" ? STDOUT_FILENO
+                                             : ::open(destination.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (fd < 0) {
+                registry.logs.erase(destination);
+                lua_pushnil(L);
+                lua_pushfstring(L, "cannot open log %s: %s", destination.c_str(), std::strerror(errno));
+                return 2;
+            }
+            existing = std::make_unique<dawn::AsyncLog>(fd, fd != STDOUT_FILENO, level);
+        }
+        log = existing.get();
+    }
+
+    auto **slot = static_cast<dawn::AsyncLog **>(lua_newuserdata(L, sizeof(void *)));
+    *slot = log;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, logger_mt_ref);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+// Drives a native MultipartParser from Lua. Each part becomes a table
+// { name, filename, mimetype, headers, is_file, size, body | path } passed to the
+// on_start_part / on_end_part / on_part / progress_callback functions found in the
+// options table, and fields and files are collected into a form table
+// (form[name] = part for files, the value for fields).
+struct MultipartSession {
+    dawn::MultipartParser parser;
+    lua_State *L;
+    int callbacks_ref;
+    int form_ref;
+    int part_ref = LUA_NOREF;
+
+    MultipartSession(lua_State *L, std::string_view boundary, const dawn::MultipartOptions &options, int callbacks_ref)
+        : parser(boundary, options), L(L), callbacks_ref(callbacks_ref) {
+        lua_newtable(L);
+        form_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        parser.on_part_begin = [this](dawn::MultipartPart &part) { return begin_part(part); };
+        parser.on_part_end = [this](dawn::MultipartPart &part) { return end_part(part); };
+    }
+
+    ~MultipartSession() {
+        luaL_unref(L, LUA_REGISTRYINDEX, part_ref);
+        luaL_unref(L, LUA_REGISTRYINDEX, form_ref);
+    }
+
+    // False on malformed input or a failing callback; the reason is in parser.error.
+    bool feed(std::string_view data) {
+        if (!parser.feed(data)) return false;
+        lua_pushnumber(L, static_cast<lua_Number>(parser.total_read()));
+        return callback("progress_callback", 1);
+    }
+
+    void push_form() const {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, form_ref);
+    }
+
+private:
+    static void set_string(lua_State *L, const char *key, const std::string &value) {
+        lua_pushlstring(L, value.data(), value.size());
+        lua_setfield(L, -2, key);
+    }
+
+    // Calls callbacks[name] with the `nargs` values on top of the stack, if present.
+    bool callback(const char *name, int nargs) {
+        if (callbacks_ref == LUA_NOREF || callbacks_ref == LUA_REFNIL) {
+            lua_pop(L, nargs);
+            return true;
+        }
+        lua_rawgeti(L, LUA_REGISTRYINDEX, callbacks_ref);
+        lua_getfield(L, -1, name);
+        lua_remove(L, -2);
+        if (!lua_isfunction(L, -1)) {
+            lua_pop(L, nargs + 1);
+            return true;
+        }
+        lua_insert(L, -(nargs + 1));
+        if (lua_pcall(L, nargs, 0, 0) != LUA_OK) {
+            const char *message = lua_tostring(L, -1);
+            parser.error = message ? message : "error in multipart callback";
+            lua_pop(L, 1);
+            return false;
+        }
+        return true;
+    }
+
+    bool begin_part(const dawn::MultipartPart &part) {
+        lua_createtable(L, 0, 9);
+        lua_createtable(L, 0, static_cast<int>(part.headers.size()));
+        for (const auto &[key, value] : part.headers) {
+            lua_pushlstring(L, key.data(), key.size());
+            lua_pushlstring(L, value.data(), value.size());
+            lua_rawset(L, -3);
+        }
+        lua_setfield(L, -2, "headers");
+        set_string(L, "name", part.name);
+        if (part.is_file) set_string(L, "filename", part.filename);
+        if (!part.content_type.empty()) set_string(L, "mimetype", part.content_type);
+        lua_pushboolean(L, part.is_file);
+        lua_setfield(L, -2, "is_file");
+        lua_pushnumber(L, 0);
+        lua_setfield(L, -2, "size");
+
+        lua_pushvalue(L, -1);
+        part_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        return callback("on_start_part", 1);
+    }
+
+    bool end_part(const dawn::MultipartPart &part) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, part_ref);
+        luaL_unref(L, LUA_REGISTRYINDEX, part_ref);
+        part_ref = LUA_NOREF;
+
+        lua_pushnumber(L, static_cast<lua_Number>(part.size));
+        lua_setfield(L, -2, "size");
+        if (!part.path.empty()) {
+            set_string(L, "path", part.path);
+        } else {
+            set_string(L, "body", part.body);
+        }
+
+        lua_pushvalue(L, -1);
+        if (!callback("on_end_part", 1)) {
+            lua_pop(L, 1);
+            return false;
+        }
+        lua_pushvalue(L, -1);
+        if (!callback("on_part", 1)) {
+            lua_pop(L, 1);
+            return false;
+        }
+
+        if (!part.name.empty()) {
+            lua_rawgeti(L, LUA_REGISTRYINDEX, form_ref);
+            lua_pushlstring(L, part.name.data(), part.name.size());
+            if (part.is_file) {
+                lua_pushvalue(L, -3);
+            } else {
+                lua_pushlstring(L, part.body.data(), part.body.size());
+            }
+            lua_rawset(L, -3);
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1); // part table
+        return true;
+    }
+};
+
+static bool is_multipart_content(std::string_view content_type) {
+    return content_type.size() >= 19 && dawn::iequals(content_type.substr(0, 19), "multipart/form-data");
+}
+
+// Reads max_memory_size, max_header_size, max_total_size, stream_to_disk,
+// decode_base64 and auto_save_dir from the table at idx; missing fields keep
+// their defaults.
+static dawn::MultipartOptions read_multipart_options(lua_State *L, int idx) {
+    dawn::MultipartOptions options;
+    if (!lua_istable(L, idx)) return options;
+    lua_getfield(L, idx, "max_memory_size");
+    if (lua_isnumber(L, -1)) options.max_memory_size = static_cast<size_t>(lua_tonumber(L, -1));
+    lua_getfield(L, idx, "max_header_size");
+    if (lua_isnumber(L, -1)) options.max_header_size = static_cast<size_t>(lua_tonumber(L, -1));
+    lua_getfield(L, idx, "max_total_size");
+    if (lua_isnumber(L, -1)) options.max_total_size = static_cast<size_t>(std::max<lua_Number>(0, lua_tonumber(L, -1)));
+    lua_getfield(L, idx, "stream_to_disk");
+    if (lua_isboolean(L, -1)) options.stream_to_disk = lua_toboolean(L, -1);
+    lua_getfield(L, idx, "decode_base64");
+    if (lua_isboolean(L, -1)) options.decode_base64 = lua_toboolean(L, -1);
+    lua_getfield(L, idx, "auto_save_dir");
+    if (lua_isstring(L, -1)) options.auto_save_dir = lua_tostring(L, -1);
+    lua_pop(L, 6);
+    return options;
+}
+
+static MultipartSession *check_multipart(lua_State *L) {
+    auto *session = *static_cast<MultipartSession **>(check_userdata(L, 1, multipart_mt_ref, "multipart"));
+    if (!session) luaL_error(L, "multipart parser has been closed");
+    return session;
+}
+
+// parser:feed(chunk). Raises the parse (or callback) error, like the Lua parser did.
+static int multipart_feed(lua_State *L) {
+    MultipartSession *session = check_multipart(L);
+    size_t len = 0;
+    const char *data = luaL_checklstring(L, 2, &len);
+    session->L = L;
+    if (!session->feed(std::string_view(data, len))) {
+        return luaL_error(L, "%s", session->parser.error.c_str());
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int multipart_done(lua_State *L) {
+    lua_pushboolean(L, check_multipart(L)->parser.done());
+    return 1;
+}
+
+static int multipart_form(lua_State *L) {
+    check_multipart(L)->push_form();
+    return 1;
+}
+
+// Deletes the session; unless the body was complete, the files it wrote are removed.
+static int multipart_close(lua_State *L) {
+    auto **slot = static_cast<MultipartSession **>(check_userdata(L, 1, multipart_mt_ref, "multipart"));
+    if (*slot) {
+        int callbacks_ref = (*slot)->callbacks_ref;
+        (*slot)->L = L;
+        delete *slot;
+        *slot = nullptr;
+        luaL_unref(L, LUA_REGISTRYINDEX, callbacks_ref);
+    }
+    return 0;
+}
+
+static void create_multipart_metatable(lua_State *L) {
+    static const luaL_Reg methods[] = {
+        {"feed", multipart_feed},
+        {"done", multipart_done},
+        {"form", multipart_form},
+        {"close", multipart_close},
+        {nullptr, nullptr}
+    };
+    luaL_newmetatable(L, "multipart");
+    luaL_newlib(L, methods);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, multipart_close);
+    lua_setfield(L, -2, "__gc");
+    multipart_mt_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+// uws.multipart_parser(content_type [, opts]): a native streaming parser. opts takes
+// the MultipartOptions fields plus on_start_part, on_end_part, on_part and
+// progress_callback functions.
+static int uw_multipart_parser(lua_State *L) {
+    size_t len = 0;
+    const char *content_type = luaL_checklstring(L, 1, &len);
+    std::string boundary = dawn::MultipartParser::boundary_from_content_type(std::string_view(content_type, len));
+    if (boundary.empty()) return luaL_error(L, "Boundary not found in content type");
+    dawn::MultipartOptions options = read_multipart_options(L, 2);
+
+    auto **slot = static_cast<MultipartSession **>(lua_newuserdata(L, sizeof(MultipartSession *)));
+    *slot = nullptr;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, multipart_mt_ref);
+    lua_setmetatable(L, -2);
+
+    int callbacks_ref = LUA_NOREF;
+    if (lua_istable(L, 2)) {
+        lua_pushvalue(L, 2);
+        callbacks_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    *slot = new MultipartSession(L, boundary, options, callbacks_ref);
+    return 1;
+}
+
+static void reject_body(uWS::HttpResponse<false> *res) {
+    res->writeStatus("413 Payload Too Large")->writeHeader("Content-Type", "text/plain")->end("Payload Too Large", true);
+}
+
+// One request body being read. Kept alive by the onData/onAborted callbacks; the
+// request snapshot and its Lua handle stay checked out until the body is done, so
+// every chunk of a streamed body sees the same req object.
+struct PendingBody : std::enable_shared_from_this<PendingBody> {
+    RequestSnapshot request;
+    RequestHandle *req;
+    int handler;
+    int params_ref; // LUA_NOREF when the handler takes no params argument
+    std::string pattern;
+    BodyOptions options;
+    std::string data;
+    std::unique_ptr<MultipartSession> multipart; // set for natively parsed form uploads
+    size_t received = 0;
+    bool responded = false;
+    bool done = false;
+
+    PendingBody(uWS::HttpRequest *q, int handler, int params_ref, const std::string &pattern, const BodyOptions &options)
+        : request(q), req(acquire_request()), handler(handler), params_ref(params_ref),
+          pattern(pattern), options(options) {
+        req->snapshot = &request;
+    }
+
+    enum class Kind { RAW, JSON, FORM };
+
+    // Calls the handler with (req, res, [params,] body, is_last), corked. For JSON
+    // the buffered body is handed over to a JsonDocument and Lua gets the decoded
+    // value (or a view of it), then false or the parse error after is_last; for FORM Lua gets the form table built by the multipart session. The call
+    // with the whole body runs as a coroutine (see run_handler); stream chunks are
+    // plain calls, so they cannot overtake one another.
+    void call(uWS::HttpResponse<false> *res, std::string_view body, bool last, Kind kind = Kind::RAW) {
+        res->cork([&]() { invoke(res, body, last, kind); });
+    }
+
+    void invoke(uWS::HttpResponse<false> *res, std::string_view body, bool last, Kind kind) {
+        HttpCall call(res, req, last);
+        lua_rawgeti(main_L, LUA_REGISTRYINDEX, handler);
+        call.push(main_L);
+        int nargs = 4;
+        if (params_ref != LUA_NOREF) {
+            lua_rawgeti(main_L, LUA_REGISTRYINDEX, params_ref);
+            nargs = 5;
+        }
+        const char *json_error = nullptr;
+        switch (kind) {
+        case Kind::RAW: lua_pushlstring(main_L, body.data(), body.size()); break;
+        case Kind::JSON: json_error = push_json_body(main_L, std::move(data), options.json_lazy); break;
+        case Kind::FORM: multipart->push_form(); break;
+        }
+        lua_pushboolean(main_L, last);
+        if (kind == Kind::JSON) {
+            if (json_error) {
+                lua_pushstring(main_L, json_error);
+            } else {
+                lua_pushboolean(main_L, 0);
+            }
+            ++nargs;
+        }
+
+        if (options.stream) {
+            if (lua_pcall(main_L, nargs, 0, 0) != LUA_OK) {
+                shim_log().write(dawn::LOG_ERROR, "Lua error in route ", pattern, ": ", lua_tostring(main_L, -1));
+                lua_pop(main_L, 1);
+                call.fail();
+            }
+        } else {
+            HandlerStatus status = run_handler(call, nargs, "Lua error in route ", pattern, shared_from_this());
+            if (status == HandlerStatus::FAILED) call.fail();
+            if (status == HandlerStatus::SUSPENDED) req = nullptr; // the task releases it
+        }
+        responded = call.res->res == nullptr;
+    }
+
+    void finish() {
+        if (done) return;
+        done = true;
+        if (req) release_request(req);
+        luaL_unref(main_L, LUA_REGISTRYINDEX, params_ref);
+        params_ref = LUA_NOREF;
+        std::string().swap(data);
+        multipart.reset();
+    }
+};
+
+// Reads the request body natively and hands it to the Lua handler: once with the
+// whole body, or per chunk for streaming routes. Bodies over the route's limit are
+// refused with a 413, up front when Content-Length gives them away. Takes over
+// params_ref. Must be called from within the uWS route handler.
+static void read_body(uWS::HttpResponse<false> *res, uWS::HttpRequest *req, int handler, int params_ref,
+                      const std::string &pattern, const BodyOptions &options, const NativeGuard *jwt_guard) {
+    size_t expected = 0;
+    std::string_view length = req->getHeader("content-length");
+    std::from_chars(length.data(), length.data() + length.size(), expected);
+    if (options.max_body_size && expected > options.max_body_size) {
+        luaL_unref(main_L, LUA_REGISTRYINDEX, params_ref);
+        reject_body(res);
+        return;
+    }
+
+    auto body = std::make_shared<PendingBody>(req, handler, params_ref, pattern, options);
+    body->req->jwt_guard = jwt_guard;
+    std::string_view content_type = body->request.header("content-type");
+    if (options.multipart && !options.stream && is_multipart_content(content_type)) {
+        std::string boundary = dawn::MultipartParser::boundary_from_content_type(content_type);
+        if (boundary.empty()) {
+            body->finish();
+            res->writeStatus("400 Bad Request")->writeHeader("Content-Type", "text/plain")->end("Boundary not found in content type");
+            return;
+        }
+        body->multipart = std::make_unique<MultipartSession>(main_L, boundary, *options.multipart_options, options.multipart_callbacks);
+    } else if (!options.stream) {
+        body->data.reserve(std::min(expected, options.max_body_size ? options.max_body_size : BODY_RESERVE_LIMIT));
+    }
+
+    // Also deletes what an unfinished multipart body wrote to disk.
+    res->onAborted([body]() {
+        body->finish();
+    });
+
+    res->onData([res, body](std::string_view chunk, bool last) {
+        assert_loop_thread();
+        if (body->done) return;
+
+        body->received += chunk.size();
+        if (body->options.max_body_size && body->received > body->options.max_body_size) {
+            if (!body->responded) reject_body(res);
+            body->finish();
+            return;
+        }
+        if (body->multipart) {
+            // finish() drops the session, which deletes the files of an incomplete body.
+            bool fed = body->multipart->feed(chunk);
+            if (fed && last && !body->multipart->parser.done()) {
+                fed = false;
+                body->multipart->parser.error = "body ended before the closing boundary";
+            }
+            if (!fed) {
+                shim_log().write(dawn::LOG_ERROR, "Multipart error in route ", body->pattern, ": ", body->multipart->parser.error);
+                if (body->multipart->parser.too_large()) {
+                    reject_body(res);
+                } else {
+                    res->writeStatus("400 Bad Request")->writeHeader("Content-Type", "text/plain")->end("Malformed multipart body", true);
+                }
+                body->finish();
+                return;
+            }
+            if (!last) return;
+            body->call(res, {}, true, PendingBody::Kind::FORM);
+        } else if (body->options.stream) {
+            // Once the handler has ended the response, later chunks are dropped.
+            if (body->responded) {
+                body->finish();
+                return;
+            }
+            body->call(res, chunk, last);
+        } else {
+            body->data.append(chunk.data(), chunk.size());
+            if (!last) return;
+            bool as_json = body->options.json && is_json_content(body->request.header("content-type"));
+            body->call(res, body->data, true, as_json ? PendingBody::Kind::JSON : PendingBody::Kind::RAW);
+        }
+        if (last) body->finish();
+    });
+}
+
+// Shared body of the post/put/patch bindings: middleware once, then the body is
+// read natively and the handler gets (req, res, body, true).
+static void call_body_handler(int ref, const std::string &route, uWS::HttpResponse<false> *res, uWS::HttpRequest *req) {
+    assert_loop_thread();
+    res->cork([&]() {
+        const NativeGuard *jwt_guard = nullptr;
+        if (!run_guards(res, req, jwt_guard)) return;
+        HttpCall call(res, req);
+        call.req->jwt_guard = jwt_guard;
+        if (!execute_middleware(main_L, call, route)) return;
+        // read_body owns the response from here. The req/res middleware saw go stale
+        // when this call ends; the handler gets handles of its own.
+        call.final = false;
+        read_body(res, req, ref, LUA_NOREF, route, BodyOptions{}, jwt_guard);
+    });
+}
+
+// Shared body of the get/delete/head/options bindings: middleware, then the
+// Lua handler with (req, res), corked so its writes leave in one syscall.
+static void call_http_handler(int ref, const std::string &route, uWS::HttpResponse<false> *res, uWS::HttpRequest *req, const char *label) {
+    assert_loop_thread();
+    res->cork([&]() {
+        const NativeGuard *jwt_guard = nullptr;
+        if (!run_guards(res, req, jwt_guard)) return;
+        HttpCall call(res, req);
+        call.req->jwt_guard = jwt_guard;
+        if (!execute_middleware(main_L, call, route)) return;
+
+        lua_rawgeti(main_L, LUA_REGISTRYINDEX, ref);
+        call.push(main_L);
+        if (run_handler(call, 2, label, {}) == HandlerStatus::FAILED) call.fail();
+    });
+}
+
+int uw_get(lua_State *L) {
+    std::string route = luaL_checkstring(L, 1);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    lua_pushvalue(L, 2);
+    int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    int callback_id = callback_id_counter++;
+    lua_callbacks[callback_id] = ref;
+
+    app->get(route, [callback_id, route](auto *res, auto *req) {
+        call_http_handler(lua_callbacks[callback_id], route, res, req, "Lua error");
+    });
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+int uw_post(lua_State *L) {
+    std::string route = luaL_checkstring(L, 1);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    lua_pushvalue(L, 2);
+    int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    int callback_id = callback_id_counter++;
+    lua_callbacks[callback_id] = ref;
+
+    app->post(route, [callback_id, route](auto *res, auto *req) {
+        call_body_handler(lua_callbacks[callback_id], route, res, req);
+    });
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+int uw_put(lua_State *L) {
+    std::string route = luaL_checkstring(L, 1);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    lua_pushvalue(L, 2);
+    int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    int callback_id = callback_id_counter++;
+    lua_callbacks[callback_id] = ref;
+
+    app->put(route, [callback_id, route](auto *res, auto *req) {
+        call_body_handler(lua_callbacks[callback_id], route, res, req);
+    });
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+
+int uw_delete(lua_State *L) {
+    std::string route = luaL_checkstring(L, 1);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    lua_pushvalue(L, 2);
+    int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    int callback_id = callback_id_counter++;
+    lua_callbacks[callback_id] = ref;
+
+    app->del(route, [callback_id, route](auto *res, auto *req) {
+        call_http_handler(lua_callbacks[callback_id], route, res, req, "Lua error in DELETE handler");
+    });
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+int uw_patch(lua_State *L) {
+    std::string route = luaL_checkstring(L, 1);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    lua_pushvalue(L, 2);
+    int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    int callback_id = callback_id_counter++;
+    lua_callbacks[callback_id] = ref;
+
+    app->patch(route, [callback_id, route](auto *res, auto *req) {
+        call_body_handler(lua_callbacks[callback_id], route, res, req);
+    });
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+int uw_head(lua_State *L) {
+    std::string route = luaL_checkstring(L, 1);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    lua_pushvalue(L, 2);
+    int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    int callback_id = callback_id_counter++;
+    lua_callbacks[callback_id] = ref;
+
+    app->head(route, [callback_id, route](auto *res, auto *req) {
+        call_http_handler(lua_callbacks[callback_id], route, res, req, "Lua error in HEAD handler");
+    });
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+int uw_options(lua_State *L) {
+    std::string route = luaL_checkstring(L, 1);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    lua_pushvalue(L, 2);
+    int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    int callback_id = callback_id_counter++;
+    lua_callbacks[callback_id] = ref;
+
+    app->options(route, [callback_id, route](auto *res, auto *req) {
+        call_http_handler(lua_callbacks[callback_id], route, res, req, "Lua error in OPTIONS handler");
+    });
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// Pushes the matched route parameters (plus `splat` for * routes) as a Lua table,
+// or nil for routes that have neither, so static routes cost no allocation.
+static void push_route_params(lua_State *L, const dawn::Route &route, const dawn::RouteMatch &match) {
+    if (match.param_count == 0 && !route.has_splat) {
+        lua_pushnil(L);
+        return;
+    }
+    lua_createtable(L, 0, static_cast<int>(match.param_count) + (route.has_splat ? 1 : 0));
+    for (size_t i = 0; i < match.param_count; ++i) {
+        const std::string &name = route.param_names[i];
+        lua_pushlstring(L, name.data(), name.size());
+        lua_pushlstring(L, match.params[i].data(), match.params[i].size());
+        lua_rawset(L, -3);
+    }
+    if (route.has_splat) {
+        lua_pushlstring(L, match.splat.data(), match.splat.size());
+        lua_setfield(L, -2, "splat");
+    }
+}
+
+static void dispatch_route(uWS::HttpResponse<false> *res, uWS::HttpRequest *req) {
+    assert_loop_thread();
+    // Before the route lookup, so preflights are answered even where no OPTIONS route exists.
+    const NativeGuard *jwt_guard = nullptr;
+    if (!run_guards(res, req, jwt_guard)) return;
+
+    dawn::RouteMatch match;
+    dawn::HttpMethod method = dawn::parse_method(req->getMethod());
+    if (!router.match(method, req->getUrl(), match)) {
+        res->writeStatus("404 Not Found")->end("Not Found");
+        return;
+    }
+
+    const dawn::Route &route = router.route(match.route_id);
+    bool has_body = method == dawn::HttpMethod::POST || method == dawn::HttpMethod::PUT || method == dawn::HttpMethod::PATCH;
+    HttpCall call(res, req);
+    call.req->jwt_guard = jwt_guard;
+    if (!execute_middleware(main_L, call, route.pattern)) return;
+
+    if (!has_body) {
+        lua_rawgeti(main_L, LUA_REGISTRYINDEX, route.handler);
+        call.push(main_L);
+        push_route_params(main_L, route, match);
+        if (run_handler(call, 3, "Lua error in route ", route.pattern) == HandlerStatus::FAILED) call.fail();
+        return;
+    }
+
+    const BodyOptions &options = route_body_options[match.route_id];
+    if (options.before_body != LUA_NOREF) {
+        // Runs before any of the body is read, so it can turn an upload away
+        // without receiving it. What it returns replaces params for the handler.
+        lua_rawgeti(main_L, LUA_REGISTRYINDEX, options.before_body);
+        call.push(main_L);
+        push_route_params(main_L, route, match);
+        if (lua_pcall(main_L, 3, 1, 0) != LUA_OK) {
+            shim_log().write(dawn::LOG_ERROR, "Lua error before body in route ", route.pattern, ": ", lua_tostring(main_L, -1));
+            lua_pop(main_L, 1);
+            call.fail();
+            return;
+        }
+        if (!lua_toboolean(main_L, -1) || !call.res->res) {
+            lua_pop(main_L, 1);
+            return;
+        }
+    } else {
+        push_route_params(main_L, route, match);
+    }
+
+    // read_body owns the response from here. The req/res middleware saw go stale
+    // when this call ends; the handler gets handles of its own.
+    call.final = false;
+    // The params table outlives this call, so it is kept in the registry until
+    // the body has been handled or the request is aborted.
+    int params_ref = luaL_ref(main_L, LUA_REGISTRYINDEX);
+    read_body(res, req, route.handler, params_ref, route.pattern, options, jwt_guard);
+}
+
+// uws.route(method, pattern, handler [, opts]): registers a route with the native router.
+// The handler receives (req, res, params) for GET/DELETE/HEAD/OPTIONS and
+// (req, res, params, body, true) for POST/PUT/PATCH once the whole body is in.
+// opts.max_body_size caps the body (413 beyond it); opts.stream = true calls the
+// handler per chunk as (req, res, params, chunk, is_last) instead; opts.json = true
+// decodes application/json bodies natively and passes the value (tables for
+// objects and arrays, or lazy views with opts.json = "lazy"; see uws.json_decode),
+// followed after is_last by false, or by the parse error with the raw text as body;
+// opts.multipart = true or an options table (see uws.multipart_parser) parses
+// multipart/form-data natively and passes the form table as the body.
+// opts.before_body(req, res, params) runs once per POST/PUT/PATCH request before
+// the body is read; unless it returns false or nil or ends the response, the
+// handler gets its return value in place of params.
+// Returns true plus a flag telling whether an existing method+pattern was replaced.
+int uw_route(lua_State *L) {
+    const char *method_str = luaL_checkstring(L, 1);
+    size_t pattern_len = 0;
+    const char *pattern = luaL_checklstring(L, 2, &pattern_len);
+    luaL_checktype(L, 3, LUA_TFUNCTION);
+
+    BodyOptions options;
+    if (lua_istable(L, 4)) {
+        lua_getfield(L, 4, "max_body_size");
+        options.max_body_size = static_cast<size_t>(std::max<lua_Integer>(0, lua_tointeger(L, -1)));
+        lua_getfield(L, 4, "stream");
+        options.stream = lua_toboolean(L, -1);
+        lua_getfield(L, 4, "json");
+        options.json = lua_toboolean(L, -1);
+        options.json_lazy = lua_type(L, -1) == LUA_TSTRING && strcmp(lua_tostring(L, -1), "lazy") == 0;
+        lua_pop(L, 3);
+        lua_getfield(L, 4, "multipart");
+        if (lua_toboolean(L, -1)) {
+            options.multipart = true;
+            options.multipart_options = std::make_shared<dawn::MultipartOptions>(read_multipart_options(L, lua_gettop(L)));
+            if (lua_istable(L, -1)) {
+                lua_pushvalue(L, -1);
+                options.multipart_callbacks = luaL_ref(L, LUA_REGISTRYINDEX);
+            }
+        }
+        lua_pop(L, 1);
+        lua_getfield(L, 4, "before_body");
+        if (lua_isfunction(L, -1)) {
+            options.before_body = luaL_ref(L, LUA_REGISTRYINDEX);
+        } else {
+            lua_pop(L, 1);
+        }
+    }
+
+    if (!app) {
+        return luaL_error(L, "uWS::App not initialized. Call create_app first.");
+    }
+    dawn::HttpMethod method = dawn::parse_method(method_str);
+    if (method == dawn::HttpMethod::UNKNOWN) {
+        return luaL_error(L, "unsupported route method '%s'", method_str);
+    }
+
+    lua_pushvalue(L, 3);
+    int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    int replaced = dawn::Router::NO_ROUTE;
+    int id = router.insert(method, std::string_view(pattern, pattern_len), ref, &replaced);
+    if (id == dawn::Router::NO_ROUTE) {
+        luaL_unref(L, LUA_REGISTRYINDEX, ref);
+        return luaL_error(L, "route '%s' has too many parameters", pattern);
+    }
+    route_body_options.resize(router.size());
+    route_body_options[id] = options;
+    if (replaced != dawn::Router::NO_ROUTE) {
+        luaL_unref(L, LUA_REGISTRYINDEX, router.route(replaced).handler);
+        router.route(replaced).handler = LUA_NOREF;
+        luaL_unref(L, LUA_REGISTRYINDEX, route_body_options[replaced].before_body);
+        route_body_options[replaced].before_body = LUA_NOREF;
+    }
+
+    if (!router_mounted) {
+        app->any("/*", [](auto *res, auto *req) {
+            res->cork([res, req]() { dispatch_route(res, req); });
+        });
+        router_mounted = true;
+    }
+
+    lua_pushboolean(L, 1);
+    lua_pushboolean(L, replaced != dawn::Router::NO_ROUTE);
+    return 2;
+}
+
+// Socket ids are v4 UUIDs from the per-thread generator in native/uuid.hpp.
+static std::string generate_unique_id() {
+    return dawn::uuid_v4();
+}
+
+// uws.uuid_v4() / uws.uuid_v7(): v7 ids sort by creation time.
+static int uw_uuid_v4(lua_State *L) {
+    char id[dawn::UUID_LENGTH];
+    dawn::uuid_v4(id);
+    lua_pushlstring(L, id, sizeof(id));
+    return 1;
+}
+
+static int uw_uuid_v7(lua_State *L) {
+    char id[dawn::UUID_LENGTH];
+    dawn::uuid_v7(id);
+    lua_pushlstring(L, id, sizeof(id));
+    return 1;
+}
+
+// Calls the route's Lua callback with (ws, event, <push_args() values>) while the
+// socket is corked, so every frame the callback sends to it leaves in one write.
+template <typename PushArgs>
+static void call_websocket_callback(DawnWebSocket *ws, int callback_id, const char *event, PushArgs &&push_args) {
+    ws->cork([&]() {
+        lua_rawgeti(main_L, LUA_REGISTRYINDEX, lua_callbacks[callback_id]);
+        push_websocket(main_L, ws);
+        lua_pushstring(main_L, event);
+        int nargs = 2 + push_args();
+        if (lua_pcall(main_L, nargs, 0, 0) != LUA_OK) {
+            shim_log().write(dawn::LOG_ERROR, "Lua error (", event, "): ", lua_tostring(main_L, -1));
+            lua_pop(main_L, 1);
+        }
+    });
+}
+
+static uWS::CompressOptions parse_compression(lua_State *L, int idx) {
+    if (lua_isboolean(L, idx)) {
+        return lua_toboolean(L, idx) ? uWS::SHARED_COMPRESSOR : uWS::DISABLED;
+    }
+    std::string_view name = luaL_checkstring(L, idx);
+    if (name == "disabled") return uWS::DISABLED;
+    if (name == "shared") return uWS::SHARED_COMPRESSOR;
+    if (name == "dedicated") return uWS::DEDICATED_COMPRESSOR;
+    if (name == "dedicated_3kb") return uWS::DEDICATED_COMPRESSOR_3KB;
+    if (name == "dedicated_4kb") return uWS::DEDICATED_COMPRESSOR_4KB;
+    if (name == "dedicated_8kb") return uWS::DEDICATED_COMPRESSOR_8KB;
+    if (name == "dedicated_16kb") return uWS::DEDICATED_COMPRESSOR_16KB;
+    if (name == "dedicated_32kb") return uWS::DEDICATED_COMPRESSOR_32KB;
+    if (name == "dedicated_64kb") return uWS::DEDICATED_COMPRESSOR_64KB;
+    if (name == "dedicated_128kb") return uWS::DEDICATED_COMPRESSOR_128KB;
+    if (name == "dedicated_256kb") return uWS::DEDICATED_COMPRESSOR_256KB;
+    luaL_error(L, "unknown compression '%s'", name.data());
+    return uWS::DISABLED;
+}
+
+// uws.ws(route, fn [, opts]). fn(ws, event, ...) gets "open", "message",
+// "drain" and "close". opts:
+//   max_backpressure   bytes buffered per socket before the slow-consumer policy applies
+//   slow_consumer      "drop_newest" (default) | "drop_oldest" | "close"
+//   max_queued         bytes kept by drop_oldest
+//   compression        false | true ("shared") | "shared" | "dedicated" | "dedicated_<n>kb"
+//   max_payload_length largest accepted message, in bytes
+//   idle_timeout       seconds without traffic before uWS closes the socket (0 or >= 8)
+//   send_pings         send protocol pings so live clients never hit idle_timeout
+//   reset_idle_on_send count outgoing messages as activity too
+//   max_lifetime       minutes before a socket is closed regardless of activity
+int uw_ws(lua_State *L) {
+    std::string route = luaL_checkstring(L, 1);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    auto options = std::make_shared<WebSocketRouteOptions>();
+    if (lua_istable(L, 3)) {
+        lua_getfield(L, 3, "compression");
+        if (!lua_isnil(L, -1)) options->compression = parse_compression(L, lua_gettop(L));
+        lua_getfield(L, 3, "max_payload_length");
+        if (lua_isnumber(L, -1)) options->max_payload_length = static_cast<unsigned int>(lua_tonumber(L, -1));
+        lua_getfield(L, 3, "idle_timeout");
+        if (lua_isnumber(L, -1)) {
+            lua_Integer idle = lua_tointeger(L, -1);
+            if (idle < 0 || (idle > 0 && idle < 8) || idle > 960) {
+                return luaL_error(L, "idle_timeout must be 0 or between 8 and 960 seconds");
+            }
+            options->idle_timeout = static_cast<unsigned short>(idle);
+        }
+        lua_getfield(L, 3, "send_pings");
+        if (lua_isboolean(L, -1)) options->send_pings = lua_toboolean(L, -1);
+        lua_getfield(L, 3, "reset_idle_on_send");
+        if (lua_isboolean(L, -1)) options->reset_idle_on_send = lua_toboolean(L, -1);
+        lua_getfield(L, 3, "max_lifetime");
+        if (lua_isnumber(L, -1)) options->max_lifetime = static_cast<unsigned short>(lua_tointeger(L, -1));
+        lua_pop(L, 6);
+
+        lua_getfield(L, 3, "max_backpressure");
+        if (lua_isnumber(L, -1)) options->max_backpressure = static_cast<unsigned int>(lua_tonumber(L, -1));
+        lua_getfield(L, 3, "max_queued");
+        if (lua_isnumber(L, -1)) options->max_queued = static_cast<size_t>(lua_tonumber(L, -1));
+        lua_getfield(L, 3, "slow_consumer");
+        if (lua_isstring(L, -1)) {
+            std::string_view policy = lua_tostring(L, -1);
+            if (policy == "drop_oldest") {
+                options->policy = SlowConsumerPolicy::DROP_OLDEST;
+            } else if (policy == "close") {
+                options->policy = SlowConsumerPolicy::CLOSE;
+            } else if (policy != "drop_newest") {
+                return luaL_error(L, "unknown slow_consumer policy '%s'", lua_tostring(L, -1));
+            }
+        }
+        lua_pop(L, 3);
+    }
+    lua_pushvalue(L, 2);
+    int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    int callback_id = callback_id_counter++;
+    lua_callbacks[callback_id] = ref;
+
+    // drop_oldest stops writing at max_backpressure itself; uWS's hard limit sits a
+    // queue's worth above it so topic publishes are still bounded.
+    unsigned int uws_limit = options->max_backpressure;
+    if (options->policy == SlowConsumerPolicy::DROP_OLDEST) {
+        uws_limit += static_cast<unsigned int>(options->max_queued);
+    }
+
+    app->ws<WebSocketUserData>(route, {
+        .compression = options->compression,
+        .maxPayloadLength = options->max_payload_length,
+        .idleTimeout = options->idle_timeout,
+        .maxBackpressure = uws_limit,
+        .closeOnBackpressureLimit = options->policy == SlowConsumerPolicy::CLOSE,
+        .resetIdleTimeoutOnSend = options->reset_idle_on_send,
+        .sendPingsAutomatically = options->send_pings,
+        .maxLifetime = options->max_lifetime,
+        .open = [callback_id, options](auto *ws) {
+            assert_loop_thread();
+            // Generate and store the unique ID in the user data
+            ws->getUserData()->id = generate_unique_id();
+            ws->getUserData()->options = options.get();
+            register_socket(ws);
+            call_websocket_callback(ws, callback_id, "open", []() { return 0; });
+        },
+
+        .message = [callback_id](auto *ws, std::string_view message, uWS::OpCode opCode) {
+            assert_loop_thread();
+            call_websocket_callback(ws, callback_id, "message", [&]() {
+                lua_pushlstring(main_L, message.data(), message.size());
+                lua_pushinteger(main_L, static_cast<int>(opCode));
+                return 2;
+            });
+        },
+
+        .dropped = [](auto *ws, std::string_view, uWS::OpCode) {
+            ++ws->getUserData()->dropped;
+        },
+
+        .drain = [callback_id](auto *ws) {
+            assert_loop_thread();
+            flush_websocket_queue(ws);
+            call_websocket_callback(ws, callback_id, "drain", [ws]() {
+                lua_pushinteger(main_L, ws->getBufferedAmount());
+                return 1;
+            });
+        },
+
+        .close = [callback_id](auto *ws, int code, std::string_view message) {
+            assert_loop_thread();
+            lua_rawgeti(main_L, LUA_REGISTRYINDEX, lua_callbacks[callback_id]);
+            push_websocket(main_L, ws);
+            lua_pushstring(main_L, "close");
+            lua_pushinteger(main_L, code);
+            lua_pushlstring(main_L, message.data(), message.size());
+
+            if (lua_pcall(main_L, 4, 0, 0) != LUA_OK) {
+                shim_log().write(dawn::LOG_ERROR, "Lua error (close): ", lua_tostring(main_L, -1));
+                lua_pop(main_L, 1);
+            }
+            release_websocket(main_L, ws);
+        }
+    });
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// Static files. Each uws.serve_static route owns a StaticCache; the caches of a
+// loop are drained of inotify events by one timer that does not keep the loop alive.
+struct StaticRoute {
+    std::string prefix;
+    std::string root;
+    std::shared_ptr<dawn::StaticCache> cache;
+};
+
+static thread_local std::vector<std::shared_ptr<dawn::StaticCache>> static_caches;
+static thread_local struct us_timer_t *static_cache_timer = nullptr;
+static constexpr int STATIC_POLL_MS = 250;
+
+static void poll_static_caches(struct us_timer_t *) {
+    for (auto &cache : static_caches) cache->poll();
+}
+
+// Sends `body` (a view into an in-memory `file`) with tryEnd, continuing from
+// onWritable under backpressure. The captured shared_ptr keeps the data alive
+// until the end.
+static void send_static_body(uWS::HttpResponse<false> *res, std::shared_ptr<const dawn::StaticFile> file, std::string_view body) {
+    auto [ok, done] = res->tryEnd(body, body.size());
+    if (ok || done) return;
+    res->onWritable([res, file, body](uintmax_t offset) {
+        auto [ok, done] = res->tryEnd(body.substr(static_cast<size_t>(offset)), body.size());
+        return ok;
+    })->onAborted([file]() {});
+}
+
+// A streamed file being sent: `length` bytes from `first`, read a chunk at a time.
+struct StaticStream {
+    static constexpr size_t CHUNK = 64 * 1024;
+
+    std::shared_ptr<const dawn::StaticFile> file;
+    size_t first;
+    size_t length;
+    std::string chunk;        // last chunk read; uWS may not have taken all of it
+    uintmax_t chunk_at = 0;   // response offset of chunk[0]
+};
+
+// Writes what uWS has not yet taken, reading further chunks with pread, until the
+// socket backs up (false) or the response is complete (true). A file that shrank
+// since it was cached comes up short: the connection is closed rather than
+// sending fewer bytes than the Content-Length promised.
+static bool pump_static_stream(uWS::HttpResponse<false> *res, StaticStream &s) {
+    for (;;) {
+        uintmax_t offset = res->getWriteOffset();
+        if (offset >= s.chunk_at + s.chunk.size()) {
+            size_t want = std::min(StaticStream::CHUNK, s.length - static_cast<size_t>(offset));
+            s.chunk.resize(want);
+            if (s.file->read(s.first + static_cast<size_t>(offset), s.chunk.data(), want) < want) {
+                shim_log().write(dawn::LOG_WARN, "Static file changed while being sent: ", s.file->path);
+                res->close();
+                return true;
+            }
+            s.chunk_at = offset;
+        }
+        auto [ok, done] = res->tryEnd(std::string_view(s.chunk).substr(static_cast<size_t>(offset - s.chunk_at)), s.length);
+        if (done) return true;
+        if (!ok) return false;
+    }
+}
+
+static void stream_static_file(uWS::HttpResponse<false> *res, std::shared_ptr<const dawn::StaticFile> file, size_t first, size_t length) {
+    auto stream = std::make_shared<StaticStream>(StaticStream{std::move(file), first, length, {}, 0});
+    if (length == 0) {
+        res->end();
+        return;
+    }
+    if (pump_static_stream(res, *stream)) return;
+    res->onWritable([res, stream](uintmax_t) {
+        return pump_static_stream(res, *stream);
+    })->onAborted([stream]() {});
+}
+
+static bool static_not_modified(uWS::HttpRequest *req, const dawn::StaticFile &file) {
+    std::string_view if_none_match = req->getHeader("if-none-match");
+    if (!if_none_match.empty()) return dawn::etag_matches(if_none_match, file.etag);
+    std::string_view if_modified_since = req->getHeader("if-modified-since");
+    time_t since = 0;
+    return !if_modified_since.empty() && dawn::parse_http_date(if_modified_since, since) && file.mtime <= since;
+}
+
+static void serve_static_file(uWS::HttpResponse<false> *res, uWS::HttpRequest *req, const StaticRoute &route, bool head) {
+    const dawn::StaticOptions &options = route.cache->options();
+    std::string_view url = req->getUrl();
+    std::string relative;
+    if (!dawn::decode_static_path(url.substr(std::min(url.size(), route.prefix.size())), relative)) {
+        res->writeStatus("403 Forbidden")->end("Forbidden");
+        return;
+    }
+    std::string path = route.root;
+    if (relative.empty() || relative.front() != '/') path.push_back('/');
+    path += relative;
+    bool directory_url = path.back() == '/';
+    if (directory_url) path += options.index;
+
+    std::shared_ptr<const dawn::StaticFile> file = route.cache->get(path);
+    if (!file && !directory_url && dawn::is_directory(path)) {
+        // A directory requested without the trailing slash.
+        path += '/';
+        path += options.index;
+        file = route.cache->get(path);
+    }
+    if (!file) {
+        res->writeStatus("404 Not Found")->end("Not Found");
+        return;
+    }
+
+    std::string_view range_header = req->getHeader("range");
+    std::shared_ptr<const dawn::StaticFile> body = file;
+    std::string_view encoding;
+    bool has_variants = file->has_brotli || file->has_gzip;
+    if (has_variants && range_header.empty()) {
+        std::string_view accept = req->getHeader("accept-encoding");
+        if (file->has_brotli && dawn::accepts_encoding(accept, "br")) {
+            if (auto variant = route.cache->get(path + ".br")) {
+                body = std::move(variant);
+                encoding = "br";
+            }
+        }
+        if (encoding.empty() && file->has_gzip && dawn::accepts_encoding(accept, "gzip")) {
+            if (auto variant = route.cache->get(path + ".gz")) {
+                body = std::move(variant);
+                encoding = "gzip";
+            }
+        }
+    }
+
+    auto write_validators = [&]() {
+        res->writeHeader("ETag", body->etag);
+        res->writeHeader("Last-Modified", body->last_modified);
+        if (options.max_age >= 0) res->writeHeader("Cache-Control", "public, max-age=" + std::to_string(options.max_age));
+        if (has_variants) res->writeHeader("Vary", "Accept-Encoding");
+    };
+
+    if (static_not_modified(req, *body)) {
+        res->writeStatus("304 Not Modified");
+        write_validators();
+        res->endWithoutBody(std::nullopt);
+        return;
+    }
+
+    size_t first = 0, length = body->size;
+    if (!range_header.empty()) {
+        std::string_view if_range = req->getHeader("if-range");
+        size_t last = 0;
+        dawn::RangeResult range = dawn::RangeResult::NONE;
+        if (if_range.empty() || if_range == body->etag || if_range == body->last_modified) {
+            range = dawn::parse_range(range_header, body->size, first, last);
+        }
+        if (range == dawn::RangeResult::UNSATISFIABLE) {
+            res->writeStatus("416 Range Not Satisfiable");
+            res->writeHeader("Content-Range", "bytes */" + std::to_string(body->size));
+            res->end();
+            return;
+        }
+        if (range == dawn::RangeResult::SATISFIABLE) {
+            res->writeStatus("206 Partial Content");
+            res->writeHeader("Content-Range", "bytes " + std::to_string(first) + "-" + std::to_string(last) + "/" + std::to_string(body->size));
+            length = last - first + 1;
+        } else {
+            first = 0;
+        }
+    }
+
+    res->writeHeader("Content-Type", dawn::mime_type(file->path));
+    res->writeHeader("Accept-Ranges", "bytes");
+    if (!encoding.empty()) res->writeHeader("Content-Encoding", encoding);
+    write_validators();
+    if (head) {
+        res->endWithoutBody(length);
+        return;
+    }
+    if (body->streamed()) {
+        stream_static_file(res, std::move(body), first, length);
+    } else {
+        std::string_view content = body->body().substr(first, length);
+        send_static_body(res, std::move(body), content);
+    }
 }
+
+// uws.serve_static(route_prefix, directory [, opts]) serves GET/HEAD below
+// route_prefix from directory. opts: cache_size, stream_threshold (bytes),
+// precompressed (serve .br/.gz siblings, default true), max_age (seconds) and index.
+int uw_serve_static(lua_State *L) {
+    std::string route_prefix = luaL_checkstring(L, 1);
+    std::string dir_path = luaL_checkstring(L, 2);
+    if (!app) {
+        shim_log().write(dawn::LOG_ERROR, "uWS::App not initialized. Call create_app first.");
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+
+    if (!fs::is_directory(dir_path)) {
+        shim_log().write(dawn::LOG_ERROR, "Static file directory '", dir_path, "' does not exist or is not a directory.");
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+
+    dawn::StaticOptions options;
+    if (lua_istable(L, 3)) {
+        lua_getfield(L, 3, "cache_size");
+        if (lua_isnumber(L, -1)) options.cache_size = static_cast<size_t>(lua_tonumber(L, -1));
+        lua_getfield(L, 3, "stream_threshold");
+        if (lua_isnumber(L, -1)) options.stream_threshold = static_cast<size_t>(lua_tonumber(L, -1));
+        lua_getfield(L, 3, "precompressed");
+        if (lua_isboolean(L, -1)) options.precompressed = lua_toboolean(L, -1);
+        lua_getfield(L, 3, "max_age");
+        if (lua_isnumber(L, -1)) options.max_age = static_cast<long>(lua_tonumber(L, -1));
+        lua_getfield(L, 3, "index");
+        if (lua_isstring(L, -1)) options.index = lua_tostring(L, -1);
+        lua_pop(L, 5);
+    }
+
+    while (!route_prefix.empty() && route_prefix.back() == '/') route_prefix.pop_back();
+    while (dir_path.size() > 1 && dir_path.back() == '/') dir_path.pop_back();
+
+    auto route = std::make_shared<StaticRoute>();
+    route->prefix = route_prefix;
+    route->root = dir_path;
+    route->cache = std::make_shared<dawn::StaticCache>(std::move(options));
+    static_caches.push_back(route->cache);
+    if (!static_cache_timer) {
+        static_cache_timer = us_create_timer(reinterpret_cast<struct us_loop_t *>(uWS::Loop::get()), 1, 0);
+        us_timer_set(static_cache_timer, poll_static_caches, STATIC_POLL_MS, STATIC_POLL_MS);
+    }
+
+    std::string route_pattern = route_prefix + "/*";
+    app->get(route_pattern, [route](auto *res, auto *req) {
+        serve_static_file(res, req, *route, false);
     });
+    app->head(route_pattern, [route](auto *res, auto *req) {
+        serve_static_file(res, req, *route, true);
+    });
+
     lua_pushboolean(L, 1);
     return 1;
 }
+// uws.publish(topic, payload [, opcode [, compress]]): sends payload once to every
+// socket subscribed to topic, on this loop synchronously and on the other worker
+// loops via Loop::defer. Returns whether this loop had any subscriber.
+static int uw_publish(lua_State *L) {
+    size_t topic_len = 0, len = 0;
+    const char *topic = luaL_checklstring(L, 1, &topic_len);
+    const char *message = luaL_checklstring(L, 2, &len);
+    uWS::OpCode opcode = opt_opcode(L, 3, len, false);
+    bool compress = lua_toboolean(L, 4);
+    if (!app) {
+        return luaL_error(L, "uWS::App not initialized. Call create_app first.");
+    }
+
+    bool delivered = app->publish(std::string_view(topic, topic_len), std::string_view(message, len), opcode, compress);
+
+    uWS::Loop *self = uWS::Loop::get();
+    std::lock_guard<std::mutex> lock(publish_loops_mutex);
+    if (publish_loops.size() > 1) {
+        auto shared_topic = std::make_shared<const std::string>(topic, topic_len);
+        auto shared_message = std::make_shared<const std::string>(message, len);
+        for (uWS::Loop *loop : publish_loops) {
+            if (loop == self) continue;
+            loop->defer([shared_topic, shared_message, opcode, compress]() {
+                if (app) app->publish(*shared_topic, *shared_message, opcode, compress);
+            });
+        }
+    }
+    lua_pushboolean(L, delivered);
+    return 1;
+}
+
+// uws.num_subscribers(topic): subscribers on this loop only.
+static int uw_num_subscribers(lua_State *L) {
+    size_t len = 0;
+    const char *topic = luaL_checklstring(L, 1, &len);
+    lua_pushinteger(L, app ? app->numSubscribers(std::string_view(topic, len)) : 0);
+    return 1;
+}
+
+// Presence. uws.presence_store() wraps a native/presence_store.hpp store in a
+// userdata; the in-memory state backend keeps all room membership in one.
+struct PresenceHandle {
+    dawn::PresenceStore store;
+    int iterating = 0; // store:each in progress; the store must not change under it
+};
+
+static thread_local int presence_mt_ref = LUA_NOREF;
+
+static PresenceHandle *check_presence(lua_State *L) {
+    return *static_cast<PresenceHandle **>(check_userdata(L, 1, presence_mt_ref, "presence"));
+}
+
+static PresenceHandle *check_presence_writable(lua_State *L) {
+    PresenceHandle *h = check_presence(L);
+    if (h->iterating) luaL_error(L, "presence store modified during each()");
+    return h;
+}
+
+static void push_string_list(lua_State *L, const std::vector<std::string> &items) {
+    lua_createtable(L, static_cast<int>(items.size()), 0);
+    for (size_t i = 0; i < items.size(); ++i) {
+        lua_pushlstring(L, items[i].data(), items[i].size());
+        lua_rawseti(L, -2, static_cast<int>(i + 1));
+    }
+}
+
+// store:join(topic, id, joined_at, meta) -> false if id was already in topic.
+static int presence_join(lua_State *L) {
+    PresenceHandle *h = check_presence_writable(L);
+    std::string_view topic = check_string_view(L, 2);
+    std::string_view id = check_string_view(L, 3);
+    int64_t joined_at = static_cast<int64_t>(luaL_optnumber(L, 4, 0));
+    size_t len = 0;
+    const char *meta = luaL_optlstring(L, 5, "", &len);
+    lua_pushboolean(L, h->store.join(topic, id, joined_at, std::string(meta, len)));
+    return 1;
+}
+
+// store:replace(topic, id, joined_at, meta) -> true if id was not in topic; an
+// existing member gets the new joined_at and meta.
+static int presence_replace(lua_State *L) {
+    PresenceHandle *h = check_presence_writable(L);
+    std::string_view topic = check_string_view(L, 2);
+    std::string_view id = check_string_view(L, 3);
+    int64_t joined_at = static_cast<int64_t>(luaL_optnumber(L, 4, 0));
+    size_t len = 0;
+    const char *meta = luaL_optlstring(L, 5, "", &len);
+    lua_pushboolean(L, h->store.replace(topic, id, joined_at, std::string(meta, len)));
+    return 1;
+}
+
+static int presence_leave(lua_State *L) {
+    PresenceHandle *h = check_presence_writable(L);
+    lua_pushboolean(L, h->store.leave(check_string_view(L, 2), check_string_view(L, 3)));
+    return 1;
+}
+
+// store:leave_all(id) -> the topics id left.
+static int presence_leave_all(lua_State *L) {
+    PresenceHandle *h = check_presence_writable(L);
+    push_string_list(L, h->store.leave_all(check_string_view(L, 2)));
+    return 1;
+}
+
+static int presence_has(lua_State *L) {
+    PresenceHandle *h = check_presence(L);
+    lua_pushboolean(L, h->store.find(check_string_view(L, 2), check_string_view(L, 3)) != nullptr);
+    return 1;
+}
+
+// store:get(topic, id) -> joined_at, meta, or nil.
+static int presence_get(lua_State *L) {
+    PresenceHandle *h = check_presence(L);
+    const dawn::PresenceStore::Entry *entry = h->store.find(check_string_view(L, 2), check_string_view(L, 3));
+    if (!entry) {
+        lua_pushnil(L);
+        return 1;
+    }
+    lua_pushnumber(L, static_cast<lua_Number>(entry->joined_at));
+    lua_pushlstring(L, entry->meta.data(), entry->meta.size());
+    return 2;
+}
+
+static int presence_count(lua_State *L) {
+    PresenceHandle *h = check_presence(L);
+    lua_pushinteger(L, static_cast<lua_Integer>(h->store.count(check_string_view(L, 2))));
+    return 1;
+}
+
+static int presence_members(lua_State *L) {
+    PresenceHandle *h = check_presence(L);
+    std::string_view topic = check_string_view(L, 2);
+    lua_createtable(L, static_cast<int>(h->store.count(topic)), 0);
+    int i = 0;
+    h->store.each(topic, [&](std::string_view id, const dawn::PresenceStore::Entry &) {
+        lua_pushlstring(L, id.data(), id.size());
+        lua_rawseti(L, -2, ++i);
+    });
+    return 1;
+}
+
+// store:each(topic, fn): fn(id, joined_at, meta) per member, without building the
+// room as a table. fn must not change the store.
+static int presence_each(lua_State *L) {
+    PresenceHandle *h = check_presence(L);
+    std::string_view topic = check_string_view(L, 2);
+    luaL_checktype(L, 3, LUA_TFUNCTION);
+    bool failed = false;
+    ++h->iterating;
+    h->store.each(topic, [&](std::string_view id, const dawn::PresenceStore::Entry &entry) {
+        if (failed) return;
+        lua_pushvalue(L, 3);
+        lua_pushlstring(L, id.data(), id.size());
+        lua_pushnumber(L, static_cast<lua_Number>(entry.joined_at));
+        lua_pushlstring(L, entry.meta.data(), entry.meta.size());
+        failed = lua_pcall(L, 3, 0, 0) != LUA_OK;
+    });
+    --h->iterating;
+    if (failed) return lua_error(L);
+    return 0;
+}
+
+static int presence_topics(lua_State *L) {
+    PresenceHandle *h = check_presence(L);
+    lua_newtable(L);
+    int i = 0;
+    h->store.each_topic(check_string_view(L, 2), [&](std::string_view topic) {
+        lua_pushlstring(L, topic.data(), topic.size());
+        lua_rawseti(L, -2, ++i);
+    });
+    return 1;
+}
+
+static int presence_create(lua_State *L) {
+    PresenceHandle *h = check_presence_writable(L);
+    lua_pushboolean(L, h->store.create(check_string_view(L, 2)));
+    return 1;
+}
+
+static int presence_exists(lua_State *L) {
+    PresenceHandle *h = check_presence(L);
+    lua_pushboolean(L, h->store.exists(check_string_view(L, 2)));
+    return 1;
+}
+
+static int presence_remove(lua_State *L) {
+    PresenceHandle *h = check_presence_writable(L);
+    lua_pushboolean(L, h->store.remove_topic(check_string_view(L, 2)));
+    return 1;
+}
+
+static int presence_version(lua_State *L) {
+    lua_pushnumber(L, static_cast<lua_Number>(check_presence(L)->store.version()));
+    return 1;
+}
+
+// store:changes(topic, since_version) -> { { joined, id, joined_at, meta }, ... } in
+// order, or nil once the change log no longer reaches back to since_version.
+static int presence_changes(lua_State *L) {
+    PresenceHandle *h = check_presence(L);
+    std::string_view topic = check_string_view(L, 2);
+    lua_Number since_arg = luaL_checknumber(L, 3);
+    luaL_argcheck(L, is_uint64(since_arg), 3, "version must be a non-negative integer");
+    uint64_t since = static_cast<uint64_t>(since_arg);
+    lua_newtable(L);
+    int i = 0;
+    bool complete = h->store.changes_since(topic, since, [&](const dawn::PresenceStore::Change &change) {
+        lua_createtable(L, 0, 4);
+        lua_pushboolean(L, change.joined);
+        lua_setfield(L, -2, "joined");
+        lua_pushlstring(L, change.member.data(), change.member.size());
+        lua_setfield(L, -2, "id");
+        lua_pushnumber(L, static_cast<lua_Number>(change.joined_at));
+        lua_setfield(L, -2, "joined_at");
+        lua_pushlstring(L, change.meta.data(), change.meta.size());
+        lua_setfield(L, -2, "meta");
+        lua_rawseti(L, -2, ++i);
+    });
+    if (!complete) lua_pushnil(L);
+    return 1;
+}
+
+// store:size() -> number of topics, number of distinct members.
+static int presence_size(lua_State *L) {
+    PresenceHandle *h = check_presence(L);
+    lua_pushinteger(L, static_cast<lua_Integer>(h->store.topic_count()));
+    lua_pushinteger(L, static_cast<lua_Integer>(h->store.member_count()));
+    return 2;
+}
+
+static int presence_gc(lua_State *L) {
+    auto **slot = static_cast<PresenceHandle **>(check_userdata(L, 1, presence_mt_ref, "presence"));
+    delete *slot;
+    *slot = nullptr;
+    return 0;
+}
+
+static void create_presence_metatable(lua_State *L) {
+    static const luaL_Reg methods[] = {
+        {"join", presence_join},
+        {"replace", presence_replace},
+        {"leave", presence_leave},
+        {"leave_all", presence_leave_all},
+        {"has", presence_has},
+        {"get", presence_get},
+        {"count", presence_count},
+        {"members", presence_members},
+        {"each", presence_each},
+        {"topics", presence_topics},
+        {"create", presence_create},
+        {"exists", presence_exists},
+        {"remove", presence_remove},
+        {"version", presence_version},
+        {"changes", presence_changes},
+        {"size", presence_size},
+        {nullptr, nullptr}
+    };
+    luaL_newmetatable(L, "presence");
+    luaL_newlib(L, methods);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, presence_gc);
+    lua_setfield(L, -2, "__gc");
+    presence_mt_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+// uws.presence_store([log_capacity]): an empty store whose change log keeps the
+// last log_capacity (default 1024) joins and leaves.
+static int uw_presence_store(lua_State *L) {
+    size_t log_capacity = static_cast<size_t>(luaL_optinteger(L, 1, 1024));
+    auto **slot = static_cast<PresenceHandle **>(lua_newuserdata(L, sizeof(PresenceHandle *)));
+    *slot = nullptr;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, presence_mt_ref);
+    lua_setmetatable(L, -2);
+    *slot = new PresenceHandle{dawn::PresenceStore(log_capacity)};
+    return 1;
+}
 
-int uw_put(lua_State *L) {
-    const char *route = luaL_checkstring(L, 1);
-    luaL_checktype(L, 2, LUA_TFUNCTION);
-    lua_pushvalue(L, 2);
-    int ref = luaL_ref(L, LUA_REGISTRYINDEX);
-    int callback_id = callback_id_counter++;
-    lua_callbacks[callback_id] = ref;
+// Redis. uws.redis_connect opens a RESP connection on this loop's usockets loop,
+// so replies and pub/sub messages arrive as ordinary loop events: commands are
+// pipelined (written without waiting for earlier replies, each reply handed to the
+// next callback or coroutine in line), and a dropped connection is re-established
+// with exponential backoff and its subscriptions restored. A client that has
+// subscriptions only accepts (p)(un)subscribe, as Redis itself requires; use a
+// second client for commands.
+//
+// Commands are not written as they are issued: they collect in the client's buffer
+// and every client with something new is flushed once per loop iteration (from the
+// loop's pre and post handlers), so all the commands a sweep issues go out in one
+// write.
 
-    app->put(route, [callback_id, route](uWS::HttpResponse<false> *res_uws, uWS::HttpRequest *req_uws) {
-        if (res_uws) {
-            std::shared_ptr<std::string> body = std::make_shared<std::string>();
+// Who gets a reply: a callback, or a coroutine suspended in client:call.
+struct RedisWaiter {
+    int ref;
+    bool resume;
+};
 
-            res_uws->onData([callback_id, res_uws, req_uws, route, body](std::string_view data, bool last) mutable {
-                body->append(data.data(), data.size());
+struct RedisClient {
+    std::string host;
+    int port = 6379;
+    std::string username;
+    std::string password;
+    int db = 0;
+    unsigned connect_timeout = 5;           // seconds
+    bool reconnect = true;
+    int reconnect_delay_min = 100;          // ms, doubled per failed attempt
+    int reconnect_delay_max = 5000;
+    int reconnect_delay = 100;
+    size_t max_buffer = 16 * 1024 * 1024;   // unsent command bytes
 
-                if (last) {
-                    std::lock_guard<std::mutex> lock(lua_mutex);
-                    if (!execute_middleware(main_L, res_uws, req_uws, route)) return;
+    int self_ref = LUA_NOREF;               // pins the Lua object until close
+    int on_connect_ref = LUA_NOREF;
+    int on_disconnect_ref = LUA_NOREF;
 
-                    lua_rawgeti(main_L, LUA_REGISTRYINDEX, lua_callbacks[callback_id]);
-                    create_req_userdata(main_L, req_uws);
-                    create_res_userdata(main_L, res_uws);
-                     lua_pushlstring(main_L, data.data(), data.size());
-                    lua_pushboolean(main_L, last);
+    struct us_socket_t *socket = nullptr;
+    struct us_timer_t *timer = nullptr;
+    bool connected = false;
+    bool closed = false;
+    bool flush_scheduled = false;
+    std::string close_reason;
 
-                    if (lua_pcall(main_L, 4, 0, 0) != LUA_OK) {
-                        std::cerr << "Lua error in PUT handler: " << lua_tostring(main_L, -1) << std::endl;
-                        lua_pop(main_L, 1);
-                        res_uws->writeHeader("Content-Type", "text/plain")->end("Internal Server Error");
-                    }
-                }
-            });
+    std::string out;                        // encoded commands not yet written
+    size_t out_sent = 0;
+    std::deque<RedisWaiter> pending;        // one per command awaiting its reply
+    dawn::RespParser parser;
 
-            res_uws->onAborted([]() {
-                std::cerr << "PUT request aborted" << std::endl;
-            });
+    std::unordered_map<std::string, int> channels; // channel -> callback ref
+    std::unordered_map<std::string, int> patterns;
+    size_t confirmations = 0;               // (un)subscribe acknowledgements still due
+    int64_t server_subscriptions = 0;       // as last reported by Redis
+};
 
-        } else {
-            std::cerr << "Error: res_uws is NULL in PUT handler!" << std::endl;
-        }
-    });
+// Marks the AUTH/SELECT replies in RedisClient::pending; a failure there drops the connection.
+static constexpr int REDIS_HANDSHAKE = LUA_NOREF - 1;
 
-    lua_pushboolean(L, 1);
-    return 1;
+static thread_local struct us_socket_context_t *redis_context = nullptr;
+static thread_local std::vector<RedisClient *> redis_clients;
+static thread_local std::vector<RedisClient *> redis_unflushed;
+static thread_local int redis_mt_ref = LUA_NOREF;
+
+static RedisClient *redis_client_of(struct us_socket_t *s) {
+    return *static_cast<RedisClient **>(us_socket_ext(0, s));
 }
 
+static void redis_flush(RedisClient *c) {
+    while (c->connected && c->out_sent < c->out.size()) {
+        size_t left = std::min<size_t>(c->out.size() - c->out_sent, INT_MAX);
+        int written = us_socket_write(0, c->socket, c->out.data() + c->out_sent, static_cast<int>(left), 0);
+        if (written <= 0) return;
+        c->out_sent += static_cast<size_t>(written);
+        if (static_cast<size_t>(written) < left) return; // rest goes out from on_writable
+    }
+    if (c->out_sent == c->out.size()) {
+        c->out.clear();
+        c->out_sent = 0;
+    }
+}
 
-int uw_delete(lua_State *L) {
-    const char *route = luaL_checkstring(L, 1);
-    luaL_checktype(L, 2, LUA_TFUNCTION);
-    lua_pushvalue(L, 2);
-    int ref = luaL_ref(L, LUA_REGISTRYINDEX);
-    int callback_id = callback_id_counter++;
-    lua_callbacks[callback_id] = ref;
+template <typename Args>
+static void redis_append(RedisClient *c, const Args &args) {
+    dawn::resp_append_command(c->out, args);
+}
 
-    app->del(route, [callback_id, route](uWS::HttpResponse<false> *res_uws, uWS::HttpRequest *req_uws) {
-        std::lock_guard<std::mutex> lock(lua_mutex);
-        if (!execute_middleware(main_L, res_uws, req_uws, route)) return;
+// Defers the write to the end of the current loop iteration. While disconnected
+// there is nothing to do: on_open writes whatever has collected.
+static void redis_schedule_flush(RedisClient *c) {
+    if (c->flush_scheduled || !c->connected) return;
+    c->flush_scheduled = true;
+    redis_unflushed.push_back(c);
+}
 
-        lua_rawgeti(main_L, LUA_REGISTRYINDEX, lua_callbacks[callback_id]);
-        create_req_userdata(main_L, req_uws);
-        create_res_userdata(main_L, res_uws);
+static void redis_flush_scheduled(uWS::Loop *) {
+    if (redis_unflushed.empty()) return;
+    std::vector<RedisClient *> clients;
+    clients.swap(redis_unflushed);
+    for (RedisClient *c : clients) {
+        c->flush_scheduled = false;
+        redis_flush(c);
+    }
+}
 
-        if (lua_pcall(main_L, 2, 0, 0) != LUA_OK) {
-            std::cerr << "Lua error in DELETE handler: " << lua_tostring(main_L, -1) << std::endl;
-            lua_pop(main_L, 1);
-            res_uws->writeHeader("Content-Type", "text/plain")->end("Internal Server Error");
+// Pushes a reply for Lua: strings and integers as themselves, arrays as tables.
+// Inside arrays a nil reply becomes uws.json_null and an error becomes { err = msg }.
+static void push_resp(lua_State *L, const dawn::RespValue &value, bool nested) {
+    switch (value.type) {
+    case dawn::RespType::SIMPLE:
+    case dawn::RespType::BULK:
+        lua_pushlstring(L, value.str.data(), value.str.size());
+        break;
+    case dawn::RespType::INTEGER:
+        lua_pushnumber(L, static_cast<lua_Number>(value.integer));
+        break;
+    case dawn::RespType::ERROR:
+        lua_createtable(L, 0, 1);
+        lua_pushlstring(L, value.str.data(), value.str.size());
+        lua_setfield(L, -2, "err");
+        break;
+    case dawn::RespType::NIL:
+        if (nested) lua_pushlightuserdata(L, nullptr);
+        else lua_pushnil(L);
+        break;
+    case dawn::RespType::ARRAY:
+        lua_createtable(L, static_cast<int>(value.elements.size()), 0);
+        for (size_t i = 0; i < value.elements.size(); ++i) {
+            push_resp(L, value.elements[i], true);
+            lua_rawseti(L, -2, static_cast<int>(i + 1));
         }
-    });
-    lua_pushboolean(L, 1);
-    return 1;
+        break;
+    }
 }
 
-int uw_patch(lua_State *L) {
-    const char *route = luaL_checkstring(L, 1);
-    luaL_checktype(L, 2, LUA_TFUNCTION);
-    lua_pushvalue(L, 2);
-    int ref = luaL_ref(L, LUA_REGISTRYINDEX);
-    int callback_id = callback_id_counter++;
-    lua_callbacks[callback_id] = ref;
+// Calls the function at ref with the arguments push_args(main_L) leaves on the stack.
+template <typename PushArgs>
+static void call_redis_callback(int ref, const char *what, PushArgs &&push_args) {
+    lua_rawgeti(main_L, LUA_REGISTRYINDEX, ref);
+    int nargs = push_args(main_L);
+    if (lua_pcall(main_L, nargs, 0, 0) != LUA_OK) {
+        shim_log().write(dawn::LOG_ERROR, "Lua error (redis ", what, "): ", lua_tostring(main_L, -1));
+        lua_pop(main_L, 1);
+    }
+}
 
-    app->patch(route, [callback_id, route](uWS::HttpResponse<false> *res_uws, uWS::HttpRequest *req_uws) {
-        std::string body;
-        res_uws->onData([callback_id, res_uws, &body, req_uws, route](std::string_view data, bool last) mutable {
-            body.append(data.data(), data.size());
-            if (last) {
-                std::lock_guard<std::mutex> lock(lua_mutex);
-                if (!execute_middleware(main_L, res_uws, req_uws, route)) return;
-
-                lua_rawgeti(main_L, LUA_REGISTRYINDEX, lua_callbacks[callback_id]);
-                create_req_userdata(main_L, req_uws);
-                create_res_userdata(main_L, res_uws);
-                lua_pushlstring(main_L, body.data(), body.size());
-
-                if (lua_pcall(main_L, 3, 0, 0) != LUA_OK) {
-                    std::cerr << "Lua error in PATCH handler: " << lua_tostring(main_L, -1) << std::endl;
-                    lua_pop(main_L, 1);
-                    res_uws->writeHeader("Content-Type", "text/plain")->end("Internal Server Error");
-                }
-            }
-        });
-        res_uws->onAborted([]() {
-            std::cerr << "PATCH request aborted" << std::endl;
+// Hands a reply to its waiter and drops the waiter's ref. A coroutine is resumed
+// with the values as the results of its client:call.
+template <typename PushArgs>
+static void redis_complete(const RedisWaiter &waiter, PushArgs &&push_args) {
+    if (!waiter.resume) {
+        call_redis_callback(waiter.ref, "reply", push_args);
+    } else {
+        lua_rawgeti(main_L, LUA_REGISTRYINDEX, waiter.ref);
+        lua_State *co = lua_tothread(main_L, -1);
+        lua_pop(main_L, 1);
+        resume_and_report(co, push_args(co), "redis call");
+    }
+    luaL_unref(main_L, LUA_REGISTRYINDEX, waiter.ref);
+}
+
+static void redis_fail_pending(RedisClient *c, const char *reason) {
+    std::deque<RedisWaiter> pending;
+    pending.swap(c->pending);
+    for (const RedisWaiter &waiter : pending) {
+        if (waiter.ref < 0) continue;
+        redis_complete(waiter, [&](lua_State *L) {
+            lua_pushnil(L);
+            lua_pushstring(L, reason);
+            return 2;
         });
-    });
-    lua_pushboolean(L, 1);
-    return 1;
+    }
 }
 
-int uw_head(lua_State *L) {
-    const char *route = luaL_checkstring(L, 1);
-    luaL_checktype(L, 2, LUA_TFUNCTION);
-    lua_pushvalue(L, 2);
-    int ref = luaL_ref(L, LUA_REGISTRYINDEX);
-    int callback_id = callback_id_counter++;
-    lua_callbacks[callback_id] = ref;
+static void redis_connect(RedisClient *c);
+
+static void redis_reconnect_timer(struct us_timer_t *timer) {
+    RedisClient *c = *static_cast<RedisClient **>(us_timer_ext(timer));
+    if (!c->closed && !c->socket) redis_connect(c);
+}
 
-    app->head(route, [callback_id, route](uWS::HttpResponse<false> *res_uws, uWS::HttpRequest *req_uws) {
-        std::lock_guard<std::mutex> lock(lua_mutex);
-        if (!execute_middleware(main_L, res_uws, req_uws, route)) return;
+static void redis_schedule_reconnect(RedisClient *c) {
+    if (!c->timer) {
+        c->timer = us_create_timer(reinterpret_cast<struct us_loop_t *>(uWS::Loop::get()), 1, sizeof(RedisClient *));
+        *static_cast<RedisClient **>(us_timer_ext(c->timer)) = c;
+    }
+    us_timer_set(c->timer, redis_reconnect_timer, c->reconnect_delay, 0);
+    c->reconnect_delay = std::min(c->reconnect_delay * 2, c->reconnect_delay_max);
+}
 
-        lua_rawgeti(main_L, LUA_REGISTRYINDEX, lua_callbacks[callback_id]);
-        create_req_userdata(main_L, req_uws);
-        create_res_userdata(main_L, res_uws);
+// The socket is gone (closed, failed to connect or timed out). Replies still owed
+// are failed, since Redis may or may not have run those commands; commands issued
+// while no connection was up stay queued for the next one.
+static void redis_disconnected(RedisClient *c, struct us_socket_t *s) {
+    if (c->socket != s) return;
+    bool was_connected = c->connected;
+    c->socket = nullptr;
+    c->connected = false;
+    c->parser.reset();
+    c->confirmations = 0;
+    c->server_subscriptions = 0;
+    std::string reason = c->closed ? "client closed" : c->close_reason.empty() ? "connection lost" : c->close_reason;
+    c->close_reason.clear();
 
-        if (lua_pcall(main_L, 2, 0, 0) != LUA_OK) {
-            std::cerr << "Lua error in HEAD handler: " << lua_tostring(main_L, -1) << std::endl;
-            lua_pop(main_L, 1);
-            res_uws->writeHeader("Content-Type", "text/plain")->end("Internal Server Error");
-        }
-    });
-    lua_pushboolean(L, 1);
-    return 1;
+    if (was_connected || c->closed || !c->reconnect) {
+        c->out.clear();
+        c->out_sent = 0;
+        redis_fail_pending(c, reason.c_str());
+    }
+    if (was_connected && c->on_disconnect_ref != LUA_NOREF && !c->closed) {
+        call_redis_callback(c->on_disconnect_ref, "on_disconnect", [&](lua_State *L) {
+            lua_rawgeti(L, LUA_REGISTRYINDEX, c->self_ref);
+            lua_pushstring(L, reason.c_str());
+            return 2;
+        });
+    }
+    if (!c->closed && c->reconnect) redis_schedule_reconnect(c);
 }
 
-int uw_options(lua_State *L) {
-    const char *route = luaL_checkstring(L, 1);
-    luaL_checktype(L, 2, LUA_TFUNCTION);
-    lua_pushvalue(L, 2);
-    int ref = luaL_ref(L, LUA_REGISTRYINDEX);
-    int callback_id = callback_id_counter++;
-    lua_callbacks[callback_id] = ref;
+static struct us_socket_t *redis_on_open(struct us_socket_t *s, int /*is_client*/, char * /*ip*/, int /*ip_length*/) {
+    RedisClient *c = redis_client_of(s);
+    c->connected = true;
+    us_socket_timeout(0, s, 0);
 
-    app->options(route, [callback_id, route](uWS::HttpResponse<false> *res_uws, uWS::HttpRequest *req_uws) {
-        std::lock_guard<std::mutex> lock(lua_mutex);
-        if (!execute_middleware(main_L, res_uws, req_uws, route)) return;
+    // Nothing has been written on this connection yet, so the handshake and the
+    // restored subscriptions go in front of whatever was queued meanwhile.
+    std::string queued;
+    queued.swap(c->out);
+    c->out_sent = 0;
+    if (!c->password.empty()) {
+        if (c->username.empty()) redis_append(c, std::vector<std::string_view>{"AUTH", c->password});
+        else redis_append(c, std::vector<std::string_view>{"AUTH", c->username, c->password});
+        c->pending.push_front({REDIS_HANDSHAKE, false});
+    }
+    if (c->db != 0) {
+        std::string db = std::to_string(c->db);
+        redis_append(c, std::vector<std::string_view>{"SELECT", db});
+        c->pending.push_front({REDIS_HANDSHAKE, false});
+    }
+    for (auto *subscriptions : {&c->channels, &c->patterns}) {
+        if (subscriptions->empty()) continue;
+        std::vector<std::string_view> args{subscriptions == &c->channels ? "SUBSCRIBE" : "PSUBSCRIBE"};
+        for (auto &entry : *subscriptions) args.push_back(entry.first);
+        redis_append(c, args);
+        c->confirmations += subscriptions->size();
+    }
+    if (c->pending.empty() || c->pending.front().ref != REDIS_HANDSHAKE) c->reconnect_delay = c->reconnect_delay_min;
+    c->out += queued;
+    redis_flush(c);
 
-        lua_rawgeti(main_L, LUA_REGISTRYINDEX, lua_callbacks[callback_id]);
-        create_req_userdata(main_L, req_uws);
-        create_res_userdata(main_L, res_uws);
+    if (c->on_connect_ref != LUA_NOREF) {
+        call_redis_callback(c->on_connect_ref, "on_connect", [&](lua_State *L) {
+            lua_rawgeti(L, LUA_REGISTRYINDEX, c->self_ref);
+            return 1;
+        });
+    }
+    return s;
+}
 
-        if (lua_pcall(main_L, 2, 0, 0) != LUA_OK) {
-            std::cerr << "Lua error in OPTIONS handler: " << lua_tostring(main_L, -1) << std::endl;
-            lua_pop(main_L, 1);
-            res_uws->writeHeader("Content-Type", "text/plain")->end("Internal Server Error");
-        }
+static void redis_deliver(std::unordered_map<std::string, int> &subscriptions, const dawn::RespValue &key,
+                          const dawn::RespValue &channel, const dawn::RespValue &payload, const dawn::RespValue *pattern) {
+    auto it = subscriptions.find(key.str);
+    if (it == subscriptions.end()) return; // unsubscribed locally, acknowledgement still in flight
+    call_redis_callback(it->second, "message", [&](lua_State *L) {
+        lua_pushlstring(L, channel.str.data(), channel.str.size());
+        lua_pushlstring(L, payload.str.data(), payload.str.size());
+        if (!pattern) return 2;
+        lua_pushlstring(L, pattern->str.data(), pattern->str.size());
+        return 3;
     });
-    lua_pushboolean(L, 1);
-    return 1;
 }
 
-// Function to generate a simple unique ID
-std::string generate_unique_id() {
-    static std::random_device rd;
-    static std::mt19937 gen(rd());
-    static std::uniform_int_distribution<> distrib(0, 15);
-
-    std::stringstream ss;
-    for (int i = 0; i < 16; ++i) {
-        int val = distrib(gen);
-        ss << std::hex << val;
-        if (i == 3 || i == 5 || i == 7 || i == 9) {
-            ss << "-";
+static void redis_dispatch(RedisClient *c, const dawn::RespValue &reply) {
+    if (reply.type == dawn::RespType::ARRAY && !reply.elements.empty()) {
+        const dawn::RespValue &kind = reply.elements[0];
+        const auto &e = reply.elements;
+        if (c->confirmations > 0 && e.size() == 3 && e[2].type == dawn::RespType::INTEGER &&
+            (kind.is_string("subscribe") || kind.is_string("unsubscribe") ||
+             kind.is_string("psubscribe") || kind.is_string("punsubscribe"))) {
+            --c->confirmations;
+            c->server_subscriptions = e[2].integer;
+            return;
+        }
+        if (c->server_subscriptions > 0) {
+            if (kind.is_string("message") && e.size() == 3) {
+                redis_deliver(c->channels, e[1], e[1], e[2], nullptr);
+                return;
+            }
+            if (kind.is_string("pmessage") && e.size() == 4) {
+                redis_deliver(c->patterns, e[1], e[2], e[3], &e[1]);
+                return;
+            }
         }
     }
-    return ss.str();
-}
 
-// Lua function to get the WebSocket ID
-static int websocket_get_id(lua_State *L) {
-    uWS::WebSocket<false, true, WebSocketUserData>** ws_ud = static_cast<uWS::WebSocket<false, true, WebSocketUserData>**>(luaL_checkudata(L, 1, "websocket"));
-    if (!ws_ud || !*ws_ud) {
-        luaL_error(L, "invalid websocket userdata");
-        return 0;
+    if (c->pending.empty()) return;
+    RedisWaiter waiter = c->pending.front();
+    c->pending.pop_front();
+    if (waiter.ref == REDIS_HANDSHAKE) {
+        if (reply.type == dawn::RespType::ERROR) {
+            shim_log().write(dawn::LOG_ERROR, "Redis ", c->host, ":", c->port, " handshake failed: ", reply.str);
+            c->close_reason = reply.str;
+            us_socket_close(0, c->socket, 0, nullptr);
+        } else {
+            c->reconnect_delay = c->reconnect_delay_min; // back off only while the handshake keeps failing
+        }
+        return;
     }
-
-    lua_pushstring(L, (*ws_ud)->getUserData()->id.c_str());
-    return 1;
+    if (waiter.ref == LUA_NOREF) {
+        if (reply.type == dawn::RespType::ERROR) shim_log().write(dawn::LOG_ERROR, "Redis error: ", reply.str);
+        return;
+    }
+    redis_complete(waiter, [&](lua_State *L) {
+        if (reply.type == dawn::RespType::ERROR) {
+            lua_pushnil(L);
+            lua_pushlstring(L, reply.str.data(), reply.str.size());
+            return 2;
+        }
+        push_resp(L, reply, false);
+        return 1;
+    });
 }
 
-int uw_ws(lua_State *L) {
-    const char *route = luaL_checkstring(L, 1);
-    luaL_checktype(L, 2, LUA_TFUNCTION);
-    lua_pushvalue(L, 2);
-    int ref = luaL_ref(L, LUA_REGISTRYINDEX);
-    int callback_id = callback_id_counter++;
-    lua_callbacks[callback_id] = ref;
-
-    app->ws<WebSocketUserData>(route, {
-        .open = [callback_id, route](auto *ws) {
-            std::lock_guard<std::mutex> lock(lua_mutex);
-            lua_rawgeti(main_L, LUA_REGISTRYINDEX, lua_callbacks[callback_id]);
-
-            // Push the WebSocket userdata and set its metatable
-            uWS::WebSocket<false, true, WebSocketUserData>** ws_ud = static_cast<uWS::WebSocket<false, true, WebSocketUserData>**>(lua_newuserdata(main_L, sizeof(uWS::WebSocket<false, true, WebSocketUserData>*)));
-            *ws_ud = ws;
-            luaL_getmetatable(main_L, "websocket");
-            lua_setmetatable(main_L, -2);
+static struct us_socket_t *redis_on_data(struct us_socket_t *s, char *data, int length) {
+    RedisClient *c = redis_client_of(s);
+    if (c->socket != s) return s;
+    c->parser.feed(data, static_cast<size_t>(length));
 
-            // Generate and store the unique ID in the user data
-            ws->getUserData()->id = generate_unique_id();
+    // Held on the stack so a callback that closes the client cannot get it collected mid-loop.
+    lua_rawgeti(main_L, LUA_REGISTRYINDEX, c->self_ref);
+    dawn::RespValue reply;
+    while (c->socket == s) {
+        dawn::RespStatus status = c->parser.next(reply);
+        if (status == dawn::RespStatus::INCOMPLETE) break;
+        if (status == dawn::RespStatus::INVALID) {
+            c->close_reason = "protocol error";
+            us_socket_close(0, s, 0, nullptr);
+            break;
+        }
+        redis_dispatch(c, reply);
+    }
+    lua_pop(main_L, 1);
+    return s;
+}
 
-            lua_pushstring(main_L, "open");
+static struct us_socket_t *redis_on_writable(struct us_socket_t *s) {
+    RedisClient *c = redis_client_of(s);
+    if (c->socket == s) redis_flush(c);
+    return s;
+}
 
-            if (lua_pcall(main_L, 2, 0, 0) != LUA_OK) {
-                std::cerr << "Lua error (open): " << lua_tostring(main_L, -1) << std::endl;
-                lua_pop(main_L, 1);
-            }
-        },
+static struct us_socket_t *redis_on_close(struct us_socket_t *s, int /*code*/, void * /*reason*/) {
+    RedisClient *c = redis_client_of(s);
+    if (c->socket != s) return s;
+    lua_rawgeti(main_L, LUA_REGISTRYINDEX, c->self_ref);
+    redis_disconnected(c, s);
+    lua_pop(main_L, 1);
+    return s;
+}
 
-        .message = [callback_id](auto *ws, std::string_view message, uWS::OpCode opCode) {
-            std::cout << "uWS opcode enum value: " << static_cast<int>(opCode) << std::endl;
-            std::lock_guard<std::mutex> lock(lua_mutex);
-            lua_rawgeti(main_L, LUA_REGISTRYINDEX, lua_callbacks[callback_id]);
+static struct us_socket_t *redis_on_connect_error(struct us_socket_t *s, int code) {
+    RedisClient *c = redis_client_of(s);
+    if (c->close_reason.empty()) c->close_reason = "connection refused";
+    return redis_on_close(s, code, nullptr);
+}
 
-            // Push the WebSocket userdata with metatable
-            uWS::WebSocket<false, true, WebSocketUserData>** ws_ud = static_cast<uWS::WebSocket<false, true, WebSocketUserData>**>(lua_newuserdata(main_L, sizeof(uWS::WebSocket<false, true, WebSocketUserData>*)));
-            *ws_ud = ws;
-            luaL_getmetatable(main_L, "websocket");
-            lua_setmetatable(main_L, -2);
+static struct us_socket_t *redis_on_end(struct us_socket_t *s) {
+    return us_socket_close(0, s, 0, nullptr);
+}
 
-            lua_pushstring(main_L, "message");
-            lua_pushlstring(main_L, message.data(), message.size());
-            lua_pushinteger(main_L, static_cast<int>(opCode));
+static struct us_socket_t *redis_on_timeout(struct us_socket_t *s) {
+    RedisClient *c = redis_client_of(s);
+    if (c->connected) return s;
+    c->close_reason = "connect timed out";
+    return us_socket_close(0, s, 0, nullptr);
+}
 
+static struct us_socket_context_t *get_redis_context() {
+    if (redis_context) return redis_context;
+    struct us_socket_context_options_t options = {};
+    redis_context = us_create_socket_context(0, reinterpret_cast<struct us_loop_t *>(uWS::Loop::get()), 0, options);
+    us_socket_context_on_open(0, redis_context, redis_on_open);
+    us_socket_context_on_data(0, redis_context, redis_on_data);
+    us_socket_context_on_writable(0, redis_context, redis_on_writable);
+    us_socket_context_on_close(0, redis_context, redis_on_close);
+    us_socket_context_on_connect_error(0, redis_context, redis_on_connect_error);
+    us_socket_context_on_end(0, redis_context, redis_on_end);
+    us_socket_context_on_timeout(0, redis_context, redis_on_timeout);
+    uWS::Loop::get()->addPreHandler(&redis_unflushed, redis_flush_scheduled);
+    uWS::Loop::get()->addPostHandler(&redis_unflushed, redis_flush_scheduled);
+    return redis_context;
+}
 
-            if (lua_pcall(main_L, 4, 0, 0) != LUA_OK) {
-                std::cerr << "Lua error (message): " << lua_tostring(main_L, -1) << std::endl;
-                lua_pop(main_L, 1);
-            }
-        },
+// Starts a connection attempt. The host is resolved synchronously by usockets, so
+// pass an address or a name the resolver answers from /etc/hosts.
+static void redis_connect(RedisClient *c) {
+    struct us_socket_t *s = us_socket_context_connect(0, get_redis_context(), c->host.c_str(), c->port, nullptr, 0, sizeof(RedisClient *));
+    if (!s) {
+        if (c->reconnect) redis_schedule_reconnect(c);
+        return;
+    }
+    *static_cast<RedisClient **>(us_socket_ext(0, s)) = c;
+    c->socket = s;
+    us_socket_timeout(0, s, c->connect_timeout);
+}
 
-        .close = [callback_id](auto *ws, int code, std::string_view message) {
-            std::lock_guard<std::mutex> lock(lua_mutex);
-            lua_rawgeti(main_L, LUA_REGISTRYINDEX, lua_callbacks[callback_id]);
+// Closes the connection and stops reconnecting. With notify, callbacks still owed a
+// reply get (nil, "client closed"); without, Lua is not touched at all (used from
+// __gc while the state itself is closing).
+static void redis_close(RedisClient *c, bool notify) {
+    if (c->closed) return;
+    c->closed = true;
+    redis_clients.erase(std::remove(redis_clients.begin(), redis_clients.end(), c), redis_clients.end());
+    redis_unflushed.erase(std::remove(redis_unflushed.begin(), redis_unflushed.end(), c), redis_unflushed.end());
+    if (c->timer) {
+        us_timer_close(c->timer);
+        c->timer = nullptr;
+    }
+    if (!notify) {
+        c->pending.clear();
+        c->on_disconnect_ref = LUA_NOREF;
+    }
+    if (struct us_socket_t *s = c->socket) {
+        if (!notify) c->socket = nullptr; // on_close then leaves the client alone
+        us_socket_close(0, s, 0, nullptr);
+    }
+    if (!notify) return;
 
-            // Push the WebSocket userdata with metatable
-            uWS::WebSocket<false, true, WebSocketUserData>** ws_ud = static_cast<uWS::WebSocket<false, true, WebSocketUserData>**>(lua_newuserdata(main_L, sizeof(uWS::WebSocket<false, true, WebSocketUserData>*)));
-            *ws_ud = ws;
-            luaL_getmetatable(main_L, "websocket");
-            lua_setmetatable(main_L, -2);
+    redis_fail_pending(c, "client closed");
+    for (auto *subscriptions : {&c->channels, &c->patterns}) {
+        for (auto &entry : *subscriptions) luaL_unref(main_L, LUA_REGISTRYINDEX, entry.second);
+        subscriptions->clear();
+    }
+    luaL_unref(main_L, LUA_REGISTRYINDEX, c->on_connect_ref);
+    luaL_unref(main_L, LUA_REGISTRYINDEX, c->on_disconnect_ref);
+    luaL_unref(main_L, LUA_REGISTRYINDEX, c->self_ref);
+    c->on_connect_ref = c->on_disconnect_ref = c->self_ref = LUA_NOREF;
+}
 
-            lua_pushstring(main_L, "close");
-            lua_pushinteger(main_L, code);
-            lua_pushlstring(main_L, message.data(), message.size());
+static RedisClient *check_redis(lua_State *L) {
+    auto *client = *static_cast<RedisClient **>(check_userdata(L, 1, redis_mt_ref, "redis"));
+    if (!client || client->closed) luaL_error(L, "redis client has been closed");
+    return client;
+}
 
-            if (lua_pcall(main_L, 4, 0, 0) != LUA_OK) {
-                std::cerr << "Lua error (close): " << lua_tostring(main_L, -1) << std::endl;
-                lua_pop(main_L, 1);
-            }
+// Encodes the command table at idx into the client's buffer; on a bad argument
+// nothing is appended and a Lua error is raised.
+static void redis_append_table(lua_State *L, RedisClient *c, int idx) {
+    size_t count = lua_objlen(L, idx);
+    if (count == 0) luaL_argerror(L, idx, "empty command");
+    size_t start = c->out.size();
+    dawn::resp_append_array_header(c->out, count);
+    for (size_t i = 1; i <= count; ++i) {
+        lua_rawgeti(L, idx, static_cast<int>(i));
+        int type = lua_type(L, -1);
+        if (type != LUA_TSTRING && type != LUA_TNUMBER) {
+            c->out.resize(start);
+            luaL_error(L, "redis command argument %d is not a string or number", static_cast<int>(i));
         }
-    });
-
-    // Register the get_id function in the "websocket" metatable
-    luaL_getmetatable(L, "websocket");
-    lua_pushcfunction(L, websocket_get_id);
-    lua_setfield(L, -2, "get_id");
-    lua_pop(L, 1); // Pop the metatable
-
-    lua_pushboolean(L, 1);
-    return 1;
+        size_t len = 0;
+        const char *arg = lua_tolstring(L, -1, &len);
+        dawn::resp_append_bulk(c->out, std::string_view(arg, len));
+        lua_pop(L, 1);
+    }
 }
 
-// Assuming fs, app, and other necessary includes/definitions are present
-// Assuming you have uWebSockets.h or similar for uWS::App and Response/Request types
-// #include "uWebSockets.h"
-
-// Assuming 'app' is globally available, e.g.:
-// uWS::App* app = nullptr;
-// namespace fs = std::filesystem; // Alias for std::filesystem
-
-// Helper function to get MIME type (assuming it's correct)
-std::string get_mime_type(const std::string& filepath) {
-    fs::path p(filepath);
-    std::string ext = p.extension().string();
-    if (ext == ".html" || ext == ".htm") return "text/html";
-    if (ext == ".css") return "text/css";
-    if (ext == ".js") return "application/javascript";
-    if (ext == ".json") return "application/json";
-    if (ext == ".jpg" || ext == ".jpeg") return "image/jpeg";
-    if (ext == ".png") return "image/png";
-    if (ext == ".gif") return "image/gif";
-    if (ext == ".svg") return "image/svg+xml";
-    if (ext == ".ico") return "image/x-icon";
-    if (ext == ".pdf") return "application/pdf";
-    if (ext == ".txt") return "text/plain";
-    return "application/octet-stream";
+// Checks that client can take a command; otherwise pushes nil and the reason.
+static bool redis_accepts_command(lua_State *L, RedisClient *c) {
+    luaL_checktype(L, 2, LUA_TTABLE);
+    if (!c->channels.empty() || !c->patterns.empty()) {
+        luaL_error(L, "redis client is in subscribe mode; use another client for commands");
+    }
+    if (c->out.size() - c->out_sent > c->max_buffer || (!c->socket && !c->reconnect)) {
+        lua_pushnil(L);
+        lua_pushstring(L, c->connected ? "redis send buffer full" : "redis not connected");
+        return false;
+    }
+    return true;
 }
 
-// New function to serve static files
-int uw_serve_static(lua_State *L) {
-    const char *route_prefix = luaL_checkstring(L, 1);
-    const char *dir_path = luaL_checkstring(L, 2);
-
-    std::cout << "[uw_serve_static] Registering static route: " << route_prefix
-              << " serving from directory: " << dir_path << std::endl;
+// client:command({ name, args... } [, callback]) -> true, or nil and an error when
+// too much is already waiting to be sent. callback(reply) gets the reply, or
+// (nil, message) for an error reply or a connection lost before the reply came.
+static int redis_command(lua_State *L) {
+    RedisClient *c = check_redis(L);
+    if (!redis_accepts_command(L, c)) return 2;
+    redis_append_table(L, c, 2);
 
-    if (!fs::is_directory(dir_path)) {
-        std::cerr << "ERROR: Static file directory '" << dir_path << "' does not exist or is not a directory." << std::endl;
-        lua_pushboolean(L, 0);
-        return 1;
+    int ref = LUA_NOREF;
+    if (lua_isfunction(L, 3)) {
+        lua_pushvalue(L, 3);
+        ref = luaL_ref(L, LUA_REGISTRYINDEX);
     }
+    c->pending.push_back({ref, false});
+    redis_schedule_flush(c);
+    lua_pushboolean(L, 1);
+    return 1;
+}
 
-    std::string route_pattern = std::string(route_prefix) + "/*";
+// client:call({ name, args... }) -> reply, or nil and an error. Suspends the calling
+// coroutine until the reply is in; coroutines calling in the same loop iteration
+// share one pipeline.
+static int redis_call(lua_State *L) {
+    RedisClient *c = check_redis(L);
+    if (!redis_accepts_command(L, c)) return 2;
+    int main_thread = lua_pushthread(L);
+    lua_pop(L, 1);
+    if (main_thread) {
+        return luaL_error(L, "client:call must be called from a coroutine; use client:command with a callback");
+    }
+    redis_append_table(L, c, 2);
+    lua_pushthread(L);
+    c->pending.push_back({luaL_ref(L, LUA_REGISTRYINDEX), true});
+    redis_schedule_flush(c);
+    return lua_yield(L, 0);
+}
 
-    app->get(route_pattern.c_str(), [dir_path_str = std::string(dir_path), route_prefix_str = std::string(route_prefix)](auto *res, auto *req) {
-        std::string_view url = req->getUrl();
-        std::cout << "[Request] Incoming URL: " << url << std::endl;
+// Shared body of subscribe/psubscribe/unsubscribe/punsubscribe.
+static int redis_subscription(lua_State *L, bool pattern, bool subscribe) {
+    RedisClient *c = check_redis(L);
+    size_t len = 0;
+    const char *name = luaL_checklstring(L, 2, &len);
+    std::string key(name, len);
+    auto &subscriptions = pattern ? c->patterns : c->channels;
+    auto it = subscriptions.find(key);
 
-        std::string file_path_suffix = std::string(url.substr(route_prefix_str.length()));
-        if (!file_path_suffix.empty() && file_path_suffix[0] == '/') {
-            file_path_suffix.erase(0, 1);
+    if (subscribe) {
+        luaL_checktype(L, 3, LUA_TFUNCTION);
+        lua_pushvalue(L, 3);
+        int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        if (it != subscriptions.end()) {
+            luaL_unref(L, LUA_REGISTRYINDEX, it->second); // new callback, same subscription
+            it->second = ref;
+            lua_pushboolean(L, 1);
+            return 1;
         }
-        std::cout << "[Request] Extracted file path suffix: " << file_path_suffix << std::endl;
-
-        if (file_path_suffix.find("..") != std::string::npos) {
-            std::cerr << "WARNING: Directory traversal attempt detected for: " << file_path_suffix << std::endl;
-            res->writeStatus("403 Forbidden")->end("Forbidden");
-            return;
+        subscriptions.emplace(key, ref);
+    } else {
+        if (it == subscriptions.end()) {
+            lua_pushboolean(L, 0);
+            return 1;
         }
+        luaL_unref(L, LUA_REGISTRYINDEX, it->second);
+        subscriptions.erase(it);
+    }
 
-        fs::path full_path = fs::path(dir_path_str) / file_path_suffix;
-        std::cout << "[File Path] Constructed full path: " << full_path.string() << std::endl;
+    // While disconnected the maps are all there is; on_open subscribes from them.
+    if (c->connected) {
+        const char *command = pattern ? (subscribe ? "PSUBSCRIBE" : "PUNSUBSCRIBE") : (subscribe ? "SUBSCRIBE" : "UNSUBSCRIBE");
+        redis_append(c, std::vector<std::string_view>{command, key});
+        ++c->confirmations;
+        redis_schedule_flush(c);
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
 
-        if (fs::is_directory(full_path)) {
-            std::cout << "[File Path] Path is a directory, appending index.html." << std::endl;
-            full_path /= "index.html";
-        }
+// client:subscribe(channel, fn): fn(channel, message) per message on channel.
+static int redis_subscribe(lua_State *L) { return redis_subscription(L, false, true); }
+// client:psubscribe(pattern, fn): fn(channel, message, pattern) per matching message.
+static int redis_psubscribe(lua_State *L) { return redis_subscription(L, true, true); }
+static int redis_unsubscribe(lua_State *L) { return redis_subscription(L, false, false); }
+static int redis_punsubscribe(lua_State *L) { return redis_subscription(L, true, false); }
 
-        if (fs::exists(full_path) && fs::is_regular_file(full_path)) {
-            auto file_stream_ptr = std::make_shared<std::ifstream>(full_path, std::ios::binary);
+static int redis_is_connected(lua_State *L) {
+    auto *client = *static_cast<RedisClient **>(check_userdata(L, 1, redis_mt_ref, "redis"));
+    lua_pushboolean(L, client && client->connected);
+    return 1;
+}
 
-            if (file_stream_ptr->is_open()) {
-                file_stream_ptr->seekg(0, std::ios::end);
-                size_t file_size = file_stream_ptr->tellg();
-                file_stream_ptr->seekg(0, std::ios::beg);
+static int redis_close_method(lua_State *L) {
+    auto *client = *static_cast<RedisClient **>(check_userdata(L, 1, redis_mt_ref, "redis"));
+    if (client) redis_close(client, true);
+    return 0;
+}
 
-                std::cout << "[File Open] File '" << full_path.string() << "' opened successfully. Size: " << file_size << " bytes." << std::endl;
+// A client is pinned until closed, so this only runs for closed clients or while
+// the whole state is closing.
+static int redis_gc(lua_State *L) {
+    auto **slot = static_cast<RedisClient **>(check_userdata(L, 1, redis_mt_ref, "redis"));
+    if (*slot) {
+        redis_close(*slot, false);
+        delete *slot;
+        *slot = nullptr;
+    }
+    return 0;
+}
 
-                std::string mime_type = get_mime_type(full_path.string());
-                res->writeHeader("Content-Type", mime_type);
-                res->writeHeader("Content-Length", std::to_string(file_size));
-                std::cout << "[Headers] Set Content-Type: " << mime_type << ", Content-Length: " << file_size << std::endl;
+static void create_redis_metatable(lua_State *L) {
+    static const luaL_Reg methods[] = {
+        {"command", redis_command},
+        {"call", redis_call},
+        {"subscribe", redis_subscribe},
+        {"psubscribe", redis_psubscribe},
+        {"unsubscribe", redis_unsubscribe},
+        {"punsubscribe", redis_punsubscribe},
+        {"connected", redis_is_connected},
+        {"close", redis_close_method},
+        {nullptr, nullptr}
+    };
+    luaL_newmetatable(L, "redis");
+    luaL_newlib(L, methods);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, redis_gc);
+    lua_setfield(L, -2, "__gc");
+    redis_mt_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+}
 
-                // Determine a reasonable max chunk size for a single write to avoid onWritable for small files
-                // UWS_MAX_SENDFILE_SIZE is not directly exposed to userland code like this.
-                // A common buffer size or even the system's socket buffer size can be a guide.
-                // Let's use 64KB as a heuristic for a "small" file that can be sent in one go.
-                const size_t SMALL_FILE_THRESHOLD = 64 * 1024; // 64 KB
+// Closes this loop's clients before the worker's Lua state goes away.
+static void close_redis_clients() {
+    std::vector<RedisClient *> clients;
+    clients.swap(redis_clients);
+    for (RedisClient *c : clients) redis_close(c, true);
+    if (redis_context) {
+        uWS::Loop::get()->removePreHandler(&redis_unflushed);
+        uWS::Loop::get()->removePostHandler(&redis_unflushed);
+        us_socket_context_free(0, redis_context);
+        redis_context = nullptr;
+    }
+}
 
-                if (file_size <= SMALL_FILE_THRESHOLD) {
-                    // Read the entire small file into a buffer and send it all at once
-                    std::vector<char> buffer(file_size);
-                    if (!file_stream_ptr->read(buffer.data(), file_size)) {
-                        std::cerr << "ERROR: Failed to read entire small file: " << full_path.string() << std::endl;
-                        res->writeStatus("500 Internal Server Error")->end("File Read Error");
-                        return;
-                    }
-                    std::cout << "[Small File] Sending entire file (" << file_size << " bytes) in one go." << std::endl;
-                    res->end(std::string_view(buffer.data(), file_size));
-                    // No need for onWritable or explicit res->write, res->end(data) sends it all.
-                } else {
-                    // File is large, use onWritable for chunking
-                    auto buffer_ptr = std::make_shared<std::vector<char>>(16 * 1024); // 16KB buffer for chunks
-
-                    res->onWritable([res, file_stream_ptr, buffer_ptr, remaining_bytes_captured = file_size](int offset) mutable {
-                        std::cout << "[onWritable] Called. Offset: " << offset << ", Remaining bytes (before this chunk): " << remaining_bytes_captured << std::endl;
-
-                        size_t chunk_to_read = std::min((size_t)offset, remaining_bytes_captured);
-
-                        if (chunk_to_read == 0) {
-                            std::cout << "[onWritable] No bytes to read in this chunk (chunk_to_read is 0)." << std::endl;
-                            if (remaining_bytes_captured == 0) {
-                                std::cout << "[onWritable] All bytes sent, calling res->end()." << std::endl;
-                                res->end(); // Important: End the response here if all is sent
-                            }
-                            return true; // Indicate that no more data is immediately available to write
-                        }
-
-                        if (!file_stream_ptr->read(buffer_ptr->data(), chunk_to_read)) {
-                            std::cerr << "ERROR: [onWritable] File read error or EOF unexpectedly! File: (Check if stream is still valid: " << file_stream_ptr->good() << ")" << std::endl;
-                            res->end(); // Attempt to gracefully close the response on read error
-                            return true; // Stop writing
-                        }
-
-                        remaining_bytes_captured -= chunk_to_read;
-                        res->write(std::string_view(buffer_ptr->data(), chunk_to_read));
-                        std::cout << "[onWritable] Wrote " << chunk_to_read << " bytes. Remaining: " << remaining_bytes_captured << std::endl;
-
-                        if (remaining_bytes_captured == 0) {
-                            std::cout << "[onWritable] Last chunk sent, calling res->end()." << std::endl;
-                            res->end(); // Important: End the response once all data is sent
-                        }
-                        return remaining_bytes_captured == 0; // Return true if done, false otherwise
-                    })->onAborted([file_stream_ptr, full_path_str = full_path.string()]() {
-                        std::cerr << "WARNING: Static file transfer aborted for '" << full_path_str << "'." << std::endl;
-                    });
-
-                    // Send the first chunk for large files
-                    size_t first_chunk_size = std::min(buffer_ptr->size(), file_size);
-                    if (first_chunk_size > 0) {
-                        std::cout << "[Initial Write] Sending first chunk of size: " << first_chunk_size << " for large file." << std::endl;
-                        if (!file_stream_ptr->read(buffer_ptr->data(), first_chunk_size)) {
-                             std::cerr << "ERROR: [Initial Write] File read error for first chunk of large file! File: " << full_path.string() << std::endl;
-                             res->end();
-                             return;
-                        }
-                        res->write(std::string_view(buffer_ptr->data(), first_chunk_size));
-                    }
-                    std::cout << "[Initial Write] More data to send. onWritable will continue for large file." << std::endl;
-                }
+// uws.redis_connect(host, port [, opts]) -> client. Connects in the background;
+// commands issued before the connection is up are queued. opts: username,
+// password, db, connect_timeout (seconds), reconnect (default true),
+// reconnect_delay / max_reconnect_delay (ms), max_buffer (bytes of unsent
+// commands), on_connect(client) and on_disconnect(client, reason).
+static int uw_redis_connect(lua_State *L) {
+    const char *host = luaL_checkstring(L, 1);
+    int port = static_cast<int>(luaL_optinteger(L, 2, 6379));
+    if (!uWS::Loop::get()) return luaL_error(L, "no event loop");
 
-            } else {
-                std::cerr << "ERROR: Could not open file for reading: " << full_path.string() << std::endl;
-                res->writeStatus("500 Internal Server Error")->end("Could not open file.");
-            }
-        } else {
-            std::cout << "[File Check] File not found or not a regular file: " << full_path.string() << std::endl;
-            res->writeStatus("404 Not Found")->end("Not Found");
-        }
-    });
+    auto *c = new RedisClient();
+    c->host = host;
+    c->port = port;
+    if (lua_istable(L, 3)) {
+        lua_getfield(L, 3, "username");
+        if (lua_isstring(L, -1)) c->username = lua_tostring(L, -1);
+        lua_getfield(L, 3, "password");
+        if (lua_isstring(L, -1)) c->password = lua_tostring(L, -1);
+        lua_getfield(L, 3, "db");
+        if (lua_isnumber(L, -1)) c->db = static_cast<int>(lua_tointeger(L, -1));
+        lua_getfield(L, 3, "connect_timeout");
+        if (lua_isnumber(L, -1)) c->connect_timeout = static_cast<unsigned>(lua_tointeger(L, -1));
+        lua_getfield(L, 3, "reconnect");
+        if (lua_isboolean(L, -1)) c->reconnect = lua_toboolean(L, -1);
+        lua_getfield(L, 3, "reconnect_delay");
+        if (lua_isnumber(L, -1)) c->reconnect_delay_min = std::max(1, static_cast<int>(lua_tointeger(L, -1)));
+        lua_getfield(L, 3, "max_reconnect_delay");
+        if (lua_isnumber(L, -1)) c->reconnect_delay_max = static_cast<int>(lua_tointeger(L, -1));
+        lua_getfield(L, 3, "max_buffer");
+        if (lua_isnumber(L, -1)) c->max_buffer = static_cast<size_t>(lua_tonumber(L, -1));
+        lua_pop(L, 8);
+        lua_getfield(L, 3, "on_connect");
+        c->on_connect_ref = lua_isfunction(L, -1) ? luaL_ref(L, LUA_REGISTRYINDEX) : (lua_pop(L, 1), LUA_NOREF);
+        lua_getfield(L, 3, "on_disconnect");
+        c->on_disconnect_ref = lua_isfunction(L, -1) ? luaL_ref(L, LUA_REGISTRYINDEX) : (lua_pop(L, 1), LUA_NOREF);
+    }
+    c->reconnect_delay_max = std::max(c->reconnect_delay_max, c->reconnect_delay_min);
+    c->reconnect_delay = c->reconnect_delay_min;
 
-    lua_pushboolean(L, 1);
+    auto **slot = static_cast<RedisClient **>(lua_newuserdata(L, sizeof(RedisClient *)));
+    *slot = c;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, redis_mt_ref);
+    lua_setmetatable(L, -2);
+    lua_pushvalue(L, -1);
+    c->self_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    redis_clients.push_back(c);
+    redis_connect(c);
     return 1;
 }
+
 int uw_listen(lua_State *L) {
     if (!app) {
-        std::cerr << "Error: uWS::App not initialized." << std::endl;
+        shim_log().write(dawn::LOG_ERROR, "uWS::App not initialized.");
         lua_pushboolean(L, 0);
         return 1;
     }
 
     int port = luaL_checkinteger(L, 1);
-    app->listen(port, [L, port](auto *token) {
-        std::lock_guard<std::mutex> lock(lua_mutex);
+    // uSockets sets SO_REUSEPORT on listen sockets unless LIBUS_LISTEN_EXCLUSIVE_PORT
+    // is passed, so every worker can bind the same port and the kernel spreads
+    // incoming connections between them.
+    app->listen(port, [port](auto *token) {
         if (token) {
             std::cout << "Listening on port " << port << std::endl;
         } else {
-            std::cerr << "Failed to listen on port " << port << std::endl;
+            shim_log().write(dawn::LOG_ERROR, "Failed to listen on port ", port);
         }
     });
 
     return 0;
 }
 
-int uw_run(lua_State *L) {
+int uw_run(lua_State * /*L*/) {
     if (!app) {
-        std::cerr << "Error: uWS::App not initialized. Call create_app first." << std::endl;
+        shim_log().write(dawn::LOG_ERROR, "uWS::App not initialized. Call create_app first.");
         return 0;
     }
     app->run();
     return 0;
 }
 
+static int uw_worker_id(lua_State *L) {
+    lua_pushinteger(L, worker_id);
+    return 1;
+}
+
+#ifdef LIBUS_USE_LIBUV
+// Points luv at this worker's loop before the bootstrap script requires it, so
+// luv timers/signals created by the worker run on the same loop as its uWS::App
+// instead of racing on libuv's default loop from several threads. Returns the
+// dlopen handle (nullptr if luv was not found), to be dlclose'd once the
+// worker's Lua state is closed.
+static void *bind_luv_to_loop(lua_State *L, uv_loop_t *loop) {
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "searchpath");
+    if (!lua_isfunction(L, -1)) {
+        lua_pop(L, 2);
+        return nullptr;
+    }
+    lua_pushstring(L, "luv");
+    lua_getfield(L, -3, "cpath");
+    if (lua_pcall(L, 2, 1, 0) != LUA_OK || !lua_isstring(L, -1)) {
+        lua_pop(L, 2);
+        return nullptr;
+    }
+    void *lib = dlopen(lua_tostring(L, -1), RTLD_NOW | RTLD_LOCAL);
+    lua_pop(L, 2);
+    if (!lib) return nullptr;
+
+    using luv_set_loop_fn = void (*)(lua_State *, uv_loop_t *);
+    auto set_loop = reinterpret_cast<luv_set_loop_fn>(dlsym(lib, "luv_set_loop"));
+    if (set_loop) {
+        set_loop(L, loop);
+    }
+    return lib;
+}
+#endif
+
+static void run_worker(int id, std::string bootstrap_script, std::string path, std::string cpath) {
+    worker_id = id;
+
+#ifdef LIBUS_USE_LIBUV
+    uv_loop_t native_loop;
+    uv_loop_init(&native_loop);
+    uWS::Loop::get(&native_loop);
+#endif
+
+    lua_State *L = luaL_newstate();
+    luaL_openlibs(L);
+
+    lua_getglobal(L, "package");
+    lua_pushlstring(L, path.data(), path.size());
+    lua_setfield(L, -2, "path");
+    lua_pushlstring(L, cpath.data(), cpath.size());
+    lua_setfield(L, -2, "cpath");
+    lua_pop(L, 1);
+
+    lua_pushinteger(L, id);
+    lua_setglobal(L, "DAWN_WORKER_ID");
+
+#ifdef LIBUS_USE_LIBUV
+    void *luv_lib = bind_luv_to_loop(L, &native_loop);
+#endif
+
+    // The bootstrap script builds the server and calls DawnServer:run(), which
+    // creates this thread's app and registers its routes against this state.
+    if (luaL_dofile(L, bootstrap_script.c_str()) != LUA_OK) {
+        shim_log().write(dawn::LOG_ERROR, "Worker ", id, " bootstrap error: ", lua_tostring(L, -1));
+        lua_pop(L, 1);
+    } else if (app) {
+        app->run();
+    } else {
+        shim_log().write(dawn::LOG_ERROR, "Worker ", id, ": bootstrap script did not create an app.");
+    }
+
+    unregister_publish_loop(uWS::Loop::get());
+    app.reset();
+    close_redis_clients();
+    close_handler_tasks();
+    if (static_cache_timer) {
+        us_timer_close(static_cache_timer);
+        static_cache_timer = nullptr;
+    }
+    static_caches.clear();
+    guards.clear();
+    jwt_secrets.clear();
+    request_pool.clear();
+    response_pool.clear();
+    socket_slots.clear();
+    free_socket_slots.clear();
+    socket_ids.clear();
+    router = dawn::Router();
+    router_mounted = false;
+    route_body_options.clear();
+    middlewares.clear();
+    lua_callbacks.clear();
+    lua_close(L);
+    main_L = nullptr;
+
+#ifdef LIBUS_USE_LIBUV
+    if (luv_lib) dlclose(luv_lib);
+    uWS::Loop::get()->free();
+    uv_loop_close(&native_loop);
+#endif
+}
+
+// uws.run_workers(n, bootstrap_script): runs n event loops, one per thread, each
+// with its own uWS::App and a fresh Lua state that executes bootstrap_script.
+// Blocks until every worker has exited. n <= 0 means one worker per core.
+int uw_run_workers(lua_State *L) {
+    int count = luaL_checkinteger(L, 1);
+    std::string bootstrap_script = luaL_checkstring(L, 2);
+    if (count <= 0) {
+        count = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "path");
+    std::string path = lua_isstring(L, -1) ? lua_tostring(L, -1) : "";
+    lua_getfield(L, -2, "cpath");
+    std::string cpath = lua_isstring(L, -1) ? lua_tostring(L, -1) : "";
+    lua_pop(L, 3);
+
+    std::vector<std::thread> workers;
+    workers.reserve(count);
+    for (int i = 1; i <= count; ++i) {
+        workers.emplace_back(run_worker, i, bootstrap_script, path, cpath);
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
 extern "C" int luaopen_uwebsockets(lua_State *L) {
     create_metatables(L);
+    create_json_metatable(L);
+    create_multipart_metatable(L);
+    create_presence_metatable(L);
+    create_rate_limiter_metatable(L);
+    create_token_store_metatable(L);
+    create_logger_metatable(L);
+    create_redis_metatable(L);
 
     luaL_Reg functions[] = {
         {"create_app", uw_create_app},
@@ -831,14 +4683,63 @@ extern "C" int luaopen_uwebsockets(lua_State *L) {
         {"patch", uw_patch},
         {"head", uw_head},
         {"options", uw_options},
+        {"route", uw_route},
         {"ws", uw_ws},
         {"listen", uw_listen},
         {"run", uw_run},
+        {"run_workers", uw_run_workers},
+        {"worker_id", uw_worker_id},
         {"use", uw_use},
-        {"serve_static", uw_serve_static}, // Add the new function
+        {"serve_static", uw_serve_static},
+        {"publish", uw_publish},
+        {"send", uw_send},
+        {"uuid_v4", uw_uuid_v4},
+        {"uuid_v7", uw_uuid_v7},
+        {"is_open", uw_is_open},
+        {"num_subscribers", uw_num_subscribers},
+        {"json_decode", uw_json_decode},
+        {"json_totable", uw_json_totable},
+        {"multipart_parser", uw_multipart_parser},
+        {"presence_store", uw_presence_store},
+        {"redis_connect", uw_redis_connect},
+        {"guard", uw_guard},
+        {"rate_limiter", uw_rate_limiter},
+        {"token_store", uw_token_store},
+        {"logger", uw_logger},
+        {"sleep", uw_sleep},
+        {"resume", uw_resume},
         {nullptr, nullptr}
     };
 
     luaL_newlib(L, functions);
+
+    // uws.METHOD_GET ... uws.METHOD_OPTIONS, the values of req.method_id.
+    for (size_t i = 0; i < dawn::METHOD_COUNT; ++i) {
+        std::string key = "METHOD_";
+        for (const char *c = dawn::method_name(static_cast<dawn::HttpMethod>(i)); *c; ++c) {
+            key.push_back(static_cast<char>(*c - 'a' + 'A'));
+        }
+        lua_pushinteger(L, static_cast<lua_Integer>(i));
+        lua_setfield(L, -2, key.c_str());
+    }
+    lua_pushinteger(L, static_cast<lua_Integer>(dawn::HttpMethod::UNKNOWN));
+    lua_setfield(L, -2, "METHOD_UNKNOWN");
+
+    lua_pushlightuserdata(L, nullptr);
+    lua_setfield(L, -2, "json_null");
+
+    static const luaL_Reg jwt_functions[] = {
+        {"sign", jwt_sign},
+        {"verify", jwt_verify},
+        {"sha256", jwt_sha256},
+        {"sha256_hex", jwt_sha256_hex},
+        {"hmac_sha256", jwt_hmac_sha256},
+        {"base64url_encode", jwt_base64url_encode},
+        {"base64url_decode", jwt_base64url_decode},
+        {"equal", jwt_equal},
+        {nullptr, nullptr}
+    };
+    luaL_newlib(L, jwt_functions);
+    lua_setfield(L, -2, "jwt");
     return 1;
 }
\ No newline at end of file
@@ -170,6 +170,16 @@ function BackendStrategy:diff_presence(topic, old_state, new_state)
   }
 end
 
+--- Gets one member's presence on a topic. Optional: the default reads the whole
+--- room, backends that can look a single member up should override it.
+--- @param topic string
+--- @param id string A websocket or user ID.
+--- @return table|nil The member's metadata.
+function BackendStrategy:get_presence(topic, id)
+  assert_type(topic, "string", "topic")
+  return (self:get_all_presence(topic) or {})[id]
+end
+
 
 ---return marked sockets
 
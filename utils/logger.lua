@@ -6,6 +6,11 @@ ffi.cdef[[
     int getpid();
 ]]
 
+-- Inside the server, entries are formatted and written by the shim's async
+-- logs (uws.logger): a writer thread batches them off the event loop.
+local has_uws, uws = pcall(require, "uwebsockets")
+local native_logger = has_uws and type(uws) == "table" and uws.logger or nil
+
 local ENV = os.getenv("ENV") or "development"
 local is_dev = ENV == "development"
 
@@ -70,6 +75,16 @@ function Logger:new()
     obj.min_level = LogLevel.INFO
     obj.last_request_id = nil
 
+    if native_logger then
+        local file, err = native_logger(LOG_FILE, LogLevel.DEBUG)
+        if file then
+            obj.native = file
+            obj.console = native_logger("stdout", LogLevel.DEBUG)
+            return obj
+        end
+        print("[Logger] Failed to open log file:", err)
+    end
+
     obj.log_async = uv.new_async(function()
         obj:processLogQueue()
     end)
@@ -97,6 +112,15 @@ end
 function Logger:log(level, msg, source, request_id)
     if level < self.min_level then return end
 
+    local native = self.native
+    if native then
+        native:write(level, msg, source, request_id)
+        if self.log_mode == "dev" then
+            self.console:print(level, msg)
+        end
+        return
+    end
+
     local level_name = LogLevel.toString(level)
     source = source or "unknown"
 
@@ -158,6 +182,10 @@ function Logger:processLogQueue()
 end
 
 function Logger:flushBuffer()
+    if self.native then
+        self.native:flush()
+        return
+    end
     if #self.log_queue == 0 or not self.log_fd then return end
 
     local batch_logs = table.concat(self.log_queue)
@@ -179,6 +207,7 @@ end
 function Logger:shutdown()
     self.shutdown_signal = true
     self:flushBuffer()
+    if self.console then self.console:flush() end
 
     if self.log_fd then
         local fd = self.log_fd
@@ -1,6 +1,11 @@
 -- promise.lua
 local uv = require("luv")
 
+-- Route handlers run as coroutines owned by the server; waking one through
+-- uws.resume lets the server finish the request when the handler returns.
+local has_uws, uws = pcall(require, "uwebsockets")
+local resume = has_uws and uws.resume or coroutine.resume
+
 local Promise = {}
 Promise.__index = Promise
 
@@ -77,15 +82,23 @@ function Promise:catch_(on_rejected)
   return self:then_(nil, on_rejected)
 end
 
--- await() blocks the current coroutine until a promise resolves
+-- await() blocks the current coroutine (an async function or a route handler)
+-- until a promise resolves
 local function await(promise)
   local co = coroutine.running()
   assert(co, "await must be called inside an async function")
 
+  -- A settled promise runs its callbacks at once, before there is a yield to resume
+  if promise.status == "fulfilled" then
+    return promise.value
+  elseif promise.status == "rejected" then
+    error(promise.reason)
+  end
+
   promise:then_(function(value)
-    coroutine.resume(co, true, value)
+    resume(co, true, value)
   end, function(reason)
-    coroutine.resume(co, false, reason)
+    resume(co, false, reason)
   end)
 
   local ok, result = coroutine.yield()
@@ -127,6 +140,32 @@ local function async(fn)
 end
 
 
+-- await_callback(fn) calls fn(callback) and suspends the current coroutine until
+-- callback(...) fires, returning its arguments; e.g. for luv file I/O:
+--   local err, data = await_callback(function(cb) uv.fs_read(fd, size, 0, cb) end)
+local function await_callback(fn)
+  local co = coroutine.running()
+  assert(co, "await_callback must be called inside a coroutine")
+
+  local waiting, done, results = false, false, nil
+  fn(function(...)
+    if done then return end
+    done = true
+    if waiting then
+      resume(co, ...)
+    else
+      results = {n = select("#", ...), ...}
+    end
+  end)
+
+  if done then
+    return unpack(results, 1, results.n)
+  end
+  waiting = true
+  return coroutine.yield()
+end
+
+
 -- settimeout.lua
 local function setTimeout(ms, callback)
   local timer = uv.new_timer()
@@ -142,5 +181,6 @@ return {
   Promise = Promise,
   await = await,
   async = async,
+  await_callback = await_callback,
     setTimeout = setTimeout,
 }
@@ -1,16 +1,34 @@
 -- utils/uuid.lua
+-- Uses the shim's native generators (uws.uuid_v4 / uws.uuid_v7) when the module
+-- is loadable, and falls back to math.random otherwise (e.g. in plain-Lua tools).
 
 local M = {}
 
+local ok, uws = pcall(require, "uwebsockets")
+if not ok or type(uws) ~= "table" or not uws.uuid_v4 then
+    uws = nil
+end
+
 -- Seed once at startup
 math.randomseed(os.time() + tonumber(tostring({}):sub(8), 16))
 
-function M.v4()
+local function lua_v4()
     local template = "xxxxxxxx-xxxx-4xxx-yxxx-xxxxxxxxxxxx"
-    return string.gsub(template, "[xy]", function(c)
+    return (string.gsub(template, "[xy]", function(c)
         local v = (c == "x") and math.random(0, 15) or math.random(8, 11)
         return string.format("%x", v)
-    end)
+    end))
 end
 
+-- Time-ordered: 48-bit ms timestamp first, so ids sort by creation time.
+local function lua_v7()
+    local ms = math.floor(os.time() * 1000)
+    local hex = string.format("%012x", ms)
+    local rest = lua_v4()
+    return hex:sub(1, 8) .. "-" .. hex:sub(9, 12) .. "-7" .. rest:sub(16, 18) .. rest:sub(19)
+end
+
+M.v4 = uws and uws.uuid_v4 or lua_v4
+M.v7 = uws and uws.uuid_v7 or lua_v7
+
 return M
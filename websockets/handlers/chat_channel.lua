@@ -55,7 +55,7 @@ function ChatHandler:message(ws, payload, state, shared, topic, presence)
 
     local message_content = payload.body
     if message_content and #message_content > 0 then
-        local sender_presence = presence:get_all_presence(topic)[state.ws_id]
+        local sender_presence = presence:get_presence(topic, state.ws_id)
         local sender_nickname = sender_presence and sender_presence.meta and sender_presence.meta.nickname or "Unknown"
 
         local message_to_broadcast = {
@@ -88,7 +88,7 @@ end
 function ChatHandler:leave( ws, payload, state, shared, topic, presence)
     local user_id = state.user_id
     if user_id then
-        local sender_presence = presence:get_all_presence(topic)[state.ws_id]
+        local sender_presence = presence:get_presence(topic, state.ws_id)
         local sender_nickname = sender_presence and sender_presence.meta and sender_presence.meta.nickname or "User"
 
         shared.sockets:leave_room(topic, ws)
@@ -108,7 +108,7 @@ function ChatHandler:typing( ws, payload, state, shared, topic, presence)
     local user_id = state.user_id
     if not user_id then return end
 
-    local sender_presence = presence:get_all_presence(topic)[state.ws_id]
+    local sender_presence = presence:get_presence(topic, state.ws_id)
     local sender_nickname = sender_presence and sender_presence.meta and sender_presence.meta.nickname or "User"
 
     shared.sockets:broadcast_to_room(topic, {
@@ -157,7 +157,7 @@ function ChatHandler:private_message( ws, payload, state, shared, topic, presenc
     end
 
     local receiver_ws_id =  shared.sockets:getSyncPrivateChatId(receiver_id)
-    local sender_presence = presence:get_all_presence(topic)[state.ws_id]
+    local sender_presence = presence:get_presence(topic, state.ws_id)
     local sender_nickname = sender_presence and sender_presence.meta and sender_presence.meta.nickname or "User"
 
     if receiver_ws_id then
@@ -218,7 +218,7 @@ function ChatHandler:set_nickname(dawn_sockets, ws, payload, state, shared, topi
         return
     end
 
-    local old_presence = presence:get_all_presence(topic)[state.ws_id]
+    local old_presence = presence:get_presence(topic, state.ws_id)
     local old_nickname = old_presence and old_presence.meta and old_presence.meta.nickname or "User"
 
     presence:set_presence(topic, state.ws_id, { nickname = new_nickname, user_id = user_id })
@@ -260,7 +260,7 @@ end
 function ChatHandler:before_close(dawn_sockets, ws, state, shared, topic, presence)
     local user_id = state.user_id
     if user_id then
-        local sender_presence = presence:get_all_presence(topic)[state.ws_id]
+        local sender_presence = presence:get_presence(topic, state.ws_id)
         local sender_nickname = sender_presence and sender_presence.meta and sender_presence.meta.nickname or "User"
         dawn_sockets:broadcast_to_room(topic, {
             type = "system_message",
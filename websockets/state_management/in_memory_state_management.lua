@@ -1,4 +1,5 @@
 local cjson = require("cjson")
+local uws = require("uwebsockets")
 local BackendStrategy = require("server.websockets.presence_interface")
 --- @class InMemoryBackend : BackendStrategy
 local InMemoryBackend = {}
@@ -14,7 +15,10 @@ function InMemoryBackend:new()
 end
 
 local pubsub = {}
-local presence = {}
+-- Room membership lives in a native store (uws.presence_store): members are kept
+-- densely per room, with joined_at as a number and the rest of the metadata as
+-- JSON, and joins/leaves are logged so diffs never copy a room.
+local presence = uws.presence_store()
 local statuses = {}
 local private_messages = {}
 local queued_messages = {}
@@ -67,6 +71,21 @@ function InMemoryBackend:set_user_status(user_id, status)
   statuses[user_id] = status
 end
 
+-- joined_at is stored natively; everything else in meta goes in as JSON.
+local function encode_meta(meta)
+  local rest = {}
+  for k, v in pairs(meta) do
+    if k ~= "joined_at" then rest[k] = v end
+  end
+  return tonumber(meta.joined_at) or 0, cjson.encode(rest)
+end
+
+local function decode_meta(joined_at, json)
+  local meta = cjson.decode(json)
+  if joined_at ~= 0 then meta.joined_at = joined_at end
+  return meta
+end
+
 --- Sets the presence information for a user on a specific topic.
 --- @param topic string The topic the user is present on.
 --- @param ws_id string The ID of the user's websocket identifier.
@@ -74,26 +93,26 @@ end
 --- @param user_id string The ID of the user (not used in this in-memory implementation).
 function InMemoryBackend:set_presence(topic, ws_id, user_id, meta)
   if not ws_id then return end
+  if type(user_id) == "table" and meta == nil then
+    -- Called as set_presence(topic, ws_id, meta).
+    user_id, meta = nil, user_id
+  end
   if not meta then meta = {} end
+  local joined_at, json = encode_meta(meta)
+  -- replace, not join: setting presence again updates the meta already there.
   if user_id then
     if self:exist_in_presence(ws_id, topic) then
       self:remove_presence(topic, ws_id)
     end
-   
-  presence[topic] = presence[topic] or {}
-   if not (presence[topic][user_id]) then
-    presence[topic][user_id] = meta
-    end
+    presence:replace(topic, user_id, joined_at, json)
   else
-    presence[topic] = presence[topic] or {}
-    if not (presence[topic][ws_id]) then
-    presence[topic][ws_id] = meta
-    end
+    presence:replace(topic, ws_id, joined_at, json)
   end
 end
 
 function InMemoryBackend:exist_in_presence(ws_id, topic)
-  return presence[topic] and presence[topic][ws_id] ~= nil
+  if type(ws_id) ~= "string" or type(topic) ~= "string" then return false end
+  return presence:has(topic, ws_id)
 end
 
 --- Removes the presence information for a user from a specific topic.
@@ -101,21 +120,81 @@ end
 --- @param ws_id string The ID of the user\'s websocket identifier'.
 function InMemoryBackend:remove_presence(topic, ws_id)
   local user_id = self:get_ws_id_binded_user_id(ws_id)
-  if presence[topic] and presence[topic][ws_id] then
-    presence[topic][ws_id] = nil
-    if not next(presence[topic]) then presence[topic] = nil end 
-  end
-  if user_id and presence[topic] and presence[topic][user_id] then
-    presence[topic][user_id] = nil
-    if not next(presence[topic]) then presence[topic] = nil end 
+  presence:leave(topic, ws_id)
+  if user_id then
+    presence:leave(topic, user_id)
   end
 end
 
+-- Decoded metadata per topic and member from the last get_all_presence, reused
+-- while the member's joined_at and JSON are unchanged.
+local meta_cache = {}
+
 --- Gets the presence information for all users on a specific topic.
 --- @param topic string The topic to retrieve presence information for.
 --- @return table A table where keys are user IDs and values are their metadata.
+--- The metadata tables are shared between calls; copy one before changing it.
 function InMemoryBackend:get_all_presence(topic)
-  return presence[topic] or {}
+  local result, previous, cache = {}, meta_cache[topic] or {}, {}
+  presence:each(topic, function(id, joined_at, json)
+    local hit = previous[id]
+    if not (hit and hit.json == json and hit.joined_at == joined_at) then
+      hit = { json = json, joined_at = joined_at, meta = decode_meta(joined_at, json) }
+    end
+    cache[id] = hit
+    result[id] = hit.meta
+  end)
+  -- Rebuilt on every call, so members who left drop out of it.
+  meta_cache[topic] = next(cache) and cache or nil
+  return result
+end
+
+--- Gets one member's presence metadata without building the whole room.
+--- @param topic string
+--- @param id string A websocket or user ID.
+--- @return table|nil
+function InMemoryBackend:get_presence(topic, id)
+  if type(id) ~= "string" then return nil end
+  local joined_at, json = presence:get(topic, id)
+  if not joined_at then return nil end
+  return decode_meta(joined_at, json)
+end
+
+--- Number of members present on a topic.
+function InMemoryBackend:count_presence(topic)
+  return presence:count(topic)
+end
+
+--- IDs on a topic that joined before `cutoff` (seconds since the epoch), read
+--- without decoding any metadata.
+function InMemoryBackend:idle_members(topic, cutoff)
+  local idle = {}
+  presence:each(topic, function(id, joined_at)
+    if joined_at ~= 0 and joined_at < cutoff then idle[#idle + 1] = id end
+  end)
+  return idle
+end
+
+--- Version to pass to presence_changes after modifying presence.
+function InMemoryBackend:presence_version()
+  return presence:version()
+end
+
+--- Joins and leaves on a topic since `version`, in the same shape as
+--- diff_presence, or nil when the change log no longer reaches back that far.
+function InMemoryBackend:presence_changes(topic, version)
+  local changes = presence:changes(topic, version)
+  if not changes then return nil end
+  local joins, leaves = {}, {}
+  for _, change in ipairs(changes) do
+    local meta = decode_meta(change.joined_at, change.meta)
+    if change.joined then
+      if leaves[change.id] then leaves[change.id] = nil else joins[change.id] = meta end
+    else
+      if joins[change.id] then joins[change.id] = nil else leaves[change.id] = meta end
+    end
+  end
+  return { joins = joins, leaves = leaves }
 end
 
 --- Computes the difference between two presence states for a topic.
@@ -303,7 +382,7 @@ end
 --- @param room_id string The ID of the room to check.
 --- @return boolean True if the room exists, false otherwise.
 function InMemoryBackend:room_exists(room_id)
-  return presence[room_id] ~= nil
+  return presence:exists(room_id)
 end
 
 --- Creates a new room with the given ID.
@@ -312,7 +391,7 @@ function InMemoryBackend:create_room(room_id)
     if not room_id then
     error("Room ID cannot be nil")
   end
-  presence[room_id] = {}
+  presence:create(room_id)
   return true
 end
 
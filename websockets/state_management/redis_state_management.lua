@@ -1,5 +1,7 @@
 local redis = require "redis"
 local cjson = require "cjson"
+local uws = require "uwebsockets"
+local unpack = unpack or table.unpack
 
 
 -- Utility for validation
@@ -49,65 +51,92 @@ local function check_redis_error(reply)
   return false
 end
 
+--- The native, non-blocking command connection (see uws.redis_connect), opened on
+--- first use. Commands issued through it in one loop iteration are written as a
+--- single pipeline, and replies come back through callbacks or client:call.
+function RedisBackendStrategy:async_client()
+    if not self.client then
+        self.client = uws.redis_connect(self.config.host or "127.0.0.1", self.config.port or 6379, {
+            username = self.config.username,
+            password = self.config.password,
+            db = self.config.db,
+        })
+    end
+    return self.client
+end
+
+--- Runs one command ({ name, args... }) and returns its reply. Called from a
+--- coroutine (a route handler, an async function), it waits on the async client
+--- and the loop keeps running; anywhere else, socket callbacks included, only the
+--- blocking client can answer. HGETALL comes back as a field -> value table and a
+--- missing value as nil either way.
+function RedisBackendStrategy:query(command)
+    local co, is_main = coroutine.running()
+    if co and not is_main then
+        local reply, err = self:async_client():call(command)
+        if reply == nil and err then
+            error("Redis error: " .. tostring(err))
+        end
+        if command[1] == "HGETALL" and reply then
+            local fields = {}
+            for i = 1, #reply, 2 do
+                fields[reply[i]] = reply[i + 1]
+            end
+            return fields
+        end
+        return reply
+    end
+    local reply = self.redis[command[1]:lower()](self.redis, unpack(command, 2))
+    check_redis_error(reply)
+    return reply
+end
+
 -- =================================================================================================
 --  PUB/SUB
 -- =================================================================================================
 
+--- Subscribes to a Redis channel without blocking the event loop. Messages come in
+--- through a native client (uws.redis_connect) on the server's own loop, so this
+--- must be called from a running worker; the connection is opened on first use,
+--- re-established when it drops and keeps its subscriptions across reconnects.
+--- @param topic string
+--- @param callback function Called as callback(topic, message) with the decoded message.
 function RedisBackendStrategy:subscribe(topic, callback)
     assert_type(topic, "string", "topic")
     assert_type(callback, "function", "callback")
 
-    --  redis-lua's subscribe is blocking.  This is not ideal for a shared
-    --  application.  In a real application, you'd want to use a separate
-    --  thread or an async library like LuaSocket, or use the async functions
-    --  provided by a redis-lua version supporting it.  This example uses
-    --  a simple, blocking implementation for demonstration.
-
-    local sub = redis.connect(self.config) -- Create a separate connection for subscribing
-    if not sub then
-        error("Failed to connect to Redis for subscription.")
-    end
-    local ok, err = sub:subscribe(topic)
-    if not ok then
-       error("Failed to subscribe to topic: " .. err)
-    else
-        print("Subscribed to topic: " .. topic)
+    if not self.subscriber then
+        -- A subscribed connection only accepts (un)subscribe commands, so it gets its own.
+        self.subscriber = uws.redis_connect(self.config.host or "127.0.0.1", self.config.port or 6379, {
+            username = self.config.username,
+            password = self.config.password,
+            db = self.config.db,
+        })
     end
-
-    while true do
-        local msg = sub:read_reply()
-        if not msg then
-            error("Error reading from subscription") -- handle disconnects
-        end
-        if msg[1] == "message" then
-            local received_topic = msg[2]
-            local message_data = cjson.decode(msg[3])  --  Use cjson to decode
-            callback(received_topic, message_data)
-        elseif msg[1] == "subscribe" then
-            --  Do nothing, just acknowledge subscribe.
-        else
-          -- Handle other reply types (e.g., pmessage, unsubscribe)
-          --  Log unexpected messages.
-          print("Unexpected message from Redis pubsub:", msg[1])
+    self.subscriber:subscribe(topic, function(received_topic, payload)
+        local ok, message_data = pcall(cjson.decode, payload)
+        if not ok then
+            print("Dropping undecodable message from Redis pubsub on " .. received_topic)
+            return
         end
-    end
-    sub:disconnect() -- this part will never be reached in this blocking implementation
+        callback(received_topic, message_data)
+    end)
 end
 
+--- Publishes without waiting for Redis: the PUBLISH rides the next pipeline.
 function RedisBackendStrategy:publish(topic, message)
     assert_type(topic, "string", "topic")
     assert_type(message, "table", "message")
     local message_json = cjson.encode(message) -- Use cjson to encode the message
-    local reply = self.redis:publish(topic, message_json)
-    check_redis_error(reply)
-    return reply
+    return self:async_client():command({ "PUBLISH", topic, message_json })
 end
 
 function RedisBackendStrategy:unsubscribe(topic)
     assert_type(topic, "string", "topic")
-    local reply = self.redis:unsubscribe(topic)
-    check_redis_error(reply)
-    return reply
+    if not self.subscriber then
+        return false
+    end
+    return self.subscriber:unsubscribe(topic)
 end
 
 -- =================================================================================================
@@ -122,8 +151,7 @@ end
 
 function RedisBackendStrategy:get_user_status(user_id)
     assert_type(user_id, "string", "user_id")
-    local reply = self.redis:hget("user_status", user_id)
-    check_redis_error(reply)
+    local reply = self:query({ "HGET", "user_status", user_id })
     if not reply then
         return "offline" -- Default status
     end
@@ -136,21 +164,12 @@ function RedisBackendStrategy:set_presence(topic, ws_id, user_id, meta)
       if not ws_id then return end
   if not meta then meta = {} end
   if user_id then
-    local ws_id_exits = self:exist_in_presence(ws_id, topic)
+    -- Drops the socket's entries first, so the user's is always (re)written.
     self:remove_presence(topic, ws_id)
-
-    if not (self:exist_in_presence(user_id, topic)) then
-     local meta_json = cjson.encode(meta)
-    local reply = self.redis:hset("presence:" .. topic, user_id, meta_json)
-    check_redis_error(reply)
-    end
+    self:query({ "HSET", "presence:" .. topic, user_id, cjson.encode(meta) })
   else
-    if not (self:exist_in_presence(ws_id, topic)) then
-    local meta_json = cjson.encode(meta)
-    local reply = self.redis:hset("presence:" .. topic, user_id, meta_json)
-    check_redis_error(reply)
-    end
-  end  
+    self:query({ "HSETNX", "presence:" .. topic, ws_id, cjson.encode(meta) })
+  end
 end
 
 
@@ -163,14 +182,8 @@ function RedisBackendStrategy:remove_presence(topic, ws_id, is_delete_old)
     -- local user_id = self:get_ws_id_binded_user_id(ws_id)
      local user_id = self:get_ws_id_binded_user_id(ws_id)
 
-     if self:exist_in_presence(ws_id, topic) then
-        local reply = self.redis:hdel("presence:" .. topic, ws_id)
-        check_redis_error(reply)
-     end
-        if self:exist_in_presence(user_id, topic) then
-            local reply = self.redis:hdel("presence:" .. topic, user_id)
-            check_redis_error(reply)
-        end
+        -- HDEL ignores missing fields, so there is nothing to check first.
+        self:query({ "HDEL", "presence:" .. topic, ws_id, user_id })
 
         if(is_delete_old) then
             self:delete_from_socket_users(ws_id)
@@ -179,8 +192,7 @@ end
 
 function RedisBackendStrategy:delete_from_socket_users(ws_id)
     assert_type(ws_id, "string", "ws_id")
-    local reply = self.redis:hdel("socket_users", ws_id)
-    check_redis_error(reply)
+    self:query({ "HDEL", "socket_users", ws_id })
 end
 
 --- Helper function to check if a websocket ID exists in a topic's presence.
@@ -191,22 +203,13 @@ function RedisBackendStrategy:exist_in_presence(ws_id, topic)
     assert_type(ws_id, "string", "ws_id")
     assert_type(topic, "string", "topic")
 
-    local presence_data = self:get_all_presence(topic)
-    if not presence_data then
-        return false -- No presence data found
-    end
-    for id, _ in pairs(presence_data) do
-        if id == ws_id then
-            return true
-        end
-    end
-    return false
+    local reply = self:query({ "HEXISTS", "presence:" .. topic, ws_id })
+    return reply == true or reply == 1
 end
 
 function RedisBackendStrategy:get_all_presence(topic)
     assert_type(topic, "string", "topic")
-    local reply = self.redis:hgetall("presence:" .. topic)
-    check_redis_error(reply)
+    local reply = self:query({ "HGETALL", "presence:" .. topic })
     local presence = {}
      if reply then
         for k, v in pairs(reply) do
@@ -216,6 +219,60 @@ function RedisBackendStrategy:get_all_presence(topic)
     return presence
 end
 
+function RedisBackendStrategy:get_presence(topic, id)
+    assert_type(topic, "string", "topic")
+    if type(id) ~= "string" then return nil end
+    local reply = self:query({ "HGET", "presence:" .. topic, id })
+    return reply and cjson.decode(reply) or nil
+end
+
+--- Fetches the presence of several topics at once: the HGETALLs go out as one
+--- pipeline on the async client and callback(presence_by_topic) runs when the last
+--- reply is in. A topic whose fetch failed is left out of the result.
+--- @param topics table List of topics.
+--- @param callback function
+function RedisBackendStrategy:get_all_presence_many(topics, callback)
+    assert_type(topics, "table", "topics")
+    assert_type(callback, "function", "callback")
+    local result = {}
+    local remaining = #topics
+    if remaining == 0 then
+        return callback(result)
+    end
+
+    local client = self:async_client()
+    for _, topic in ipairs(topics) do
+        local ok, err = client:command({ "HGETALL", "presence:" .. topic }, function(reply, reply_err)
+            if reply then
+                local presence = {}
+                for i = 1, #reply, 2 do
+                    -- One undecodable entry must not stall the whole fetch.
+                    local decoded, meta = pcall(cjson.decode, reply[i + 1])
+                    if decoded then
+                        presence[reply[i]] = meta
+                    else
+                        print("Dropping undecodable presence " .. tostring(reply[i]) .. " in " .. topic)
+                    end
+                end
+                result[topic] = presence
+            else
+                print("Redis presence fetch failed for " .. topic .. ": " .. tostring(reply_err))
+            end
+            remaining = remaining - 1
+            if remaining == 0 then
+                callback(result)
+            end
+        end)
+        if not ok then
+            print("Redis presence fetch failed for " .. topic .. ": " .. tostring(err))
+            remaining = remaining - 1
+        end
+    end
+    if remaining == 0 then
+        callback(result)
+    end
+end
+
 function RedisBackendStrategy:diff_presence(topic, old_state, new_state)
     assert_type(topic, "string", "topic")
     assert_type(old_state, "table", "old_state")
@@ -252,8 +309,7 @@ end
 function RedisBackendStrategy:get_ws_id_binded_user_id(ws_id)
     assert_type(ws_id, "string", "ws_id")
     --  Check if the socket ID exists in the socket_users hash
-    local reply = self.redis:hget("socket_users", ws_id)
-    check_redis_error(reply)
+    local reply = self:query({ "HGET", "socket_users", ws_id })
     return reply or nil
 end
 